@@ -0,0 +1,121 @@
+//! Measures the collector against the emulated perf ring buffers (see `perf_pt::EmuConfig`).
+//!
+//! The first table shows the collector's throughput when the producer waits for it to make space.
+//! The second shows, for a producer which doesn't wait (like the kernel), how much data was
+//! produced before the AUX buffer overflowed at various rates, with the collector blocking in
+//! `poll(2)` and busy-polling. No Intel PT hardware is needed.
+
+mod common;
+
+#[cfg(perf_pt)]
+mod collect {
+    use super::common;
+    use hwtracer::backends::perf_pt::{emulate_collection, EmuConfig, EmuRun};
+    use hwtracer::backends::PerfPTConfig;
+
+    const DEFAULT_ITERS: usize = 3;
+    const MIB: u64 = 1024 * 1024;
+
+    /// Runs `conf` `iters` (but at least one) times, returning the run with the median elapsed
+    /// time.
+    fn median_run(conf: &EmuConfig, iters: usize) -> EmuRun {
+        let initial = PerfPTConfig::default().initial_trace_bufsize;
+        let mut runs = (0..iters.max(1))
+            .map(|_| emulate_collection(conf, initial).unwrap())
+            .collect::<Vec<_>>();
+        runs.sort_by_key(|r| r.elapsed);
+        runs.swap_remove(runs.len() / 2)
+    }
+
+    fn throughput(iters: usize) {
+        println!("\nCollector throughput (producer waits for space)");
+        println!(
+            "  {:>10} {:>10} {:>10} {:>12} {:>10}",
+            "aux pages", "chunk KiB", "MiB/s", "records/s", "waits"
+        );
+        for &aux_bufsize in &[64, 1024, 8192] {
+            for &chunk_size in &[4 * 1024, 64 * 1024] {
+                let conf = EmuConfig {
+                    aux_bufsize,
+                    chunk_size,
+                    total_bytes: 256 * MIB,
+                    ..EmuConfig::default()
+                };
+                let run = median_run(&conf, iters);
+                if let Some(e) = run.error {
+                    println!(
+                        "  {:>10} {:>10} error: {}",
+                        aux_bufsize,
+                        chunk_size / 1024,
+                        e
+                    );
+                    continue;
+                }
+                let secs = run.elapsed.as_secs_f64();
+                println!(
+                    "  {:>10} {:>10} {:>10.1} {:>12.0} {:>10}",
+                    aux_bufsize,
+                    chunk_size / 1024,
+                    run.produced as f64 / MIB as f64 / secs,
+                    run.aux_records as f64 / secs,
+                    run.full_waits,
+                );
+            }
+        }
+    }
+
+    fn overflow(iters: usize) {
+        println!("\nOverflow behaviour (producer doesn't wait, 256 MiB offered)");
+        println!(
+            "  {:>10} {:>12} {:>8} {:>14} {:>10}",
+            "aux pages", "rate MiB/s", "spin us", "produced MiB", "outcome"
+        );
+        for &aux_bufsize in &[64, 1024] {
+            for &rate in &[100 * MIB, 1024 * MIB, 0] {
+                for &spin_ns in &[0, 1_000_000] {
+                    let conf = EmuConfig {
+                        aux_bufsize,
+                        rate,
+                        total_bytes: 256 * MIB,
+                        wait_for_space: false,
+                        spin_ns,
+                        ..EmuConfig::default()
+                    };
+                    let run = median_run(&conf, iters);
+                    let rate = match rate {
+                        0 => String::from("unlimited"),
+                        r => (r / MIB).to_string(),
+                    };
+                    println!(
+                        "  {:>10} {:>12} {:>8} {:>14.1} {:>10}",
+                        aux_bufsize,
+                        rate,
+                        spin_ns / 1000,
+                        run.produced as f64 / MIB as f64,
+                        match run.error {
+                            None => String::from("ok"),
+                            Some(e) => e.to_string(),
+                        }
+                    );
+                }
+            }
+        }
+    }
+
+    pub fn main() {
+        let iters = common::iters(DEFAULT_ITERS);
+        println!("Emulated collection (median of {} iterations)", iters);
+        throughput(iters);
+        overflow(iters);
+    }
+}
+
+#[cfg(perf_pt)]
+fn main() {
+    collect::main();
+}
+
+#[cfg(not(perf_pt))]
+fn main() {
+    println!("Skipping collector benchmark: the perf_pt backend was not built");
+}
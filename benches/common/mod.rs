@@ -0,0 +1,96 @@
+//! Helpers shared by the benchmarks.
+//!
+//! The benchmarks are plain programs (`harness = false`) which print a table of results. The
+//! number of iterations can be changed with the `HWTRACER_BENCH_ITERS` environment variable.
+
+#![allow(dead_code)] // Not every benchmark uses every helper.
+
+use std::env;
+use std::mem;
+use std::time::Duration;
+
+/// Returns the number of iterations to run, or `default` if `HWTRACER_BENCH_ITERS` is unset.
+pub fn iters(default: usize) -> usize {
+    match env::var("HWTRACER_BENCH_ITERS") {
+        Ok(s) => s
+            .parse()
+            .unwrap_or_else(|_| panic!("bad HWTRACER_BENCH_ITERS: {}", s)),
+        Err(_) => default,
+    }
+}
+
+/// Returns the `p`th percentile (0 <= p <= 100) of the sorted `samples`.
+pub fn percentile(sorted: &[Duration], p: f64) -> Duration {
+    percentile_index(sorted.len(), p).map_or(Duration::from_secs(0), |i| sorted[i])
+}
+
+/// Returns the index of the `p`th percentile (0 <= p <= 100) of `n` sorted samples, or `None` if
+/// there are none.
+pub fn percentile_index(n: usize, p: f64) -> Option<usize> {
+    if n == 0 {
+        return None;
+    }
+    Some(((p / 100.0) * (n - 1) as f64).round() as usize)
+}
+
+/// Prints the header for the rows printed by `print_percentiles`.
+pub fn print_percentiles_header(title: &str) {
+    println!("\n{}", title);
+    println!(
+        "  {:<28} {:>10} {:>10} {:>10} {:>10}",
+        "phase (us)", "p50", "p90", "p99", "max"
+    );
+}
+
+/// Prints a row summarising the distribution of `samples`.
+pub fn print_percentiles(name: &str, samples: &mut Vec<Duration>) {
+    samples.sort();
+    let us = |d: Duration| d.as_secs_f64() * 1e6;
+    println!(
+        "  {:<28} {:>10.2} {:>10.2} {:>10.2} {:>10.2}",
+        name,
+        us(percentile(samples, 50.0)),
+        us(percentile(samples, 90.0)),
+        us(percentile(samples, 99.0)),
+        us(percentile(samples, 100.0)),
+    );
+}
+
+/// Returns the process's resident set size and its high-water mark, in KiB.
+pub fn rss_kib() -> (u64, u64) {
+    let status = std::fs::read_to_string("/proc/self/status").unwrap_or_default();
+    let field = |name: &str| {
+        status
+            .lines()
+            .find(|l| l.starts_with(name))
+            .and_then(|l| l.split_whitespace().nth(1))
+            .and_then(|v| v.parse().ok())
+            .unwrap_or(0)
+    };
+    (field("VmRSS:"), field("VmHWM:"))
+}
+
+/// Resets the high-water mark reported by `rss_kib()` to the current RSS (Linux >= 4.0).
+pub fn reset_peak_rss() {
+    let _ = std::fs::write("/proc/self/clear_refs", "5");
+}
+
+/// Returns the CPUs the calling thread may run on.
+pub fn allowed_cpus() -> Vec<usize> {
+    let mut set: libc::cpu_set_t = unsafe { mem::zeroed() };
+    if unsafe { libc::sched_getaffinity(0, mem::size_of_val(&set), &mut set) } != 0 {
+        panic!("sched_getaffinity failed");
+    }
+    (0..libc::CPU_SETSIZE as usize)
+        .filter(|&c| unsafe { libc::CPU_ISSET(c, &set) })
+        .collect()
+}
+
+/// Pins the calling thread to `cpu`.
+pub fn pin(cpu: usize) {
+    let mut set: libc::cpu_set_t = unsafe { mem::zeroed() };
+    unsafe { libc::CPU_SET(cpu, &mut set) };
+    if unsafe { libc::sched_setaffinity(0, mem::size_of_val(&set), &set) } != 0 {
+        panic!("sched_setaffinity failed");
+    }
+}
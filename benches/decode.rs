@@ -0,0 +1,218 @@
+//! Measures the throughput of decoding traces with `iter_blocks()`.
+//!
+//! Traces are read from a corpus directory (`HWTRACER_DECODE_CORPUS`, or `benches/corpus` by
+//! default) described by a `MANIFEST` file. See `benches/corpus/MANIFEST` for the format. Since a
+//! corpus includes its code images, decoding doesn't need Intel PT hardware.
+//!
+//! A few synthetic traces with different branch mixes, and a large one, are always decoded too.
+//! No recorded traces are checked in (see `benches/corpus/MANIFEST`), so without a corpus of one's
+//! own, these are all that is measured.
+
+mod common;
+
+#[cfg(perf_pt)]
+mod decode {
+    use super::common;
+    use hwtracer::backends::perf_pt::{ImageSection, PerfPTRawTrace, SynthConfig, SynthTrace};
+    use hwtracer::Trace;
+    use std::env;
+    use std::fs;
+    use std::path::{Path, PathBuf};
+    use std::time::{Duration, Instant};
+    use tempfile::NamedTempFile;
+
+    const DEFAULT_ITERS: usize = 3;
+    // Loop iterations of the synthetic traces (each iteration runs 16 branch sites), and of the
+    // large one.
+    const SYNTH_LOOP_ITERS: u64 = 200_000;
+    const SYNTH_LARGE_LOOP_ITERS: u64 = 5_000_000;
+
+    /// A trace in the corpus.
+    struct Entry {
+        name: String,
+        trace: PathBuf,
+        image: Vec<ImageSection>,
+    }
+
+    /// Parses one line of a `MANIFEST` file, resolving paths relative to `dir`.
+    fn parse_entry(dir: &Path, line: &str) -> Result<Entry, String> {
+        let mut toks = line.split_whitespace();
+        let name = toks.next().ok_or("missing name")?.to_owned();
+        let trace = dir.join(toks.next().ok_or("missing trace file")?);
+        let mut image = Vec::new();
+        while let Some(kind) = toks.next() {
+            let arg = toks
+                .next()
+                .ok_or(format!("{} requires an argument", kind))?;
+            match kind {
+                "--raw" => {
+                    let mut sec = ImageSection::parse_raw(arg).map_err(|e| e.to_string())?;
+                    sec.filename = dir.join(sec.filename);
+                    image.push(sec);
+                }
+                "--elf" => {
+                    let (file, base) = ImageSection::split_elf_arg(arg);
+                    let secs =
+                        ImageSection::from_elf(dir.join(file), base).map_err(|e| e.to_string())?;
+                    image.extend(secs);
+                }
+                _ => return Err(format!("unknown image kind: {}", kind)),
+            }
+        }
+        Ok(Entry { name, trace, image })
+    }
+
+    fn load_corpus(dir: &Path) -> Vec<Entry> {
+        let manifest = match fs::read_to_string(dir.join("MANIFEST")) {
+            Ok(m) => m,
+            Err(e) => {
+                println!("Can't read {}/MANIFEST: {}", dir.display(), e);
+                return Vec::new();
+            }
+        };
+        let mut entries = Vec::new();
+        for (i, line) in manifest.lines().enumerate() {
+            let line = line.trim();
+            if line.is_empty() || line.starts_with('#') {
+                continue;
+            }
+            match parse_entry(dir, line) {
+                Ok(e) => entries.push(e),
+                Err(e) => panic!("MANIFEST line {}: {}", i + 1, e),
+            }
+        }
+        entries
+    }
+
+    /// The results of decoding a trace once.
+    struct Run {
+        time_to_first_block: Duration,
+        total: Duration,
+        blocks: usize,
+        peak_rss_kib: u64,
+    }
+
+    fn decode_once(trace: &dyn Trace) -> Result<Run, String> {
+        common::reset_peak_rss();
+        let before = Instant::now();
+        let mut itr = trace.iter_blocks();
+        let mut blocks = 0;
+        if let Some(b) = itr.next() {
+            b.map_err(|e| e.to_string())?;
+            blocks += 1;
+        }
+        let time_to_first_block = before.elapsed();
+        for b in itr {
+            b.map_err(|e| format!("{} (after {} blocks)", e, blocks))?;
+            blocks += 1;
+        }
+        let total = before.elapsed();
+        Ok(Run {
+            time_to_first_block,
+            total,
+            blocks,
+            peak_rss_kib: common::rss_kib().1,
+        })
+    }
+
+    /// Generates the synthetic traces. The code files must outlive the traces.
+    fn synthetic() -> Vec<(String, PerfPTRawTrace, NamedTempFile)> {
+        let shapes = [
+            ("synth-cond", 100, 0, SYNTH_LOOP_ITERS),
+            ("synth-call", 0, 0, SYNTH_LOOP_ITERS),
+            ("synth-icall", 0, 100, SYNTH_LOOP_ITERS),
+            ("synth-mix", 60, 20, SYNTH_LOOP_ITERS),
+            ("synth-large", 60, 20, SYNTH_LARGE_LOOP_ITERS),
+        ];
+        let mut traces = Vec::new();
+        for &(name, cond_pct, indirect_pct, loop_iters) in &shapes {
+            let conf = SynthConfig {
+                loop_iters,
+                cond_pct,
+                indirect_pct,
+                ..SynthConfig::default()
+            };
+            let code = NamedTempFile::new().unwrap();
+            let trace = SynthTrace::generate(&conf)
+                .and_then(|st| st.to_raw_trace(code.path()))
+                .unwrap();
+            traces.push((name.to_owned(), trace, code));
+        }
+        traces
+    }
+
+    /// Decodes `trace` `iters` times and prints a row of results for the median run.
+    fn bench(name: &str, trace: &PerfPTRawTrace, iters: usize) {
+        let mut runs = Vec::with_capacity(iters);
+        for _ in 0..iters {
+            match decode_once(trace) {
+                Ok(r) => runs.push(r),
+                Err(e) => {
+                    println!("  {:<12} decode error: {}", name, e);
+                    return;
+                }
+            }
+        }
+        runs.sort_by_key(|r| r.total);
+        let med = match common::percentile_index(runs.len(), 50.0) {
+            Some(i) => &runs[i],
+            None => {
+                println!("  {:<12} no iterations", name);
+                return;
+            }
+        };
+        let mib = trace.raw_data().len() as f64 / (1024.0 * 1024.0);
+        let secs = med.total.as_secs_f64();
+        println!(
+            "  {:<12} {:>10.2} {:>12} {:>10.3} {:>10.3} {:>10.2} {:>12.0} {:>10.1}",
+            name,
+            mib,
+            med.blocks,
+            med.time_to_first_block.as_secs_f64() * 1e3,
+            secs,
+            mib / secs,
+            med.blocks as f64 / secs,
+            med.peak_rss_kib as f64 / 1024.0,
+        );
+    }
+
+    pub fn main() {
+        let dir = env::var("HWTRACER_DECODE_CORPUS")
+            .map(PathBuf::from)
+            .unwrap_or_else(|_| Path::new(env!("CARGO_MANIFEST_DIR")).join("benches/corpus"));
+        let iters = common::iters(DEFAULT_ITERS);
+        let entries = load_corpus(&dir);
+
+        println!(
+            "Decoding corpus {} (median of {} iterations)",
+            dir.display(),
+            iters
+        );
+        println!(
+            "  {:<12} {:>10} {:>12} {:>10} {:>10} {:>10} {:>12} {:>10}",
+            "trace", "MiB", "blocks", "ttfb ms", "time s", "MiB/s", "blocks/s", "peak MiB"
+        );
+        if entries.is_empty() {
+            println!("  (no traces in corpus)");
+        }
+        for entry in entries {
+            match PerfPTRawTrace::from_file(&entry.trace, entry.image) {
+                Ok(t) => bench(&entry.name, &t, iters),
+                Err(e) => println!("  {:<12} can't load: {}", entry.name, e),
+            }
+        }
+        for (name, trace, _code) in synthetic() {
+            bench(&name, &trace, iters);
+        }
+    }
+}
+
+#[cfg(perf_pt)]
+fn main() {
+    decode::main();
+}
+
+#[cfg(not(perf_pt))]
+fn main() {
+    println!("Skipping decode benchmark: the perf_pt backend was not built");
+}
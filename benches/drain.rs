@@ -0,0 +1,246 @@
+//! Measures the copy engine which drains the AUX buffer (see `CopyMode`).
+//!
+//! First, the bandwidth of each copy mode is measured for drains of different sizes, copying from
+//! a ring (standing in for the AUX buffer) into a large, cold trace buffer.
+//!
+//! Second, the cache impact of draining is measured: a "traced" thread repeatedly walks a working
+//! set which fits in the last level cache (`HWTRACER_BENCH_WSS` KiB, 4096 by default) while a
+//! "collector" thread on another CPU drains continuously in each mode. We report the traced
+//! thread's median time per walk and, if the kernel lets us count them, its last level cache
+//! misses per walk. Neither part needs Intel PT hardware.
+
+mod common;
+
+#[cfg(perf_pt)]
+mod drain {
+    use super::common;
+    use hwtracer::backends::perf_pt::CopyMode;
+    use std::env;
+    use std::mem;
+    use std::sync::atomic::{AtomicBool, Ordering};
+    use std::sync::{Arc, Barrier};
+    use std::thread;
+    use std::time::{Duration, Instant};
+
+    const DEFAULT_ITERS: usize = 51;
+    const MODES: [CopyMode; 4] = [
+        CopyMode::Auto,
+        CopyMode::Memcpy,
+        CopyMode::Sse2,
+        CopyMode::Avx2,
+    ];
+    // The source ring (standing in for a 1024 page AUX buffer).
+    const RING_SIZE: usize = 4 * 1024 * 1024;
+    // The destination, which is much larger than the last level cache so that it starts cold.
+    const TRACE_SIZE: usize = 256 * 1024 * 1024;
+    // The size of each drain in the cache impact measurement.
+    const DRAIN_SIZE: usize = 1024 * 1024;
+    const CACHE_LINE: usize = 64;
+
+    /// Counts the calling thread's last level cache misses, if perf allows it.
+    struct MissCounter {
+        fd: libc::c_int,
+    }
+
+    impl MissCounter {
+        fn new() -> Option<Self> {
+            // A `struct perf_event_attr` (PERF_ATTR_SIZE_VER0 bytes) for
+            // PERF_TYPE_HARDWARE/PERF_COUNT_HW_CACHE_MISSES with `exclude_kernel` and
+            // `exclude_hv` set.
+            let mut attr = [0u64; 8];
+            attr[0] = (mem::size_of_val(&attr) as u64) << 32;
+            attr[1] = 3;
+            attr[5] = (1 << 5) | (1 << 6);
+            let fd =
+                unsafe { libc::syscall(libc::SYS_perf_event_open, attr.as_ptr(), 0, -1, -1, 0) };
+            if fd < 0 {
+                None
+            } else {
+                Some(Self {
+                    fd: fd as libc::c_int,
+                })
+            }
+        }
+
+        fn read(&self) -> u64 {
+            let mut v = 0u64;
+            let n = unsafe { libc::read(self.fd, &mut v as *mut u64 as *mut libc::c_void, 8) };
+            assert_eq!(n, 8);
+            v
+        }
+    }
+
+    impl Drop for MissCounter {
+        fn drop(&mut self) {
+            unsafe { libc::close(self.fd) };
+        }
+    }
+
+    /// Copies `len` bytes at a time from `ring` into `trace`, as the collector would, until the
+    /// trace is full, then starts again at the beginning of both. Returns the number of bytes
+    /// copied.
+    fn drain(mode: CopyMode, ring: &[u8], trace: &mut [u8], len: usize, total: usize) -> usize {
+        let (mut r_off, mut t_off, mut done) = (0, 0, 0);
+        while done < total {
+            if r_off + len > ring.len() {
+                r_off = 0;
+            }
+            if t_off + len > trace.len() {
+                t_off = 0;
+            }
+            mode.copy(&mut trace[t_off..t_off + len], &ring[r_off..r_off + len])
+                .unwrap();
+            r_off += len;
+            t_off += len;
+            done += len;
+        }
+        done
+    }
+
+    fn bandwidth(ring: &[u8], trace: &mut [u8]) {
+        println!("Drain bandwidth (GiB/s)");
+        print!("  {:<10}", "drain KiB");
+        for mode in &MODES {
+            print!(" {:>10}", format!("{:?}", mode));
+        }
+        println!();
+        for &len in &[4 * 1024, 64 * 1024, 1024 * 1024, 4 * 1024 * 1024] {
+            print!("  {:<10}", len / 1024);
+            for &mode in &MODES {
+                if !mode.is_supported() {
+                    print!(" {:>10}", "-");
+                    continue;
+                }
+                let before = Instant::now();
+                let done = drain(mode, ring, trace, len, TRACE_SIZE);
+                let gib = done as f64 / (1024.0 * 1024.0 * 1024.0);
+                print!(" {:>10.2}", gib / before.elapsed().as_secs_f64());
+            }
+            println!();
+        }
+    }
+
+    /// Walks `ws`, touching each cache line once, and returns a value depending on its contents.
+    #[inline(never)]
+    fn walk(ws: &[u8]) -> u64 {
+        let mut sum = 0u64;
+        for i in (0..ws.len()).step_by(CACHE_LINE) {
+            sum = sum.wrapping_add(ws[i] as u64);
+        }
+        sum
+    }
+
+    /// Walks the working set `iters` times while another thread drains in `mode` (or nothing
+    /// drains if `mode` is `None`), and prints a row of results.
+    fn cache_impact(
+        mode: Option<CopyMode>,
+        cpus: (usize, usize),
+        ring: &Arc<Vec<u8>>,
+        wss: usize,
+        iters: usize,
+    ) {
+        let name = mode.map_or_else(|| String::from("idle"), |m| format!("{:?}", m));
+        if let Some(false) = mode.map(|m| m.is_supported()) {
+            println!("  {:<10} unsupported", name);
+            return;
+        }
+        let stop = Arc::new(AtomicBool::new(false));
+        let ready = Arc::new(Barrier::new(2));
+        let drainer = mode.map(|mode| {
+            let (stop, ready, ring) = (Arc::clone(&stop), Arc::clone(&ready), Arc::clone(ring));
+            thread::spawn(move || {
+                common::pin(cpus.1);
+                let mut trace = vec![1u8; TRACE_SIZE];
+                ready.wait();
+                let mut done = 0;
+                while !stop.load(Ordering::Relaxed) {
+                    done += drain(mode, &ring, &mut trace, DRAIN_SIZE, RING_SIZE);
+                }
+                done
+            })
+        });
+        if drainer.is_some() {
+            ready.wait();
+        }
+
+        let ws = vec![1u8; wss];
+        let counter = MissCounter::new();
+        let mut times = Vec::with_capacity(iters);
+        let mut misses = Vec::with_capacity(iters);
+        assert_ne!(walk(&ws), 0); // Warm the cache.
+        let begin = Instant::now();
+        for _ in 0..iters {
+            let m = counter.as_ref().map(|c| c.read());
+            let before = Instant::now();
+            assert_ne!(walk(&ws), 0);
+            times.push(before.elapsed());
+            if let (Some(c), Some(m)) = (&counter, m) {
+                misses.push(c.read() - m);
+            }
+        }
+        let elapsed = begin.elapsed();
+
+        stop.store(true, Ordering::Relaxed);
+        let drained = drainer.map_or(0, |d| d.join().unwrap());
+        times.sort();
+        misses.sort();
+        let us = |d: Duration| d.as_secs_f64() * 1e6;
+        let misses = match misses.get(misses.len() / 2) {
+            Some(m) => format!("{}", m),
+            None => String::from("-"),
+        };
+        println!(
+            "  {:<10} {:>12.1} {:>12.1} {:>14} {:>12.2}",
+            name,
+            us(common::percentile(&times, 50.0)),
+            us(common::percentile(&times, 99.0)),
+            misses,
+            drained as f64 / (1024.0 * 1024.0 * 1024.0) / elapsed.as_secs_f64(),
+        );
+    }
+
+    pub fn main() {
+        let iters = common::iters(DEFAULT_ITERS);
+        let wss = match env::var("HWTRACER_BENCH_WSS") {
+            Ok(s) => s
+                .parse::<usize>()
+                .unwrap_or_else(|_| panic!("bad HWTRACER_BENCH_WSS: {}", s)),
+            Err(_) => 4096,
+        } * 1024;
+        let ring = Arc::new((0..RING_SIZE).map(|i| i as u8).collect::<Vec<u8>>());
+        let mut trace = vec![1u8; TRACE_SIZE];
+        bandwidth(&ring, &mut trace);
+        drop(trace);
+
+        let cpus = common::allowed_cpus();
+        let cpus = (cpus[0], *cpus.last().unwrap());
+        common::pin(cpus.0);
+        println!(
+            "\nCache impact on a thread walking {} KiB (CPU {}) while draining {} KiB at a time \
+             (CPU {}), {} iterations",
+            wss / 1024,
+            cpus.0,
+            DRAIN_SIZE / 1024,
+            cpus.1,
+            iters
+        );
+        println!(
+            "  {:<10} {:>12} {:>12} {:>14} {:>12}",
+            "drain", "walk p50 us", "walk p99 us", "LLC misses", "drain GiB/s"
+        );
+        cache_impact(None, cpus, &ring, wss, iters);
+        for &mode in &MODES {
+            cache_impact(Some(mode), cpus, &ring, wss, iters);
+        }
+    }
+}
+
+#[cfg(perf_pt)]
+fn main() {
+    drain::main();
+}
+
+#[cfg(not(perf_pt))]
+fn main() {
+    println!("Skipping drain benchmark: the perf_pt backend was not built");
+}
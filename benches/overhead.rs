@@ -0,0 +1,202 @@
+//! Measures how much tracing slows down the traced thread.
+//!
+//! Each workload is run untraced, under the Dummy backend and under the PerfPT backend with a
+//! range of buffer sizes. For each configuration we report the median wall-clock time of a
+//! start/run/stop cycle and its slowdown relative to running untraced. For PerfPT we also report
+//! the CPU time used by the collector thread, the rate at which trace data was produced and how
+//! often the trace buffer overflowed. The PerfPT rows are skipped if the backend is unavailable.
+
+mod common;
+
+use hwtracer::backends::TracerBuilder;
+use hwtracer::HWTracerError;
+use std::time::{Duration, Instant};
+
+const DEFAULT_ITERS: usize = 11;
+
+/// A loop with a data-dependent branch.
+#[inline(never)]
+fn loops() -> u64 {
+    let mut res = 0u64;
+    for i in 0..2_000_000u64 {
+        if i % 3 == 0 {
+            res = res.wrapping_add(i);
+        } else {
+            res ^= i;
+        }
+    }
+    res
+}
+
+/// Lots of calls and returns.
+#[inline(never)]
+fn fib(n: u64) -> u64 {
+    if n < 2 {
+        n
+    } else {
+        fib(n - 1) + fib(n - 2)
+    }
+}
+
+fn calls() -> u64 {
+    fib(30)
+}
+
+/// The measurements of one start/run/stop cycle.
+struct Sample {
+    wall: Duration,
+    collector_cpu: Option<Duration>,
+    trace_bytes: usize,
+}
+
+/// A tracing configuration: returns a function which runs a workload once under it.
+type Session = Box<dyn FnMut(fn() -> u64) -> Result<Sample, HWTracerError>>;
+
+fn untraced() -> Session {
+    Box::new(|workload| {
+        let before = Instant::now();
+        let res = workload();
+        let wall = before.elapsed();
+        assert_ne!(res, 1); // Stop over-optimisation.
+        Ok(Sample {
+            wall,
+            collector_cpu: None,
+            trace_bytes: 0,
+        })
+    })
+}
+
+fn dummy() -> Session {
+    let mut tracer = TracerBuilder::new()
+        .dummy()
+        .build()
+        .unwrap()
+        .thread_tracer();
+    Box::new(move |workload| {
+        let before = Instant::now();
+        tracer.start_tracing()?;
+        let res = workload();
+        let trace = tracer.stop_tracing()?;
+        let wall = before.elapsed();
+        assert_ne!(res, 1);
+        Ok(Sample {
+            wall,
+            collector_cpu: None,
+            trace_bytes: trace.raw_data().len(),
+        })
+    })
+}
+
+#[cfg(perf_pt)]
+fn perf_pt(aux_bufsize: usize) -> Result<Session, HWTracerError> {
+    use hwtracer::backends::perf_pt::PerfPTThreadTracer;
+    use hwtracer::backends::{BackendConfig, PerfPTConfig};
+
+    let conf = PerfPTConfig {
+        aux_bufsize,
+        ..PerfPTConfig::default()
+    };
+    // Check that the backend is usable with this configuration.
+    let mut bldr = TracerBuilder::new().perf_pt();
+    if let BackendConfig::PerfPT(ref mut c) = bldr.config() {
+        *c = conf.clone();
+    }
+    bldr.build()?;
+
+    let mut tracer = PerfPTThreadTracer::new(conf)?;
+    Ok(Box::new(move |workload| {
+        use hwtracer::ThreadTracer;
+
+        let before = Instant::now();
+        tracer.start_tracing()?;
+        let res = workload();
+        let trace = tracer.stop_tracing()?;
+        let wall = before.elapsed();
+        assert_ne!(res, 1);
+        Ok(Sample {
+            wall,
+            collector_cpu: Some(tracer.phase_times().collector_cpu),
+            trace_bytes: trace.raw_data().len(),
+        })
+    }))
+}
+
+#[cfg(not(perf_pt))]
+fn perf_pt(_aux_bufsize: usize) -> Result<Session, HWTracerError> {
+    Err(HWTracerError::BackendUnavailable(
+        hwtracer::backends::BackendKind::PerfPT,
+    ))
+}
+
+/// Runs `workload` `iters` times under `session` and prints a row of results.
+fn bench(
+    name: &str,
+    session: &mut Session,
+    workload: fn() -> u64,
+    iters: usize,
+    base: Option<f64>,
+) -> f64 {
+    let mut walls = Vec::with_capacity(iters);
+    let mut cpus = Vec::with_capacity(iters);
+    let mut bytes = 0;
+    let mut overflows = 0;
+    for _ in 0..iters {
+        match session(workload) {
+            Ok(s) => {
+                walls.push(s.wall);
+                cpus.extend(s.collector_cpu);
+                bytes += s.trace_bytes;
+            }
+            Err(HWTracerError::HWBufferOverflow) => overflows += 1,
+            Err(e) => panic!("{}: {}", name, e),
+        }
+    }
+    walls.sort();
+    cpus.sort();
+    let ms = |d: Duration| d.as_secs_f64() * 1e3;
+    let wall = ms(common::percentile(&walls, 50.0));
+    let total_secs = walls.iter().sum::<Duration>().as_secs_f64();
+    let dash = || String::from("-");
+    println!(
+        "  {:<16} {:>10.3} {:>9} {:>14} {:>10} {:>10.1}",
+        name,
+        wall,
+        base.map(|b| format!("{:.2}x", wall / b))
+            .unwrap_or_else(dash),
+        if cpus.is_empty() {
+            dash()
+        } else {
+            format!("{:.3}", ms(common::percentile(&cpus, 50.0)))
+        },
+        if bytes == 0 {
+            dash()
+        } else {
+            format!("{:.1}", bytes as f64 / (1024.0 * 1024.0) / total_secs)
+        },
+        100.0 * overflows as f64 / iters as f64,
+    );
+    wall
+}
+
+fn main() {
+    let iters = common::iters(DEFAULT_ITERS);
+    let workloads: [(&str, fn() -> u64); 2] = [("loop", loops), ("call", calls)];
+    for &(wl_name, workload) in &workloads {
+        println!("\nWorkload '{}' (median of {} iterations)", wl_name, iters);
+        println!(
+            "  {:<16} {:>10} {:>9} {:>14} {:>10} {:>10}",
+            "config", "wall ms", "slowdown", "collector ms", "MiB/s", "overflow %"
+        );
+        let base = bench("untraced", &mut untraced(), workload, iters, None);
+        bench("dummy", &mut dummy(), workload, iters, Some(base));
+        for &aux_bufsize in &[64, 1024, 8192] {
+            let name = format!("perf_pt aux={}", aux_bufsize);
+            match perf_pt(aux_bufsize) {
+                Ok(mut s) => {
+                    bench(&name, &mut s, workload, iters, Some(base));
+                }
+                Err(e) => println!("  {:<16} skipped: {}", name, e),
+            }
+        }
+    }
+}
@@ -0,0 +1,188 @@
+//! Measures how the placement and scheduling of the collector thread affects overflows on a
+//! loaded machine.
+//!
+//! The traced thread is pinned to the first CPU we may run on, and one busy thread pinned to each
+//! CPU keeps every core loaded (change the number with `HWTRACER_BENCH_LOAD`: the threads are
+//! spread over the CPUs in turn). Each configuration then repeatedly traces a branchy workload with
+//! a small AUX buffer, so that a collector which can't keep up causes overflows. We report the
+//! overflow rate, the median wall-clock time of a start/run/stop cycle, the collector's median CPU
+//! time (of the sessions which didn't overflow) and the p99 wakeup-to-drain latency. The "inherit"
+//! configuration is the default, where the collector shares the traced thread's CPU.
+
+mod common;
+
+#[cfg(perf_pt)]
+mod placement {
+    use super::common;
+    use hwtracer::backends::perf_pt::{LatencyHistograms, PerfPTThreadTracer};
+    use hwtracer::backends::{CpuSet, PerfPTConfig, TracerBuilder};
+    use hwtracer::{HWTracerError, ThreadTracer};
+    use std::env;
+    use std::sync::atomic::{AtomicBool, Ordering};
+    use std::sync::Arc;
+    use std::thread;
+    use std::time::{Duration, Instant};
+
+    const DEFAULT_ITERS: usize = 21;
+    // A small AUX buffer (in pages), so that a slow collector overflows.
+    const AUX_BUFSIZE: usize = 16;
+
+    #[inline(never)]
+    fn work() -> u64 {
+        let mut res = 0u64;
+        for i in 0..2_000_000u64 {
+            if i % 3 == 0 {
+                res = res.wrapping_add(i);
+            } else {
+                res ^= i;
+            }
+        }
+        res
+    }
+
+    /// Starts `n` threads, pinned to each of `cpus` in turn, which spin until `stop` is set.
+    fn load(n: usize, cpus: &[usize], stop: &Arc<AtomicBool>) -> Vec<thread::JoinHandle<()>> {
+        (0..n)
+            .map(|i| {
+                let (stop, cpu) = (Arc::clone(stop), cpus[i % cpus.len()]);
+                thread::spawn(move || {
+                    common::pin(cpu);
+                    let mut x = 0u64;
+                    while !stop.load(Ordering::Relaxed) {
+                        x = x.wrapping_mul(6364136223846793005).wrapping_add(1);
+                    }
+                    assert_ne!(x, 1);
+                })
+            })
+            .collect()
+    }
+
+    fn bench(name: &str, conf: PerfPTConfig, iters: usize) {
+        let mut tracer = match PerfPTThreadTracer::new(conf) {
+            Ok(t) => t,
+            Err(e) => {
+                println!("  {:<20} skipped: {}", name, e);
+                return;
+            }
+        };
+        let mut walls = Vec::with_capacity(iters);
+        let mut cpus = Vec::with_capacity(iters);
+        let mut overflows = 0;
+        let drain_before = LatencyHistograms::snapshot().drain;
+        for _ in 0..iters {
+            let before = Instant::now();
+            if let Err(e) = tracer.start_tracing() {
+                println!("  {:<20} skipped: {}", name, e);
+                return;
+            }
+            assert_ne!(work(), 1);
+            match tracer.stop_tracing() {
+                // The phase times aren't updated when stopping fails.
+                Ok(_) => cpus.push(tracer.phase_times().collector_cpu),
+                Err(HWTracerError::HWBufferOverflow) => overflows += 1,
+                Err(e) => panic!("{}: {}", name, e),
+            }
+            walls.push(before.elapsed());
+        }
+        walls.sort();
+        cpus.sort();
+        let drain = LatencyHistograms::snapshot().drain.since(&drain_before);
+        let ms = |d: Duration| d.as_secs_f64() * 1e3;
+        println!(
+            "  {:<20} {:>10.1} {:>10.3} {:>14.3} {:>10} {:>14.1}",
+            name,
+            100.0 * overflows as f64 / iters as f64,
+            ms(common::percentile(&walls, 50.0)),
+            ms(common::percentile(&cpus, 50.0)),
+            drain.count(),
+            drain.percentile(99.0).as_secs_f64() * 1e6,
+        );
+    }
+
+    pub fn main() {
+        if let Err(e) = TracerBuilder::new().perf_pt().build() {
+            println!("Skipping placement benchmark: {}", e);
+            return;
+        }
+        let iters = common::iters(DEFAULT_ITERS);
+        let cpus = common::allowed_cpus();
+        let nload = match env::var("HWTRACER_BENCH_LOAD") {
+            Ok(s) => s
+                .parse()
+                .unwrap_or_else(|_| panic!("bad HWTRACER_BENCH_LOAD: {}", s)),
+            Err(_) => cpus.len(),
+        };
+        let traced_cpu = cpus[0];
+        // Where "pinned" collectors run: away from the traced thread if possible.
+        let mut away = CpuSet::new();
+        away.add(*cpus.last().unwrap()).unwrap();
+
+        let stop = Arc::new(AtomicBool::new(false));
+        let loaders = load(nload, &cpus, &stop);
+        common::pin(traced_cpu);
+
+        println!(
+            "Traced thread on CPU {}, {} busy threads, AUX buffer {} pages ({} iterations)",
+            traced_cpu, nload, AUX_BUFSIZE, iters
+        );
+        println!(
+            "  {:<20} {:>10} {:>10} {:>14} {:>10} {:>14}",
+            "config", "overflow %", "wall ms", "collector ms", "drains", "drain p99 us"
+        );
+        let base = PerfPTConfig {
+            aux_bufsize: AUX_BUFSIZE,
+            ..PerfPTConfig::default()
+        };
+        let configs = vec![
+            ("inherit", base.clone()),
+            (
+                "pinned",
+                PerfPTConfig {
+                    collector_cpus: away,
+                    ..base.clone()
+                },
+            ),
+            (
+                "pinned+numa",
+                PerfPTConfig {
+                    collector_cpus: away,
+                    collector_numa_local: true,
+                    ..base.clone()
+                },
+            ),
+            (
+                "pinned+fifo",
+                PerfPTConfig {
+                    collector_cpus: away,
+                    collector_fifo_priority: 1,
+                    ..base.clone()
+                },
+            ),
+            (
+                "fifo",
+                PerfPTConfig {
+                    collector_fifo_priority: 1,
+                    ..base
+                },
+            ),
+        ];
+        for (name, conf) in configs {
+            bench(name, conf, iters);
+        }
+
+        stop.store(true, Ordering::Relaxed);
+        for l in loaders {
+            l.join().unwrap();
+        }
+    }
+}
+
+#[cfg(perf_pt)]
+fn main() {
+    placement::main();
+}
+
+#[cfg(not(perf_pt))]
+fn main() {
+    println!("Skipping placement benchmark: the perf_pt backend was not built");
+}
@@ -0,0 +1,183 @@
+//! Measures how the PerfPT backend behaves as the number of concurrently tracing threads grows.
+//!
+//! For each thread count, every thread repeatedly starts tracing, runs a small workload and stops
+//! tracing, all threads starting together. We report the latency of `start_tracing()` (and of the
+//! part of it which opens perf, where `EBUSY` retries happen), collector CPU time, overflows, how
+//! many starts timed out waiting for the PMU or failed otherwise, and the peak RSS of the process.
+//! The thread counts can be changed with `HWTRACER_BENCH_THREADS` (a comma-separated list).
+
+mod common;
+
+#[cfg(perf_pt)]
+mod scalability {
+    use super::common;
+    use hwtracer::backends::perf_pt::PerfPTThreadTracer;
+    use hwtracer::backends::{PerfPTConfig, TracerBuilder};
+    use hwtracer::{HWTracerError, ThreadTracer};
+    use std::env;
+    use std::sync::{Arc, Barrier};
+    use std::thread;
+    use std::time::{Duration, Instant};
+
+    const DEFAULT_ITERS: usize = 5;
+    const DEFAULT_THREADS: &[usize] = &[1, 8, 32, 128];
+
+    #[inline(never)]
+    fn work() -> u64 {
+        let mut res = 0u64;
+        for i in 0..100_000u64 {
+            if i % 3 == 0 {
+                res = res.wrapping_add(i);
+            } else {
+                res ^= i;
+            }
+        }
+        res
+    }
+
+    /// What one thread observed.
+    #[derive(Default)]
+    struct ThreadResult {
+        starts: Vec<Duration>,
+        inits: Vec<Duration>,
+        collector_cpu: Duration,
+        overflows: usize,
+        // Starts which timed out waiting for the PMU, and which failed otherwise.
+        timeouts: usize,
+        failures: usize,
+        // The first error which a start failed with, other than a timeout.
+        first_failure: Option<String>,
+        res: u64,
+    }
+
+    fn run_thread(barrier: Arc<Barrier>, iters: usize) -> ThreadResult {
+        let mut tracer = PerfPTThreadTracer::new(PerfPTConfig::default()).unwrap();
+        let mut tr = ThreadResult::default();
+        barrier.wait();
+        for _ in 0..iters {
+            let before = Instant::now();
+            match tracer.start_tracing() {
+                Ok(()) => (),
+                Err(HWTracerError::SessionTimeout(_)) => {
+                    tr.timeouts += 1;
+                    continue;
+                }
+                Err(e) => {
+                    tr.failures += 1;
+                    tr.first_failure.get_or_insert_with(|| e.to_string());
+                    continue;
+                }
+            }
+            tr.starts.push(before.elapsed());
+            tr.inits.push(tracer.phase_times().init);
+            tr.res = tr.res.wrapping_add(work());
+            match tracer.stop_tracing() {
+                // The phase times aren't updated when stopping fails.
+                Ok(_) => tr.collector_cpu += tracer.phase_times().collector_cpu,
+                Err(HWTracerError::HWBufferOverflow) => tr.overflows += 1,
+                Err(e) => panic!("{}", e),
+            }
+        }
+        tr
+    }
+
+    fn thread_counts() -> Vec<usize> {
+        match env::var("HWTRACER_BENCH_THREADS") {
+            Ok(s) => s
+                .split(',')
+                .map(|n| {
+                    n.trim()
+                        .parse()
+                        .unwrap_or_else(|_| panic!("bad HWTRACER_BENCH_THREADS: {}", s))
+                })
+                .collect(),
+            Err(_) => DEFAULT_THREADS.to_vec(),
+        }
+    }
+
+    pub fn main() {
+        if let Err(e) = TracerBuilder::new().perf_pt().build() {
+            println!("Skipping scalability benchmark: {}", e);
+            return;
+        }
+        let iters = common::iters(DEFAULT_ITERS);
+        println!(
+            "Concurrent tracing ({} start/stop cycles per thread)",
+            iters
+        );
+        println!(
+            "  {:>8} {:>12} {:>12} {:>12} {:>14} {:>10} {:>10} {:>10} {:>10} {:>12}",
+            "threads",
+            "start p50 ms",
+            "start p99 ms",
+            "open p99 ms",
+            "collector ms",
+            "overflows",
+            "timeouts",
+            "failures",
+            "peak MiB",
+            "KiB/thread"
+        );
+        for nthreads in thread_counts() {
+            let (base_rss, _) = common::rss_kib();
+            common::reset_peak_rss();
+            let barrier = Arc::new(Barrier::new(nthreads));
+            let handles = (0..nthreads)
+                .map(|_| {
+                    let barrier = Arc::clone(&barrier);
+                    thread::spawn(move || run_thread(barrier, iters))
+                })
+                .collect::<Vec<_>>();
+            let results = handles
+                .into_iter()
+                .map(|h| h.join().unwrap())
+                .collect::<Vec<_>>();
+            let (_, peak_rss) = common::rss_kib();
+
+            let mut starts = results
+                .iter()
+                .flat_map(|r| r.starts.clone())
+                .collect::<Vec<_>>();
+            let mut inits = results
+                .iter()
+                .flat_map(|r| r.inits.clone())
+                .collect::<Vec<_>>();
+            starts.sort();
+            inits.sort();
+            let collector_cpu = results.iter().map(|r| r.collector_cpu).sum::<Duration>();
+            let overflows = results.iter().map(|r| r.overflows).sum::<usize>();
+            let timeouts = results.iter().map(|r| r.timeouts).sum::<usize>();
+            let failures = results.iter().map(|r| r.failures).sum::<usize>();
+            let res = results.iter().fold(0u64, |a, r| a.wrapping_add(r.res));
+            let ms = |d: Duration| d.as_secs_f64() * 1e3;
+            println!(
+                "  {:>8} {:>12.3} {:>12.3} {:>12.3} {:>14.1} {:>10} {:>10} {:>10} {:>10.1} {:>12.0}   \
+                 (result: {})",
+                nthreads,
+                ms(common::percentile(&starts, 50.0)),
+                ms(common::percentile(&starts, 99.0)),
+                ms(common::percentile(&inits, 99.0)),
+                ms(collector_cpu),
+                overflows,
+                timeouts,
+                failures,
+                peak_rss as f64 / 1024.0,
+                peak_rss.saturating_sub(base_rss) as f64 / nthreads as f64,
+                res, // Stop over-optimisation.
+            );
+            if let Some(e) = results.iter().find_map(|r| r.first_failure.as_ref()) {
+                println!("  {:>8} first failure: {}", "", e);
+            }
+        }
+    }
+}
+
+#[cfg(perf_pt)]
+fn main() {
+    scalability::main();
+}
+
+#[cfg(not(perf_pt))]
+fn main() {
+    println!("Skipping scalability benchmark: the perf_pt backend was not built");
+}
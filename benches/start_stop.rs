@@ -0,0 +1,163 @@
+//! Measures the latency of `start_tracing()` and `stop_tracing()`.
+//!
+//! For the PerfPT backend, each phase of starting and stopping is also timed separately, with each
+//! context pool refill policy (see `PerfPTConfig::pool_refill`). The PerfPT backend is skipped if
+//! it is unavailable (e.g. the CPU doesn't support Intel PT). Asynchronous stopping
+//! (`stop_tracing_async()`) is timed separately.
+
+mod common;
+
+use hwtracer::backends::TracerBuilder;
+use hwtracer::ThreadTracer;
+use std::time::{Duration, Instant};
+
+const DEFAULT_ITERS: usize = 1000;
+
+/// A tiny amount of work to trace, so that stopping has something (but not much) to drain.
+#[inline(never)]
+fn work() -> u64 {
+    let mut res: u64 = 0;
+    for i in 0..100 {
+        res = res.wrapping_mul(31).wrapping_add(i);
+    }
+    res
+}
+
+/// Times `iters` start/stop cycles of `tracer`, returning the start and stop latencies.
+fn time_start_stop(
+    tracer: &mut dyn ThreadTracer,
+    iters: usize,
+) -> (Vec<Duration>, Vec<Duration>, u64) {
+    let mut starts = Vec::with_capacity(iters);
+    let mut stops = Vec::with_capacity(iters);
+    let mut res: u64 = 0;
+    for _ in 0..iters {
+        let before = Instant::now();
+        tracer.start_tracing().unwrap();
+        starts.push(before.elapsed());
+        res = res.wrapping_add(work());
+        let before = Instant::now();
+        tracer.stop_tracing().unwrap();
+        stops.push(before.elapsed());
+    }
+    (starts, stops, res)
+}
+
+fn bench_dummy(iters: usize) {
+    let mut tracer = TracerBuilder::new()
+        .dummy()
+        .build()
+        .unwrap()
+        .thread_tracer();
+    let (mut starts, mut stops, res) = time_start_stop(&mut *tracer, iters);
+    common::print_percentiles_header(&format!("Dummy backend ({} iterations)", iters));
+    common::print_percentiles("start_tracing()", &mut starts);
+    common::print_percentiles("stop_tracing()", &mut stops);
+    println!("  (result: {})", res); // Stop over-optimisation.
+}
+
+#[cfg(perf_pt)]
+fn bench_perf_pt(iters: usize) {
+    use hwtracer::backends::{PerfPTConfig, PoolRefill};
+
+    if let Err(e) = TracerBuilder::new().perf_pt().build() {
+        println!("\nSkipping PerfPT backend: {}", e);
+        return;
+    }
+    for &refill in &[PoolRefill::Off, PoolRefill::Inline, PoolRefill::Background] {
+        bench_perf_pt_config(
+            iters,
+            PerfPTConfig {
+                pool_refill: refill,
+                ..PerfPTConfig::default()
+            },
+        );
+    }
+    bench_perf_pt_async(iters);
+}
+
+/// Times `stop_tracing_async()`, which is what the traced thread waits for, and resolving the
+/// pending trace.
+#[cfg(perf_pt)]
+fn bench_perf_pt_async(iters: usize) {
+    use hwtracer::backends::perf_pt::PerfPTThreadTracer;
+
+    let mut tracer = PerfPTThreadTracer::default();
+    let mut stops = Vec::with_capacity(iters);
+    let mut waits = Vec::with_capacity(iters);
+    let mut res: u64 = 0;
+    for _ in 0..iters {
+        tracer.start_tracing().unwrap();
+        res = res.wrapping_add(work());
+        let before = Instant::now();
+        let pending = tracer.stop_tracing_async().unwrap();
+        stops.push(before.elapsed());
+        let before = Instant::now();
+        pending.wait().unwrap();
+        waits.push(before.elapsed());
+    }
+    common::print_percentiles_header(&format!(
+        "PerfPT backend, asynchronous stop ({} iterations)",
+        iters
+    ));
+    common::print_percentiles("stop_tracing_async()", &mut stops);
+    common::print_percentiles("PendingTrace::wait()", &mut waits);
+    println!("  (result: {})", res); // Stop over-optimisation.
+}
+
+#[cfg(perf_pt)]
+fn bench_perf_pt_config(iters: usize, config: hwtracer::backends::PerfPTConfig) {
+    use hwtracer::backends::perf_pt::PerfPTThreadTracer;
+
+    let refill = config.pool_refill;
+    let mut tracer = PerfPTThreadTracer::new(config).unwrap();
+    let mut phases: Vec<(&str, Vec<Duration>)> = vec![
+        ("perf_pt_init_tracer", Vec::new()),
+        ("pthread_create + sem_wait", Vec::new()),
+        ("PERF_EVENT_IOC_ENABLE", Vec::new()),
+        ("PERF_EVENT_IOC_DISABLE", Vec::new()),
+        ("stop pipe close + join", Vec::new()),
+        ("perf_pt_free_tracer", Vec::new()),
+        ("start_tracing()", Vec::new()),
+        ("stop_tracing()", Vec::new()),
+    ];
+    let mut res: u64 = 0;
+    for _ in 0..iters {
+        let before = Instant::now();
+        tracer.start_tracing().unwrap();
+        let start = before.elapsed();
+        res = res.wrapping_add(work());
+        let before = Instant::now();
+        tracer.stop_tracing().unwrap();
+        let stop = before.elapsed();
+
+        let t = tracer.phase_times();
+        for (i, d) in [
+            t.init, t.spawn, t.enable, t.disable, t.join, t.free, start, stop,
+        ]
+        .iter()
+        .enumerate()
+        {
+            phases[i].1.push(*d);
+        }
+    }
+    common::print_percentiles_header(&format!(
+        "PerfPT backend, pool refill {:?} ({} iterations)",
+        refill, iters
+    ));
+    for (name, samples) in &mut phases {
+        common::print_percentiles(name, samples);
+    }
+    println!("  (result: {})", res); // Stop over-optimisation.
+}
+
+#[cfg(not(perf_pt))]
+fn bench_perf_pt(_iters: usize) {
+    println!("\nSkipping PerfPT backend: not built");
+}
+
+fn main() {
+    let iters = common::iters(DEFAULT_ITERS);
+    bench_dummy(iters);
+    bench_perf_pt(iters);
+}
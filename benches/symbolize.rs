@@ -0,0 +1,122 @@
+//! Measures the throughput of symbolizing addresses with `Symbolizer::symbolize_into()`.
+//!
+//! The addresses are in the code of the benchmark's own executable (which is read with
+//! `ImageSection::from_elf()`, so this doesn't need Intel PT hardware), either spread uniformly
+//! over it, or close together, as the blocks of a trace tend to be.
+
+mod common;
+
+#[cfg(perf_pt)]
+mod symbolize {
+    use super::common;
+    use hwtracer::backends::perf_pt::{ImageSection, ModuleMap, Symbolizer};
+    use std::env;
+    use std::time::{Duration, Instant};
+
+    const DEFAULT_ITERS: usize = 5;
+    const ADDRS: usize = 10_000_000;
+
+    // A xorshift generator, so the addresses are the same from run to run.
+    struct Rng(u64);
+
+    impl Rng {
+        fn next(&mut self) -> u64 {
+            self.0 ^= self.0 << 13;
+            self.0 ^= self.0 >> 7;
+            self.0 ^= self.0 << 17;
+            self.0
+        }
+    }
+
+    /// Returns `ADDRS` addresses in `image`, each either random (`local` false) or within a few
+    /// hundred bytes of the previous one, with an occasional jump elsewhere (`local` true).
+    fn addrs(image: &[ImageSection], local: bool) -> Vec<u64> {
+        let total = image.iter().map(|s| s.size).sum::<u64>();
+        let at = |mut off: u64| {
+            for s in image {
+                if off < s.size {
+                    return s.vaddr + off;
+                }
+                off -= s.size;
+            }
+            unreachable!();
+        };
+        let mut rng = Rng(0x9e37_79b9_7f4a_7c15);
+        let mut off = 0;
+        (0..ADDRS)
+            .map(|_| {
+                let r = rng.next();
+                off = if !local || r % 64 == 0 {
+                    (r >> 8) % total
+                } else {
+                    (off + (r >> 8) % 512) % total
+                };
+                at(off)
+            })
+            .collect()
+    }
+
+    fn bench(name: &str, image: &[ImageSection], local: bool, iters: usize) {
+        let addrs = addrs(image, local);
+        let mut times = Vec::with_capacity(iters);
+        // Load the symbol table, and fault in the output vector, before timing lookups.
+        let sym = Symbolizer::new(ModuleMap::new(image).unwrap());
+        let mut syms = Vec::new();
+        sym.symbolize_into(&addrs, &mut syms);
+        let found = syms.iter().filter(|s| s.is_some()).count();
+        for _ in 0..iters {
+            let before = Instant::now();
+            sym.symbolize_into(&addrs, &mut syms);
+            times.push(before.elapsed());
+        }
+        times.sort();
+        let secs = common::percentile(&times, 50.0).as_secs_f64();
+        println!(
+            "  {:<12} {:>12} {:>10.1} {:>10.3} {:>14.0}",
+            name,
+            addrs.len(),
+            found as f64 * 100.0 / addrs.len() as f64,
+            secs,
+            addrs.len() as f64 / secs,
+        );
+    }
+
+    fn load_time(image: &[ImageSection]) -> Duration {
+        let sym = Symbolizer::new(ModuleMap::new(image).unwrap());
+        let before = Instant::now();
+        sym.symbolize_one(image[0].vaddr);
+        before.elapsed()
+    }
+
+    pub fn main() {
+        let exe = env::current_exe().unwrap();
+        let image = ImageSection::from_elf(&exe, 0).unwrap();
+        let iters = common::iters(DEFAULT_ITERS);
+
+        println!(
+            "Symbolizing {} (median of {} iterations)",
+            exe.display(),
+            iters
+        );
+        println!(
+            "  symbol table loaded in {:.3} ms",
+            load_time(&image).as_secs_f64() * 1e3
+        );
+        println!(
+            "  {:<12} {:>12} {:>10} {:>10} {:>14}",
+            "addresses", "lookups", "found %", "time s", "lookups/s"
+        );
+        bench("uniform", &image, false, iters);
+        bench("local", &image, true, iters);
+    }
+}
+
+#[cfg(perf_pt)]
+fn main() {
+    symbolize::main();
+}
+
+#[cfg(not(perf_pt))]
+fn main() {
+    println!("Skipping symbolize benchmark: the perf_pt backend was not built");
+}
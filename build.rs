@@ -103,10 +103,21 @@ fn main() {
     if cfg!(all(target_os = "linux", target_arch = "x86_64"))
         && feature_check("check_perf_pt.c", "check_perf_pt")
     {
+        c_build.file("src/backends/perf_pt/arbiter.c");
+        c_build.file("src/backends/perf_pt/budget.c");
         c_build.file("src/backends/perf_pt/collect.c");
+        c_build.file("src/backends/perf_pt/copy.c");
         c_build.file("src/backends/perf_pt/decode.c");
+        c_build.file("src/backends/perf_pt/emu.c");
+        c_build.file("src/backends/perf_pt/flight.c");
+        c_build.file("src/backends/perf_pt/synth.c");
         c_build.file("src/backends/perf_pt/util.c");
 
+        // Compile in USDT probes if the system has the headers for them.
+        if feature_check("check_sdt.c", "check_sdt") {
+            c_build.define("PERF_PT_HAVE_SDT", None);
+        }
+
         // Decide whether to build our own libipt.
         if let Ok(val) = env::var("IPT_PATH") {
             let mut inc_path = PathBuf::from(val.clone());
@@ -0,0 +1,164 @@
+//! Records a corpus of Intel PT traces for the `decode` benchmark.
+//!
+//! Each workload is traced and the raw trace is written into the corpus directory, along with
+//! copies of the code the trace ran through, so that the corpus can be decoded on any Linux
+//! machine (even one without Intel PT).
+//!
+//! Usage: `cargo run --release --example record_corpus -- <dir> [large-iters]`
+
+#[cfg(perf_pt)]
+mod record {
+    use hwtracer::backends::perf_pt::ImageSection;
+    use hwtracer::backends::{BackendConfig, TracerBuilder};
+    use hwtracer::{HWTracerError, Trace};
+    use libc::{clock_gettime, timespec, CLOCK_MONOTONIC};
+    use std::collections::HashMap;
+    use std::env;
+    use std::fs;
+    use std::io::Write;
+    use std::path::Path;
+    use std::process;
+
+    // Size of the AUX buffer to record with, in pages. Big enough to not overflow on large traces.
+    const AUX_BUFSIZE: usize = 8192;
+    // How many times to retry a workload which overflowed the AUX buffer.
+    const MAX_TRIES: usize = 5;
+    // Default iteration count for the large workload.
+    const DFLT_LARGE_ITERS: u64 = 500_000_000;
+
+    /// A tight loop with a data-dependent branch.
+    #[inline(never)]
+    fn loops(iters: u64) -> u64 {
+        let mut res = 0u64;
+        for i in 0..iters {
+            if i % 3 == 0 {
+                res = res.wrapping_add(i);
+            } else {
+                res ^= i;
+            }
+        }
+        res
+    }
+
+    /// Lots of calls and returns.
+    #[inline(never)]
+    fn fib(n: u64) -> u64 {
+        if n < 2 {
+            n
+        } else {
+            fib(n - 1) + fib(n - 2)
+        }
+    }
+
+    /// Lots of calls into the VDSO.
+    #[inline(never)]
+    fn vdso(iters: u64) -> u64 {
+        let mut res = 0;
+        let mut tv = timespec {
+            tv_sec: 0,
+            tv_nsec: 0,
+        };
+        for _ in 0..iters {
+            unsafe { clock_gettime(CLOCK_MONOTONIC, &mut tv) };
+            res += tv.tv_nsec as u64;
+        }
+        res
+    }
+
+    /// Trace `f`, retrying if the trace buffer overflows.
+    fn record<F: Fn() -> u64>(f: F) -> Box<dyn Trace> {
+        let mut bldr = TracerBuilder::new().perf_pt();
+        if let BackendConfig::PerfPT(ref mut conf) = bldr.config() {
+            conf.aux_bufsize = AUX_BUFSIZE;
+        }
+        let tracer = bldr.build().unwrap_or_else(|e| {
+            eprintln!("can't trace: {}", e);
+            process::exit(1);
+        });
+        let mut thr_tracer = tracer.thread_tracer();
+        for _ in 0..MAX_TRIES {
+            thr_tracer.start_tracing().unwrap();
+            let res = f();
+            match thr_tracer.stop_tracing() {
+                Ok(trace) => {
+                    println!("  result: {}", res); // Stop over-optimisation.
+                    return trace;
+                }
+                Err(HWTracerError::HWBufferOverflow) => println!("  overflow, retrying"),
+                Err(e) => panic!("{}", e),
+            }
+        }
+        panic!("trace buffer overflowed {} times", MAX_TRIES);
+    }
+
+    pub fn main() {
+        let args = env::args().collect::<Vec<_>>();
+        if args.len() < 2 {
+            eprintln!("usage: record_corpus <dir> [large-iters]");
+            process::exit(2);
+        }
+        let dir = Path::new(&args[1]);
+        let large_iters = args
+            .get(2)
+            .map(|s| s.parse().unwrap())
+            .unwrap_or(DFLT_LARGE_ITERS);
+        fs::create_dir_all(dir.join("images")).unwrap();
+
+        // Copy the code of this process into the corpus. All workloads share the same image.
+        let image = ImageSection::current_process(dir.join("images").join("vdso")).unwrap();
+        let mut copies = HashMap::new();
+        let mut image_args = String::new();
+        for sec in &image {
+            let idx = copies.len();
+            let copy = copies.entry(sec.filename.clone()).or_insert_with(|| {
+                // The VDSO was already written into the corpus.
+                if let Ok(rel) = sec.filename.strip_prefix(dir) {
+                    return rel.to_str().unwrap().to_owned();
+                }
+                let name = format!(
+                    "images/{}-{}",
+                    idx,
+                    sec.filename.file_name().unwrap().to_str().unwrap()
+                );
+                fs::copy(&sec.filename, dir.join(&name)).unwrap();
+                name
+            });
+            image_args.push_str(&format!(
+                " --raw {}:0x{:x}-0x{:x}:0x{:x}",
+                copy,
+                sec.offset,
+                sec.offset + sec.size,
+                sec.vaddr
+            ));
+        }
+
+        let workloads: Vec<(&str, Box<dyn Fn() -> u64>)> = vec![
+            ("small", Box::new(|| loops(10))),
+            ("loop", Box::new(|| loops(100_000))),
+            ("call", Box::new(|| fib(22))),
+            ("vdso", Box::new(|| vdso(10_000))),
+            ("large", Box::new(move || loops(large_iters))),
+        ];
+        let mut manifest = fs::File::create(dir.join("MANIFEST")).unwrap();
+        writeln!(manifest, "# Recorded by the record_corpus example.").unwrap();
+        for (name, f) in workloads {
+            println!("recording {}", name);
+            let trace = record(f);
+            let trace_file = format!("{}.pt", name);
+            fs::write(dir.join(&trace_file), trace.raw_data()).unwrap();
+            writeln!(manifest, "{} {}{}", name, trace_file, image_args).unwrap();
+            println!("  {} bytes", trace.raw_data().len());
+        }
+    }
+}
+
+#[cfg(perf_pt)]
+fn main() {
+    record::main();
+}
+
+#[cfg(not(perf_pt))]
+fn main() {
+    eprintln!("record_corpus requires the perf_pt backend, which was not built");
+    std::process::exit(1);
+}
@@ -0,0 +1,8 @@
+#include <sys/sdt.h>
+
+int
+check(int x)
+{
+    DTRACE_PROBE1(hwtracer, check, x);
+    return x;
+}
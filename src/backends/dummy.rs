@@ -1,5 +1,5 @@
 use crate::errors::HWTracerError;
-use crate::{Block, ThreadTracer, Trace, Tracer, TracerState};
+use crate::{Block, SessionStatus, Stats, ThreadTracer, Trace, Tracer, TracerState};
 #[cfg(test)]
 use std::fs::File;
 use std::iter::Iterator;
@@ -12,6 +12,14 @@ impl Trace for DummyTrace {
     #[cfg(test)]
     fn to_file(&self, _: &mut File) {}
 
+    fn raw_data(&self) -> &[u8] {
+        &[]
+    }
+
+    fn stats(&self) -> Stats {
+        Stats::new()
+    }
+
     fn iter_blocks<'t: 'i, 'i>(
         &'t self,
     ) -> Box<dyn Iterator<Item = Result<Block, HWTracerError>> + 'i> {
@@ -70,6 +78,17 @@ impl ThreadTracer for DummyThreadTracer {
         self.state = TracerState::Stopped;
         Ok(Box::new(DummyTrace {}))
     }
+
+    fn status(&self) -> SessionStatus {
+        match self.state {
+            TracerState::Started => SessionStatus::Ok,
+            TracerState::Stopped => SessionStatus::Stopped,
+        }
+    }
+
+    fn stats(&self) -> Stats {
+        Stats::new()
+    }
 }
 
 // Iterate over the blocks of a DummyTrace.
@@ -110,6 +129,16 @@ mod tests {
         test_helpers::test_not_started(DummyThreadTracer::new());
     }
 
+    #[test]
+    fn test_async_stop() {
+        test_helpers::test_async_stop(DummyThreadTracer::new());
+    }
+
+    #[test]
+    fn test_status() {
+        test_helpers::test_status(DummyThreadTracer::new());
+    }
+
     #[test]
     fn test_block_iterator() {
         let mut tracer = DummyThreadTracer::new();
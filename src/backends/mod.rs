@@ -8,7 +8,8 @@ pub mod perf_pt;
 use crate::backends::perf_pt::PerfPTTracer;
 #[cfg(perf_pt)]
 use core::arch::x86_64::__cpuid_count;
-use libc::size_t;
+use libc::{c_int, size_t};
+use std::fmt;
 pub mod dummy;
 
 #[derive(Debug)]
@@ -20,6 +21,12 @@ pub enum BackendKind {
 const PERF_PT_DFLT_DATA_BUFSIZE: size_t = 64;
 const PERF_PT_DFLT_AUX_BUFSIZE: size_t = 1024;
 const PERF_PT_DFLT_INITIAL_TRACE_BUFSIZE: size_t = 1024 * 1024; // 1MiB
+const PERF_PT_DFLT_OPEN_TIMEOUT_NS: u64 = 600_000_000; // 600ms
+const PERF_PT_DFLT_POOL_DEPTH: size_t = 8;
+const PERF_PT_DFLT_AUX_ADAPT_BUDGET: size_t = 65536; // 256MiB of 4KiB pages.
+
+// The number of CPUs a `CpuSet` can hold, as for the C library's `cpu_set_t`.
+const CPU_SET_SIZE: usize = 1024;
 
 impl BackendKind {
     // Finds a suitable `BackendKind` for the current hardware/OS.
@@ -71,6 +78,77 @@ pub enum BackendConfig {
     PerfPT(PerfPTConfig),
 }
 
+/// A set of CPUs, laid out like the C library's `cpu_set_t`.
+#[derive(Clone, Copy, Eq, PartialEq)]
+#[repr(C)]
+pub struct CpuSet {
+    bits: [u64; CPU_SET_SIZE / 64],
+}
+
+impl CpuSet {
+    /// Makes an empty set.
+    pub fn new() -> Self {
+        Self {
+            bits: [0; CPU_SET_SIZE / 64],
+        }
+    }
+
+    /// Adds `cpu` to the set. CPUs are numbered as in `/proc/cpuinfo`.
+    pub fn add(&mut self, cpu: usize) -> Result<(), HWTracerError> {
+        if cpu >= CPU_SET_SIZE {
+            return Err(HWTracerError::BadConfig(format!(
+                "CPU {} is too large for a CPU set",
+                cpu
+            )));
+        }
+        self.bits[cpu / 64] |= 1 << (cpu % 64);
+        Ok(())
+    }
+
+    /// Returns true if `cpu` is in the set.
+    pub fn contains(&self, cpu: usize) -> bool {
+        cpu < CPU_SET_SIZE && self.bits[cpu / 64] & (1 << (cpu % 64)) != 0
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.bits.iter().all(|&w| w == 0)
+    }
+
+    /// Iterates over the CPUs in the set, in ascending order.
+    pub fn iter(&self) -> impl Iterator<Item = usize> + '_ {
+        (0..CPU_SET_SIZE).filter(move |&c| self.contains(c))
+    }
+}
+
+impl Default for CpuSet {
+    fn default() -> Self {
+        Self::new()
+    }
+}
+
+impl fmt::Debug for CpuSet {
+    fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result {
+        f.debug_set().entries(self.iter()).finish()
+    }
+}
+
+/// When a PerfPT thread tracer prepares the tracer context for its next session (see
+/// `PerfPTConfig::pool_refill`).
+///
+/// Shared with C code. Must stay in sync.
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+#[repr(C)]
+pub enum PoolRefill {
+    /// Never: `start_tracing()` initialises a context itself.
+    Off,
+    /// When the thread tracer is created and at the end of `stop_tracing()`, on the traced
+    /// thread. This moves the cost from starting to stopping.
+    Inline,
+    /// As for `Inline`, but on a shared background thread, so the traced thread doesn't pay at
+    /// all (unless it starts tracing before the context is ready, in which case it waits).
+    Background,
+}
+
 /// Configures the PerfPT backend.
 ///
 // Must stay in sync with the C code.
@@ -83,6 +161,74 @@ pub struct PerfPTConfig {
     pub aux_bufsize: size_t,
     /// The initial trace storage buffer size (in bytes) of new traces.
     pub initial_trace_bufsize: size_t,
+    /// The CPUs which collector threads may run on. If empty, a collector inherits the affinity
+    /// of the thread which starts tracing, and so may compete with it for a core.
+    pub collector_cpus: CpuSet,
+    /// Keep a trace's storage on the NUMA node of the CPU its collector runs on, migrating the
+    /// initial storage buffer there if necessary. Best combined with `collector_cpus`.
+    pub collector_numa_local: bool,
+    /// If non-zero, run collector threads under the `SCHED_FIFO` policy at this priority (1-99),
+    /// so that busy threads can't delay draining the AUX buffer. This usually requires
+    /// `CAP_SYS_NICE`, without which starting to trace fails with `EPERM`.
+    pub collector_fifo_priority: c_int,
+    /// Busy-poll mode. If non-zero, after each drain the collector spins (for up to this many
+    /// nanoseconds) watching the perf buffers for new data, instead of sleeping until the kernel
+    /// wakes it. This drains bursts sooner, at the cost of keeping a core busy, and stopping may
+    /// take up to this long. Best combined with `collector_cpus`.
+    pub collector_spin_ns: u64,
+    /// If the tracing hardware is busy when tracing starts (e.g. another thread or process is
+    /// tracing), wait for up to this many nanoseconds for it to become free before failing with
+    /// `HWTracerError::SessionTimeout` (`u64::MAX` waits forever). Waiting threads in this process
+    /// are queued, and woken in turn as sessions end.
+    pub open_timeout_ns: u64,
+    /// The queueing priority of this tracer when waiting for the tracing hardware. Higher
+    /// priorities are served first; equal priorities in order of arrival.
+    pub open_priority: c_int,
+    /// The most tracer contexts prepared ahead of time (see `pool_refill`) which the process may
+    /// hold at once. Each holds its perf buffers, which count against the `perf_event_mlock_kb`
+    /// limit. The kernel allows only one Intel PT event per thread, so a thread tracer holds at
+    /// most one.
+    pub pool_depth: size_t,
+    /// Whether (and where) thread tracers prepare the tracer context for their next session ahead
+    /// of time. A prepared context uses the thread's Intel PT event, so another tracer can't trace
+    /// the same thread while one exists.
+    pub pool_refill: PoolRefill,
+    /// Give each tracing session an eventfd which becomes readable as soon as collection fails
+    /// (see `PerfPTThreadTracer::status_fd()`), for event loops which can't poll
+    /// `ThreadTracer::status()`.
+    pub status_eventfd: bool,
+    /// If non-zero, sessions started with `PerfPTThreadTracer::start_tracing_tagged()` use an
+    /// AUX buffer sized from what earlier sessions with the same tag needed: doubled after an
+    /// overflow (up to this many pages), and halved again (down to `aux_bufsize`) after a run of
+    /// sessions which used little of it. Must be 0 or a power of 2 no smaller than `aux_bufsize`.
+    pub aux_bufsize_max: size_t,
+    /// The most pages which the learned AUX buffer sizes of all tags may add up to. A tag's size
+    /// isn't grown past this, so the AUX memory of tagged sessions stays bounded however many tags
+    /// overflow.
+    pub aux_adapt_budget: size_t,
+    /// If non-zero, the most memory (in bytes) which the perf buffers and trace storage of the
+    /// whole process may use (see `perf_pt::MemoryStats`). A tracer which would exceed it starts
+    /// with an AUX buffer shrunk to as little as 1/16th of `aux_bufsize`, or fails with `ENOMEM`
+    /// if even that doesn't fit. A trace which can't grow within it fails its session with
+    /// `ENOMEM`. The budget applies to the allocations of tracers with this configuration, so
+    /// all tracers should share it.
+    pub memory_budget: u64,
+    /// If non-zero, a trace which reaches this many bytes is truncated: the collector turns the
+    /// tracing hardware off (so the traced thread runs at full speed for the rest of the session),
+    /// drops any further data, and `ThreadTracer::status()` becomes `SessionStatus::Truncated`.
+    /// Stopping then returns the trace so far (see `PerfPTTrace::is_truncated()`), which may
+    /// exceed this by up to the size of the AUX buffer.
+    pub max_session_bytes: u64,
+    /// Called when a trace is truncated (see `max_session_bytes`), with `truncate_callback_data`
+    /// and the trace's length. The callback runs on the collector thread, so it must be quick and
+    /// must not use the tracer.
+    pub truncate_callback: Option<extern "C" fn(data: usize, len: u64)>,
+    /// Passed to `truncate_callback`.
+    pub truncate_callback_data: usize,
+    /// Store traces in a memfd rather than in `malloc`ed memory. When collection stops, the
+    /// memfd is shrunk to the trace and sealed, so that the trace can be handed to another
+    /// process without copying it (see `perf_pt::send_trace()`).
+    pub memfd_storage: bool,
 }
 
 impl Default for PerfPTConfig {
@@ -91,6 +237,22 @@ impl Default for PerfPTConfig {
             data_bufsize: PERF_PT_DFLT_DATA_BUFSIZE,
             aux_bufsize: PERF_PT_DFLT_AUX_BUFSIZE,
             initial_trace_bufsize: PERF_PT_DFLT_INITIAL_TRACE_BUFSIZE,
+            collector_cpus: CpuSet::new(),
+            collector_numa_local: false,
+            collector_fifo_priority: 0,
+            collector_spin_ns: 0,
+            open_timeout_ns: PERF_PT_DFLT_OPEN_TIMEOUT_NS,
+            open_priority: 0,
+            pool_depth: PERF_PT_DFLT_POOL_DEPTH,
+            pool_refill: PoolRefill::Off,
+            status_eventfd: false,
+            aux_bufsize_max: 0,
+            aux_adapt_budget: PERF_PT_DFLT_AUX_ADAPT_BUDGET,
+            memory_budget: 0,
+            max_session_bytes: 0,
+            truncate_callback: None,
+            truncate_callback_data: 0,
+            memfd_storage: false,
         }
     }
 }
@@ -185,7 +347,8 @@ impl TracerBuilder {
 
 #[cfg(test)]
 mod tests {
-    use super::{BackendConfig, TracerBuilder};
+    use super::{BackendConfig, CpuSet, TracerBuilder};
+    use crate::errors::HWTracerError;
 
     // Check that building a default Tracer works.
     #[test]
@@ -213,6 +376,22 @@ mod tests {
         }
     }
 
+    #[test]
+    fn test_cpu_set() {
+        let mut set = CpuSet::new();
+        assert!(set.is_empty());
+        set.add(0).unwrap();
+        set.add(65).unwrap();
+        set.add(1023).unwrap();
+        assert!(set.contains(65) && !set.contains(64) && !set.contains(1024));
+        assert_eq!(set.iter().collect::<Vec<_>>(), vec![0, 65, 1023]);
+        assert_eq!(format!("{:?}", set), "{0, 65, 1023}");
+        match set.add(1024) {
+            Err(HWTracerError::BadConfig(_)) => (),
+            _ => panic!(),
+        }
+    }
+
     // Ensure we can share `Tracer`s between threads.
     #[test]
     fn test_shared_tracers_betwen_threads() {
@@ -0,0 +1,199 @@
+//! AUX buffer sizes learned per tag.
+//!
+//! Sessions started with `PerfPTThreadTracer::start_tracing_tagged()` report back how they went:
+//! an overflow doubles the tag's AUX buffer for its next session, and a run of sessions which never
+//! filled more than a quarter of the buffer halves it again. Since the AUX watermark is a fixed
+//! fraction of the buffer, it grows and shrinks with it. Sizes are shared by every tracer in the
+//! process, so a tag only has to overflow once, and are kept within
+//! `PerfPTConfig::aux_adapt_budget` pages in total.
+
+use crate::backends::PerfPTConfig;
+use lazy_static::lazy_static;
+use libc::size_t;
+use std::collections::HashMap;
+use std::sync::Mutex;
+
+// How many quiet sessions in a row it takes to halve a tag's AUX buffer.
+const QUIET_SESSIONS: u32 = 16;
+// A session is quiet if the AUX buffer was never more than 1/QUIET_FILL_DIV full.
+const QUIET_FILL_DIV: u64 = 4;
+
+lazy_static! {
+    static ref SIZES: Mutex<Sizes> = Mutex::new(Sizes::default());
+}
+
+/// How a tagged session ended.
+#[derive(Clone, Copy, Debug)]
+pub(super) enum Outcome {
+    /// The trace overflowed.
+    Overflowed,
+    /// The session succeeded, and the AUX buffer held at most this many bytes at once.
+    Filled(u64),
+}
+
+struct TagSize {
+    pages: size_t,
+    // Quiet sessions since the size last changed.
+    quiet: u32,
+}
+
+#[derive(Default)]
+struct Sizes {
+    // Only tags which needed more than `aux_bufsize` are kept.
+    tags: HashMap<String, TagSize>,
+    // The sum of the sizes in `tags`.
+    total: size_t,
+}
+
+impl Sizes {
+    fn aux_bufsize(&self, tag: &str, conf: &PerfPTConfig) -> size_t {
+        match self.tags.get(tag) {
+            Some(ts) => ts.pages.min(conf.aux_bufsize_max).max(conf.aux_bufsize),
+            None => conf.aux_bufsize,
+        }
+    }
+
+    fn record(&mut self, tag: &str, conf: &PerfPTConfig, pages: size_t, outcome: Outcome) {
+        let old = self.tags.get(tag).map(|ts| ts.pages).unwrap_or(0);
+        let new = match outcome {
+            Outcome::Overflowed => {
+                let new = (pages * 2).min(conf.aux_bufsize_max);
+                if new <= old || self.total - old + new > conf.aux_adapt_budget {
+                    return;
+                }
+                new
+            }
+            Outcome::Filled(bytes) => {
+                let ts = match self.tags.get_mut(tag) {
+                    Some(ts) => ts,
+                    None => return,
+                };
+                if bytes * QUIET_FILL_DIV > (pages * page_size()) as u64 {
+                    ts.quiet = 0;
+                    return;
+                }
+                ts.quiet += 1;
+                if ts.quiet < QUIET_SESSIONS {
+                    return;
+                }
+                ts.pages / 2
+            }
+        };
+        self.total = self.total - old + new;
+        if new <= conf.aux_bufsize {
+            self.total -= new;
+            self.tags.remove(tag);
+        } else {
+            self.tags.insert(
+                tag.to_owned(),
+                TagSize {
+                    pages: new,
+                    quiet: 0,
+                },
+            );
+        }
+    }
+}
+
+fn page_size() -> size_t {
+    unsafe { libc::sysconf(libc::_SC_PAGESIZE) as size_t }
+}
+
+/// Returns the AUX buffer size (in pages) for the next session tagged `tag`.
+pub(super) fn aux_bufsize(tag: &str, conf: &PerfPTConfig) -> size_t {
+    if conf.aux_bufsize_max == 0 {
+        return conf.aux_bufsize;
+    }
+    SIZES.lock().unwrap().aux_bufsize(tag, conf)
+}
+
+/// Records the outcome of a session tagged `tag` which used an AUX buffer of `pages` pages.
+pub(super) fn record(tag: &str, conf: &PerfPTConfig, pages: size_t, outcome: Outcome) {
+    if conf.aux_bufsize_max != 0 {
+        SIZES.lock().unwrap().record(tag, conf, pages, outcome);
+    }
+}
+
+/// Returns the AUX buffer size (in pages) learned for `tag`, or `None` if sessions tagged `tag`
+/// haven't needed more than `PerfPTConfig::aux_bufsize`.
+pub fn learned_aux_bufsize(tag: &str) -> Option<usize> {
+    SIZES.lock().unwrap().tags.get(tag).map(|ts| ts.pages)
+}
+
+/// Forgets every learned AUX buffer size.
+pub fn forget_aux_bufsizes() {
+    let mut sizes = SIZES.lock().unwrap();
+    sizes.tags.clear();
+    sizes.total = 0;
+}
+
+#[cfg(test)]
+mod tests {
+    use super::{page_size, Outcome, Sizes, QUIET_FILL_DIV, QUIET_SESSIONS};
+    use crate::backends::PerfPTConfig;
+
+    fn conf() -> PerfPTConfig {
+        PerfPTConfig {
+            aux_bufsize: 4,
+            aux_bufsize_max: 32,
+            aux_adapt_budget: 48,
+            ..PerfPTConfig::default()
+        }
+    }
+
+    #[test]
+    fn test_grow_shrink() {
+        let conf = conf();
+        let mut sizes = Sizes::default();
+        assert_eq!(sizes.aux_bufsize("a", &conf), 4);
+        // Successful sessions of an unknown tag are forgotten.
+        sizes.record("a", &conf, 4, Outcome::Filled(0));
+        assert!(sizes.tags.is_empty());
+
+        for &want in &[8, 16, 32, 32] {
+            let pages = sizes.aux_bufsize("a", &conf);
+            sizes.record("a", &conf, pages, Outcome::Overflowed);
+            assert_eq!(sizes.aux_bufsize("a", &conf), want);
+        }
+        assert_eq!(sizes.total, 32);
+
+        // A busy session resets the quiet count.
+        let quiet = Outcome::Filled(0);
+        let busy = Outcome::Filled((32 * page_size()) as u64 / QUIET_FILL_DIV + 1);
+        for _ in 0..QUIET_SESSIONS - 1 {
+            sizes.record("a", &conf, 32, quiet);
+        }
+        sizes.record("a", &conf, 32, busy);
+        for _ in 0..QUIET_SESSIONS - 1 {
+            sizes.record("a", &conf, 32, quiet);
+        }
+        assert_eq!(sizes.aux_bufsize("a", &conf), 32);
+        sizes.record("a", &conf, 32, quiet);
+        assert_eq!(sizes.aux_bufsize("a", &conf), 16);
+
+        for _ in 0..QUIET_SESSIONS * 2 {
+            sizes.record("a", &conf, sizes.aux_bufsize("a", &conf), quiet);
+        }
+        assert_eq!(sizes.aux_bufsize("a", &conf), 4);
+        assert!(sizes.tags.is_empty());
+        assert_eq!(sizes.total, 0);
+    }
+
+    #[test]
+    fn test_budget() {
+        let conf = conf();
+        let mut sizes = Sizes::default();
+        for _ in 0..3 {
+            let pages = sizes.aux_bufsize("a", &conf);
+            sizes.record("a", &conf, pages, Outcome::Overflowed);
+        }
+        for _ in 0..3 {
+            let pages = sizes.aux_bufsize("b", &conf);
+            sizes.record("b", &conf, pages, Outcome::Overflowed);
+        }
+        // "b" can't grow to 32 pages without exceeding the budget.
+        assert_eq!(sizes.aux_bufsize("a", &conf), 32);
+        assert_eq!(sizes.aux_bufsize("b", &conf), 16);
+        assert_eq!(sizes.total, 48);
+    }
+}
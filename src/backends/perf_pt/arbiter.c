@@ -0,0 +1,344 @@
+// Copyright (c) 2018 King's College London
+// created by the Software Development Team <http://soft-dev.org/>
+//
+// The Universal Permissive License (UPL), Version 1.0
+//
+// Subject to the condition set forth below, permission is hereby granted to any
+// person obtaining a copy of this software, associated documentation and/or
+// data (collectively the "Software"), free of charge and under any and all
+// copyright rights in the Software, and any and all patent rights owned or
+// freely licensable by each licensor hereunder covering either (i) the
+// unmodified Software as contributed to or provided by such licensor, or (ii)
+// the Larger Works (as defined below), to deal in both
+//
+// (a) the Software, and
+// (b) any piece of software and/or hardware listed in the lrgrwrks.txt file
+// if one is included with the Software (each a "Larger Work" to which the Software
+// is contributed by such licensors),
+//
+// without restriction, including without limitation the rights to copy, create
+// derivative works of, display, perform, and distribute the Software and make,
+// use, sell, offer for sale, import, export, have made, and have sold the
+// Software and the Larger Work(s), and to sublicense the foregoing rights on
+// either these or other terms.
+//
+// This license is subject to the following condition: The above copyright
+// notice and either this complete permission notice or at a minimum a reference
+// to the UPL must be included in all copies or substantial portions of the
+// Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+/*
+ * The session arbiter.
+ *
+ * perf_event_open(2) fails with EBUSY while the Intel PT PMU can't take
+ * another event (e.g. another tracer holds it). Rather than have every
+ * thread blindly sleep and retry, threads which find the PMU busy queue here,
+ * ordered by priority (highest first) and then by arrival. Only the thread at
+ * the head of the queue retries: it is woken as soon as a session in this
+ * process is freed, and otherwise polls with an exponential backoff (since
+ * sessions in other processes can free the PMU too). A thread which can't
+ * open a session before its deadline leaves the queue with a timeout error.
+ *
+ * A thread always tries to open once before queueing, even if others are
+ * queued. EBUSY is per thread (a thread's own event may still be held, e.g. by
+ * a pooled context or a session which is still being stopped), so the threads
+ * already queued may be waiting for something which doesn't stop this one
+ * opening. Opens which succeed at once don't touch the queue's lock.
+ *
+ * The process has one arbiter, used by the perf_pt_arbiter_*() functions.
+ * Tests make their own with perf_pt_arbiter_new(), so that they don't share a
+ * queue with real sessions.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include "perf_pt_private.h"
+
+// The first and largest backoff (in nanoseconds) between retries by the head
+// of the queue when nothing in this process wakes it.
+#define RETRY_MIN_NSECS (30 * 1000)
+#define RETRY_MAX_NSECS (2 * 1000 * 1000)
+
+// Any thread may update the counters, so they need atomic increments.
+#define STAT_INC(field) \
+    atomic_fetch_add_explicit((_Atomic uint64_t *) &(field), 1, memory_order_relaxed)
+
+/*
+ * Process-wide arbiter statistics.
+ *
+ * Shared with Rust code. Must stay in sync.
+ */
+struct perf_pt_arbiter_stats {
+    uint64_t opens;             // Sessions opened.
+    uint64_t contended;         // Opens which had to queue.
+    uint64_t timeouts;          // Opens which timed out.
+    uint64_t busy_retries;      // Attempts which found the PMU busy.
+    uint64_t waiters;           // Threads queued now.
+    uint64_t max_waiters;       // The most threads queued at once.
+};
+
+// A queued thread. Lives on its thread's stack.
+struct waiter {
+    int priority;
+    pthread_cond_t cond;        // Signalled when we may have become the head,
+                                // or when a session was released.
+    struct waiter *next;
+};
+
+struct perf_pt_arbiter {
+    pthread_mutex_t lock;
+    struct waiter *queue;       // The head of the queue, or NULL.
+    _Atomic uint64_t nwaiters;  // The length of `queue`.
+    uint64_t releases;          // Times a session was released (under `lock`).
+    struct perf_pt_arbiter_stats stats; // `waiters` and `max_waiters` are
+                                        // only written under `lock`.
+};
+
+static struct perf_pt_arbiter process_arbiter = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+// Exposed prototypes.
+struct perf_pt_arbiter *perf_pt_arbiter_new(void);
+void perf_pt_arbiter_free(struct perf_pt_arbiter *);
+int perf_pt_arbiter_open_in(struct perf_pt_arbiter *, int (*)(void *), void *,
+                            int, uint64_t, uint64_t *, struct perf_pt_cerror *);
+void perf_pt_arbiter_release_in(struct perf_pt_arbiter *);
+void perf_pt_get_arbiter_stats_in(struct perf_pt_arbiter *,
+                                  struct perf_pt_arbiter_stats *);
+void perf_pt_get_arbiter_stats(struct perf_pt_arbiter_stats *);
+
+static void
+enqueue(struct perf_pt_arbiter *a, struct waiter *w)
+{
+    struct waiter **pos = &a->queue;
+    while ((*pos != NULL) && ((*pos)->priority >= w->priority)) {
+        pos = &(*pos)->next;
+    }
+    w->next = *pos;
+    *pos = w;
+    uint64_t n = atomic_fetch_add(&a->nwaiters, 1) + 1;
+    PERF_PT_STAT_SET(a->stats.waiters, n);
+    PERF_PT_STAT_MAX(a->stats.max_waiters, n);
+}
+
+// Removes `w` from the queue and wakes the new head (if any).
+static void
+dequeue(struct perf_pt_arbiter *a, struct waiter *w)
+{
+    struct waiter **pos = &a->queue;
+    while (*pos != w) {
+        pos = &(*pos)->next;
+    }
+    *pos = w->next;
+    PERF_PT_STAT_SET(a->stats.waiters, atomic_fetch_sub(&a->nwaiters, 1) - 1);
+    if (a->queue != NULL) {
+        pthread_cond_signal(&a->queue->cond);
+    }
+}
+
+static struct timespec
+to_timespec(uint64_t ns)
+{
+    struct timespec ts = {ns / 1000000000, ns % 1000000000};
+    return ts;
+}
+
+/*
+ * Make an arbiter of its own for a test, to be freed with
+ * perf_pt_arbiter_free().
+ *
+ * Returns NULL if memory can't be allocated.
+ */
+struct perf_pt_arbiter *
+perf_pt_arbiter_new(void)
+{
+    struct perf_pt_arbiter *a = calloc(1, sizeof(*a));
+    if (a != NULL) {
+        pthread_mutex_init(&a->lock, NULL);
+    }
+    return a;
+}
+
+/*
+ * Free an arbiter made by perf_pt_arbiter_new(). Nothing may be queued in it.
+ */
+void
+perf_pt_arbiter_free(struct perf_pt_arbiter *a)
+{
+    pthread_mutex_destroy(&a->lock);
+    free(a);
+}
+
+/*
+ * Open a session by calling `open_fn(arg)`, which returns a file descriptor
+ * or sets errno and returns -1. While `open_fn` fails with EBUSY, queue with
+ * priority `priority` until it succeeds, fails otherwise, or `timeout_ns`
+ * nanoseconds pass (UINT64_MAX waits forever). The time spent waiting is
+ * stored in `*waited_ns`.
+ *
+ * Returns a file descriptor, or -1 on error. On timeout the error kind is
+ * perf_pt_cerror_timeout, and its code is the milliseconds waited.
+ */
+int
+perf_pt_arbiter_open(int (*open_fn)(void *), void *arg, int priority,
+                     uint64_t timeout_ns, uint64_t *waited_ns,
+                     struct perf_pt_cerror *err)
+{
+    return perf_pt_arbiter_open_in(&process_arbiter, open_fn, arg, priority,
+                                   timeout_ns, waited_ns, err);
+}
+
+/*
+ * Like perf_pt_arbiter_open(), but queue in the arbiter `a`.
+ */
+int
+perf_pt_arbiter_open_in(struct perf_pt_arbiter *a, int (*open_fn)(void *),
+                        void *arg, int priority, uint64_t timeout_ns,
+                        uint64_t *waited_ns, struct perf_pt_cerror *err)
+{
+    *waited_ns = 0;
+    // Fast path: only queue if the PMU is busy for us.
+    int fd = open_fn(arg);
+    if (fd != -1) {
+        STAT_INC(a->stats.opens);
+        return fd;
+    }
+    if (errno != EBUSY) {
+        perf_pt_set_err(err, perf_pt_cerror_errno, errno);
+        return -1;
+    }
+    STAT_INC(a->stats.busy_retries);
+
+    uint64_t start = perf_pt_now_ns();
+    uint64_t deadline = (timeout_ns > UINT64_MAX - start) ? UINT64_MAX : start + timeout_ns;
+    uint64_t backoff = RETRY_MIN_NSECS;
+    struct waiter me = {.priority = priority, .next = NULL};
+    pthread_condattr_t cond_attr;
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&me.cond, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+
+    pthread_mutex_lock(&a->lock);
+    enqueue(a, &me);
+    STAT_INC(a->stats.contended);
+    for (;;) {
+        uint64_t now = perf_pt_now_ns();
+        if (a->queue == &me) {
+            // We're at the head: try to open.
+            uint64_t seen_releases = a->releases;
+            pthread_mutex_unlock(&a->lock);
+            fd = open_fn(arg);
+            int open_errno = errno;
+            pthread_mutex_lock(&a->lock);
+            if (fd != -1) {
+                STAT_INC(a->stats.opens);
+                break;
+            }
+            if (open_errno != EBUSY) {
+                perf_pt_set_err(err, perf_pt_cerror_errno, open_errno);
+                break;
+            }
+            STAT_INC(a->stats.busy_retries);
+            now = perf_pt_now_ns();
+            if (now >= deadline) {
+                goto timeout;
+            }
+            if (a->releases != seen_releases) {
+                continue; // Something was freed while we tried: try again.
+            }
+            uint64_t until = (deadline - now > backoff) ? now + backoff : deadline;
+            struct timespec ts = to_timespec(until);
+            pthread_cond_timedwait(&me.cond, &a->lock, &ts);
+            if (backoff < RETRY_MAX_NSECS) {
+                backoff *= 2;
+            }
+        } else {
+            if (now >= deadline) {
+                goto timeout;
+            }
+            struct timespec ts = to_timespec(deadline);
+            pthread_cond_timedwait(&me.cond, &a->lock, &ts);
+        }
+        continue;
+
+timeout:
+        STAT_INC(a->stats.timeouts);
+        uint64_t waited_ms = (now - start) / 1000000;
+        perf_pt_set_err(err, perf_pt_cerror_timeout,
+                        waited_ms > INT32_MAX ? INT32_MAX : (int) waited_ms);
+        break;
+    }
+    dequeue(a, &me);
+    pthread_mutex_unlock(&a->lock);
+    pthread_cond_destroy(&me.cond);
+
+    *waited_ns = perf_pt_now_ns() - start;
+    perf_pt_hist_record(perf_pt_hist_open_wait, *waited_ns);
+    return fd;
+}
+
+/*
+ * Tell the arbiter that a session opened with perf_pt_arbiter_open() has been
+ * closed, waking the head of the queue (if any).
+ */
+void
+perf_pt_arbiter_release(void)
+{
+    perf_pt_arbiter_release_in(&process_arbiter);
+}
+
+/*
+ * Like perf_pt_arbiter_release(), but for a session opened with
+ * perf_pt_arbiter_open_in(a, ...).
+ */
+void
+perf_pt_arbiter_release_in(struct perf_pt_arbiter *a)
+{
+    if (atomic_load(&a->nwaiters) == 0) {
+        return;
+    }
+    pthread_mutex_lock(&a->lock);
+    a->releases++;
+    if (a->queue != NULL) {
+        pthread_cond_signal(&a->queue->cond);
+    }
+    pthread_mutex_unlock(&a->lock);
+}
+
+/*
+ * Copy the process-wide arbiter's statistics into `out`.
+ */
+void
+perf_pt_get_arbiter_stats(struct perf_pt_arbiter_stats *out)
+{
+    perf_pt_get_arbiter_stats_in(&process_arbiter, out);
+}
+
+/*
+ * Copy the statistics of the arbiter `a` into `out`.
+ */
+void
+perf_pt_get_arbiter_stats_in(struct perf_pt_arbiter *a,
+                             struct perf_pt_arbiter_stats *out)
+{
+    const uint64_t *from = (const uint64_t *) &a->stats;
+    uint64_t *to = (uint64_t *) out;
+    for (size_t i = 0; i < sizeof(a->stats) / sizeof(uint64_t); i++) {
+        to[i] = PERF_PT_STAT_LOAD(from[i]);
+    }
+}
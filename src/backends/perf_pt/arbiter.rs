@@ -0,0 +1,206 @@
+//! Statistics of the session arbiter, which queues tracers waiting for busy tracing hardware.
+//!
+//! See `arbiter.c` for how the queue works, and `PerfPTConfig::open_timeout_ns` and
+//! `PerfPTConfig::open_priority` for how to configure a tracer's place in it. Wait times are
+//! recorded in `LatencyHistograms::open_wait`.
+
+use super::perf_pt_get_arbiter_stats;
+use crate::Stats;
+
+/// Process-wide statistics of the session arbiter.
+///
+/// Shared with C code. Must stay in sync.
+#[repr(C)]
+#[derive(Clone, Debug, Default)]
+pub struct ArbiterStats {
+    /// Sessions opened.
+    pub opens: u64,
+    /// Opens which found the hardware busy and had to queue.
+    pub contended: u64,
+    /// Opens which timed out in the queue.
+    pub timeouts: u64,
+    /// Attempts to open a session which found the hardware busy.
+    pub busy_retries: u64,
+    /// Tracers queued at the time of the snapshot.
+    pub waiters: u64,
+    /// The most tracers queued at once.
+    pub max_waiters: u64,
+}
+
+impl ArbiterStats {
+    /// Takes a snapshot of the statistics, which cover every tracer in the process.
+    pub fn snapshot() -> Self {
+        let mut stats = Self::default();
+        unsafe { perf_pt_get_arbiter_stats(&mut stats) };
+        stats
+    }
+
+    /// Adds the counters to `stats`, with names prefixed by `arbiter.`.
+    pub fn add_to(&self, stats: &mut Stats) {
+        for &(name, v) in &[
+            ("opens", self.opens),
+            ("contended", self.contended),
+            ("timeouts", self.timeouts),
+            ("busy_retries", self.busy_retries),
+            ("waiters", self.waiters),
+            ("max_waiters", self.max_waiters),
+        ] {
+            stats.set(format!("arbiter.{}", name), v);
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::super::{
+        perf_pt_arbiter_free, perf_pt_arbiter_new, perf_pt_arbiter_open_in,
+        perf_pt_arbiter_release_in, perf_pt_get_arbiter_stats_in, PerfPTCError,
+    };
+    use super::ArbiterStats;
+    use crate::errors::HWTracerError;
+    use libc::{c_int, c_void};
+    use std::sync::atomic::{AtomicBool, Ordering};
+    use std::sync::{Arc, Mutex};
+    use std::thread;
+    use std::time::Duration;
+
+    // An arbiter of the test's own, so that sessions opened by other tests don't queue with the
+    // test's threads.
+    struct Arbiter(*mut c_void);
+
+    unsafe impl Send for Arbiter {}
+    unsafe impl Sync for Arbiter {}
+
+    impl Arbiter {
+        fn new() -> Self {
+            let a = unsafe { perf_pt_arbiter_new() };
+            assert!(!a.is_null());
+            Arbiter(a)
+        }
+
+        // Opens a session on the pretend PMU `pmu`.
+        fn open(
+            &self,
+            pmu: &'static AtomicBool,
+            priority: c_int,
+            timeout_ns: u64,
+        ) -> Result<Duration, HWTracerError> {
+            let mut waited = 0;
+            let mut cerr = PerfPTCError::new();
+            let fd = unsafe {
+                perf_pt_arbiter_open_in(
+                    self.0,
+                    try_open,
+                    pmu as *const AtomicBool as *mut c_void,
+                    priority,
+                    timeout_ns,
+                    &mut waited,
+                    &mut cerr,
+                )
+            };
+            if fd == -1 {
+                Err(cerr.into())
+            } else {
+                assert_eq!(fd, 1000);
+                Ok(Duration::from_nanos(waited))
+            }
+        }
+
+        fn release(&self, pmu: &AtomicBool) {
+            pmu.store(false, Ordering::SeqCst);
+            unsafe { perf_pt_arbiter_release_in(self.0) };
+        }
+
+        fn stats(&self) -> ArbiterStats {
+            let mut stats = ArbiterStats::default();
+            unsafe { perf_pt_get_arbiter_stats_in(self.0, &mut stats) };
+            stats
+        }
+
+        // Waits until `n` threads are queued.
+        fn wait_for_waiters(&self, n: u64) {
+            while self.stats().waiters < n {
+                thread::sleep(Duration::from_millis(1));
+            }
+        }
+    }
+
+    impl Drop for Arbiter {
+        fn drop(&mut self) {
+            unsafe { perf_pt_arbiter_free(self.0) };
+        }
+    }
+
+    // A pretend PMU which can hold one session at a time. Only `test_arbiter` uses it.
+    static BUSY: AtomicBool = AtomicBool::new(false);
+    // Another pretend PMU, standing for a thread's own Intel PT event, which is busy for that
+    // thread alone.
+    static OWN_BUSY: AtomicBool = AtomicBool::new(false);
+
+    extern "C" fn try_open(pmu: *mut c_void) -> c_int {
+        let pmu = unsafe { &*(pmu as *const AtomicBool) };
+        if pmu.swap(true, Ordering::SeqCst) {
+            unsafe { *libc::__errno_location() = libc::EBUSY };
+            -1
+        } else {
+            1000
+        }
+    }
+
+    // The pretend PMU is shared, so everything is tested in one test.
+    #[test]
+    fn test_arbiter() {
+        let arbiter = Arc::new(Arbiter::new());
+        assert_eq!(arbiter.open(&BUSY, 0, 0).unwrap(), Duration::from_secs(0));
+
+        // While the PMU is held, a second open times out.
+        match arbiter.open(&BUSY, 0, 20_000_000) {
+            Err(HWTracerError::SessionTimeout(d)) => assert!(d >= Duration::from_millis(20)),
+            r => panic!("expected a timeout, got {:?}", r),
+        }
+
+        // Queued opens are served by priority, and then in order of arrival.
+        let order = Arc::new(Mutex::new(Vec::new()));
+        let threads = [0, 0, 5, 0]
+            .iter()
+            .enumerate()
+            .map(|(i, &prio)| {
+                let (a, order) = (Arc::clone(&arbiter), Arc::clone(&order));
+                let t = thread::spawn(move || {
+                    let waited = a.open(&BUSY, prio, u64::max_value()).unwrap();
+                    order.lock().unwrap().push(i);
+                    a.release(&BUSY);
+                    waited
+                });
+                arbiter.wait_for_waiters(i as u64 + 1);
+                t
+            })
+            .collect::<Vec<_>>();
+        arbiter.release(&BUSY);
+        for t in threads {
+            assert!(t.join().unwrap() > Duration::from_secs(0));
+        }
+        assert_eq!(*order.lock().unwrap(), vec![2, 0, 1, 3]);
+
+        let stats = arbiter.stats();
+        assert_eq!(stats.opens, 5);
+        assert_eq!(stats.contended, 5);
+        assert_eq!(stats.timeouts, 1);
+        assert_eq!(stats.max_waiters, 4);
+        assert_eq!(stats.waiters, 0);
+
+        // A thread queued for its own busy event doesn't hold up opens which can succeed.
+        OWN_BUSY.store(true, Ordering::SeqCst);
+        let t = {
+            let a = Arc::clone(&arbiter);
+            thread::spawn(move || a.open(&OWN_BUSY, 0, u64::max_value()).unwrap())
+        };
+        arbiter.wait_for_waiters(1);
+        assert_eq!(arbiter.open(&BUSY, 0, 0).unwrap(), Duration::from_secs(0));
+        arbiter.release(&BUSY);
+        arbiter.release(&OWN_BUSY);
+        assert!(t.join().unwrap() > Duration::from_secs(0));
+        arbiter.release(&OWN_BUSY);
+        assert_eq!(arbiter.stats().opens, 7);
+    }
+}
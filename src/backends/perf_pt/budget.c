@@ -0,0 +1,148 @@
+// Copyright (c) 2018 King's College London
+// created by the Software Development Team <http://soft-dev.org/>
+//
+// The Universal Permissive License (UPL), Version 1.0
+//
+// Subject to the condition set forth below, permission is hereby granted to any
+// person obtaining a copy of this software, associated documentation and/or
+// data (collectively the "Software"), free of charge and under any and all
+// copyright rights in the Software, and any and all patent rights owned or
+// freely licensable by each licensor hereunder covering either (i) the
+// unmodified Software as contributed to or provided by such licensor, or (ii)
+// the Larger Works (as defined below), to deal in both
+//
+// (a) the Software, and
+// (b) any piece of software and/or hardware listed in the lrgrwrks.txt file
+// if one is included with the Software (each a "Larger Work" to which the Software
+// is contributed by such licensors),
+//
+// without restriction, including without limitation the rights to copy, create
+// derivative works of, display, perform, and distribute the Software and make,
+// use, sell, offer for sale, import, export, have made, and have sold the
+// Software and the Larger Work(s), and to sublicense the foregoing rights on
+// either these or other terms.
+//
+// This license is subject to the following condition: The above copyright
+// notice and either this complete permission notice or at a minimum a reference
+// to the UPL must be included in all copies or substantial portions of the
+// Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+/*
+ * The memory budget.
+ *
+ * Every tracer context's perf buffers (which the kernel pins, and counts
+ * against `perf_event_mlock_kb`) and every trace's storage are accounted
+ * here, so that the process can see how much memory tracing uses. An
+ * allocation made on behalf of a session with a non-zero budget (see
+ * `PerfPTConfig::memory_budget`) is refused if it would take the process'
+ * total over that budget: new sessions are given smaller AUX buffers, and a
+ * trace which can't grow fails its session with ENOMEM.
+ */
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "perf_pt_private.h"
+
+// Any thread may update the counters, so they need atomic read-modify-writes.
+#define STAT_ADD(field, n) \
+    atomic_fetch_add_explicit((_Atomic uint64_t *) &(field), (n), memory_order_relaxed)
+#define STAT_SUB(field, n) \
+    atomic_fetch_sub_explicit((_Atomic uint64_t *) &(field), (n), memory_order_relaxed)
+
+/*
+ * Process-wide memory budget statistics.
+ *
+ * Shared with Rust code. Must stay in sync.
+ */
+struct perf_pt_budget_stats {
+    uint64_t buf_bytes;         // Bytes of perf buffers mapped now.
+    uint64_t trace_bytes;       // Bytes of trace storage allocated now.
+    uint64_t peak_bytes;        // The most of both at once.
+    uint64_t downsized;         // Sessions given a smaller AUX buffer than
+                                // configured.
+    uint64_t denied;            // Allocations refused.
+};
+
+static _Atomic uint64_t used;   // `buf_bytes + trace_bytes`.
+static struct perf_pt_budget_stats stats;
+
+void perf_pt_get_budget_stats(struct perf_pt_budget_stats *);
+
+static uint64_t *
+kind_field(enum perf_pt_budget_kind kind)
+{
+    return (kind == perf_pt_budget_bufs) ? &stats.buf_bytes : &stats.trace_bytes;
+}
+
+/*
+ * Account for `bytes` more memory of the given kind, unless that would take
+ * the total over `limit` (0 meaning no limit).
+ *
+ * Returns true if the memory was accounted for, or false otherwise.
+ */
+bool
+perf_pt_budget_reserve(enum perf_pt_budget_kind kind, uint64_t bytes,
+                       uint64_t limit)
+{
+    uint64_t cur = atomic_load_explicit(&used, memory_order_relaxed);
+    uint64_t new;
+    do {
+        new = cur + bytes;
+        if ((limit != 0) && ((new > limit) || (new < cur))) {
+            STAT_ADD(stats.denied, 1);
+            return false;
+        }
+    } while (!atomic_compare_exchange_weak_explicit(&used, &cur, new,
+             memory_order_relaxed, memory_order_relaxed));
+    STAT_ADD(*kind_field(kind), bytes);
+
+    uint64_t peak = PERF_PT_STAT_LOAD(stats.peak_bytes);
+    while ((new > peak) &&
+           !atomic_compare_exchange_weak_explicit(
+               (_Atomic uint64_t *) &stats.peak_bytes, &peak, new,
+               memory_order_relaxed, memory_order_relaxed)) {
+    }
+    return true;
+}
+
+/*
+ * Give back `bytes` of memory of the given kind.
+ */
+void
+perf_pt_budget_release(enum perf_pt_budget_kind kind, uint64_t bytes)
+{
+    STAT_SUB(*kind_field(kind), bytes);
+    atomic_fetch_sub_explicit(&used, bytes, memory_order_relaxed);
+}
+
+/*
+ * Count a session given a smaller AUX buffer than configured.
+ */
+void
+perf_pt_budget_note_downsized(void)
+{
+    STAT_ADD(stats.downsized, 1);
+}
+
+/*
+ * Copy the budget's statistics into `out`.
+ */
+void
+perf_pt_get_budget_stats(struct perf_pt_budget_stats *out)
+{
+    const uint64_t *from = (const uint64_t *) &stats;
+    uint64_t *to = (uint64_t *) out;
+    for (size_t i = 0; i < sizeof(stats) / sizeof(uint64_t); i++) {
+        to[i] = PERF_PT_STAT_LOAD(from[i]);
+    }
+}
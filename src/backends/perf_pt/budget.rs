@@ -0,0 +1,88 @@
+//! The process-wide memory budget of the PerfPT backend.
+//!
+//! The perf buffers of every tracer context and the storage of every trace are accounted for, so
+//! that `MemoryStats::snapshot()` can report how much memory tracing uses. With
+//! `PerfPTConfig::memory_budget` set, a tracer's allocations are refused if they would take the
+//! process' total over the budget: see `budget.c` for what happens then.
+
+use super::perf_pt_get_budget_stats;
+use crate::Stats;
+
+/// The kinds of memory accounted for.
+///
+/// Shared with C code. Must stay in sync.
+#[repr(C)]
+#[derive(Clone, Copy, Debug)]
+#[allow(dead_code)]
+pub(super) enum BudgetKind {
+    /// Perf buffers.
+    Bufs,
+    /// Trace storage.
+    Trace,
+}
+
+/// Process-wide memory use of the PerfPT backend.
+///
+/// Shared with C code. Must stay in sync.
+#[repr(C)]
+#[derive(Clone, Debug, Default)]
+pub struct MemoryStats {
+    /// Bytes of perf buffers (including those of prepared contexts) mapped now.
+    pub buf_bytes: u64,
+    /// Bytes of trace storage allocated now.
+    pub trace_bytes: u64,
+    /// The most bytes of both kinds in use at once.
+    pub peak_bytes: u64,
+    /// Sessions given a smaller AUX buffer than configured, to stay within the budget.
+    pub downsized: u64,
+    /// Allocations refused by the budget.
+    pub denied: u64,
+}
+
+impl MemoryStats {
+    /// Takes a snapshot of the statistics, which cover every tracer and trace in the process.
+    pub fn snapshot() -> Self {
+        let mut stats = Self::default();
+        unsafe { perf_pt_get_budget_stats(&mut stats) };
+        stats
+    }
+
+    /// Adds the counters to `stats`, with names prefixed by `memory.`.
+    pub fn add_to(&self, stats: &mut Stats) {
+        for &(name, v) in &[
+            ("buf_bytes", self.buf_bytes),
+            ("trace_bytes", self.trace_bytes),
+            ("peak_bytes", self.peak_bytes),
+            ("downsized", self.downsized),
+            ("denied", self.denied),
+        ] {
+            stats.set(format!("memory.{}", name), v);
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::super::{perf_pt_budget_release, perf_pt_budget_reserve, PerfPTTrace};
+    use super::{BudgetKind, MemoryStats};
+
+    #[test]
+    fn test_budget() {
+        // Other tests allocate traces concurrently, so only check what they can't affect.
+        let before = MemoryStats::snapshot();
+        assert!(!unsafe { perf_pt_budget_reserve(BudgetKind::Trace, 2, 1) });
+        assert!(MemoryStats::snapshot().denied > before.denied);
+
+        assert!(unsafe { perf_pt_budget_reserve(BudgetKind::Bufs, 1 << 40, 0) });
+        let during = MemoryStats::snapshot();
+        assert!(during.buf_bytes >= 1 << 40);
+        assert!(during.peak_bytes >= 1 << 40);
+        unsafe { perf_pt_budget_release(BudgetKind::Bufs, 1 << 40) };
+
+        // A trace which can't grow within its budget fails to allocate.
+        assert!(PerfPTTrace::with_storage(1 << 20, 1, false).is_err());
+        let trace = PerfPTTrace::with_storage(1 << 20, 0, false).unwrap();
+        assert!(MemoryStats::snapshot().trace_bytes >= 1 << 20);
+        drop(trace);
+    }
+}
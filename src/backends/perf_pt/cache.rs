@@ -0,0 +1,514 @@
+//! An on-disk cache of decoded traces.
+//!
+//! Decoding a trace against the same code always gives the same blocks, so a `DecodeCache` keeps
+//! the blocks of each trace it decodes in a file named after a `CacheKey`, which is hashed from
+//! the trace and the code image. Files in the image are identified by their ELF build-id (or, for
+//! files without one, such as a dumped VDSO, by the bytes of the section), so rebuilding a binary
+//! in place doesn't bring back stale results. A trace decoded in pieces (as `hwtracer-decode`
+//! does) may give different blocks around the split points, so its key includes them (see
+//! `CacheKey::split_at()`).
+//!
+//! Entries are written to a temporary file and renamed into place, and never change after that,
+//! so any number of processes can share a cache directory. Readers map entries read-only: an entry
+//! evicted while mapped stays readable until it is unmapped. A hit updates the entry's
+//! modification time, and inserting an entry evicts the least recently used entries until the
+//! cache fits within its size.
+
+use super::offline::build_id;
+use super::{ImageSection, PerfPTRawTrace};
+use crate::errors::HWTracerError;
+use crate::{Block, Stats, Trace};
+use libc::c_void;
+use std::collections::HashMap;
+use std::convert::TryInto;
+use std::fmt::{self, Display, Formatter};
+use std::fs::{self, File, OpenOptions};
+use std::io::{self, BufWriter, Write};
+use std::os::unix::io::AsRawFd;
+use std::path::{Path, PathBuf};
+use std::ptr;
+use std::slice;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::time::{Duration, SystemTime};
+
+// Bump when the key derivation or the entry format changes.
+const CACHE_VERSION: u64 = 1;
+// An entry is `ENTRY_MAGIC`, the number of blocks as a little-endian `u64`, and then two
+// little-endian `u64`s per block (as written by `hwtracer-decode -f binary`).
+const ENTRY_MAGIC: &[u8; 8] = b"hwtblk01";
+const ENTRY_HEADER_SIZE: usize = 16;
+const ENTRY_EXT: &str = "blocks";
+const TMP_EXT: &str = "tmp";
+// Temporary files older than this were left behind by a writer which died.
+const STALE_TMP_AGE: Duration = Duration::from_secs(3600);
+
+// Distinguishes the temporary files of concurrent inserts in one process.
+static TMP_SEQ: AtomicU64 = AtomicU64::new(0);
+
+/// Identifies a trace decoded against a code image.
+#[derive(Clone, Copy, Debug, Eq, Hash, PartialEq)]
+pub struct CacheKey(u64, u64);
+
+impl CacheKey {
+    /// Makes the key of the raw trace `trace` decoded against `image`. The files in `image` must
+    /// exist.
+    pub fn new(trace: &[u8], image: &[ImageSection]) -> Result<Self, HWTracerError> {
+        let mut h = KeyHasher::new();
+        h.write_u64(CACHE_VERSION);
+        h.write(trace);
+        let mut ids = HashMap::new();
+        for sec in image {
+            if !ids.contains_key(&sec.filename) {
+                ids.insert(sec.filename.clone(), build_id(&sec.filename)?);
+            }
+            match ids[&sec.filename] {
+                Some(ref id) => {
+                    h.write_u64(1);
+                    h.write(id);
+                }
+                None => {
+                    h.write_u64(0);
+                    h.write(&sec.read_code()?);
+                }
+            }
+            h.write_u64(sec.offset);
+            h.write_u64(sec.size);
+            h.write_u64(sec.vaddr);
+        }
+        let (a, b) = h.finish();
+        Ok(CacheKey(a, b))
+    }
+
+    /// Returns the key of the same trace decoded in pieces split at the trace offsets `splits`.
+    /// With no splits, this is the same key.
+    pub fn split_at(self, splits: &[usize]) -> Self {
+        if splits.is_empty() {
+            return self;
+        }
+        let mut h = KeyHasher::new();
+        h.write_u64(self.0);
+        h.write_u64(self.1);
+        for &off in splits {
+            h.write_u64(off as u64);
+        }
+        let (a, b) = h.finish();
+        CacheKey(a, b)
+    }
+}
+
+impl Display for CacheKey {
+    fn fmt(&self, f: &mut Formatter) -> fmt::Result {
+        write!(f, "{:016x}{:016x}", self.0, self.1)
+    }
+}
+
+/// A 128-bit hash which, unlike `std`'s hashers, is the same in every build, so that keys stay
+/// valid across processes and releases. It isn't meant to resist deliberate collisions.
+pub(super) struct KeyHasher {
+    a: u64,
+    b: u64,
+}
+
+impl KeyHasher {
+    const K1: u64 = 0x9e37_79b9_7f4a_7c15;
+    const K2: u64 = 0xc2b2_ae3d_27d4_eb4f;
+
+    pub(super) fn new() -> Self {
+        Self {
+            a: Self::K1,
+            b: Self::K2,
+        }
+    }
+
+    fn mix(&mut self, w: u64) {
+        self.a = (self.a ^ w).wrapping_mul(Self::K1).rotate_left(31);
+        self.b = (self.b ^ w.rotate_left(32))
+            .wrapping_mul(Self::K2)
+            .rotate_left(29);
+    }
+
+    pub(super) fn write_u64(&mut self, v: u64) {
+        self.mix(v);
+    }
+
+    // Hashes `data` and its length, so that consecutive fields can't run into each other.
+    pub(super) fn write(&mut self, data: &[u8]) {
+        self.mix(data.len() as u64);
+        let mut words = data.chunks_exact(8);
+        for w in &mut words {
+            self.mix(u64::from_le_bytes(w.try_into().unwrap()));
+        }
+        let rest = words.remainder();
+        if !rest.is_empty() {
+            let mut w = [0; 8];
+            w[..rest.len()].copy_from_slice(rest);
+            self.mix(u64::from_le_bytes(w));
+        }
+    }
+
+    pub(super) fn finish(self) -> (u64, u64) {
+        // The finaliser of MurmurHash3, so that every input bit affects every output bit.
+        fn fmix(mut h: u64) -> u64 {
+            h ^= h >> 33;
+            h = h.wrapping_mul(0xff51_afd7_ed55_8ccd);
+            h ^= h >> 33;
+            h = h.wrapping_mul(0xc4ce_b9fe_1a85_ec53);
+            h ^ (h >> 33)
+        }
+        (fmix(self.a ^ self.b.rotate_left(17)), fmix(self.b ^ self.a))
+    }
+}
+
+/// The blocks of a cached trace, mapped from the cache.
+#[derive(Debug)]
+pub struct CachedBlocks {
+    // The mapped entry.
+    map: *const u8,
+    map_size: usize,
+    // The number of blocks.
+    len: usize,
+}
+
+// The mapping is read-only and owned by this struct.
+unsafe impl Send for CachedBlocks {}
+unsafe impl Sync for CachedBlocks {}
+
+impl CachedBlocks {
+    /// Maps the entry `file`, returning `None` if it isn't a valid entry.
+    fn map(file: &File) -> Result<Option<Self>, HWTracerError> {
+        let size = file.metadata()?.len() as usize;
+        if size < ENTRY_HEADER_SIZE {
+            return Ok(None);
+        }
+        let map = unsafe {
+            libc::mmap(
+                ptr::null_mut(),
+                size,
+                libc::PROT_READ,
+                libc::MAP_SHARED,
+                file.as_raw_fd(),
+                0,
+            )
+        };
+        if map == libc::MAP_FAILED {
+            return Err(io::Error::last_os_error().into());
+        }
+        let mut blocks = Self {
+            map: map as *const u8,
+            map_size: size,
+            len: 0,
+        };
+        let hdr = unsafe { slice::from_raw_parts(blocks.map, ENTRY_HEADER_SIZE) };
+        let len = u64::from_le_bytes(hdr[8..].try_into().unwrap()) as usize;
+        if hdr[..8] != ENTRY_MAGIC[..] || len.checked_mul(16) != Some(size - ENTRY_HEADER_SIZE) {
+            return Ok(None);
+        }
+        blocks.len = len;
+        Ok(Some(blocks))
+    }
+
+    /// Returns the number of blocks.
+    pub fn len(&self) -> usize {
+        self.len
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.len == 0
+    }
+
+    /// Returns the `i`th block, or `None` if there are fewer blocks.
+    pub fn get(&self, i: usize) -> Option<Block> {
+        if i >= self.len {
+            return None;
+        }
+        let word = |j: usize| {
+            let off = ENTRY_HEADER_SIZE + (i * 2 + j) * 8;
+            let bytes = unsafe { slice::from_raw_parts(self.map.add(off), 8) };
+            u64::from_le_bytes(bytes.try_into().unwrap())
+        };
+        Some(Block::new(word(0), word(1)))
+    }
+
+    /// Iterates over the blocks in trace order.
+    pub fn iter(&self) -> impl Iterator<Item = Block> + '_ {
+        (0..self.len).map(move |i| self.get(i).unwrap())
+    }
+}
+
+impl Drop for CachedBlocks {
+    fn drop(&mut self) {
+        unsafe { libc::munmap(self.map as *mut c_void, self.map_size) };
+    }
+}
+
+/// An on-disk cache of decoded traces, which may be shared by several processes.
+#[derive(Debug)]
+pub struct DecodeCache {
+    dir: PathBuf,
+    max_bytes: u64,
+    hits: AtomicU64,
+    misses: AtomicU64,
+    inserts: AtomicU64,
+    evictions: AtomicU64,
+}
+
+impl DecodeCache {
+    /// Opens the cache in the directory `dir` (creating it if necessary), which inserting keeps to
+    /// at most `max_bytes` bytes of entries.
+    pub fn open<P: AsRef<Path>>(dir: P, max_bytes: u64) -> Result<Self, HWTracerError> {
+        fs::create_dir_all(&dir)?;
+        Ok(Self {
+            dir: dir.as_ref().to_owned(),
+            max_bytes,
+            hits: AtomicU64::new(0),
+            misses: AtomicU64::new(0),
+            inserts: AtomicU64::new(0),
+            evictions: AtomicU64::new(0),
+        })
+    }
+
+    fn entry_path(&self, key: &CacheKey) -> PathBuf {
+        self.dir.join(format!("{}.{}", key, ENTRY_EXT))
+    }
+
+    /// Returns the blocks cached under `key`, if any.
+    pub fn get(&self, key: &CacheKey) -> Result<Option<CachedBlocks>, HWTracerError> {
+        let path = self.entry_path(key);
+        let file = match File::open(&path) {
+            Ok(f) => f,
+            Err(e) if e.kind() == io::ErrorKind::NotFound => {
+                self.misses.fetch_add(1, Ordering::Relaxed);
+                return Ok(None);
+            }
+            Err(e) => return Err(e.into()),
+        };
+        match CachedBlocks::map(&file)? {
+            Some(blocks) => {
+                // Mark the entry as recently used. Failing to do so only affects eviction.
+                unsafe { libc::futimens(file.as_raw_fd(), ptr::null()) };
+                self.hits.fetch_add(1, Ordering::Relaxed);
+                Ok(Some(blocks))
+            }
+            None => {
+                // Entries are complete when they appear, so this one was damaged: drop it.
+                let _ = fs::remove_file(&path);
+                self.misses.fetch_add(1, Ordering::Relaxed);
+                Ok(None)
+            }
+        }
+    }
+
+    /// Caches `blocks` under `key`, replacing any existing entry, and returns the new entry.
+    /// Least recently used entries are then evicted to keep the cache within its size (which may
+    /// evict the new entry, though it remains usable through the returned `CachedBlocks`).
+    pub fn insert(&self, key: &CacheKey, blocks: &[Block]) -> Result<CachedBlocks, HWTracerError> {
+        let tmp_path = self.dir.join(format!(
+            ".{}.{}.{}.{}",
+            key,
+            std::process::id(),
+            TMP_SEQ.fetch_add(1, Ordering::Relaxed),
+            TMP_EXT
+        ));
+        let res = self.write_entry(&tmp_path, blocks).and_then(|file| {
+            fs::rename(&tmp_path, self.entry_path(key))?;
+            Ok(file)
+        });
+        let file = match res {
+            Ok(f) => f,
+            Err(e) => {
+                let _ = fs::remove_file(&tmp_path);
+                return Err(e);
+            }
+        };
+        self.inserts.fetch_add(1, Ordering::Relaxed);
+        let entry = CachedBlocks::map(&file)?.unwrap();
+        self.evict()?;
+        Ok(entry)
+    }
+
+    fn write_entry(&self, path: &Path, blocks: &[Block]) -> Result<File, HWTracerError> {
+        // Readable too, so that the new entry can be mapped from it.
+        let file = OpenOptions::new()
+            .read(true)
+            .write(true)
+            .create_new(true)
+            .open(path)?;
+        let mut out = BufWriter::new(&file);
+        out.write_all(ENTRY_MAGIC)?;
+        out.write_all(&(blocks.len() as u64).to_le_bytes())?;
+        for b in blocks {
+            out.write_all(&b.first_instr().to_le_bytes())?;
+            out.write_all(&b.last_instr().to_le_bytes())?;
+        }
+        out.flush()?;
+        drop(out);
+        Ok(file)
+    }
+
+    /// Removes the least recently used entries until the cache fits within its size, along with
+    /// any stale temporary files. Entries which other processes remove first are skipped.
+    fn evict(&self) -> Result<(), HWTracerError> {
+        let now = SystemTime::now();
+        let mut entries = Vec::new();
+        let mut total = 0;
+        for ent in fs::read_dir(&self.dir)? {
+            let ent = ent?;
+            let path = ent.path();
+            let meta = match ent.metadata() {
+                Ok(m) => m,
+                Err(_) => continue,
+            };
+            let mtime = meta.modified()?;
+            match path.extension().and_then(|e| e.to_str()) {
+                Some(ENTRY_EXT) => {
+                    total += meta.len();
+                    entries.push((mtime, meta.len(), path));
+                }
+                Some(TMP_EXT) => {
+                    if now.duration_since(mtime).unwrap_or_default() > STALE_TMP_AGE {
+                        let _ = fs::remove_file(&path);
+                    }
+                }
+                _ => (),
+            }
+        }
+        if total <= self.max_bytes {
+            return Ok(());
+        }
+        entries.sort();
+        for (_, len, path) in entries {
+            if total <= self.max_bytes {
+                break;
+            }
+            match fs::remove_file(&path) {
+                Ok(()) => {
+                    self.evictions.fetch_add(1, Ordering::Relaxed);
+                }
+                Err(e) if e.kind() == io::ErrorKind::NotFound => (),
+                Err(e) => return Err(e.into()),
+            }
+            total -= len;
+        }
+        Ok(())
+    }
+
+    /// Returns the blocks of `trace`, from the cache if possible, otherwise by decoding the trace
+    /// and caching the result. A trace which fails to decode isn't cached.
+    pub fn decode(&self, trace: &PerfPTRawTrace) -> Result<CachedBlocks, HWTracerError> {
+        let key = CacheKey::new(trace.raw_data(), trace.image())?;
+        if let Some(blocks) = self.get(&key)? {
+            return Ok(blocks);
+        }
+        let blocks = trace.iter_blocks().collect::<Result<Vec<_>, _>>()?;
+        self.insert(&key, &blocks)
+    }
+
+    /// Returns how often this `DecodeCache` hit, missed, inserted and evicted entries, as
+    /// counters prefixed by `cache.`.
+    pub fn stats(&self) -> Stats {
+        let mut stats = Stats::new();
+        for &(name, ref v) in &[
+            ("hits", &self.hits),
+            ("misses", &self.misses),
+            ("inserts", &self.inserts),
+            ("evictions", &self.evictions),
+        ] {
+            stats.set(format!("cache.{}", name), v.load(Ordering::Relaxed));
+        }
+        stats
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::{CacheKey, DecodeCache, ENTRY_HEADER_SIZE};
+    use crate::backends::perf_pt::ImageSection;
+    use crate::Block;
+    use std::fs;
+    use std::thread;
+    use std::time::Duration;
+    use tempfile::TempDir;
+
+    fn blocks(n: u64) -> Vec<Block> {
+        (0..n).map(|i| Block::new(i * 16, i * 16 + 4)).collect()
+    }
+
+    #[test]
+    fn test_key() {
+        let dir = TempDir::new().unwrap();
+        let code = dir.path().join("code");
+        fs::write(&code, &[0x90; 64]).unwrap();
+        let image = vec![ImageSection::new(&code, 0, 32, 0x1000)];
+        let k = CacheKey::new(b"trace", &image).unwrap();
+        assert_eq!(k, CacheKey::new(b"trace", &image).unwrap());
+        assert_ne!(k, CacheKey::new(b"trac", &image).unwrap());
+        assert_ne!(k, CacheKey::new(b"trace", &[]).unwrap());
+        let moved = vec![ImageSection::new(&code, 0, 32, 0x2000)];
+        assert_ne!(k, CacheKey::new(b"trace", &moved).unwrap());
+        // So does decoding in pieces, unless there's only one.
+        assert_eq!(k.split_at(&[]), k);
+        assert_ne!(k.split_at(&[2]), k);
+        assert_ne!(k.split_at(&[2]), k.split_at(&[3]));
+        assert_ne!(k.split_at(&[2]), k.split_at(&[2, 3]));
+        // Changing the code (which has no build-id) changes the key.
+        fs::write(&code, &[0xcc; 64]).unwrap();
+        assert_ne!(k, CacheKey::new(b"trace", &image).unwrap());
+        assert_eq!(format!("{}", k).len(), 32);
+    }
+
+    #[test]
+    fn test_get_insert() {
+        let dir = TempDir::new().unwrap();
+        let cache = DecodeCache::open(dir.path().join("cache"), 1 << 20).unwrap();
+        let key = CacheKey::new(b"trace", &[]).unwrap();
+        assert!(cache.get(&key).unwrap().is_none());
+        let inserted = cache.insert(&key, &blocks(100)).unwrap();
+        let got = cache.get(&key).unwrap().unwrap();
+        assert_eq!(got.len(), 100);
+        assert_eq!(got.iter().collect::<Vec<_>>(), blocks(100));
+        assert_eq!(inserted.get(99), Some(Block::new(99 * 16, 99 * 16 + 4)));
+        assert_eq!(inserted.get(100), None);
+
+        // Another cache on the same directory (e.g. in another process) sees the entry.
+        let other = DecodeCache::open(dir.path().join("cache"), 1 << 20).unwrap();
+        assert_eq!(other.get(&key).unwrap().unwrap().len(), 100);
+
+        // A damaged entry is a miss, and is removed.
+        let path = cache.entry_path(&key);
+        fs::write(&path, b"hwtblk01junk").unwrap();
+        assert!(cache.get(&key).unwrap().is_none());
+        assert!(!path.exists());
+
+        let stats = cache.stats();
+        assert_eq!(stats.get("cache.hits"), Some(1));
+        assert_eq!(stats.get("cache.misses"), Some(2));
+        assert_eq!(stats.get("cache.inserts"), Some(1));
+    }
+
+    #[test]
+    fn test_evict_lru() {
+        let dir = TempDir::new().unwrap();
+        let entry_size = (ENTRY_HEADER_SIZE + 10 * 16) as u64;
+        let cache = DecodeCache::open(dir.path(), entry_size * 2).unwrap();
+        let keys = (0..3)
+            .map(|i: u8| CacheKey::new(&[i], &[]).unwrap())
+            .collect::<Vec<_>>();
+        cache.insert(&keys[0], &blocks(10)).unwrap();
+        // Modification times may only have a granularity of some milliseconds.
+        thread::sleep(Duration::from_millis(20));
+        cache.insert(&keys[1], &blocks(10)).unwrap();
+        thread::sleep(Duration::from_millis(20));
+        // Using the first entry makes the second the least recently used.
+        assert!(cache.get(&keys[0]).unwrap().is_some());
+        thread::sleep(Duration::from_millis(20));
+        let third = cache.insert(&keys[2], &blocks(10)).unwrap();
+        assert!(cache.get(&keys[0]).unwrap().is_some());
+        assert!(cache.get(&keys[1]).unwrap().is_none());
+        assert!(cache.get(&keys[2]).unwrap().is_some());
+        assert_eq!(cache.stats().get("cache.evictions"), Some(1));
+
+        // An entry evicted while mapped stays readable.
+        fs::remove_file(cache.entry_path(&keys[2])).unwrap();
+        assert_eq!(third.iter().count(), 10);
+    }
+}
@@ -52,6 +52,7 @@
 #include <limits.h>
 #include <linux/perf_event.h>
 #include <sys/ioctl.h>
+#include <sys/eventfd.h>
 #include <semaphore.h>
 #include <hwtracer_util.h>
 #include <stdbool.h>
@@ -62,19 +63,82 @@
 #include <intel-pt.h>
 
 #include "perf_pt_private.h"
+#include "probes.h"
 
 #define SYSFS_PT_TYPE   "/sys/bus/event_source/devices/intel_pt/type"
 #define MAX_PT_TYPE_STR 8
 
-#define MAX_OPEN_PERF_TRIES  20000
-#define OPEN_PERF_WAIT_NSECS 1000 * 30
-
 #define AUX_BUF_WAKE_RATIO 0.5
 
+// Under memory pressure, a session's AUX buffer may be shrunk to as little as
+// 1/2^MAX_AUX_DOWNSIZE_SHIFT of its configured size (see budget.c).
+#define MAX_AUX_DOWNSIZE_SHIFT 4
+
+// The most `pause` instructions executed between checks for new data when
+// busy-polling. The number doubles from one up to this after each check.
+#define SPIN_MAX_PAUSES 64
+
+// NUMA memory policy constants, from <numaif.h> (which needs libnuma).
+#ifndef MPOL_LOCAL
+#define MPOL_LOCAL 4
+#endif
+#ifndef MPOL_MF_MOVE
+#define MPOL_MF_MOVE (1 << 1)
+#endif
+
 #ifndef INFTIM
 #define INFTIM -1
 #endif
 
+// Older kernel headers lack these AUX record flags.
+#ifndef PERF_AUX_FLAG_PARTIAL
+#define PERF_AUX_FLAG_PARTIAL   0x04
+#endif
+#ifndef PERF_AUX_FLAG_COLLISION
+#define PERF_AUX_FLAG_COLLISION 0x08
+#endif
+
+/*
+ * How long (in nanoseconds) the phases of starting and stopping the most
+ * recent tracing session took.
+ *
+ * Shared with Rust code. Must stay in sync.
+ */
+struct perf_pt_phase_times {
+    __u64 spawn_ns;   // pthread_create() and waiting for the thread to start.
+    __u64 enable_ns;  // PERF_EVENT_IOC_ENABLE.
+    __u64 disable_ns; // PERF_EVENT_IOC_DISABLE.
+    __u64 join_ns;    // Closing the stop pipe and joining the tracer thread.
+    __u64 collector_cpu_ns; // CPU time used by the tracer thread.
+    __u64 open_wait_ns; // Queueing in the arbiter for the perf fd.
+};
+
+/*
+ * The status of a tracing session, which the tracer thread updates as soon as
+ * it fails.
+ *
+ * Shared with Rust code. Must stay in sync.
+ */
+enum perf_pt_status {
+    perf_pt_status_ok,          // Collecting.
+    perf_pt_status_overflow,    // Stopped collecting: the trace overflowed.
+    perf_pt_status_failed,      // Stopped collecting: some other error.
+    perf_pt_status_truncated,   // Stopped collecting: the trace reached its
+                                // size limit.
+};
+
+/*
+ * Who releases a stopping session's perf event and buffers: the tracer thread
+ * when it has drained them, if perf_pt_release_when_drained() asked it to
+ * before it finished, or otherwise perf_pt_release_when_drained() or
+ * perf_pt_free_tracer().
+ */
+enum perf_pt_release {
+    perf_pt_release_on_free,    // Released by perf_pt_free_tracer().
+    perf_pt_release_requested,  // Released by the tracer thread when done.
+    perf_pt_release_drained,    // The tracer thread is done.
+};
+
 /*
  * Stores all information about the tracer.
  * Exposed to Rust only as an opaque pointer.
@@ -89,6 +153,32 @@ struct tracer_ctx {
     size_t              aux_bufsize;        // The size of the AUX buffer's mmap(2).
     void                *base_buf;          // Ptr to the start of the base buffer.
     size_t              base_bufsize;       // The size the base buffer's mmap(2).
+    uint64_t            budget_bytes;       // Bytes reserved from the memory
+                                            // budget for the buffers.
+    int                 flight_slot;        // Flight recorder slot, or -1.
+    struct perf_pt_phase_times
+                        phase_times;        // Timings of the last session.
+    struct perf_pt_collector_stats
+                        stats;              // Statistics of the last session.
+    cpu_set_t           collector_cpus;     // CPUs the collector may run on.
+    bool                collector_numa_local; // Keep trace storage node-local.
+    int                 collector_fifo_priority; // SCHED_FIFO priority, or 0.
+    uint64_t            collector_spin_ns;  // Busy-poll budget, or 0.
+    uint64_t            max_session_bytes;  // Trace size limit, or 0.
+    void                (*truncate_callback)(uintptr_t, uint64_t);
+                                            // Called if the limit is hit.
+    uintptr_t           truncate_callback_data;
+    __u64               stop_start_ns;      // When stopping began.
+    __u64               collector_done_ns;  // When the tracer thread
+                                            // finished draining.
+    _Atomic int         release;            // An `enum perf_pt_release`.
+    bool                perf_released;      // Set by release_perf().
+    _Atomic bool        collector_done;     // Set when the tracer thread
+                                            // has finished draining.
+    _Atomic uint32_t    status;             // An `enum perf_pt_status`.
+    int                 status_fd;          // An eventfd signalled when
+                                            // `status` leaves
+                                            // perf_pt_status_ok, or -1.
 };
 
 /*
@@ -100,26 +190,33 @@ struct perf_pt_config {
     size_t      aux_bufsize;           // AUX buf size (in pages).
     size_t      initial_trace_bufsize; // Initial capacity (in bytes) of a
                                        // trace storage buffer.
-};
-
-/*
- * The manually malloc/free'd buffer managed by the Rust side.
- * To understand why this is split out from `struct perf_pt_trace`, see the
- * corresponding struct in the Rust side.
- */
-struct perf_pt_trace_buf {
-    void *p;
-};
-
-/*
- * Storage for a trace.
- *
- * Shared with Rust code. Must stay in sync.
- */
-struct perf_pt_trace {
-    struct perf_pt_trace_buf buf;
-    __u64 len;
-    __u64 capacity;
+    cpu_set_t   collector_cpus;        // CPUs the collector may run on. If
+                                       // empty, the caller's are inherited.
+    bool        collector_numa_local;  // Keep trace storage on the
+                                       // collector's NUMA node.
+    int         collector_fifo_priority; // Run the collector under
+                                         // SCHED_FIFO at this priority (if
+                                         // non-zero).
+    uint64_t    collector_spin_ns;     // Busy-poll for up to this long
+                                       // before blocking (0 = never).
+    uint64_t    open_timeout_ns;       // Wait for up to this long for the
+                                       // PMU to become free.
+    int         open_priority;         // Queueing priority for the PMU.
+    size_t      pool_depth;            // Only used by Rust.
+    int         pool_refill;           // Only used by Rust.
+    bool        status_eventfd;        // Signal an eventfd if the
+                                       // collector fails.
+    size_t      aux_bufsize_max;       // Only used by Rust.
+    size_t      aux_adapt_budget;      // Only used by Rust.
+    uint64_t    memory_budget;         // The memory budget (in bytes) of
+                                       // the process (0 = unlimited).
+    uint64_t    max_session_bytes;     // Stop collecting once a trace
+                                       // reaches this size (0 = never).
+    void        (*truncate_callback)(uintptr_t, uint64_t);
+                                       // Called (on the collector thread)
+                                       // when that happens, or NULL.
+    uintptr_t   truncate_callback_data; // Passed to the callback.
+    bool        memfd_storage;         // Only used by Rust.
 };
 
 /*
@@ -136,6 +233,20 @@ struct tracer_thread_args {
                         *base_header;       // Pointer to the header in the base buffer.
     struct perf_pt_cerror
                         *err;               // Errors generated inside the thread.
+    __u64               *cpu_ns;            // Where to store the thread's CPU time.
+    _Atomic bool        *done;              // Set when we are about to exit.
+    _Atomic uint32_t    *status;            // Set if we fail.
+    int                 status_fd;          // Signalled if we fail, or -1.
+    void                (*truncate_callback)(uintptr_t, uint64_t);
+    uintptr_t           truncate_callback_data;
+    struct perf_pt_collector_stats
+                        *stats;             // Statistics to update.
+    bool                numa_local;         // Move trace storage to our node.
+    uint64_t            spin_ns;            // Busy-poll budget, or 0.
+    struct tracer_ctx   *tr_ctx;            // Released when we are done, if
+                                            // asked to (see release_perf()).
+    bool                init_failed;        // Set by the thread if it failed
+                                            // before the poll loop started.
 };
 
 // A data buffer sample indicating that new data is available in the AUX
@@ -159,19 +270,38 @@ struct read_format {
 
 // Private prototypes.
 static bool handle_sample(void *, struct perf_event_mmap_page *, struct
-                          perf_pt_trace *, void *, struct perf_pt_cerror *);
+                          perf_pt_trace *, void *,
+                          struct perf_pt_collector_stats *,
+                          struct perf_pt_cerror *);
 static bool read_aux(void *, struct perf_event_mmap_page *,
-                     struct perf_pt_trace *, struct perf_pt_cerror *);
-static bool poll_loop(int, int, struct perf_event_mmap_page *, void *,
-                      struct perf_pt_trace *, struct perf_pt_cerror *);
+                     struct perf_pt_trace *, struct perf_pt_collector_stats *,
+                     struct perf_pt_cerror *);
 static void *tracer_thread(void *);
-static int open_perf(size_t, struct perf_pt_cerror *);
+static bool spin_for_data(struct perf_event_mmap_page *, uint64_t,
+                          struct perf_pt_collector_stats *);
+static bool collector_attr(struct tracer_ctx *, pthread_attr_t *,
+                           struct perf_pt_cerror *);
+static void *grow_storage(struct perf_pt_trace *, size_t);
+static bool make_storage_local(struct perf_pt_trace *, struct perf_pt_cerror *);
+static int read_pt_type(struct perf_pt_cerror *);
+static int open_perf(struct perf_pt_config *, pid_t, uint64_t *, struct perf_pt_cerror *);
+static bool release_perf(struct tracer_ctx *, struct perf_pt_cerror *);
 
 // Exposed Prototypes.
-struct tracer_ctx *perf_pt_init_tracer(struct perf_pt_config *, struct perf_pt_cerror *);
+struct tracer_ctx *perf_pt_init_tracer(struct perf_pt_config *, pid_t, struct perf_pt_cerror *);
 bool perf_pt_start_tracer(struct tracer_ctx *, struct perf_pt_trace *, struct perf_pt_cerror *);
 bool perf_pt_stop_tracer(struct tracer_ctx *tr_ctx, struct perf_pt_cerror *);
+bool perf_pt_disable_tracer(struct tracer_ctx *, struct perf_pt_cerror *);
+bool perf_pt_release_when_drained(struct tracer_ctx *, struct perf_pt_cerror *);
+bool perf_pt_collector_done(struct tracer_ctx *);
+bool perf_pt_join_tracer(struct tracer_ctx *, struct perf_pt_cerror *);
+_Atomic uint32_t *perf_pt_status_word(struct tracer_ctx *);
+size_t perf_pt_aux_bufsize(struct tracer_ctx *);
+int perf_pt_status_fd(struct tracer_ctx *);
 bool perf_pt_free_tracer(struct tracer_ctx *tr_ctx, struct perf_pt_cerror *);
+void perf_pt_get_phase_times(struct tracer_ctx *, struct perf_pt_phase_times *);
+void perf_pt_get_collector_stats(struct tracer_ctx *,
+                                 struct perf_pt_collector_stats *);
 
 
 /*
@@ -184,6 +314,7 @@ bool perf_pt_free_tracer(struct tracer_ctx *tr_ctx, struct perf_pt_cerror *);
 static bool
 handle_sample(void *aux_buf, struct perf_event_mmap_page *hdr,
               struct perf_pt_trace *trace, void *data_tmp,
+              struct perf_pt_collector_stats *stats,
               struct perf_pt_cerror *err)
 {
     // We need to use atomics with orderings to protect against 2 cases.
@@ -212,6 +343,7 @@ handle_sample(void *aux_buf, struct perf_event_mmap_page *hdr,
 
     // Copy samples out, removing wrap in the process.
     void *data_tmp_end = data_tmp;
+    __u64 copy_start = perf_pt_now_ns();
     if (tail <= head) {
         // Not wrapped.
         memcpy(data_tmp, data + tail, head - tail);
@@ -224,6 +356,8 @@ handle_sample(void *aux_buf, struct perf_event_mmap_page *hdr,
         data_tmp_end += head;
     }
     atomic_store_explicit((_Atomic __u64 *) &hdr->data_tail, head, memory_order_relaxed);
+    PERF_PT_STAT_ADD(stats->copy_ns, perf_pt_now_ns() - copy_start);
+    PERF_PT_STAT_ADD(stats->bytes_copied, data_tmp_end - data_tmp);
 
     void *next_sample = data_tmp;
     while (next_sample != data_tmp_end) {
@@ -233,18 +367,29 @@ handle_sample(void *aux_buf, struct perf_event_mmap_page *hdr,
         case PERF_RECORD_AUX:
                 // Data was written to the AUX buffer.
                 rec_aux_sample = next_sample;
+                PERF_PT_STAT_ADD(stats->aux_records, 1);
+                if (rec_aux_sample->flags & PERF_AUX_FLAG_PARTIAL) {
+                    PERF_PT_STAT_ADD(stats->aux_partial, 1);
+                }
+                if (rec_aux_sample->flags & PERF_AUX_FLAG_COLLISION) {
+                    PERF_PT_STAT_ADD(stats->aux_collision, 1);
+                }
                 // Check that the data written into the AUX buffer was not
                 // truncated. If it was, then we didn't read out of the data buffer
                 // quickly/frequently enough.
                 if (rec_aux_sample->flags & PERF_AUX_FLAG_TRUNCATED) {
+                    PERF_PT_STAT_ADD(stats->aux_truncated, 1);
+                    PERF_PT_PROBE2(overflow, PERF_PT_OVERFLOW_TRUNCATED, trace->len);
                     perf_pt_set_err(err, perf_pt_cerror_ipt, pte_overflow);
                     return false;
                 }
-                if (read_aux(aux_buf, hdr, trace, err) == false) {
+                if (read_aux(aux_buf, hdr, trace, stats, err) == false) {
                     return false;
                 }
                 break;
             case PERF_RECORD_LOST:
+                PERF_PT_STAT_ADD(stats->lost_records, 1);
+                PERF_PT_PROBE2(overflow, PERF_PT_OVERFLOW_LOST, trace->len);
                 perf_pt_set_err(err, perf_pt_cerror_ipt, pte_overflow);
                 return false;
                 break;
@@ -252,6 +397,12 @@ handle_sample(void *aux_buf, struct perf_event_mmap_page *hdr,
                 // Shouldn't happen with PT.
                 errx(EXIT_FAILURE, "Unexpected PERF_RECORD_LOST_SAMPLES sample");
                 break;
+            case PERF_RECORD_ITRACE_START:
+                PERF_PT_STAT_ADD(stats->itrace_start_records, 1);
+                break;
+            default:
+                PERF_PT_STAT_ADD(stats->other_records, 1);
+                break;
         }
         next_sample += sample_hdr->size;
     }
@@ -264,9 +415,10 @@ handle_sample(void *aux_buf, struct perf_event_mmap_page *hdr,
  *
  * Reads from `aux_buf` (whose meta-data is in `hdr`) into `trace`.
  */
-bool
+static bool
 read_aux(void *aux_buf, struct perf_event_mmap_page *hdr,
-         struct perf_pt_trace *trace, struct perf_pt_cerror *err)
+         struct perf_pt_trace *trace, struct perf_pt_collector_stats *stats,
+         struct perf_pt_cerror *err)
 {
     // Use of atomics here for the same reasons as for handle_sample().
     __u64 head_monotonic =
@@ -286,6 +438,14 @@ read_aux(void *aux_buf, struct perf_event_mmap_page *hdr,
         // Wrap-around.
         new_data_size = (size - tail) + head;
     }
+    PERF_PT_STAT_MAX(stats->max_aux_fill, new_data_size);
+
+    // Once the trace is truncated, anything still in the buffer is dropped.
+    if (trace->truncated) {
+        atomic_store_explicit((_Atomic __u64 *) &hdr->aux_tail, head, memory_order_release);
+        PERF_PT_STAT_ADD(stats->discarded_bytes, new_data_size);
+        return true;
+    }
 
     // Reallocate the trace storage buffer if more space is required.
     __u64 required_capacity = trace->len + new_data_size;
@@ -297,38 +457,143 @@ read_aux(void *aux_buf, struct perf_event_mmap_page *hdr,
             perf_pt_set_err(err, perf_pt_cerror_errno, ENOMEM);
             return false;
         }
+        // If the memory budget can't cover that, settle for what we need.
         size_t new_capacity = required_capacity * 2;
-        void *new_buf = realloc(trace->buf.p, new_capacity);
+        if (!perf_pt_budget_reserve(perf_pt_budget_trace,
+                                    new_capacity - trace->capacity, trace->budget)) {
+            new_capacity = required_capacity;
+            if (!perf_pt_budget_reserve(perf_pt_budget_trace,
+                                        new_capacity - trace->capacity, trace->budget)) {
+                perf_pt_set_err(err, perf_pt_cerror_errno, ENOMEM);
+                return false;
+            }
+        }
+        void *new_buf = grow_storage(trace, new_capacity);
         if (new_buf == NULL) {
             perf_pt_set_err(err, perf_pt_cerror_errno, errno);
+            perf_pt_budget_release(perf_pt_budget_trace, new_capacity - trace->capacity);
             return false;
         }
         trace->capacity = new_capacity;
         trace->buf.p = new_buf;
+        PERF_PT_STAT_ADD(stats->reallocs, 1);
     }
 
-    // Finally append the new AUX data to the end of the trace storage buffer.
+    // Finally append the new AUX data to the end of the trace storage buffer (see copy.c).
+    __u64 copy_start = perf_pt_now_ns();
     if (tail <= head) {
-        memcpy(trace->buf.p + trace->len, aux_buf + tail, head - tail);
+        perf_pt_copy(trace->buf.p + trace->len, aux_buf + tail, head - tail);
         trace->len += head - tail;
     } else {
-        memcpy(trace->buf.p + trace->len, aux_buf + tail, size - tail);
+        perf_pt_copy(trace->buf.p + trace->len, aux_buf + tail, size - tail);
         trace->len += size - tail;
-        memcpy(trace->buf.p + trace->len, aux_buf, head);
-        trace->len += size + head;
+        perf_pt_copy(trace->buf.p + trace->len, aux_buf, head);
+        trace->len += head;
     }
     atomic_store_explicit((_Atomic __u64 *) &hdr->aux_tail, head, memory_order_release);
+    PERF_PT_STAT_ADD(stats->copy_ns, perf_pt_now_ns() - copy_start);
+    PERF_PT_STAT_ADD(stats->bytes_copied, new_data_size);
+    PERF_PT_STAT_ADD(stats->aux_bytes, new_data_size);
+    PERF_PT_PROBE3(aux_drain, new_data_size, head, trace->len);
     return true;
 }
 
 /*
- * Take trace data out of the AUX buffer.
+ * Grow `trace`'s storage buffer to `new_capacity` bytes.
  *
- * Returns true on success and false otherwise.
+ * A malloc(3)d buffer is realloc(3)d. A buffer mapped from a memfd (see
+ * `struct perf_pt_trace`) is grown by growing the file and remapping it.
+ *
+ * Returns the (possibly moved) buffer, or NULL with errno set on failure, in
+ * which case the old buffer is left intact.
+ */
+static void *
+grow_storage(struct perf_pt_trace *trace, size_t new_capacity)
+{
+    if (trace->memfd == -1) {
+        return realloc(trace->buf.p, new_capacity);
+    }
+    if (ftruncate(trace->memfd, new_capacity) == -1) {
+        return NULL;
+    }
+    void *new_buf = mremap(trace->buf.p, trace->capacity, new_capacity, MREMAP_MAYMOVE);
+    return (new_buf == MAP_FAILED) ? NULL : new_buf;
+}
+
+/*
+ * Busy-wait for up to `budget_ns` nanoseconds for the kernel to publish new
+ * data in either of the perf buffers, backing off exponentially (up to
+ * SPIN_MAX_PAUSES `pause` instructions) between checks.
+ *
+ * Returns true if there is new data, or false if the budget ran out.
  */
 static bool
-poll_loop(int perf_fd, int stop_fd, struct perf_event_mmap_page *mmap_hdr,
-          void *aux, struct perf_pt_trace *trace, struct perf_pt_cerror *err)
+spin_for_data(struct perf_event_mmap_page *hdr, uint64_t budget_ns,
+              struct perf_pt_collector_stats *stats)
+{
+    uint64_t start = perf_pt_now_ns(), now = start;
+    unsigned pauses = 1;
+    bool found = false;
+
+    while (1) {
+        // The heads are monotonic, but we store wrapped tails (see read_aux()
+        // and handle_sample()), so compare wrapped heads with them. Only we
+        // move the tails, so they needn't be loaded atomically.
+        __u64 aux_head = atomic_load_explicit((_Atomic __u64 *) &hdr->aux_head,
+                                              memory_order_acquire);
+        __u64 data_head = atomic_load_explicit((_Atomic __u64 *) &hdr->data_head,
+                                               memory_order_acquire);
+        if ((aux_head % hdr->aux_size != hdr->aux_tail) ||
+            (data_head % hdr->data_size != hdr->data_tail)) {
+            found = true;
+            break;
+        }
+        now = perf_pt_now_ns();
+        if (now - start >= budget_ns) {
+            break;
+        }
+        for (unsigned i = 0; i < pauses; i++) {
+            __builtin_ia32_pause();
+        }
+        if (pauses < SPIN_MAX_PAUSES) {
+            pauses *= 2;
+        }
+    }
+
+    if (found) {
+        PERF_PT_STAT_ADD(stats->spin_hits, 1);
+        now = perf_pt_now_ns();
+    } else {
+        PERF_PT_STAT_ADD(stats->spin_misses, 1);
+    }
+    PERF_PT_STAT_ADD(stats->spin_ns, now - start);
+    return found;
+}
+
+/*
+ * Take trace data out of the AUX buffer until `stop_fd` is closed.
+ *
+ * `perf_fd` need not be a real perf file descriptor: anything which polls
+ * readable when new samples are available and can be read(2) (e.g. an
+ * eventfd) will do. This allows the ring buffer emulator (emu.c) to drive the
+ * loop.
+ *
+ * If `spin_ns` is non-zero, the loop busy-polls the buffers for up to that
+ * long before blocking in poll(2) (see spin_for_data()).
+ *
+ * If the trace has a `max_len`, then once a drain takes it past that, tracing
+ * is disabled, the trace is marked truncated, `on_truncate` (if not NULL) is
+ * called with `truncate_arg` and the trace's length, and any data which
+ * arrives later is dropped. So a trace can exceed `max_len` by at most the
+ * size of the AUX buffer.
+ *
+ * Returns true on success and false otherwise.
+ */
+bool
+perf_pt_poll_loop(int perf_fd, int stop_fd, struct perf_event_mmap_page *mmap_hdr,
+                  void *aux, struct perf_pt_trace *trace, uint64_t spin_ns,
+                  void (*on_truncate)(void *, uint64_t), void *truncate_arg,
+                  struct perf_pt_collector_stats *stats, struct perf_pt_cerror *err)
 {
     int n_events = 0;
     bool ret = true;
@@ -346,16 +611,22 @@ poll_loop(int perf_fd, int stop_fd, struct perf_event_mmap_page *mmap_hdr,
     }
 
     while (1) {
-        n_events = poll(pfds, 2, INFTIM);
+        // In busy-poll mode, spin until new data appears, and then only check
+        // the file descriptors (for a stop request) without blocking.
+        bool spun = (spin_ns > 0) && spin_for_data(mmap_hdr, spin_ns, stats);
+        n_events = poll(pfds, 2, spun ? 0 : INFTIM);
         if (n_events == -1) {
             perf_pt_set_err(err, perf_pt_cerror_errno, errno);
             ret = false;
             goto done;
         }
+        PERF_PT_STAT_ADD(stats->wakeups, 1);
+        PERF_PT_PROBE2(collector_wakeup, pfds[0].revents, pfds[1].revents);
+        __u64 wakeup = perf_pt_now_ns();
 
         // POLLIN on pfds[0]: Overflow event on either the Perf AUX or data buffer.
         // POLLHUP on pfds[1]: Tracer stopped by parent.
-        if ((pfds[0].revents & POLLIN) || (pfds[1].revents & POLLHUP)) {
+        if (spun || (pfds[0].revents & POLLIN) || (pfds[1].revents & POLLHUP)) {
             // Read from the Perf file descriptor.
             // We don't actually use any of what we read, but it's probably
             // best that we drain the fd anyway.
@@ -368,10 +639,25 @@ poll_loop(int perf_fd, int stop_fd, struct perf_event_mmap_page *mmap_hdr,
                 }
             }
 
-            if (!handle_sample(aux, mmap_hdr, trace, data_tmp, err)) {
+            if (!handle_sample(aux, mmap_hdr, trace, data_tmp, stats, err)) {
                 ret = false;
                 break;
             }
+            perf_pt_hist_record(perf_pt_hist_drain, perf_pt_now_ns() - wakeup);
+
+            if ((trace->max_len != 0) && !trace->truncated &&
+                (trace->len >= trace->max_len)) {
+                // Turn the hardware off, so that the traced thread runs at
+                // full speed from now on. If this fails (or `perf_fd` isn't a
+                // perf file descriptor), the trace still doesn't grow, as
+                // later data is dropped.
+                ioctl(perf_fd, PERF_EVENT_IOC_DISABLE, 0);
+                trace->truncated = true;
+                PERF_PT_PROBE1(trace_truncated, trace->len);
+                if (on_truncate != NULL) {
+                    on_truncate(truncate_arg, trace->len);
+                }
+            }
 
             if (pfds[1].revents & POLLHUP) {
                 break;
@@ -392,34 +678,77 @@ done:
     return ret;
 }
 
+// The arguments of try_open_perf().
+struct open_perf_args {
+    struct perf_event_attr *attr;
+    pid_t tid;
+};
+
+// Make one attempt to open a perf file descriptor, for the arbiter.
+static int
+try_open_perf(void *arg)
+{
+    struct open_perf_args *args = arg;
+    return syscall(SYS_perf_event_open, args->attr, args->tid, -1, -1, 0);
+}
+
 /*
- * Opens the perf file descriptor and returns it.
+ * Returns the perf "type" of Intel PT, or -1 on error.
  *
- * Returns a file descriptor, or -1 on error.
+ * The type can't change while we run, so it's only read from sysfs once.
  */
 static int
-open_perf(size_t aux_bufsize, struct perf_pt_cerror *err) {
-    struct perf_event_attr attr;
-    memset(&attr, 0, sizeof(attr));
-    attr.size = sizeof(attr);
-    attr.size = sizeof(struct perf_event_attr);
-
-    int ret = -1;
+read_pt_type(struct perf_pt_cerror *err)
+{
+    static _Atomic int cached_type = -1;
+    int type = atomic_load_explicit(&cached_type, memory_order_relaxed);
+    if (type != -1) {
+        return type;
+    }
 
-    // Get the perf "type" for Intel PT.
     FILE *pt_type_file = fopen(SYSFS_PT_TYPE, "r");
     if (pt_type_file == NULL) {
         perf_pt_set_err(err, perf_pt_cerror_errno, errno);
-        ret = -1;
-        goto clean;
+        return -1;
     }
     char pt_type_str[MAX_PT_TYPE_STR];
     if (fgets(pt_type_str, sizeof(pt_type_str), pt_type_file) == NULL) {
         perf_pt_set_err(err, perf_pt_cerror_errno, errno);
-        ret = -1;
-        goto clean;
+    } else {
+        type = atoi(pt_type_str);
+    }
+    if (fclose(pt_type_file) == -1) {
+        perf_pt_set_err(err, perf_pt_cerror_errno, errno);
+        type = -1;
+    }
+    if (type != -1) {
+        atomic_store_explicit(&cached_type, type, memory_order_relaxed);
+    }
+    return type;
+}
+
+/*
+ * Opens the perf file descriptor for the configuration `tr_conf`, tracing the
+ * thread `tid` (or the calling thread if `tid` is 0), and returns it. The
+ * time spent waiting for the PMU is stored in `*wait_ns`.
+ *
+ * Returns a file descriptor, or -1 on error.
+ */
+static int
+open_perf(struct perf_pt_config *tr_conf, pid_t tid, uint64_t *wait_ns,
+          struct perf_pt_cerror *err) {
+    *wait_ns = 0;
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.size = sizeof(struct perf_event_attr);
+
+    // Get the perf "type" for Intel PT.
+    int pt_type = read_pt_type(err);
+    if (pt_type == -1) {
+        return -1;
     }
-    attr.type = atoi(pt_type_str);
+    attr.type = pt_type;
 
     // Exclude the kernel.
     attr.exclude_kernel = 1;
@@ -438,33 +767,111 @@ open_perf(size_t aux_bufsize, struct perf_pt_cerror *err) {
     attr.wakeup_watermark = 1;
 
     // Generate a PERF_RECORD_AUX sample when the AUX buffer is almost full.
-    attr.aux_watermark = (size_t) ((double) aux_bufsize * getpagesize()) * AUX_BUF_WAKE_RATIO;
+    attr.aux_watermark = (size_t) ((double) tr_conf->aux_bufsize * getpagesize()) * AUX_BUF_WAKE_RATIO;
 
     // Acquire file descriptor through which to talk to Intel PT. This syscall
     // could return EBUSY, meaning another process or thread has locked the
-    // Perf device.
-    struct timespec wait_time = {0, OPEN_PERF_WAIT_NSECS};
-    pid_t target_tid = syscall(__NR_gettid);
-    for (int tries = MAX_OPEN_PERF_TRIES; tries > 0; tries--) {
-        ret = syscall(SYS_perf_event_open, &attr, target_tid, -1, -1, 0);
-        if ((ret == -1) && (errno == EBUSY)) {
-            nanosleep(&wait_time, NULL); // Doesn't matter if this is interrupted.
-        } else {
-            break;
+    // Perf device, in which case the arbiter queues us until it's free.
+    struct open_perf_args args = {&attr, tid == 0 ? syscall(__NR_gettid) : tid};
+    return perf_pt_arbiter_open(try_open_perf, &args, tr_conf->open_priority,
+                                tr_conf->open_timeout_ns, wait_ns, err);
+}
+
+/*
+ * Initialise `attr` with the attributes of collector threads for `tr_ctx`: its
+ * CPU affinity and scheduling policy.
+ *
+ * Returns true on success or false otherwise. On success, the caller must
+ * destroy `attr`.
+ */
+static bool
+collector_attr(struct tracer_ctx *tr_ctx, pthread_attr_t *attr,
+               struct perf_pt_cerror *err)
+{
+    int rc = pthread_attr_init(attr);
+    if (rc != 0) {
+        perf_pt_set_err(err, perf_pt_cerror_errno, rc);
+        return false;
+    }
+
+    if (CPU_COUNT(&tr_ctx->collector_cpus) > 0) {
+        rc = pthread_attr_setaffinity_np(attr, sizeof(tr_ctx->collector_cpus),
+                                         &tr_ctx->collector_cpus);
+        if (rc != 0) {
+            goto fail;
         }
     }
 
-    if (ret == -1) {
+    if (tr_ctx->collector_fifo_priority != 0) {
+        struct sched_param param = {
+            .sched_priority = tr_ctx->collector_fifo_priority
+        };
+        if (((rc = pthread_attr_setinheritsched(attr, PTHREAD_EXPLICIT_SCHED)) != 0) ||
+            ((rc = pthread_attr_setschedpolicy(attr, SCHED_FIFO)) != 0) ||
+            ((rc = pthread_attr_setschedparam(attr, &param)) != 0)) {
+            goto fail;
+        }
+    }
+    return true;
+
+fail:
+    perf_pt_set_err(err, perf_pt_cerror_errno, rc);
+    pthread_attr_destroy(attr);
+    return false;
+}
+
+/*
+ * Make the calling thread allocate memory on its own NUMA node, and move the
+ * pages of `trace`'s storage buffer there. Later growth of the buffer (by
+ * realloc(3) in the calling thread) then also stays on the node.
+ *
+ * Only the whole pages inside the buffer are moved, so as not to disturb
+ * neighbouring allocations. Kernels without NUMA support have only one node,
+ * so there is nothing to do.
+ *
+ * Returns true on success or false otherwise.
+ */
+static bool
+make_storage_local(struct perf_pt_trace *trace, struct perf_pt_cerror *err)
+{
+    if (syscall(SYS_set_mempolicy, MPOL_LOCAL, NULL, 0) == -1) {
+        if (errno == ENOSYS) {
+            return true;
+        }
         perf_pt_set_err(err, perf_pt_cerror_errno, errno);
+        return false;
     }
 
-clean:
-    if ((pt_type_file != NULL) && (fclose(pt_type_file) == -1)) {
+    uintptr_t page_size = getpagesize();
+    uintptr_t start = ((uintptr_t) trace->buf.p + page_size - 1) & ~(page_size - 1);
+    uintptr_t end = ((uintptr_t) trace->buf.p + trace->capacity) & ~(page_size - 1);
+    if ((end > start) &&
+        (syscall(SYS_mbind, start, end - start, MPOL_LOCAL, NULL, 0, MPOL_MF_MOVE) == -1)) {
         perf_pt_set_err(err, perf_pt_cerror_errno, errno);
-        ret = -1;
+        return false;
     }
+    return true;
+}
 
-    return ret;
+// What the collector thread does when its trace is truncated.
+struct truncate_hook {
+    _Atomic uint32_t    *status;
+    int                 status_fd;
+    void                (*callback)(uintptr_t, uint64_t);
+    uintptr_t           callback_data;
+};
+
+static void
+on_truncate(void *arg, uint64_t len)
+{
+    struct truncate_hook *hook = arg;
+    atomic_store_explicit(hook->status, perf_pt_status_truncated, memory_order_release);
+    if (hook->status_fd != -1) {
+        eventfd_write(hook->status_fd, 1);
+    }
+    if (hook->callback != NULL) {
+        hook->callback(hook->callback_data, len);
+    }
 }
 
 /*
@@ -487,6 +894,25 @@ tracer_thread(void *arg)
     void *aux_buf = thr_args->aux_buf;
     struct perf_event_mmap_page *base_header = thr_args->base_header;
     struct perf_pt_cerror *err = thr_args->err;
+    __u64 *cpu_ns = thr_args->cpu_ns;
+    _Atomic bool *done = thr_args->done;
+    _Atomic uint32_t *status = thr_args->status;
+    int status_fd = thr_args->status_fd;
+    struct truncate_hook hook = {
+        status,
+        status_fd,
+        thr_args->truncate_callback,
+        thr_args->truncate_callback_data,
+    };
+    uint64_t spin_ns = thr_args->spin_ns;
+    struct perf_pt_collector_stats *stats = thr_args->stats;
+    struct tracer_ctx *tr_ctx = thr_args->tr_ctx;
+
+    if (thr_args->numa_local && !make_storage_local(trace, err)) {
+        thr_args->init_failed = true;
+        ret = false;
+        goto clean;
+    }
 
     // Resume the interpreter loop.
     if (sem_post(thr_args->tracer_init_sem) != 0) {
@@ -497,7 +923,8 @@ tracer_thread(void *arg)
     sem_posted = true;
 
     // Start reading out of the AUX buffer.
-    if (!poll_loop(perf_fd, stop_fd_rd, base_header, aux_buf, trace, err)) {
+    if (!perf_pt_poll_loop(perf_fd, stop_fd_rd, base_header, aux_buf, trace,
+                           spin_ns, on_truncate, &hook, stats, err)) {
         ret = false;
         goto clean;
     }
@@ -506,6 +933,27 @@ clean:
     if (!sem_posted) {
         sem_post(thr_args->tracer_init_sem);
     }
+    if (!ret && sem_posted) {
+        // Let the traced thread know at once that the session is useless.
+        bool overflow = (err->kind == perf_pt_cerror_ipt) && (err->code == pte_overflow);
+        atomic_store_explicit(status, overflow ? perf_pt_status_overflow : perf_pt_status_failed,
+                              memory_order_release);
+        if (status_fd != -1) {
+            eventfd_write(status_fd, 1); // If this fails, stopping still reports the error.
+        }
+    }
+    *cpu_ns = perf_pt_thread_cpu_ns();
+    tr_ctx->collector_done_ns = perf_pt_now_ns();
+
+    // If an asynchronous stop is waiting for us, let go of the perf event now,
+    // rather than when the stopped session is resolved, so that the traced
+    // thread can start a new session straight away.
+    if (atomic_exchange(&tr_ctx->release, perf_pt_release_drained) == perf_pt_release_requested) {
+        if (!release_perf(tr_ctx, err)) {
+            ret = false;
+        }
+    }
+    atomic_store_explicit(done, true, memory_order_release);
 
     return (void *) ret;
 }
@@ -517,10 +965,12 @@ clean:
  */
 
 /*
- * Initialise a tracer context.
+ * Initialise a tracer context for tracing the thread `tid` (or the calling
+ * thread if `tid` is 0). The context may be initialised by any thread, but
+ * only `tid` may then start and stop tracing with it.
  */
 struct tracer_ctx *
-perf_pt_init_tracer(struct perf_pt_config *tr_conf, struct perf_pt_cerror *err)
+perf_pt_init_tracer(struct perf_pt_config *tr_conf, pid_t tid, struct perf_pt_cerror *err)
 {
     struct tracer_ctx *tr_ctx = NULL;
     bool failing = false;
@@ -537,11 +987,52 @@ perf_pt_init_tracer(struct perf_pt_config *tr_conf, struct perf_pt_cerror *err)
     memset(tr_ctx, 0, sizeof(*tr_ctx));
     tr_ctx->stop_fds[0] = tr_ctx->stop_fds[1] = -1;
     tr_ctx->perf_fd = -1;
+    tr_ctx->flight_slot = -1;
+    tr_ctx->collector_cpus = tr_conf->collector_cpus;
+    tr_ctx->collector_numa_local = tr_conf->collector_numa_local;
+    tr_ctx->collector_fifo_priority = tr_conf->collector_fifo_priority;
+    tr_ctx->collector_spin_ns = tr_conf->collector_spin_ns;
+    tr_ctx->max_session_bytes = tr_conf->max_session_bytes;
+    tr_ctx->truncate_callback = tr_conf->truncate_callback;
+    tr_ctx->truncate_callback_data = tr_conf->truncate_callback_data;
+    tr_ctx->status_fd = -1;
+    if (tr_conf->status_eventfd) {
+        tr_ctx->status_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (tr_ctx->status_fd == -1) {
+            perf_pt_set_err(err, perf_pt_cerror_errno, errno);
+            failing = true;
+            goto clean;
+        }
+    }
+
+    // Account for the perf buffers in the memory budget. If it can't cover
+    // them, halve the AUX buffer until it can (within limits).
+    struct perf_pt_config conf = *tr_conf;
+    int page_size = getpagesize();
+    size_t min_aux_bufsize = conf.aux_bufsize >> MAX_AUX_DOWNSIZE_SHIFT;
+    for (;;) {
+        uint64_t bytes = (1 + conf.data_bufsize + conf.aux_bufsize) * page_size;
+        if (perf_pt_budget_reserve(perf_pt_budget_bufs, bytes, conf.memory_budget)) {
+            tr_ctx->budget_bytes = bytes;
+            break;
+        }
+        if ((conf.aux_bufsize == 1) || (conf.aux_bufsize / 2 < min_aux_bufsize)) {
+            perf_pt_set_err(err, perf_pt_cerror_errno, ENOMEM);
+            failing = true;
+            goto clean;
+        }
+        conf.aux_bufsize /= 2;
+    }
+    if (conf.aux_bufsize != tr_conf->aux_bufsize) {
+        perf_pt_budget_note_downsized();
+        tr_conf = &conf;
+    }
 
     // Obtain a file descriptor through which to speak to perf.
-    tr_ctx->perf_fd = open_perf(tr_conf->aux_bufsize, err);
+    uint64_t open_wait_ns;
+    tr_ctx->perf_fd = open_perf(tr_conf, tid, &open_wait_ns, err);
+    tr_ctx->phase_times.open_wait_ns = open_wait_ns;
     if (tr_ctx->perf_fd == -1) {
-        perf_pt_set_err(err, perf_pt_cerror_errno, errno);
         failing = true;
         goto clean;
     }
@@ -567,7 +1058,6 @@ perf_pt_init_tracer(struct perf_pt_config *tr_conf, struct perf_pt_cerror *err)
     //
     // Data buffer is preceded by one management page (the header), hence `1 +
     // data_bufsize'.
-    int page_size = getpagesize();
     tr_ctx->base_bufsize = (1 + tr_conf->data_bufsize) * page_size;
     tr_ctx->base_buf = mmap(NULL, tr_ctx->base_bufsize, PROT_WRITE, MAP_SHARED, tr_ctx->perf_fd, 0);
     if (tr_ctx->base_buf == MAP_FAILED) {
@@ -592,6 +1082,8 @@ perf_pt_init_tracer(struct perf_pt_config *tr_conf, struct perf_pt_cerror *err)
         failing = true;
         goto clean;
     }
+    PERF_PT_PROBE3(session_init, tr_ctx->perf_fd, tr_conf->data_bufsize,
+                   tr_conf->aux_bufsize);
 
 clean:
     if (failing && (tr_ctx != NULL)) {
@@ -616,6 +1108,7 @@ perf_pt_start_tracer(struct tracer_ctx *tr_ctx, struct perf_pt_trace *trace, str
 {
     int clean_sem = 0, clean_thread = 0;
     int ret = true;
+    __u64 start = perf_pt_now_ns();
 
     // A pipe to signal the trace thread to stop.
     //
@@ -639,6 +1132,12 @@ perf_pt_start_tracer(struct tracer_ctx *tr_ctx, struct perf_pt_trace *trace, str
     // coming from inside the thread. We initialise it to "no errors".
     tr_ctx->tracer_thread_err.kind = perf_pt_cerror_unused;
     tr_ctx->tracer_thread_err.code = 0;
+    memset(&tr_ctx->stats, 0, sizeof(tr_ctx->stats));
+    atomic_store_explicit(&tr_ctx->collector_done, false, memory_order_relaxed);
+    atomic_store_explicit(&tr_ctx->release, perf_pt_release_on_free, memory_order_relaxed);
+    atomic_store_explicit(&tr_ctx->status, perf_pt_status_ok, memory_order_relaxed);
+    trace->max_len = tr_ctx->max_session_bytes;
+    trace->truncated = false;
 
     // Build the arguments struct for the tracer thread.
     struct tracer_thread_args thr_args = {
@@ -649,12 +1148,31 @@ perf_pt_start_tracer(struct tracer_ctx *tr_ctx, struct perf_pt_trace *trace, str
         tr_ctx->aux_buf,
         tr_ctx->base_buf, // The header is the first region in the base buf.
         &tr_ctx->tracer_thread_err,
+        &tr_ctx->phase_times.collector_cpu_ns,
+        &tr_ctx->collector_done,
+        &tr_ctx->status,
+        tr_ctx->status_fd,
+        tr_ctx->truncate_callback,
+        tr_ctx->truncate_callback_data,
+        &tr_ctx->stats,
+        tr_ctx->collector_numa_local,
+        tr_ctx->collector_spin_ns,
+        tr_ctx,
+        false,
     };
 
     // Spawn a thread to deal with copying out of the PT AUX buffer.
-    int rc = pthread_create(&tr_ctx->tracer_thread, NULL, tracer_thread, &thr_args);
+    __u64 spawn_start = perf_pt_now_ns();
+    pthread_attr_t attr;
+    if (!collector_attr(tr_ctx, &attr, err)) {
+        ret = false;
+        goto clean;
+    }
+    int rc = pthread_create(&tr_ctx->tracer_thread, &attr, tracer_thread, &thr_args);
+    pthread_attr_destroy(&attr);
     if (rc) {
-        perf_pt_set_err(err, perf_pt_cerror_errno, errno);
+        // e.g. EPERM if we may not use SCHED_FIFO.
+        perf_pt_set_err(err, perf_pt_cerror_errno, rc);
         ret = false;
         goto clean;
     }
@@ -670,6 +1188,14 @@ perf_pt_start_tracer(struct tracer_ctx *tr_ctx, struct perf_pt_trace *trace, str
             goto clean;
         }
     }
+    if (thr_args.init_failed) {
+        perf_pt_set_err(err, tr_ctx->tracer_thread_err.kind,
+                        tr_ctx->tracer_thread_err.code);
+        ret = false;
+        goto clean;
+    }
+    __u64 enable_start = perf_pt_now_ns();
+    tr_ctx->phase_times.spawn_ns = enable_start - spawn_start;
 
     // Turn on tracing hardware.
     if (ioctl(tr_ctx->perf_fd, PERF_EVENT_IOC_ENABLE, 0) < 0) {
@@ -677,6 +1203,11 @@ perf_pt_start_tracer(struct tracer_ctx *tr_ctx, struct perf_pt_trace *trace, str
         ret = false;
         goto clean;
     }
+    tr_ctx->phase_times.enable_ns = perf_pt_now_ns() - enable_start;
+    tr_ctx->flight_slot = perf_pt_flight_register(tr_ctx->perf_fd, tr_ctx->base_buf,
+                                                  tr_ctx->aux_buf, tr_ctx->aux_bufsize);
+    perf_pt_hist_record(perf_pt_hist_start, perf_pt_now_ns() - start);
+    PERF_PT_PROBE1(session_start, tr_ctx->perf_fd);
 
 clean:
     if ((clean_sem) && (sem_destroy(&tracer_init_sem) == -1)) {
@@ -707,14 +1238,35 @@ clean:
  */
 bool
 perf_pt_stop_tracer(struct tracer_ctx *tr_ctx, struct perf_pt_cerror *err)
+{
+    bool ret = perf_pt_disable_tracer(tr_ctx, err);
+    if (!perf_pt_join_tracer(tr_ctx, err)) {
+        ret = false;
+    }
+    return ret;
+}
+
+/*
+ * The first half of stopping: turn off the tracing hardware and tell the
+ * tracer thread to stop, without waiting for it to drain the buffers.
+ * perf_pt_join_tracer() must be called afterwards (from any thread), even if
+ * this fails.
+ *
+ * Returns true on success or false otherwise.
+ */
+bool
+perf_pt_disable_tracer(struct tracer_ctx *tr_ctx, struct perf_pt_cerror *err)
 {
     int ret = true;
 
     // Turn off tracer hardware.
+    __u64 disable_start = perf_pt_now_ns();
+    tr_ctx->stop_start_ns = disable_start;
     if (ioctl(tr_ctx->perf_fd, PERF_EVENT_IOC_DISABLE, 0) < 0) {
         perf_pt_set_err(err, perf_pt_cerror_errno, errno);
         ret = false;
     }
+    tr_ctx->phase_times.disable_ns = perf_pt_now_ns() - disable_start;
 
     // Signal poll loop to end.
     if (close(tr_ctx->stop_fds[1]) == -1) {
@@ -722,6 +1274,51 @@ perf_pt_stop_tracer(struct tracer_ctx *tr_ctx, struct perf_pt_cerror *err)
         ret = false;
     }
     tr_ctx->stop_fds[1] = -1;
+    return ret;
+}
+
+/*
+ * Ask the tracer thread to release the perf event and buffers (see
+ * release_perf()) as soon as it has drained them, rather than leaving them to
+ * perf_pt_free_tracer(), so that a new session can be opened for the traced
+ * thread while this one is still being collected. If the tracer thread has
+ * already finished, they are released now.
+ *
+ * Must only be called after perf_pt_disable_tracer(), as the hardware must be
+ * off before the perf event is closed.
+ *
+ * Returns true on success or false otherwise.
+ */
+bool
+perf_pt_release_when_drained(struct tracer_ctx *tr_ctx, struct perf_pt_cerror *err)
+{
+    if (atomic_exchange(&tr_ctx->release, perf_pt_release_requested) == perf_pt_release_drained) {
+        return release_perf(tr_ctx, err);
+    }
+    return true;
+}
+
+/*
+ * Returns true if the tracer thread has finished draining the buffers, so that
+ * perf_pt_join_tracer() won't block.
+ */
+bool
+perf_pt_collector_done(struct tracer_ctx *tr_ctx)
+{
+    return atomic_load_explicit(&tr_ctx->collector_done, memory_order_acquire);
+}
+
+/*
+ * The second half of stopping: wait for the tracer thread to drain the
+ * buffers and exit.
+ *
+ * Returns true on success or false otherwise.
+ */
+bool
+perf_pt_join_tracer(struct tracer_ctx *tr_ctx, struct perf_pt_cerror *err)
+{
+    int ret = true;
+    __u64 join_start = perf_pt_now_ns();
 
     // Wait for poll loop to exit.
     void *thr_exit;
@@ -733,6 +1330,7 @@ perf_pt_stop_tracer(struct tracer_ctx *tr_ctx, struct perf_pt_cerror *err)
         perf_pt_set_err(err, tr_ctx->tracer_thread_err.kind, tr_ctx->tracer_thread_err.code);
         ret = false;
     }
+    tr_ctx->phase_times.join_ns = perf_pt_now_ns() - join_start;
 
     // Clean up
     if (close(tr_ctx->stop_fds[0]) == -1) {
@@ -741,9 +1339,69 @@ perf_pt_stop_tracer(struct tracer_ctx *tr_ctx, struct perf_pt_cerror *err)
     }
     tr_ctx->stop_fds[0] = -1;
 
+    // Stopping took until the hardware was off and the tracer thread had
+    // drained the buffers, whichever was later. (How long after that the
+    // tracer thread was joined doesn't count: after an asynchronous stop, that
+    // is up to the user.)
+    __u64 stop_end_ns = tr_ctx->stop_start_ns + tr_ctx->phase_times.disable_ns;
+    if (tr_ctx->collector_done_ns > stop_end_ns) {
+        stop_end_ns = tr_ctx->collector_done_ns;
+    }
+    perf_pt_hist_record(perf_pt_hist_stop, stop_end_ns - tr_ctx->stop_start_ns);
+    PERF_PT_PROBE2(session_stop, tr_ctx->perf_fd, ret);
+
     return ret;
 }
 
+/*
+ * Returns the status word of the tracer. It is valid until the tracer is
+ * freed, and may be read (atomically) from any thread.
+ */
+_Atomic uint32_t *
+perf_pt_status_word(struct tracer_ctx *tr_ctx)
+{
+    return &tr_ctx->status;
+}
+
+/*
+ * Returns the size (in pages) of the tracer's AUX buffer, which may be smaller
+ * than configured if the memory budget is short.
+ */
+size_t
+perf_pt_aux_bufsize(struct tracer_ctx *tr_ctx)
+{
+    return tr_ctx->aux_bufsize / getpagesize();
+}
+
+/*
+ * Returns the tracer's status eventfd, or -1 if it has none.
+ */
+int
+perf_pt_status_fd(struct tracer_ctx *tr_ctx)
+{
+    return tr_ctx->status_fd;
+}
+
+/*
+ * Copy the phase timings of the most recent tracing session into `times`.
+ */
+void
+perf_pt_get_phase_times(struct tracer_ctx *tr_ctx, struct perf_pt_phase_times *times)
+{
+    *times = tr_ctx->phase_times;
+}
+
+/*
+ * Copy the collector statistics of the current (or most recent) tracing session
+ * into `stats`. May be called while tracing.
+ */
+void
+perf_pt_get_collector_stats(struct tracer_ctx *tr_ctx,
+                            struct perf_pt_collector_stats *stats)
+{
+    perf_pt_read_collector_stats(&tr_ctx->stats, stats);
+}
+
 /*
  * Clean up and free a tracer_ctx and its contents.
  *
@@ -753,16 +1411,7 @@ bool
 perf_pt_free_tracer(struct tracer_ctx *tr_ctx, struct perf_pt_cerror *err) {
     int ret = true;
 
-    if ((tr_ctx->aux_buf) &&
-        (munmap(tr_ctx->aux_buf, tr_ctx->aux_bufsize) == -1)) {
-        perf_pt_set_err(err, perf_pt_cerror_errno, errno);
-        ret = false;
-    }
-    if ((tr_ctx->base_buf) &&
-        (munmap(tr_ctx->base_buf, tr_ctx->base_bufsize) == -1)) {
-        perf_pt_set_err(err, perf_pt_cerror_errno, errno);
-        ret = false;
-    }
+    PERF_PT_PROBE1(session_free, tr_ctx->perf_fd);
     if (tr_ctx->stop_fds[1] != -1) {
         // If the write end of the pipe is still open, the thread is still running.
         close(tr_ctx->stop_fds[1]); // signals thread to stop.
@@ -774,12 +1423,55 @@ perf_pt_free_tracer(struct tracer_ctx *tr_ctx, struct perf_pt_cerror *err) {
     if (tr_ctx->stop_fds[0] != -1) {
         close(tr_ctx->stop_fds[0]);
     }
-    if (tr_ctx->perf_fd >= 0) {
-        close(tr_ctx->perf_fd);
-        tr_ctx->perf_fd = -1;
+    if (tr_ctx->status_fd != -1) {
+        close(tr_ctx->status_fd);
+    }
+    if (!release_perf(tr_ctx, err)) {
+        ret = false;
     }
     if (tr_ctx != NULL) {
         free(tr_ctx);
     }
     return ret;
 }
+
+/*
+ * Unregister the tracer from the flight recorder, unmap its buffers and close
+ * its perf file descriptor, freeing the traced thread's Intel PT event for a
+ * new session. Does nothing if this has already been done. The tracing
+ * hardware must be off and the tracer thread must have finished with the
+ * buffers.
+ *
+ * Returns true on success or false otherwise.
+ */
+static bool
+release_perf(struct tracer_ctx *tr_ctx, struct perf_pt_cerror *err)
+{
+    bool ret = true;
+
+    if (tr_ctx->perf_released) {
+        return true;
+    }
+    tr_ctx->perf_released = true;
+    perf_pt_flight_unregister(tr_ctx->flight_slot);
+    tr_ctx->flight_slot = -1;
+    if ((tr_ctx->aux_buf) &&
+        (munmap(tr_ctx->aux_buf, tr_ctx->aux_bufsize) == -1)) {
+        perf_pt_set_err(err, perf_pt_cerror_errno, errno);
+        ret = false;
+    }
+    if ((tr_ctx->base_buf) &&
+        (munmap(tr_ctx->base_buf, tr_ctx->base_bufsize) == -1)) {
+        perf_pt_set_err(err, perf_pt_cerror_errno, errno);
+        ret = false;
+    }
+    if (tr_ctx->budget_bytes != 0) {
+        perf_pt_budget_release(perf_pt_budget_bufs, tr_ctx->budget_bytes);
+    }
+    // The descriptor's number is kept for the probes.
+    if (tr_ctx->perf_fd >= 0) {
+        close(tr_ctx->perf_fd);
+        perf_pt_arbiter_release();
+    }
+    return ret;
+}
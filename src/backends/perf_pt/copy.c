@@ -0,0 +1,240 @@
+// Copyright (c) 2018 King's College London
+// created by the Software Development Team <http://soft-dev.org/>
+//
+// The Universal Permissive License (UPL), Version 1.0
+//
+// Subject to the condition set forth below, permission is hereby granted to any
+// person obtaining a copy of this software, associated documentation and/or
+// data (collectively the "Software"), free of charge and under any and all
+// copyright rights in the Software, and any and all patent rights owned or
+// freely licensable by each licensor hereunder covering either (i) the
+// unmodified Software as contributed to or provided by such licensor, or (ii)
+// the Larger Works (as defined below), to deal in both
+//
+// (a) the Software, and
+// (b) any piece of software and/or hardware listed in the lrgrwrks.txt file
+// if one is included with the Software (each a "Larger Work" to which the Software
+// is contributed by such licensors),
+//
+// without restriction, including without limitation the rights to copy, create
+// derivative works of, display, perform, and distribute the Software and make,
+// use, sell, offer for sale, import, export, have made, and have sold the
+// Software and the Larger Work(s), and to sublicense the foregoing rights on
+// either these or other terms.
+//
+// This license is subject to the following condition: The above copyright
+// notice and either this complete permission notice or at a minimum a reference
+// to the UPL must be included in all copies or substantial portions of the
+// Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+/*
+ * The copy engine used to drain the AUX buffer.
+ *
+ * Trace data copied out of the AUX buffer isn't read again until it is
+ * decoded, usually long after (and often on another core). Copying it with
+ * ordinary stores fills the collector core's caches with it, evicting data
+ * which the traced thread (if it shares a core or last level cache) and the
+ * collector itself will need. For large copies we therefore use non-temporal
+ * (streaming) stores, which write around the caches, and prefetch the source
+ * with a non-temporal hint.
+ *
+ * The instruction set is chosen at runtime: AVX2 if the CPU and OS support
+ * it, otherwise SSE2 (which every x86_64 CPU has). Small copies, where the
+ * set up costs dominate, use memcpy(3).
+ */
+
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+#include <immintrin.h>
+#include "perf_pt_private.h"
+
+// Copies shorter than this (in bytes) use memcpy(3) in automatic mode.
+#define NT_COPY_MIN (64 * 1024)
+// How far ahead (in bytes) of the copy the source is prefetched.
+#define PREFETCH_DISTANCE 512
+
+// Shared with Rust code. Must stay in sync.
+enum perf_pt_copy_mode {
+    perf_pt_copy_auto,
+    perf_pt_copy_memcpy,
+    perf_pt_copy_sse2,
+    perf_pt_copy_avx2,
+};
+
+static _Atomic int copy_mode = perf_pt_copy_auto;
+
+bool perf_pt_copy_supported(int);
+bool perf_pt_set_copy_mode(int);
+void perf_pt_copy_with(int, void *, const void *, size_t);
+
+/*
+ * Copy an unaligned head with memcpy(3) so that `*dst` becomes aligned to
+ * `align` bytes. Returns how many bytes were copied.
+ */
+static size_t
+align_dst(uint8_t *dst, const uint8_t *src, size_t len, size_t align)
+{
+    size_t head = (align - ((uintptr_t) dst & (align - 1))) & (align - 1);
+    if (head > len) {
+        head = len;
+    }
+    memcpy(dst, src, head);
+    return head;
+}
+
+static void
+copy_sse2(void *dst, const void *src, size_t len)
+{
+    uint8_t *d = dst;
+    const uint8_t *s = src;
+    size_t done = align_dst(d, s, len, 16);
+    d += done;
+    s += done;
+    len -= done;
+
+    while (len >= 64) {
+        _mm_prefetch((const char *) s + PREFETCH_DISTANCE, _MM_HINT_NTA);
+        __m128i a = _mm_loadu_si128((const __m128i *) s);
+        __m128i b = _mm_loadu_si128((const __m128i *) (s + 16));
+        __m128i c = _mm_loadu_si128((const __m128i *) (s + 32));
+        __m128i e = _mm_loadu_si128((const __m128i *) (s + 48));
+        _mm_stream_si128((__m128i *) d, a);
+        _mm_stream_si128((__m128i *) (d + 16), b);
+        _mm_stream_si128((__m128i *) (d + 32), c);
+        _mm_stream_si128((__m128i *) (d + 48), e);
+        d += 64;
+        s += 64;
+        len -= 64;
+    }
+    // Streaming stores are weakly ordered: make them visible before any
+    // later store (e.g. of the AUX tail or the trace length).
+    _mm_sfence();
+    memcpy(d, s, len);
+}
+
+__attribute__((target("avx2")))
+static void
+copy_avx2(void *dst, const void *src, size_t len)
+{
+    uint8_t *d = dst;
+    const uint8_t *s = src;
+    size_t done = align_dst(d, s, len, 32);
+    d += done;
+    s += done;
+    len -= done;
+
+    while (len >= 128) {
+        _mm_prefetch((const char *) s + PREFETCH_DISTANCE, _MM_HINT_NTA);
+        _mm_prefetch((const char *) s + PREFETCH_DISTANCE + 64, _MM_HINT_NTA);
+        __m256i a = _mm256_loadu_si256((const __m256i *) s);
+        __m256i b = _mm256_loadu_si256((const __m256i *) (s + 32));
+        __m256i c = _mm256_loadu_si256((const __m256i *) (s + 64));
+        __m256i e = _mm256_loadu_si256((const __m256i *) (s + 96));
+        _mm256_stream_si256((__m256i *) d, a);
+        _mm256_stream_si256((__m256i *) (d + 32), b);
+        _mm256_stream_si256((__m256i *) (d + 64), c);
+        _mm256_stream_si256((__m256i *) (d + 96), e);
+        d += 128;
+        s += 128;
+        len -= 128;
+    }
+    _mm_sfence();
+    memcpy(d, s, len);
+}
+
+static bool
+have_avx2(void)
+{
+    // -1 means unknown. Threads may race to set it, but they all store the same value.
+    static _Atomic int avx2 = -1;
+    int have = atomic_load_explicit(&avx2, memory_order_relaxed);
+    if (have == -1) {
+        __builtin_cpu_init();
+        have = __builtin_cpu_supports("avx2") ? 1 : 0;
+        atomic_store_explicit(&avx2, have, memory_order_relaxed);
+    }
+    return have == 1;
+}
+
+/*
+ * Returns true if the copy mode `mode` can be used on this machine.
+ */
+bool
+perf_pt_copy_supported(int mode)
+{
+    switch (mode) {
+        case perf_pt_copy_auto:
+        case perf_pt_copy_memcpy:
+        case perf_pt_copy_sse2:
+            return true;
+        case perf_pt_copy_avx2:
+            return have_avx2();
+        default:
+            return false;
+    }
+}
+
+/*
+ * Set the copy mode used by all collectors in the process.
+ *
+ * Returns false (and leaves the mode unchanged) if `mode` is unsupported.
+ */
+bool
+perf_pt_set_copy_mode(int mode)
+{
+    if (!perf_pt_copy_supported(mode)) {
+        return false;
+    }
+    atomic_store_explicit(&copy_mode, mode, memory_order_relaxed);
+    return true;
+}
+
+/*
+ * Copy `len` bytes from `src` to `dst` (which must not overlap) using the
+ * copy mode `mode`, which must be supported.
+ */
+void
+perf_pt_copy_with(int mode, void *dst, const void *src, size_t len)
+{
+    if (mode == perf_pt_copy_auto) {
+        if (len < NT_COPY_MIN) {
+            mode = perf_pt_copy_memcpy;
+        } else if (have_avx2()) {
+            mode = perf_pt_copy_avx2;
+        } else {
+            mode = perf_pt_copy_sse2;
+        }
+    }
+
+    switch (mode) {
+        case perf_pt_copy_sse2:
+            copy_sse2(dst, src, len);
+            break;
+        case perf_pt_copy_avx2:
+            copy_avx2(dst, src, len);
+            break;
+        default:
+            memcpy(dst, src, len);
+    }
+}
+
+/*
+ * Copy `len` bytes of trace data from `src` to `dst` using the process's copy
+ * mode.
+ */
+void
+perf_pt_copy(void *dst, const void *src, size_t len)
+{
+    perf_pt_copy_with(atomic_load_explicit(&copy_mode, memory_order_relaxed),
+                      dst, src, len);
+}
@@ -0,0 +1,111 @@
+//! The engine the collector uses to copy trace data out of the AUX buffer.
+//!
+//! Large copies use non-temporal stores so that draining the AUX buffer doesn't evict the data
+//! the collector and traced threads are working on. See `copy.c` for the details.
+
+use super::{perf_pt_copy_supported, perf_pt_copy_with, perf_pt_set_copy_mode};
+use crate::errors::HWTracerError;
+use std::os::raw::c_void;
+
+/// How trace data is copied out of the AUX buffer.
+///
+/// Shared with C code. Must stay in sync.
+#[repr(C)]
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub enum CopyMode {
+    /// Non-temporal stores for large copies (using the best instruction set available),
+    /// `memcpy` otherwise. The default.
+    Auto,
+    /// Always use `memcpy`.
+    Memcpy,
+    /// Always use SSE2 non-temporal stores.
+    Sse2,
+    /// Always use AVX2 non-temporal stores.
+    Avx2,
+}
+
+impl CopyMode {
+    /// Returns `true` if this mode can be used on this machine.
+    pub fn is_supported(self) -> bool {
+        unsafe { perf_pt_copy_supported(self) }
+    }
+
+    /// Sets the mode used by all collectors in the process. This takes effect on the next copy,
+    /// including in tracers which are already running.
+    pub fn set_global(self) -> Result<(), HWTracerError> {
+        if unsafe { perf_pt_set_copy_mode(self) } {
+            Ok(())
+        } else {
+            Err(self.unsupported())
+        }
+    }
+
+    /// Copies `src` into `dst` (which must be the same length) in this mode. This is the same
+    /// copy the collector makes, and is exposed for benchmarking.
+    pub fn copy(self, dst: &mut [u8], src: &[u8]) -> Result<(), HWTracerError> {
+        assert_eq!(dst.len(), src.len());
+        if !self.is_supported() {
+            return Err(self.unsupported());
+        }
+        unsafe {
+            perf_pt_copy_with(
+                self,
+                dst.as_mut_ptr() as *mut c_void,
+                src.as_ptr() as *const c_void,
+                src.len(),
+            )
+        };
+        Ok(())
+    }
+
+    fn unsupported(self) -> HWTracerError {
+        HWTracerError::NoHWSupport(format!("copy mode {:?} is not supported", self))
+    }
+}
+
+impl Default for CopyMode {
+    fn default() -> Self {
+        CopyMode::Auto
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::CopyMode;
+
+    // Check every supported mode copies correctly, whatever the alignment of the buffers and
+    // however much is left over after the vector loop.
+    #[test]
+    fn test_copy() {
+        let src = (0..300_000u32)
+            .map(|i| (i * 7 + i / 251) as u8)
+            .collect::<Vec<u8>>();
+        let modes = [
+            CopyMode::Auto,
+            CopyMode::Memcpy,
+            CopyMode::Sse2,
+            CopyMode::Avx2,
+        ];
+        for &mode in modes.iter().filter(|m| m.is_supported()) {
+            for &src_off in &[0, 1, 17, 32] {
+                for &dst_off in &[0, 3, 16, 31] {
+                    for &len in &[0, 1, 15, 63, 64, 127, 128, 129, 4097, 200_000] {
+                        let mut dst = vec![0u8; dst_off + len + 1];
+                        let src = &src[src_off..src_off + len];
+                        mode.copy(&mut dst[dst_off..dst_off + len], src).unwrap();
+                        assert_eq!(&dst[dst_off..dst_off + len], src, "{:?} {}", mode, len);
+                        assert!(dst[..dst_off].iter().all(|&b| b == 0));
+                        assert_eq!(dst[dst_off + len], 0);
+                    }
+                }
+            }
+        }
+    }
+
+    #[test]
+    fn test_set_global() {
+        assert!(CopyMode::Sse2.is_supported());
+        CopyMode::Memcpy.set_global().unwrap();
+        CopyMode::Auto.set_global().unwrap();
+    }
+}
@@ -50,6 +50,29 @@
 #include <hwtracer_util.h>
 
 #include "perf_pt_private.h"
+#include "probes.h"
+
+/*
+ * Describes a region of a file to be loaded into a libipt image.
+ *
+ * Shared with Rust code. Must stay in sync.
+ */
+struct perf_pt_image_section {
+    const char  *filename;  // The file containing the code.
+    uint64_t    offset;     // Offset of the region within the file.
+    uint64_t    size;       // Size of the region (in bytes).
+    uint64_t    vaddr;      // Virtual address at which the region was loaded.
+};
+
+/*
+ * A block decoder and the image it decodes against. libipt doesn't take
+ * ownership of an image given to a decoder, so we keep it here to free it
+ * along with the decoder.
+ */
+struct perf_pt_block_decoder {
+    struct pt_block_decoder *decoder;
+    struct pt_image *image;     // NULL if no image has been set.
+};
 
 struct load_self_image_args {
     struct pt_image *image;
@@ -59,39 +82,45 @@ struct load_self_image_args {
 };
 
 // Private prototypes.
-static bool handle_events(struct pt_block_decoder *, int *, struct perf_pt_cerror *);
+static struct pt_block_decoder *alloc_block_decoder(void *, uint64_t, int *,
+                                                    struct perf_pt_cerror *);
+static bool handle_events(struct pt_block_decoder *, int *,
+                          struct perf_pt_decoder_stats *,
+                          struct perf_pt_cerror *);
 static bool load_self_image(struct load_self_image_args *);
 static int load_self_image_cb(struct dl_phdr_info *, size_t, void *);
 static bool block_is_terminated(struct pt_block *);
+static void decode_error(struct pt_block_decoder *, int, struct perf_pt_cerror *);
+static struct perf_pt_block_decoder *wrap_block_decoder(struct pt_block_decoder *,
+                                                        struct pt_image *,
+                                                        struct perf_pt_cerror *);
 
 // Public prototypes.
 void *perf_pt_init_block_decoder(void *, uint64_t, int, char *, int *,
                                  struct perf_pt_cerror *);
-bool perf_pt_next_block(struct pt_block_decoder *, int *, uint64_t *,
-                        uint64_t *, struct perf_pt_cerror *);
-void perf_pt_free_block_decoder(struct pt_block_decoder *);
+void *perf_pt_init_raw_block_decoder(void *, uint64_t,
+                                     struct perf_pt_image_section *, size_t,
+                                     int *, struct perf_pt_cerror *);
+bool perf_pt_next_block(struct perf_pt_block_decoder *, int *, uint64_t *,
+                        uint64_t *, struct perf_pt_decoder_stats *,
+                        struct perf_pt_cerror *);
+const char *perf_pt_event_name(int);
+void perf_pt_free_block_decoder(struct perf_pt_block_decoder *);
 
 /*
- * Get ready to retrieve the basic blocks from a PT trace using the code of the
- * current process for control flow recovery.
- *
- * Accepts a raw buffer `buf` of length `len`.
- *
- * `vdso_fd` is an open file descriptor for the filename `vdso_filename`. This
- * is where the VDSO code will be written. libipt will read this file lazily,
- * so it's up to the caller to make sure this file lives long enough for their
- * purposes.
+ * Allocate a block decoder for the raw PT buffer `buf` of length `len` and
+ * synchronise it.
  *
  * `*decoder_status` will be updated to reflect the status of the decoder after
- * it has been synchronised.
+ * it has been synchronised. If the stream contains no blocks, the status will
+ * be `-pte_eos` and the decoder is still returned.
  *
- * Returns a pointer to a configured libipt block decoder or NULL on error.
+ * Returns a pointer to a libipt block decoder (with no image loaded) or NULL
+ * on error.
  */
-void *
-perf_pt_init_block_decoder(void *buf, uint64_t len, int vdso_fd, char *vdso_filename,
-                           int *decoder_status, struct perf_pt_cerror *err) {
-    bool failing = false;
-
+static struct pt_block_decoder *
+alloc_block_decoder(void *buf, uint64_t len, int *decoder_status,
+                    struct perf_pt_cerror *err) {
     // Make a block decoder configuration.
     struct pt_config config;
     memset(&config, 0, sizeof(config));
@@ -102,12 +131,10 @@ perf_pt_init_block_decoder(void *buf, uint64_t len, int vdso_fd, char *vdso_file
     config.flags.variant.block.end_on_jump = 1;
 
     // Decode for the current CPU.
-    struct pt_block_decoder *decoder = NULL;
     int rv = pt_cpu_read(&config.cpu);
     if (rv != pte_ok) {
         perf_pt_set_err(err, perf_pt_cerror_ipt, -rv);
-        failing = true;
-        goto clean;
+        return NULL;
     }
 
     // Work around CPU bugs.
@@ -115,29 +142,64 @@ perf_pt_init_block_decoder(void *buf, uint64_t len, int vdso_fd, char *vdso_file
         rv = pt_cpu_errata(&config.errata, &config.cpu);
         if (rv < 0) {
             perf_pt_set_err(err, perf_pt_cerror_ipt, -rv);
-            failing = true;
-            goto clean;
+            return NULL;
         }
     }
 
     // Instantiate a decoder.
-    decoder = pt_blk_alloc_decoder(&config);
+    struct pt_block_decoder *decoder = pt_blk_alloc_decoder(&config);
     if (decoder == NULL) {
         perf_pt_set_err(err, perf_pt_cerror_unknown, 0);
-        failing = true;
-        goto clean;
+        return NULL;
     }
 
     // Sync the decoder.
     *decoder_status = pt_blk_sync_forward(decoder);
+    if ((*decoder_status < 0) && (*decoder_status != -pte_eos)) {
+        decode_error(decoder, -*decoder_status, err);
+        pt_blk_free_decoder(decoder);
+        return NULL;
+    }
+    if (*decoder_status >= 0) {
+        uint64_t offset = 0;
+        pt_blk_get_sync_offset(decoder, &offset);
+        PERF_PT_PROBE2(decoder_sync, *decoder_status, offset);
+    }
+
+    return decoder;
+}
+
+/*
+ * Get ready to retrieve the basic blocks from a PT trace using the code of the
+ * current process for control flow recovery.
+ *
+ * Accepts a raw buffer `buf` of length `len`.
+ *
+ * `vdso_fd` is an open file descriptor for the filename `vdso_filename`. This
+ * is where the VDSO code will be written. libipt will read this file lazily,
+ * so it's up to the caller to make sure this file lives long enough for their
+ * purposes.
+ *
+ * `*decoder_status` will be updated to reflect the status of the decoder after
+ * it has been synchronised.
+ *
+ * Returns a pointer to a configured block decoder, to be freed with
+ * `perf_pt_free_block_decoder()`, or NULL on error.
+ */
+void *
+perf_pt_init_block_decoder(void *buf, uint64_t len, int vdso_fd, char *vdso_filename,
+                           int *decoder_status, struct perf_pt_cerror *err) {
+    bool failing = false;
+
+    struct pt_block_decoder *decoder =
+        alloc_block_decoder(buf, len, decoder_status, err);
+    if (decoder == NULL) {
+        return NULL;
+    }
     if (*decoder_status == -pte_eos) {
         // There were no blocks in the stream. The user will find out on next
         // call to perf_pt_next_block().
-        goto clean;
-    } else if (*decoder_status < 0) {
-        perf_pt_set_err(err, perf_pt_cerror_ipt, -*decoder_status);
-        failing = true;
-        goto clean;
+        return wrap_block_decoder(decoder, NULL, err);
     }
 
     // Build and load a memory image from which to recover control flow.
@@ -154,7 +216,7 @@ perf_pt_init_block_decoder(void *buf, uint64_t len, int vdso_fd, char *vdso_file
         goto clean;
     }
 
-    rv = pt_blk_set_image(decoder, image);
+    int rv = pt_blk_set_image(decoder, image);
     if (rv < 0) {
         perf_pt_set_err(err, perf_pt_cerror_ipt, -rv);
         failing = true;
@@ -164,9 +226,71 @@ perf_pt_init_block_decoder(void *buf, uint64_t len, int vdso_fd, char *vdso_file
 clean:
     if (failing) {
         pt_blk_free_decoder(decoder);
+        pt_image_free(image);
         return NULL;
     }
-    return decoder;
+    return wrap_block_decoder(decoder, image, err);
+}
+
+/*
+ * Get ready to retrieve the basic blocks from a PT trace recorded elsewhere
+ * (e.g. read back from disk).
+ *
+ * This is like `perf_pt_init_block_decoder()`, except that instead of using
+ * the code of the current process, control flow is recovered from the
+ * `nsections` file regions described by `sections`.
+ *
+ * Returns a pointer to a configured block decoder, to be freed with
+ * `perf_pt_free_block_decoder()`, or NULL on error.
+ */
+void *
+perf_pt_init_raw_block_decoder(void *buf, uint64_t len,
+                               struct perf_pt_image_section *sections,
+                               size_t nsections, int *decoder_status,
+                               struct perf_pt_cerror *err) {
+    bool failing = false;
+
+    struct pt_block_decoder *decoder =
+        alloc_block_decoder(buf, len, decoder_status, err);
+    if (decoder == NULL) {
+        return NULL;
+    }
+    if (*decoder_status == -pte_eos) {
+        return wrap_block_decoder(decoder, NULL, err);
+    }
+
+    struct pt_image *image = pt_image_alloc(NULL);
+    if (image == NULL) {
+        perf_pt_set_err(err, perf_pt_cerror_unknown, 0);
+        failing = true;
+        goto clean;
+    }
+
+    for (size_t i = 0; i < nsections; i++) {
+        struct perf_pt_image_section *sec = &sections[i];
+        int rv = pt_image_add_file(image, sec->filename, sec->offset,
+                                   sec->size, NULL, sec->vaddr);
+        if (rv < 0) {
+            perf_pt_set_err(err, perf_pt_cerror_ipt, -rv);
+            failing = true;
+            goto clean;
+        }
+    }
+
+    int rv = pt_blk_set_image(decoder, image);
+    if (rv < 0) {
+        perf_pt_set_err(err, perf_pt_cerror_ipt, -rv);
+        failing = true;
+        goto clean;
+    }
+
+clean:
+    if (failing) {
+        pt_blk_free_decoder(decoder);
+        pt_image_free(image);
+        return NULL;
+    }
+    return wrap_block_decoder(decoder, image, err);
 }
 
 /*
@@ -177,15 +301,19 @@ clean:
  * the instruction stream has been reached.
  *
  * `*decoder_status` will be updated with the new decoder status after the operation.
+ * Events seen are counted in `*stats`.
  *
  * Returns true on success or false otherwise. Upon failure, `*first_instr` and
  * `*last_instr` are undefined.
  */
 bool
-perf_pt_next_block(struct pt_block_decoder *decoder, int *decoder_status,
-        uint64_t *first_instr, uint64_t *last_instr, struct perf_pt_cerror *err) {
+perf_pt_next_block(struct perf_pt_block_decoder *bdecoder, int *decoder_status,
+        uint64_t *first_instr, uint64_t *last_instr,
+        struct perf_pt_decoder_stats *stats, struct perf_pt_cerror *err) {
+    struct pt_block_decoder *decoder = bdecoder->decoder;
+
     // If there are events pending, look at those first.
-    if (handle_events(decoder, decoder_status, err) != true) {
+    if (handle_events(decoder, decoder_status, stats, err) != true) {
         // handle_events will have already called perf_pt_set_err().
         return false;
     } else if (*decoder_status & pts_eos) {
@@ -206,7 +334,7 @@ perf_pt_next_block(struct pt_block_decoder *decoder, int *decoder_status,
     bool first_block = true;
     *last_instr = 0;
     while (!block_is_terminated(&block)) {
-        if (handle_events(decoder, decoder_status, err) != true) {
+        if (handle_events(decoder, decoder_status, stats, err) != true) {
             // handle_events will have already called perf_pt_set_err().
             return false;
         } else if (*decoder_status & pts_eos) {
@@ -230,7 +358,7 @@ perf_pt_next_block(struct pt_block_decoder *decoder, int *decoder_status,
             return true;
         } else if (*decoder_status < 0) {
             // A real error.
-            perf_pt_set_err(err, perf_pt_cerror_ipt, -*decoder_status);
+            decode_error(decoder, -*decoder_status, err);
             return false;
         }
 
@@ -267,16 +395,20 @@ perf_pt_next_block(struct pt_block_decoder *decoder, int *decoder_status,
  * overflow.
  */
 static bool
-handle_events(struct pt_block_decoder *decoder, int *decoder_status, struct perf_pt_cerror *err) {
+handle_events(struct pt_block_decoder *decoder, int *decoder_status,
+              struct perf_pt_decoder_stats *stats, struct perf_pt_cerror *err) {
     bool ret = true;
 
     while(*decoder_status & pts_event_pending) {
         struct pt_event event;
         *decoder_status = pt_blk_event(decoder, &event, sizeof(event));
         if (*decoder_status < 0) {
-            perf_pt_set_err(err, perf_pt_cerror_ipt, -*decoder_status);
+            decode_error(decoder, -*decoder_status, err);
             return false;
         }
+        if (event.type < PERF_PT_MAX_EVENT_TYPES) {
+            stats->events[event.type]++;
+        }
 
         switch (event.type) {
             // Tracing enabled/disabled packets (TIP.PGE/TIP.PGD).
@@ -296,7 +428,7 @@ handle_events(struct pt_block_decoder *decoder, int *decoder_status, struct perf
             case ptev_overflow:
                 // We translate the overflow event to an overflow error for
                 // Rust to detect later.
-                perf_pt_set_err(err, perf_pt_cerror_ipt, pte_overflow);
+                decode_error(decoder, pte_overflow, err);
                 ret = false;
                 break;
             // Execution mode packet (MODE.Exec).
@@ -351,6 +483,51 @@ handle_events(struct pt_block_decoder *decoder, int *decoder_status, struct perf
     return ret;
 }
 
+/*
+ * Sets `err` to the libipt error `code` which was encountered by `decoder`.
+ */
+static void
+decode_error(struct pt_block_decoder *decoder, int code,
+             struct perf_pt_cerror *err)
+{
+    uint64_t offset = 0;
+    pt_blk_get_offset(decoder, &offset);
+    PERF_PT_PROBE2(decode_error, code, offset);
+    perf_pt_set_err(err, perf_pt_cerror_ipt, code);
+}
+
+/*
+ * Returns a name for the event type `type` (an `enum pt_event_type`), or NULL
+ * if the type is unknown.
+ */
+const char *
+perf_pt_event_name(int type)
+{
+    switch (type) {
+        case ptev_enabled: return "enabled";
+        case ptev_disabled: return "disabled";
+        case ptev_async_disabled: return "async_disabled";
+        case ptev_async_branch: return "async_branch";
+        case ptev_paging: return "paging";
+        case ptev_async_paging: return "async_paging";
+        case ptev_overflow: return "overflow";
+        case ptev_exec_mode: return "exec_mode";
+        case ptev_tsx: return "tsx";
+        case ptev_stop: return "stop";
+        case ptev_vmcs: return "vmcs";
+        case ptev_async_vmcs: return "async_vmcs";
+        case ptev_exstop: return "exstop";
+        case ptev_mwait: return "mwait";
+        case ptev_pwre: return "pwre";
+        case ptev_pwrx: return "pwrx";
+        case ptev_ptwrite: return "ptwrite";
+        case ptev_tick: return "tick";
+        case ptev_cbr: return "cbr";
+        case ptev_mnt: return "mnt";
+        default: return NULL;
+    }
+}
+
 /*
  * Decides if a block is terminated by a control flow dispatch.
  *
@@ -495,12 +672,36 @@ dump_vdso(int fd, uint64_t vaddr, size_t len, struct perf_pt_cerror *err)
     return true;
 }
 
+/*
+ * Wrap `decoder` and the image it decodes against, `image` (which may be
+ * NULL), so that they can be freed together.
+ *
+ * On error, both are freed and NULL is returned.
+ */
+static struct perf_pt_block_decoder *
+wrap_block_decoder(struct pt_block_decoder *decoder, struct pt_image *image,
+                   struct perf_pt_cerror *err) {
+    struct perf_pt_block_decoder *bdecoder = malloc(sizeof(*bdecoder));
+    if (bdecoder == NULL) {
+        perf_pt_set_err(err, perf_pt_cerror_errno, errno);
+        pt_blk_free_decoder(decoder);
+        pt_image_free(image);
+        return NULL;
+    }
+    bdecoder->decoder = decoder;
+    bdecoder->image = image;
+    return bdecoder;
+}
+
 /*
  * Free a block decoder and its image.
  */
 void
-perf_pt_free_block_decoder(struct pt_block_decoder *decoder) {
-    if (decoder != NULL) {
-        pt_blk_free_decoder(decoder);
+perf_pt_free_block_decoder(struct perf_pt_block_decoder *bdecoder) {
+    if (bdecoder != NULL) {
+        // The decoder refers to the image, so must go first.
+        pt_blk_free_decoder(bdecoder->decoder);
+        pt_image_free(bdecoder->image);
+        free(bdecoder);
     }
 }
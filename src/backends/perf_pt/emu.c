@@ -0,0 +1,439 @@
+// Copyright (c) 2018 King's College London
+// created by the Software Development Team <http://soft-dev.org/>
+//
+// The Universal Permissive License (UPL), Version 1.0
+//
+// Subject to the condition set forth below, permission is hereby granted to any
+// person obtaining a copy of this software, associated documentation and/or
+// data (collectively the "Software"), free of charge and under any and all
+// copyright rights in the Software, and any and all patent rights owned or
+// freely licensable by each licensor hereunder covering either (i) the
+// unmodified Software as contributed to or provided by such licensor, or (ii)
+// the Larger Works (as defined below), to deal in both
+//
+// (a) the Software, and
+// (b) any piece of software and/or hardware listed in the lrgrwrks.txt file
+// if one is included with the Software (each a "Larger Work" to which the Software
+// is contributed by such licensors),
+//
+// without restriction, including without limitation the rights to copy, create
+// derivative works of, display, perform, and distribute the Software and make,
+// use, sell, offer for sale, import, export, have made, and have sold the
+// Software and the Larger Work(s), and to sublicense the foregoing rights on
+// either these or other terms.
+//
+// This license is subject to the following condition: The above copyright
+// notice and either this complete permission notice or at a minimum a reference
+// to the UPL must be included in all copies or substantial portions of the
+// Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+/*
+ * A userspace emulation of the perf ring buffers used by the collector.
+ *
+ * The emulator lays out a `perf_event_mmap_page` header, a data buffer and an
+ * AUX buffer in ordinary memory, and a producer thread plays the role of the
+ * kernel: it writes (patterned) trace data into the AUX buffer and announces
+ * it with PERF_RECORD_AUX records in the data buffer, waking the collector
+ * via an eventfd which stands in for the perf file descriptor. The collector's
+ * real poll loop drains the buffers.
+ *
+ * This allows the collector to be tested and benchmarked without Intel PT
+ * hardware, and deterministically.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <inttypes.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <linux/perf_event.h>
+
+#include "perf_pt_private.h"
+
+// The AUX data at (monotonic) offset `off` is `pattern_byte(off, seed)`.
+#define PATTERN_PERIOD 251
+
+/*
+ * Configuration of the emulator.
+ *
+ * Shared with Rust code. Must stay in sync.
+ */
+struct perf_pt_emu_config {
+    uint64_t    data_bufsize;   // Data buffer size (in pages).
+    uint64_t    aux_bufsize;    // AUX buffer size (in pages).
+    uint64_t    total_bytes;    // Bytes of trace data to produce.
+    uint64_t    chunk_size;     // Bytes produced per PERF_RECORD_AUX.
+    uint64_t    rate;           // Bytes produced per second (0 = unlimited).
+    uint64_t    lost_period;    // Inject a PERF_RECORD_LOST every this many
+                                // PERF_RECORD_AUX records (0 = never).
+    uint64_t    seed;           // Varies the data pattern.
+    bool        wait_for_space; // When a buffer is full, wait for the
+                                // collector instead of losing data.
+    uint64_t    spin_ns;        // The collector's busy-poll budget.
+    uint64_t    max_bytes;      // The trace's `max_len`.
+};
+
+/*
+ * What happened during an emulated session.
+ *
+ * Shared with Rust code. Must stay in sync.
+ */
+struct perf_pt_emu_stats {
+    uint64_t    produced;       // Bytes written into the AUX buffer.
+    uint64_t    aux_records;    // PERF_RECORD_AUX records written.
+    uint64_t    lost_records;   // PERF_RECORD_LOST records written.
+    uint64_t    truncated;      // AUX records flagged as truncated.
+    uint64_t    full_waits;     // Times the producer waited for space.
+    uint64_t    elapsed_ns;     // Time from starting the producer until the
+                                // collector finished.
+    struct perf_pt_collector_stats
+                collector;      // What the collector saw.
+};
+
+/*
+ * The state of an emulated session.
+ */
+struct emu {
+    const struct perf_pt_emu_config
+                        *conf;
+    struct perf_event_mmap_page
+                        *hdr;           // Header of the base buffer.
+    size_t              base_bufsize;   // Header page + data buffer.
+    void                *aux_buf;
+    size_t              aux_bufsize;
+    int                 event_fd;       // Stands in for the perf fd.
+    int                 stop_fds[2];    // Closing [1] stops the collector.
+    uint8_t             *pattern;       // Pre-computed AUX data.
+    _Atomic bool        stop;           // Tells the producer to give up.
+    struct perf_pt_emu_stats
+                        stats;
+    struct perf_pt_cerror
+                        err;            // Errors from the producer.
+};
+
+// Private prototypes.
+static uint8_t pattern_byte(uint64_t, uint64_t);
+static uint64_t ring_space(uint64_t, uint64_t, uint64_t);
+static void copy_in(void *, uint64_t, uint64_t, const void *, uint64_t);
+static bool wait_space(struct emu *, _Atomic __u64 *, uint64_t, uint64_t,
+                       uint64_t, uint64_t *);
+static bool write_record(struct emu *, void *, size_t);
+static void *producer(void *);
+
+// Exposed prototypes.
+bool perf_pt_emu_run(const struct perf_pt_emu_config *, struct perf_pt_trace *,
+                     struct perf_pt_emu_stats *, struct perf_pt_cerror *);
+uint8_t perf_pt_emu_pattern_byte(uint64_t, uint64_t);
+
+static uint8_t
+pattern_byte(uint64_t off, uint64_t seed)
+{
+    return (uint8_t) ((off % PATTERN_PERIOD) ^ seed);
+}
+
+/*
+ * Returns the byte the emulator writes at AUX offset `off`, so that callers can
+ * check what the collector read out.
+ */
+uint8_t
+perf_pt_emu_pattern_byte(uint64_t off, uint64_t seed)
+{
+    return pattern_byte(off, seed);
+}
+
+/*
+ * Free space in a ring of `size` bytes (a power of 2).
+ *
+ * `head` is monotonic, but the collector stores wrapped tails, so like the
+ * kernel we work modulo the size and always leave one byte free to tell a full
+ * buffer from an empty one.
+ */
+static uint64_t
+ring_space(uint64_t head, uint64_t tail, uint64_t size)
+{
+    return size - 1 - ((head - tail) & (size - 1));
+}
+
+/*
+ * Copy `len` bytes from `src` into the ring `ring` of `size` bytes, starting
+ * at monotonic offset `head`.
+ */
+static void
+copy_in(void *ring, uint64_t size, uint64_t head, const void *src, uint64_t len)
+{
+    uint64_t off = head & (size - 1);
+    uint64_t first = len < size - off ? len : size - off;
+    memcpy(ring + off, src, first);
+    memcpy(ring, src + first, len - first);
+}
+
+/*
+ * Wait until there are at least `len` bytes free in a ring whose tail is at
+ * `*tail`. If waiting is disabled, returns immediately.
+ *
+ * Returns true if there is enough space, or false otherwise. The space
+ * available is written to `*space`.
+ */
+static bool
+wait_space(struct emu *e, _Atomic __u64 *tail, uint64_t head, uint64_t size,
+           uint64_t len, uint64_t *space)
+{
+    bool waited = false;
+    while (1) {
+        // Acquire: the collector must be done reading before we overwrite.
+        *space = ring_space(head,
+            atomic_load_explicit(tail, memory_order_acquire), size);
+        if (*space >= len) {
+            return true;
+        }
+        if ((!e->conf->wait_for_space) || atomic_load(&e->stop)) {
+            return false;
+        }
+        if (!waited) {
+            e->stats.full_waits++;
+            waited = true;
+        }
+        sched_yield();
+    }
+}
+
+/*
+ * Append a record to the data buffer and wake the collector.
+ *
+ * Returns false if there was no space for the record (i.e. it was lost).
+ */
+static bool
+write_record(struct emu *e, void *rec, size_t len)
+{
+    struct perf_event_mmap_page *hdr = e->hdr;
+    uint64_t head = hdr->data_head; // Only we write the head.
+    uint64_t space;
+    if (!wait_space(e, (_Atomic __u64 *) &hdr->data_tail, head,
+                    hdr->data_size, len, &space)) {
+        return false;
+    }
+    copy_in((void *) hdr + hdr->data_offset, hdr->data_size, head, rec, len);
+    atomic_store_explicit((_Atomic __u64 *) &hdr->data_head, head + len,
+                          memory_order_release);
+
+    uint64_t one = 1;
+    if (write(e->event_fd, &one, sizeof(one)) == -1) {
+        perf_pt_set_err(&e->err, perf_pt_cerror_errno, errno);
+    }
+    return true;
+}
+
+/*
+ * The producer thread: pretends to be the kernel.
+ */
+static void *
+producer(void *arg)
+{
+    struct emu *e = arg;
+    const struct perf_pt_emu_config *conf = e->conf;
+    struct perf_event_mmap_page *hdr = e->hdr;
+    uint64_t pending_lost = 0;
+    uint64_t start = perf_pt_now_ns();
+
+    while ((e->stats.produced < conf->total_bytes) && (!atomic_load(&e->stop))) {
+        uint64_t len = conf->total_bytes - e->stats.produced;
+        if (len > conf->chunk_size) {
+            len = conf->chunk_size;
+        }
+
+        // Write the trace data. If the AUX buffer is full the kernel writes
+        // what fits, flags the record as truncated and stops tracing.
+        uint64_t aux_head = hdr->aux_head;
+        uint64_t space;
+        bool truncated = !wait_space(e, (_Atomic __u64 *) &hdr->aux_tail,
+                                     aux_head, hdr->aux_size, len, &space);
+        if (atomic_load(&e->stop)) {
+            break;
+        }
+        if (truncated) {
+            len = space;
+        }
+        copy_in(e->aux_buf, hdr->aux_size, aux_head,
+                e->pattern + (aux_head % PATTERN_PERIOD), len);
+        atomic_store_explicit((_Atomic __u64 *) &hdr->aux_head, aux_head + len,
+                              memory_order_release);
+        e->stats.produced += len;
+
+        // Records lost because the data buffer was full are reported by a
+        // PERF_RECORD_LOST as soon as there is space again.
+        if (pending_lost > 0) {
+            struct {
+                struct perf_event_header header;
+                __u64 id;
+                __u64 lost;
+            } lost_rec = {{PERF_RECORD_LOST, 0, sizeof(lost_rec)}, 0, pending_lost};
+            if (write_record(e, &lost_rec, sizeof(lost_rec))) {
+                e->stats.lost_records++;
+                pending_lost = 0;
+            }
+        }
+        struct {
+            struct perf_event_header header;
+            __u64 aux_offset;
+            __u64 aux_size;
+            __u64 flags;
+        } aux_rec = {
+            {PERF_RECORD_AUX, 0, sizeof(aux_rec)},
+            aux_head,
+            len,
+            truncated ? PERF_AUX_FLAG_TRUNCATED : 0
+        };
+        if (write_record(e, &aux_rec, sizeof(aux_rec))) {
+            e->stats.aux_records++;
+            e->stats.truncated += truncated;
+        } else {
+            pending_lost++;
+        }
+        if (truncated) {
+            break;
+        }
+        if ((conf->lost_period != 0) &&
+            (e->stats.aux_records % conf->lost_period == 0)) {
+            pending_lost++;
+        }
+
+        // Pace ourselves if a rate was requested.
+        if (conf->rate != 0) {
+            uint64_t due = start +
+                (uint64_t) ((double) e->stats.produced * 1e9 / conf->rate);
+            uint64_t now = perf_pt_now_ns();
+            if (due > now) {
+                struct timespec ts = {
+                    (due - now) / 1000000000, (due - now) % 1000000000
+                };
+                nanosleep(&ts, NULL);
+            }
+        }
+    }
+
+    // Equivalent to stopping the tracer: the collector drains what's left.
+    close(e->stop_fds[1]);
+    return NULL;
+}
+
+/*
+ * Run an emulated tracing session as described by `conf`, collecting the
+ * trace into `trace` with the real collector poll loop. Statistics are
+ * written to `*stats`, even if collection failed.
+ *
+ * Returns true on success or false otherwise.
+ */
+bool
+perf_pt_emu_run(const struct perf_pt_emu_config *conf,
+                struct perf_pt_trace *trace, struct perf_pt_emu_stats *stats,
+                struct perf_pt_cerror *err)
+{
+    bool ret = true;
+    struct emu e;
+    memset(&e, 0, sizeof(e));
+    e.conf = conf;
+    e.hdr = MAP_FAILED;
+    e.aux_buf = MAP_FAILED;
+    e.event_fd = e.stop_fds[0] = e.stop_fds[1] = -1;
+    memset(stats, 0, sizeof(*stats));
+
+    // Lay out the buffers as the kernel would.
+    size_t page_size = getpagesize();
+    e.base_bufsize = (1 + conf->data_bufsize) * page_size;
+    e.hdr = mmap(NULL, e.base_bufsize, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (e.hdr == MAP_FAILED) {
+        perf_pt_set_err(err, perf_pt_cerror_errno, errno);
+        ret = false;
+        goto clean;
+    }
+    e.hdr->data_offset = page_size;
+    e.hdr->data_size = conf->data_bufsize * page_size;
+    e.hdr->aux_offset = e.hdr->data_offset + e.hdr->data_size;
+    e.hdr->aux_size = e.aux_bufsize = conf->aux_bufsize * page_size;
+    e.aux_buf = mmap(NULL, e.aux_bufsize, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (e.aux_buf == MAP_FAILED) {
+        perf_pt_set_err(err, perf_pt_cerror_errno, errno);
+        ret = false;
+        goto clean;
+    }
+
+    e.pattern = malloc(PATTERN_PERIOD + conf->chunk_size);
+    if (e.pattern == NULL) {
+        perf_pt_set_err(err, perf_pt_cerror_errno, errno);
+        ret = false;
+        goto clean;
+    }
+    for (uint64_t i = 0; i < PATTERN_PERIOD + conf->chunk_size; i++) {
+        e.pattern[i] = pattern_byte(i, conf->seed);
+    }
+
+    e.event_fd = eventfd(0, EFD_CLOEXEC);
+    if ((e.event_fd == -1) || (pipe(e.stop_fds) == -1)) {
+        perf_pt_set_err(err, perf_pt_cerror_errno, errno);
+        ret = false;
+        goto clean;
+    }
+
+    pthread_t producer_thread;
+    uint64_t start = perf_pt_now_ns();
+    int rc = pthread_create(&producer_thread, NULL, producer, &e);
+    if (rc != 0) {
+        perf_pt_set_err(err, perf_pt_cerror_errno, rc);
+        ret = false;
+        goto clean;
+    }
+
+    // Collect until the producer closes the stop pipe.
+    trace->max_len = conf->max_bytes;
+    trace->truncated = false;
+    ret = perf_pt_poll_loop(e.event_fd, e.stop_fds[0], e.hdr, e.aux_buf, trace,
+                            conf->spin_ns, NULL, NULL, &e.stats.collector, err);
+
+    // If the collector gave up early, the producer may be waiting for space.
+    atomic_store(&e.stop, true);
+    pthread_join(producer_thread, NULL);
+    e.stop_fds[1] = -1; // Closed by the producer.
+    e.stats.elapsed_ns = perf_pt_now_ns() - start;
+    if (e.err.kind != perf_pt_cerror_unused) {
+        perf_pt_set_err(err, e.err.kind, e.err.code);
+        ret = false;
+    }
+    *stats = e.stats;
+
+clean:
+    if (e.hdr != MAP_FAILED) {
+        munmap(e.hdr, e.base_bufsize);
+    }
+    if (e.aux_buf != MAP_FAILED) {
+        munmap(e.aux_buf, e.aux_bufsize);
+    }
+    free(e.pattern);
+    for (int i = 0; i < 2; i++) {
+        if (e.stop_fds[i] != -1) {
+            close(e.stop_fds[i]);
+        }
+    }
+    if (e.event_fd != -1) {
+        close(e.event_fd);
+    }
+    return ret;
+}
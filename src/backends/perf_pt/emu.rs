@@ -0,0 +1,318 @@
+//! An emulation of the perf ring buffers, for testing and benchmarking the collector.
+//!
+//! A producer thread plays the role of the kernel, writing patterned data into an AUX buffer and
+//! announcing it with `PERF_RECORD_AUX` records, while the collector's real poll loop drains the
+//! buffers. No Intel PT hardware (or perf support) is required. See `emu.c` for the details.
+//!
+//! This is exported (hidden from the docs) for the benchmarks only, and may change at any time.
+
+use super::{perf_pt_emu_pattern_byte, perf_pt_emu_run, CollectorStats, PerfPTCError, PerfPTTrace};
+use crate::errors::HWTracerError;
+use std::time::Duration;
+
+/// Describes an emulated tracing session.
+///
+/// Shared with C code. Must stay in sync.
+#[repr(C)]
+#[derive(Clone, Debug)]
+pub struct EmuConfig {
+    /// Data buffer size (in pages). Must be a power of 2.
+    pub data_bufsize: u64,
+    /// AUX buffer size (in pages). Must be a power of 2.
+    pub aux_bufsize: u64,
+    /// Bytes of trace data to produce.
+    pub total_bytes: u64,
+    /// Bytes of trace data announced by each `PERF_RECORD_AUX` record.
+    pub chunk_size: u64,
+    /// Bytes produced per second (0 = as fast as possible).
+    pub rate: u64,
+    /// Inject a `PERF_RECORD_LOST` record every this many `PERF_RECORD_AUX` records (0 = never).
+    pub lost_period: u64,
+    /// Varies the data written into the AUX buffer.
+    pub seed: u64,
+    /// When a buffer is full, wait for the collector to make space instead of losing data (as the
+    /// kernel would). Waiting makes a run measure the collector's maximum throughput.
+    pub wait_for_space: bool,
+    /// Run the collector in busy-poll mode with this budget (see
+    /// `PerfPTConfig::collector_spin_ns`).
+    pub spin_ns: u64,
+    /// Truncate the trace once it reaches this many bytes (see
+    /// `PerfPTConfig::max_session_bytes`; 0 = never).
+    pub max_bytes: u64,
+}
+
+impl Default for EmuConfig {
+    fn default() -> Self {
+        Self {
+            data_bufsize: 64,
+            aux_bufsize: 1024,
+            total_bytes: 64 * 1024 * 1024,
+            chunk_size: 64 * 1024,
+            rate: 0,
+            lost_period: 0,
+            seed: 0,
+            wait_for_space: true,
+            spin_ns: 0,
+            max_bytes: 0,
+        }
+    }
+}
+
+/// What happened during an emulated session.
+///
+/// Shared with C code. Must stay in sync.
+#[repr(C)]
+#[derive(Clone, Debug, Default)]
+pub(super) struct PerfPTEmuStats {
+    produced: u64,
+    aux_records: u64,
+    lost_records: u64,
+    truncated: u64,
+    full_waits: u64,
+    elapsed_ns: u64,
+    collector: CollectorStats,
+}
+
+/// The outcome of an emulated session.
+#[derive(Debug)]
+pub struct EmuRun {
+    /// Bytes written into the AUX buffer by the producer.
+    pub produced: u64,
+    /// `PERF_RECORD_AUX` records written.
+    pub aux_records: u64,
+    /// `PERF_RECORD_LOST` records written.
+    pub lost_records: u64,
+    /// `PERF_RECORD_AUX` records flagged as truncated.
+    pub truncated: u64,
+    /// How many times the producer had to wait for the collector to make space.
+    pub full_waits: u64,
+    /// Time from starting the producer until the collector finished.
+    pub elapsed: Duration,
+    /// What the collector saw.
+    pub collector: CollectorStats,
+    /// Whether the trace was truncated at `EmuConfig::max_bytes`.
+    pub trace_truncated: bool,
+    /// The error which stopped the collector, if any.
+    pub error: Option<HWTracerError>,
+    trace: PerfPTTrace,
+}
+
+impl EmuRun {
+    /// Returns the trace read out by the collector.
+    pub fn trace(&self) -> &PerfPTTrace {
+        &self.trace
+    }
+}
+
+/// Returns the byte which the emulator writes at offset `off` of the trace.
+pub fn emu_pattern_byte(off: u64, seed: u64) -> u8 {
+    unsafe { perf_pt_emu_pattern_byte(off, seed) }
+}
+
+/// Runs an emulated tracing session described by `conf`, collecting the trace with the real
+/// collector. An error is returned only if `conf` is invalid; errors during collection (e.g.
+/// overflows) are reported in the result.
+pub fn emulate_collection(
+    conf: &EmuConfig,
+    initial_trace_bufsize: usize,
+) -> Result<EmuRun, HWTracerError> {
+    fn power_of_2(v: u64) -> bool {
+        v != 0 && (v & (v - 1)) == 0
+    }
+    if !power_of_2(conf.data_bufsize) || !power_of_2(conf.aux_bufsize) {
+        return Err(HWTracerError::BadConfig(String::from(
+            "data_bufsize and aux_bufsize must be positive powers of 2",
+        )));
+    }
+    if conf.chunk_size == 0 {
+        return Err(HWTracerError::BadConfig(String::from(
+            "chunk_size must be positive",
+        )));
+    }
+
+    let mut trace = PerfPTTrace::new(initial_trace_bufsize.max(1))?;
+    let mut stats = PerfPTEmuStats::default();
+    let mut cerr = PerfPTCError::new();
+    let error = if unsafe { perf_pt_emu_run(conf, &mut trace.ctrace, &mut stats, &mut cerr) } {
+        None
+    } else {
+        Some(cerr.into())
+    };
+    Ok(EmuRun {
+        produced: stats.produced,
+        aux_records: stats.aux_records,
+        lost_records: stats.lost_records,
+        truncated: stats.truncated,
+        full_waits: stats.full_waits,
+        elapsed: Duration::from_nanos(stats.elapsed_ns),
+        collector: stats.collector,
+        trace_truncated: trace.is_truncated(),
+        error,
+        trace,
+    })
+}
+
+#[cfg(test)]
+mod tests {
+    use super::{emu_pattern_byte, emulate_collection, EmuConfig};
+    use crate::errors::HWTracerError;
+    use crate::Trace;
+
+    // Check the collected data is exactly what was produced.
+    fn check_data(conf: &EmuConfig) {
+        let run = emulate_collection(conf, 1024).unwrap();
+        assert!(run.error.is_none(), "{:?}", run.error);
+        assert_eq!(run.produced, conf.total_bytes);
+        let data = run.trace().raw_data();
+        assert_eq!(data.len() as u64, conf.total_bytes);
+        assert_eq!(run.collector.aux_bytes, conf.total_bytes);
+        assert_eq!(run.collector.aux_records, run.aux_records);
+        for (i, b) in data.iter().enumerate() {
+            assert_eq!(*b, emu_pattern_byte(i as u64, conf.seed), "offset {}", i);
+        }
+    }
+
+    // Chunks which don't divide the buffer size make reads wrap around the end of the buffers.
+    #[test]
+    fn test_wrap_around() {
+        check_data(&EmuConfig {
+            data_bufsize: 1,
+            aux_bufsize: 1,
+            total_bytes: 1024 * 1024,
+            chunk_size: 1000,
+            seed: 3,
+            ..EmuConfig::default()
+        });
+    }
+
+    #[test]
+    fn test_large_chunks() {
+        check_data(&EmuConfig {
+            total_bytes: 16 * 1024 * 1024,
+            ..EmuConfig::default()
+        });
+    }
+
+    // A full AUX buffer leads to a truncated record, which is reported as an overflow.
+    #[test]
+    fn test_truncated() {
+        let run = emulate_collection(
+            &EmuConfig {
+                data_bufsize: 1,
+                aux_bufsize: 1,
+                total_bytes: 1024 * 1024,
+                chunk_size: 1000,
+                wait_for_space: false,
+                ..EmuConfig::default()
+            },
+            1024,
+        )
+        .unwrap();
+        match run.error {
+            Some(HWTracerError::HWBufferOverflow) => (),
+            e => panic!("expected overflow, got {:?}", e),
+        }
+        assert!(run.produced < 1024 * 1024);
+    }
+
+    #[test]
+    fn test_lost() {
+        let run = emulate_collection(
+            &EmuConfig {
+                lost_period: 10,
+                total_bytes: 1024 * 1024,
+                chunk_size: 1000,
+                ..EmuConfig::default()
+            },
+            1024,
+        )
+        .unwrap();
+        match run.error {
+            Some(HWTracerError::HWBufferOverflow) => (),
+            e => panic!("expected overflow, got {:?}", e),
+        }
+        assert!(run.lost_records > 0);
+        assert!(run.collector.lost_records > 0);
+    }
+
+    #[test]
+    fn test_busy_poll() {
+        let conf = EmuConfig {
+            total_bytes: 4 * 1024 * 1024,
+            chunk_size: 1000,
+            spin_ns: 10_000_000,
+            ..EmuConfig::default()
+        };
+        check_data(&conf);
+        let run = emulate_collection(&conf, 1024).unwrap();
+        assert!(run.collector.spin_hits > 0);
+        assert!(run.collector.spin_ns > 0);
+    }
+
+    // Once the buffers have wrapped, a busy-poll still has to wait for new data. At a slow rate
+    // and with a short budget, most busy-polls give up and fall back to poll(2).
+    #[test]
+    fn test_busy_poll_wrapped() {
+        let conf = EmuConfig {
+            data_bufsize: 1,
+            aux_bufsize: 1,
+            total_bytes: 256 * 1024,
+            chunk_size: 1000,
+            rate: 2 * 1024 * 1024,
+            spin_ns: 10_000,
+            ..EmuConfig::default()
+        };
+        check_data(&conf);
+        let run = emulate_collection(&conf, 1024).unwrap();
+        let c = &run.collector;
+        assert!(
+            c.spin_misses > c.spin_hits,
+            "{} hits, {} misses",
+            c.spin_hits,
+            c.spin_misses
+        );
+        // The collector must not wake up (i.e. spin) over and over without new data.
+        assert!(c.wakeups < 2 * run.aux_records, "{} wake-ups", c.wakeups);
+    }
+
+    // A truncated trace holds a prefix of what was produced, and the rest is dropped.
+    #[test]
+    fn test_max_bytes() {
+        let conf = EmuConfig {
+            total_bytes: 4 * 1024 * 1024,
+            chunk_size: 1000,
+            max_bytes: 1024 * 1024,
+            seed: 5,
+            ..EmuConfig::default()
+        };
+        let run = emulate_collection(&conf, 1024).unwrap();
+        assert!(run.error.is_none(), "{:?}", run.error);
+        assert!(run.trace_truncated);
+        let data = run.trace().raw_data();
+        let page_size = unsafe { libc::sysconf(libc::_SC_PAGESIZE) } as u64;
+        let aux_bytes = conf.aux_bufsize * page_size;
+        assert!(data.len() as u64 >= conf.max_bytes);
+        assert!((data.len() as u64) < conf.max_bytes + aux_bytes);
+        assert_eq!(
+            data.len() as u64 + run.collector.discarded_bytes,
+            conf.total_bytes
+        );
+        for (i, b) in data.iter().enumerate() {
+            assert_eq!(*b, emu_pattern_byte(i as u64, conf.seed), "offset {}", i);
+        }
+    }
+
+    #[test]
+    fn test_bad_config() {
+        match emulate_collection(
+            &EmuConfig {
+                aux_bufsize: 3,
+                ..EmuConfig::default()
+            },
+            1024,
+        ) {
+            Err(HWTracerError::BadConfig(_)) => (),
+            _ => panic!(),
+        }
+    }
+}
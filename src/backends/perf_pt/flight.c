@@ -0,0 +1,408 @@
+// Copyright (c) 2018 King's College London
+// created by the Software Development Team <http://soft-dev.org/>
+//
+// The Universal Permissive License (UPL), Version 1.0
+//
+// Subject to the condition set forth below, permission is hereby granted to any
+// person obtaining a copy of this software, associated documentation and/or
+// data (collectively the "Software"), free of charge and under any and all
+// copyright rights in the Software, and any and all patent rights owned or
+// freely licensable by each licensor hereunder covering either (i) the
+// unmodified Software as contributed to or provided by such licensor, or (ii)
+// the Larger Works (as defined below), to deal in both
+//
+// (a) the Software, and
+// (b) any piece of software and/or hardware listed in the lrgrwrks.txt file
+// if one is included with the Software (each a "Larger Work" to which the Software
+// is contributed by such licensors),
+//
+// without restriction, including without limitation the rights to copy, create
+// derivative works of, display, perform, and distribute the Software and make,
+// use, sell, offer for sale, import, export, have made, and have sold the
+// Software and the Larger Work(s), and to sublicense the foregoing rights on
+// either these or other terms.
+//
+// This license is subject to the following condition: The above copyright
+// notice and either this complete permission notice or at a minimum a reference
+// to the UPL must be included in all copies or substantial portions of the
+// Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+/*
+ * The crash flight recorder.
+ *
+ * When a traced process crashes, the most recent (and most useful) trace data
+ * is still sitting in the perf buffers of its sessions. Once installed, the
+ * flight recorder registers every session as it starts, and on a fatal signal
+ * (SIGSEGV, SIGBUS, SIGILL, SIGFPE or SIGABRT) turns tracing off and writes
+ * each session's AUX and data rings, plus an image manifest prepared at
+ * install time, to a file opened at install time. The previous handler is then
+ * reinstated and the signal raised again.
+ *
+ * The handler only uses async-signal-safe system calls (ioctl(2), write(2),
+ * fsync(2), sigaction(2) and raise(3)) and never allocates.
+ *
+ * Since the kernel doesn't overwrite AUX data until the collector has read it,
+ * each ring holds the last `aux_size` bytes of its trace, ending at the head.
+ * The rings are written oldest byte first, so a decoder can synchronise at the
+ * first PSB packet in the dump.
+ *
+ * Sessions are registered in the process's session table. Tests register fake
+ * sessions in tables of their own (see perf_pt_flight_table_new()), so that
+ * dumping them doesn't disable the real sessions of other tests.
+ *
+ * The dump is a 16 byte magic number followed by sections, each a `struct
+ * flight_section` header and `len` bytes of payload, until the end of the
+ * file. See flight.rs for a reader.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/perf_event.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "perf_pt_private.h"
+
+// The most sessions recorded at once. Later sessions aren't recorded.
+#define FLIGHT_MAX_SESSIONS 64
+
+#define FLIGHT_MAGIC "hwtracer-flight1"
+
+// Section kinds. Must stay in sync with flight.rs.
+enum flight_kind {
+    flight_kind_aux = 1,        // An AUX ring, oldest byte first.
+    flight_kind_data = 2,       // A data ring, oldest byte first.
+    flight_kind_manifest = 3,   // The image manifest.
+};
+
+struct flight_section {
+    uint32_t kind;              // An `enum flight_kind`.
+    uint32_t tid;               // The traced thread (rings only).
+    uint64_t head;              // Bytes written to the ring since the
+                                // session started (rings only).
+    uint64_t len;               // Payload bytes following this header.
+};
+
+struct flight_session {
+    _Atomic int perf_fd;        // -1 if the slot is free.
+    pid_t tid;
+    struct perf_event_mmap_page *hdr;
+    void *aux_buf;
+    size_t aux_size;
+};
+
+struct perf_pt_flight_table {
+    struct flight_session sessions[FLIGHT_MAX_SESSIONS];
+};
+
+static struct perf_pt_flight_table process_table;
+static _Atomic int flight_fd = -1;
+static _Atomic bool dumping;
+// The manifest. Replaced manifests are never freed, as a handler running on
+// another thread may still be writing them out.
+static const char *_Atomic manifest;
+static _Atomic size_t manifest_len;
+
+static pthread_once_t sessions_once = PTHREAD_ONCE_INIT;
+
+static void
+init_table(struct perf_pt_flight_table *table)
+{
+    for (int i = 0; i < FLIGHT_MAX_SESSIONS; i++) {
+        atomic_store(&table->sessions[i].perf_fd, -1);
+    }
+}
+
+static void
+init_process_table(void)
+{
+    init_table(&process_table);
+}
+
+static const int flight_signals[] = {SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT};
+#define FLIGHT_NSIGNALS (sizeof(flight_signals) / sizeof(flight_signals[0]))
+static struct sigaction old_actions[FLIGHT_NSIGNALS];
+
+bool perf_pt_flight_install(int, const char *, size_t, struct perf_pt_cerror *);
+void perf_pt_flight_uninstall(void);
+bool perf_pt_flight_dump(void);
+struct perf_pt_flight_table *perf_pt_flight_table_new(void);
+void perf_pt_flight_table_free(struct perf_pt_flight_table *);
+int perf_pt_flight_register_in(struct perf_pt_flight_table *, int,
+                               struct perf_event_mmap_page *, void *, size_t);
+void perf_pt_flight_unregister_in(struct perf_pt_flight_table *, int);
+bool perf_pt_flight_dump_in(struct perf_pt_flight_table *);
+
+/*
+ * Write all of `buf`, retrying after short writes. Async-signal-safe.
+ */
+static bool
+write_all(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+/*
+ * Write the ring `buf` of `size` bytes, into which `head` bytes have been
+ * written, oldest byte first. Async-signal-safe.
+ */
+static bool
+write_ring(int fd, enum flight_kind kind, uint32_t tid, const char *buf,
+           uint64_t size, uint64_t head)
+{
+    uint64_t len = (head < size) ? head : size;
+    struct flight_section sec = {kind, tid, head, len};
+    if (!write_all(fd, &sec, sizeof(sec))) {
+        return false;
+    }
+    uint64_t start = head % size;
+    if (head < size) {
+        return write_all(fd, buf, head);
+    }
+    return write_all(fd, buf + start, size - start) && write_all(fd, buf, start);
+}
+
+/*
+ * Write the flight record of the process's sessions. Returns false if there is
+ * no flight record file, another thread is writing it, or writing failed.
+ * Async-signal-safe.
+ */
+bool
+perf_pt_flight_dump(void)
+{
+    return perf_pt_flight_dump_in(&process_table);
+}
+
+/*
+ * Like perf_pt_flight_dump(), but write the sessions of `table`.
+ */
+bool
+perf_pt_flight_dump_in(struct perf_pt_flight_table *table)
+{
+    struct flight_session *sessions = table->sessions;
+    int fd = atomic_load(&flight_fd);
+    if ((fd == -1) || atomic_exchange(&dumping, true)) {
+        return false;
+    }
+
+    // Stop every ring first, so that they all end at about the same time.
+    for (int i = 0; i < FLIGHT_MAX_SESSIONS; i++) {
+        int perf_fd = atomic_load(&sessions[i].perf_fd);
+        if (perf_fd >= 0) {
+            ioctl(perf_fd, PERF_EVENT_IOC_DISABLE, 0);
+        }
+    }
+
+    bool ok = write_all(fd, FLIGHT_MAGIC, strlen(FLIGHT_MAGIC));
+    for (int i = 0; ok && (i < FLIGHT_MAX_SESSIONS); i++) {
+        struct flight_session *s = &sessions[i];
+        if (atomic_load(&s->perf_fd) < 0) {
+            continue; // Free, or being claimed.
+        }
+        struct perf_event_mmap_page *hdr = s->hdr;
+        uint64_t aux_head = atomic_load_explicit((_Atomic __u64 *) &hdr->aux_head,
+                                                 memory_order_acquire);
+        uint64_t data_head = atomic_load_explicit((_Atomic __u64 *) &hdr->data_head,
+                                                  memory_order_acquire);
+        ok = write_ring(fd, flight_kind_aux, s->tid, s->aux_buf, s->aux_size, aux_head) &&
+             write_ring(fd, flight_kind_data, s->tid, (char *) hdr + hdr->data_offset,
+                        hdr->data_size, data_head);
+    }
+    const char *m = atomic_load(&manifest);
+    if (ok && (m != NULL)) {
+        struct flight_section sec = {flight_kind_manifest, 0, 0, atomic_load(&manifest_len)};
+        ok = write_all(fd, &sec, sizeof(sec)) && write_all(fd, m, sec.len);
+    }
+    if (ok) {
+        fsync(fd);
+    }
+    return ok;
+}
+
+static void
+flight_handler(int sig, siginfo_t *info, void *uctx)
+{
+    (void) info;
+    (void) uctx;
+    int saved_errno = errno;
+    perf_pt_flight_dump();
+
+    // Let the previous handler (or the default action) deal with the signal.
+    for (size_t i = 0; i < FLIGHT_NSIGNALS; i++) {
+        if (flight_signals[i] == sig) {
+            sigaction(sig, &old_actions[i], NULL);
+        }
+    }
+    errno = saved_errno;
+    raise(sig);
+}
+
+/*
+ * Install the flight recorder, which writes to `fd` (which it takes ownership
+ * of). `manifest` (which is copied) describes the code image.
+ *
+ * Returns true on success or false otherwise.
+ */
+bool
+perf_pt_flight_install(int fd, const char *new_manifest, size_t len,
+                       struct perf_pt_cerror *err)
+{
+    char *copy = malloc(len + 1);
+    if (copy == NULL) {
+        perf_pt_set_err(err, perf_pt_cerror_errno, errno);
+        return false;
+    }
+    memcpy(copy, new_manifest, len);
+    copy[len] = '\0';
+    atomic_store(&manifest_len, len);
+    atomic_store(&manifest, copy);
+
+    pthread_once(&sessions_once, init_process_table);
+    int old_fd = atomic_exchange(&flight_fd, fd);
+    if (old_fd != -1) {
+        // Already installed: just switch files.
+        close(old_fd);
+        atomic_store(&dumping, false);
+        return true;
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = flight_handler;
+    sa.sa_flags = SA_SIGINFO | SA_ONSTACK;
+    sigfillset(&sa.sa_mask);
+    for (size_t i = 0; i < FLIGHT_NSIGNALS; i++) {
+        if (sigaction(flight_signals[i], &sa, &old_actions[i]) == -1) {
+            perf_pt_set_err(err, perf_pt_cerror_errno, errno);
+            while (i-- > 0) {
+                sigaction(flight_signals[i], &old_actions[i], NULL);
+            }
+            atomic_store(&flight_fd, -1);
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Remove the flight recorder's signal handlers and close its file.
+ */
+void
+perf_pt_flight_uninstall(void)
+{
+    int fd = atomic_exchange(&flight_fd, -1);
+    if (fd == -1) {
+        return;
+    }
+    for (size_t i = 0; i < FLIGHT_NSIGNALS; i++) {
+        sigaction(flight_signals[i], &old_actions[i], NULL);
+    }
+    close(fd);
+    atomic_store(&dumping, false);
+}
+
+/*
+ * Make an empty session table for a test, to be freed with
+ * perf_pt_flight_table_free(). Returns NULL if memory can't be allocated.
+ */
+struct perf_pt_flight_table *
+perf_pt_flight_table_new(void)
+{
+    struct perf_pt_flight_table *table = malloc(sizeof(*table));
+    if (table != NULL) {
+        init_table(table);
+    }
+    return table;
+}
+
+void
+perf_pt_flight_table_free(struct perf_pt_flight_table *table)
+{
+    free(table);
+}
+
+/*
+ * Record the session with the given buffers, if the flight recorder is
+ * installed. Returns the slot to pass to perf_pt_flight_unregister(), or -1.
+ */
+int
+perf_pt_flight_register(int perf_fd, struct perf_event_mmap_page *hdr,
+                        void *aux_buf, size_t aux_size)
+{
+    if (atomic_load_explicit(&flight_fd, memory_order_relaxed) == -1) {
+        return -1;
+    }
+    return perf_pt_flight_register_in(&process_table, perf_fd, hdr, aux_buf,
+                                      aux_size);
+}
+
+/*
+ * Like perf_pt_flight_register(), but record the session in `table` (whether
+ * or not the flight recorder is installed).
+ */
+int
+perf_pt_flight_register_in(struct perf_pt_flight_table *table, int perf_fd,
+                           struct perf_event_mmap_page *hdr, void *aux_buf,
+                           size_t aux_size)
+{
+    for (int i = 0; i < FLIGHT_MAX_SESSIONS; i++) {
+        struct flight_session *s = &table->sessions[i];
+        int expected = -1;
+        // Claim the slot with an invalid fd, so that a dump skips it until
+        // it is filled in.
+        if (atomic_compare_exchange_strong(&s->perf_fd, &expected, -2)) {
+            s->tid = syscall(SYS_gettid);
+            s->hdr = hdr;
+            s->aux_buf = aux_buf;
+            s->aux_size = aux_size;
+            atomic_store(&s->perf_fd, perf_fd);
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Stop recording the session in `slot`. Must be called before its buffers are
+ * unmapped.
+ */
+void
+perf_pt_flight_unregister(int slot)
+{
+    perf_pt_flight_unregister_in(&process_table, slot);
+}
+
+void
+perf_pt_flight_unregister_in(struct perf_pt_flight_table *table, int slot)
+{
+    if (slot != -1) {
+        atomic_store(&table->sessions[slot].perf_fd, -1);
+    }
+}
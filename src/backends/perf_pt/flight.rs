@@ -0,0 +1,248 @@
+//! The crash flight recorder.
+//!
+//! Once `FlightRecorder::install()` has been called, a fatal signal makes the perf_pt backend
+//! write the whole of every tracing session's perf ring buffers (or as much as has been written
+//! to them, if they haven't yet wrapped around) to a file, oldest byte first, using only
+//! async-signal-safe calls (see `flight.c`). Whether or not the collector has already read it,
+//! the rings hold the end of each trace, so the file shows what the crashing threads did last. `FlightRecord::read()` reads the file back, and
+//! `FlightSession::trace()` turns a session into a trace which can be decoded offline.
+
+use super::offline::next_psb;
+use super::{perf_pt_flight_install, perf_pt_flight_uninstall, PerfPTCError};
+use super::{ImageSection, PerfPTRawTrace};
+use crate::errors::HWTracerError;
+use std::ffi::OsString;
+use std::fs::{self, OpenOptions};
+use std::io;
+use std::os::unix::fs::OpenOptionsExt;
+use std::os::unix::io::IntoRawFd;
+use std::path::{Path, PathBuf};
+
+// Must stay in sync with the C code.
+const FLIGHT_MAGIC: &[u8] = b"hwtracer-flight1";
+const FLIGHT_KIND_AUX: u32 = 1;
+const FLIGHT_KIND_DATA: u32 = 2;
+const FLIGHT_KIND_MANIFEST: u32 = 3;
+const FLIGHT_SECTION_SIZE: usize = 24;
+
+/// Installs and removes the crash flight recorder.
+pub struct FlightRecorder;
+
+impl FlightRecorder {
+    /// Installs handlers for `SIGSEGV`, `SIGBUS`, `SIGILL`, `SIGFPE` and `SIGABRT` which write
+    /// the perf buffers of every tracing session started from now on to `path` (which is created
+    /// or truncated now), before passing the signal on to the previous handler.
+    ///
+    /// The code image of the process is described in the record as it is now, and the VDSO's code
+    /// is written to `path` with `.vdso` appended. Install again (with a fresh `path`) after
+    /// loading code which should appear in the image.
+    ///
+    /// For crashes caused by stack overflows, threads need an alternate signal stack (see
+    /// `sigaltstack(2)`).
+    pub fn install<P: AsRef<Path>>(path: P) -> Result<(), HWTracerError> {
+        let path = path.as_ref();
+        let mut vdso_path = OsString::from(path);
+        vdso_path.push(".vdso");
+        let mut manifest = String::new();
+        for sec in ImageSection::current_process(PathBuf::from(vdso_path))? {
+            manifest.push_str(&sec.to_raw());
+            manifest.push('\n');
+        }
+        let fd = OpenOptions::new()
+            .write(true)
+            .create(true)
+            .truncate(true)
+            .custom_flags(libc::O_CLOEXEC)
+            .open(path)?
+            .into_raw_fd();
+        let mut cerr = PerfPTCError::new();
+        if !unsafe {
+            perf_pt_flight_install(fd, manifest.as_ptr() as *const _, manifest.len(), &mut cerr)
+        } {
+            unsafe { libc::close(fd) };
+            return Err(cerr.into());
+        }
+        Ok(())
+    }
+
+    /// Removes the signal handlers and closes the record file. Sessions which are already
+    /// running stay registered, but nothing is written for them.
+    pub fn uninstall() {
+        unsafe { perf_pt_flight_uninstall() };
+    }
+}
+
+/// The contents of a tracing session's perf buffers at the time of a crash.
+#[derive(Debug)]
+pub struct FlightSession {
+    /// The traced thread.
+    pub tid: u32,
+    /// Bytes written to the AUX buffer since the session started.
+    pub aux_head: u64,
+    /// The AUX buffer (i.e. the end of the trace), oldest byte first.
+    pub aux: Vec<u8>,
+    /// Bytes written to the data buffer since the session started.
+    pub data_head: u64,
+    /// The data buffer (perf records), oldest byte first.
+    pub data: Vec<u8>,
+}
+
+impl FlightSession {
+    /// Returns the end of the session's trace, from the first PSB packet in the AUX buffer on,
+    /// to be decoded against `image`.
+    pub fn trace(&self, image: Vec<ImageSection>) -> Result<PerfPTRawTrace, HWTracerError> {
+        match next_psb(&self.aux, 0) {
+            Some(off) => PerfPTRawTrace::new(&self.aux[off..], image),
+            None => Err(invalid("no PSB packet in the AUX buffer")),
+        }
+    }
+}
+
+/// A flight record written by a crashing process.
+#[derive(Debug)]
+pub struct FlightRecord {
+    /// The sessions which were running.
+    pub sessions: Vec<FlightSession>,
+    /// The code image of the process when the flight recorder was installed.
+    pub image: Vec<ImageSection>,
+}
+
+impl FlightRecord {
+    /// Reads the flight record at `path`.
+    pub fn read<P: AsRef<Path>>(path: P) -> Result<Self, HWTracerError> {
+        let buf = fs::read(path)?;
+        if !buf.starts_with(FLIGHT_MAGIC) {
+            return Err(invalid("not a flight record"));
+        }
+        let mut rec = FlightRecord {
+            sessions: Vec::new(),
+            image: Vec::new(),
+        };
+        let mut off = FLIGHT_MAGIC.len();
+        while off < buf.len() {
+            if buf.len() - off < FLIGHT_SECTION_SIZE {
+                return Err(invalid("truncated section header"));
+            }
+            let word = |i: usize| {
+                let mut b = [0; 8];
+                b.copy_from_slice(&buf[off + i..off + i + 8]);
+                u64::from_le_bytes(b)
+            };
+            let (kind, tid) = (word(0) as u32, (word(0) >> 32) as u32);
+            let (head, len) = (word(8), word(16) as usize);
+            off += FLIGHT_SECTION_SIZE;
+            if buf.len() - off < len {
+                return Err(invalid("truncated section"));
+            }
+            let payload = &buf[off..off + len];
+            off += len;
+            match kind {
+                FLIGHT_KIND_AUX => rec.sessions.push(FlightSession {
+                    tid,
+                    aux_head: head,
+                    aux: payload.to_vec(),
+                    data_head: 0,
+                    data: Vec::new(),
+                }),
+                FLIGHT_KIND_DATA => match rec.sessions.last_mut() {
+                    Some(s) if s.tid == tid => {
+                        s.data_head = head;
+                        s.data = payload.to_vec();
+                    }
+                    _ => return Err(invalid("data buffer without an AUX buffer")),
+                },
+                FLIGHT_KIND_MANIFEST => {
+                    let text = String::from_utf8_lossy(payload);
+                    for line in text.lines().filter(|l| !l.is_empty()) {
+                        rec.image.push(ImageSection::parse_raw(line)?);
+                    }
+                }
+                _ => return Err(invalid("unknown section kind")),
+            }
+        }
+        Ok(rec)
+    }
+}
+
+fn invalid(msg: &str) -> HWTracerError {
+    HWTracerError::Custom(Box::new(io::Error::new(io::ErrorKind::InvalidData, msg)))
+}
+
+#[cfg(test)]
+mod tests {
+    use super::super::{
+        perf_pt_flight_dump_in, perf_pt_flight_register_in, perf_pt_flight_table_free,
+        perf_pt_flight_table_new, perf_pt_flight_unregister_in,
+    };
+    use super::{FlightRecord, FlightRecorder, ImageSection};
+    use std::fs::{self, File};
+    use std::os::unix::io::AsRawFd;
+    use tempfile::TempDir;
+
+    // Offsets of fields of `struct perf_event_mmap_page`.
+    const DATA_HEAD: usize = 1024;
+    const DATA_OFFSET: usize = 1040;
+    const DATA_SIZE: usize = 1048;
+    const AUX_HEAD: usize = 1056;
+
+    // Check the rings of a (fake) session and the image are written, and read back in order. The
+    // session is kept in a table of its own, as dumping the process's table would disable the real
+    // sessions of tests running in parallel.
+    #[test]
+    fn test_flight_record() {
+        let dir = TempDir::new().unwrap();
+        let path = dir.path().join("crash.flight");
+        FlightRecorder::install(&path).unwrap();
+
+        // A header page followed by a 256 byte data ring, which has wrapped.
+        let mut base = vec![0u64; (4096 + 256) / 8];
+        let set = |base: &mut Vec<u64>, off: usize, v: u64| base[off / 8] = v;
+        set(&mut base, DATA_OFFSET, 4096);
+        set(&mut base, DATA_SIZE, 256);
+        set(&mut base, DATA_HEAD, 256 + 16);
+        set(&mut base, AUX_HEAD, 100);
+        let data: Vec<u8> = (0..=255).collect();
+        let base_bytes = base.as_mut_ptr() as *mut u8;
+        unsafe { std::ptr::copy_nonoverlapping(data.as_ptr(), base_bytes.add(4096), 256) };
+        // An AUX ring which hasn't wrapped.
+        let mut aux: Vec<u8> = (0..200).map(|i| i as u8).collect();
+
+        let fake_fd = File::open("/dev/null").unwrap();
+        let table = unsafe { perf_pt_flight_table_new() };
+        assert!(!table.is_null());
+        let slot = unsafe {
+            perf_pt_flight_register_in(
+                table,
+                fake_fd.as_raw_fd(),
+                base_bytes as *mut _,
+                aux.as_mut_ptr() as *mut _,
+                aux.len(),
+            )
+        };
+        assert_ne!(slot, -1);
+        assert!(unsafe { perf_pt_flight_dump_in(table) });
+        // Only one dump is written.
+        assert!(!unsafe { perf_pt_flight_dump_in(table) });
+        unsafe {
+            perf_pt_flight_unregister_in(table, slot);
+            perf_pt_flight_table_free(table);
+        }
+        FlightRecorder::uninstall();
+
+        let rec = FlightRecord::read(&path).unwrap();
+        assert_eq!(rec.sessions.len(), 1);
+        let s = &rec.sessions[0];
+        assert_eq!(s.tid, unsafe { libc::syscall(libc::SYS_gettid) } as u32);
+        assert_eq!(s.aux_head, 100);
+        assert_eq!(s.aux, &aux[..100]);
+        assert_eq!(s.data_head, 256 + 16);
+        assert_eq!(&s.data[..240], &data[16..]);
+        assert_eq!(&s.data[240..], &data[..16]);
+        assert!(s.trace(rec.image.clone()).is_err()); // No PSB.
+        let vdso = dir.path().join("crash.flight.vdso");
+        assert_eq!(rec.image, ImageSection::current_process(vdso).unwrap());
+
+        fs::write(&path, b"junk").unwrap();
+        assert!(FlightRecord::read(&path).is_err());
+    }
+}
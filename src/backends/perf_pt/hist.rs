@@ -0,0 +1,384 @@
+//! Process-wide latency histograms.
+//!
+//! The C code records how long starting and stopping a tracer, draining the perf buffers after a
+//! collector wakeup, decoding up to a trace's first block, and queueing for busy tracing hardware
+//! take. `LatencyHistograms::snapshot()`
+//! copies the histograms out, after which they can be queried or dumped (e.g. for a Prometheus
+//! textfile collector).
+
+use super::perf_pt_hist_snapshot;
+use crate::errors::HWTracerError;
+use std::fmt::Write as _;
+use std::io::{self, Write};
+use std::path::Path;
+use std::time::Duration;
+
+// The bucket layout. Must stay in sync with the C code.
+const SUB_BITS: u32 = 3;
+const SUB: u64 = 1 << SUB_BITS;
+const BUCKETS: usize = ((64 - SUB_BITS + 1) as u64 * SUB) as usize;
+
+// The largest power of two (in nanoseconds) given its own bucket in Prometheus output (~69s).
+const PROMETHEUS_MAX_POW: u32 = 36;
+// The smallest (1.024us).
+const PROMETHEUS_MIN_POW: u32 = 10;
+
+/// Identifies a histogram.
+///
+/// Shared with C code. Must stay in sync.
+#[repr(C)]
+#[derive(Clone, Copy, Debug)]
+pub(super) enum PerfPTCHistKind {
+    Start,
+    Stop,
+    Drain,
+    DecodeTTFB,
+    OpenWait,
+}
+
+/// A histogram as stored by C.
+///
+/// Shared with C code. Must stay in sync.
+#[repr(C)]
+pub(super) struct PerfPTCHist {
+    count: u64,
+    sum: u64,
+    max: u64,
+    buckets: [u64; BUCKETS],
+}
+
+/// Returns the smallest and largest values (inclusive) which fall into bucket `idx`.
+fn bucket_bounds(idx: usize) -> (u64, u64) {
+    let idx = idx as u64;
+    if idx < SUB {
+        return (idx, idx);
+    }
+    let shift = idx / SUB - 1;
+    let lower = (SUB + idx % SUB) << shift;
+    (lower, lower + ((1 << shift) - 1))
+}
+
+/// A snapshot of a latency histogram. Values are in nanoseconds.
+#[derive(Clone, Debug)]
+pub struct LatencyHistogram {
+    count: u64,
+    sum: u64,
+    max: u64,
+    buckets: Vec<u64>,
+}
+
+impl LatencyHistogram {
+    fn snapshot(kind: PerfPTCHistKind) -> Self {
+        let mut chist = PerfPTCHist {
+            count: 0,
+            sum: 0,
+            max: 0,
+            buckets: [0; BUCKETS],
+        };
+        unsafe { perf_pt_hist_snapshot(kind, &mut chist) };
+        Self {
+            count: chist.count,
+            sum: chist.sum,
+            max: chist.max,
+            buckets: chist.buckets.to_vec(),
+        }
+    }
+
+    /// How many values have been recorded.
+    pub fn count(&self) -> u64 {
+        self.count
+    }
+
+    /// The sum of the recorded values.
+    pub fn sum(&self) -> Duration {
+        Duration::from_nanos(self.sum)
+    }
+
+    /// The largest recorded value.
+    pub fn max(&self) -> Duration {
+        Duration::from_nanos(self.max)
+    }
+
+    /// Returns an upper bound of the `p`th percentile (0 <= `p` <= 100) of the recorded values,
+    /// accurate to within 12.5%, or zero if no values have been recorded.
+    pub fn percentile(&self, p: f64) -> Duration {
+        let total = self.buckets.iter().sum::<u64>();
+        if total == 0 {
+            return Duration::from_secs(0);
+        }
+        let rank = ((p / 100.0 * total as f64).ceil() as u64).max(1);
+        let mut seen = 0;
+        for (i, n) in self.buckets.iter().enumerate() {
+            seen += n;
+            if seen >= rank {
+                return Duration::from_nanos(bucket_bounds(i).1.min(self.max));
+            }
+        }
+        Duration::from_nanos(self.max)
+    }
+
+    /// Returns a histogram of the values recorded between the snapshots `earlier` and `self`.
+    /// Since the maximum can't be recovered, `max()` of the result is that of `self`.
+    pub fn since(&self, earlier: &LatencyHistogram) -> LatencyHistogram {
+        Self {
+            count: self.count.saturating_sub(earlier.count),
+            sum: self.sum.saturating_sub(earlier.sum),
+            max: self.max,
+            buckets: self
+                .buckets
+                .iter()
+                .zip(&earlier.buckets)
+                .map(|(n, e)| n.saturating_sub(*e))
+                .collect(),
+        }
+    }
+
+    /// Iterates over the non-empty buckets as `(lowest value, highest value, count)`.
+    pub fn buckets(&self) -> impl Iterator<Item = (u64, u64, u64)> + '_ {
+        self.buckets
+            .iter()
+            .enumerate()
+            .filter(|(_, &n)| n > 0)
+            .map(|(i, &n)| {
+                let (lo, hi) = bucket_bounds(i);
+                (lo, hi, n)
+            })
+    }
+
+    // Returns how many recorded values are at most `v`. `v` must be a bucket's upper bound.
+    fn count_at_most(&self, v: u64) -> u64 {
+        self.buckets()
+            .take_while(|&(_, hi, _)| hi <= v)
+            .map(|(_, _, n)| n)
+            .sum()
+    }
+}
+
+/// The format of a histogram dump.
+#[derive(Clone, Copy, Debug, Eq, PartialEq)]
+pub enum HistogramFormat {
+    /// The Prometheus text exposition format.
+    Prometheus,
+    /// A JSON object with one member per histogram.
+    Json,
+}
+
+/// Snapshots of all of the latency histograms.
+#[derive(Clone, Debug)]
+pub struct LatencyHistograms {
+    /// Starting a tracer (`perf_pt_start_tracer()`).
+    pub start: LatencyHistogram,
+    /// Stopping a tracer (`perf_pt_stop_tracer()`), including draining the buffers.
+    pub stop: LatencyHistogram,
+    /// From a collector waking up until it has drained the perf buffers.
+    pub drain: LatencyHistogram,
+    /// From starting to decode a trace until its first block is decoded.
+    pub decode_ttfb: LatencyHistogram,
+    /// Time spent queueing for the tracing hardware when it was busy (uncontended opens aren't
+    /// recorded).
+    pub open_wait: LatencyHistogram,
+}
+
+impl LatencyHistograms {
+    /// Takes a snapshot of the histograms, which cover every tracer and trace in the process.
+    pub fn snapshot() -> Self {
+        Self {
+            start: LatencyHistogram::snapshot(PerfPTCHistKind::Start),
+            stop: LatencyHistogram::snapshot(PerfPTCHistKind::Stop),
+            drain: LatencyHistogram::snapshot(PerfPTCHistKind::Drain),
+            decode_ttfb: LatencyHistogram::snapshot(PerfPTCHistKind::DecodeTTFB),
+            open_wait: LatencyHistogram::snapshot(PerfPTCHistKind::OpenWait),
+        }
+    }
+
+    fn iter(&self) -> impl Iterator<Item = (&'static str, &LatencyHistogram)> {
+        vec![
+            ("start", &self.start),
+            ("stop", &self.stop),
+            ("drain", &self.drain),
+            ("decode_ttfb", &self.decode_ttfb),
+            ("open_wait", &self.open_wait),
+        ]
+        .into_iter()
+    }
+
+    /// Formats the histograms in the Prometheus text format, as `hwtracer_perf_pt_<name>_seconds`
+    /// histograms. Bucket bounds are one nanosecond below powers of two (e.g. `le="0.000004095"`
+    /// counts the values of at most 4095ns), since those are bounds of the underlying buckets,
+    /// and so the counts are exact. The bucket set is the same in every dump.
+    pub fn to_prometheus(&self) -> String {
+        let mut out = String::new();
+        for (name, hist) in self.iter() {
+            let metric = format!("hwtracer_perf_pt_{}_seconds", name);
+            writeln!(out, "# TYPE {} histogram", metric).unwrap();
+            for pow in PROMETHEUS_MIN_POW..=PROMETHEUS_MAX_POW {
+                let le = (1u64 << pow) - 1;
+                writeln!(
+                    out,
+                    "{}_bucket{{le=\"{}\"}} {}",
+                    metric,
+                    le as f64 / 1e9,
+                    hist.count_at_most(le)
+                )
+                .unwrap();
+            }
+            writeln!(out, "{}_bucket{{le=\"+Inf\"}} {}", metric, hist.count).unwrap();
+            writeln!(out, "{}_sum {}", metric, hist.sum as f64 / 1e9).unwrap();
+            writeln!(out, "{}_count {}", metric, hist.count).unwrap();
+        }
+        out
+    }
+
+    /// Formats the histograms as a JSON object. Times are in nanoseconds and only non-empty
+    /// buckets are included.
+    pub fn to_json(&self) -> String {
+        let mut out = String::from("{");
+        for (i, (name, hist)) in self.iter().enumerate() {
+            if i > 0 {
+                out.push(',');
+            }
+            write!(
+                out,
+                "\"{}\":{{\"count\":{},\"sum_ns\":{},\"max_ns\":{}",
+                name, hist.count, hist.sum, hist.max
+            )
+            .unwrap();
+            for &(label, p) in &[("p50", 50.0), ("p90", 90.0), ("p99", 99.0), ("p999", 99.9)] {
+                write!(out, ",\"{}_ns\":{}", label, hist.percentile(p).as_nanos()).unwrap();
+            }
+            out.push_str(",\"buckets\":[");
+            for (j, (lo, hi, n)) in hist.buckets().enumerate() {
+                if j > 0 {
+                    out.push(',');
+                }
+                write!(out, "[{},{},{}]", lo, hi, n).unwrap();
+            }
+            out.push_str("]}");
+        }
+        out.push('}');
+        out
+    }
+
+    /// Writes the histograms to `path` in the format `fmt`.
+    ///
+    /// The file is replaced atomically, so a concurrent reader (e.g. a metrics scraper) never
+    /// sees a partial dump.
+    pub fn dump<P: AsRef<Path>>(&self, path: P, fmt: HistogramFormat) -> Result<(), HWTracerError> {
+        let path = path.as_ref();
+        let text = match fmt {
+            HistogramFormat::Prometheus => self.to_prometheus(),
+            HistogramFormat::Json => self.to_json(),
+        };
+        let dir = match path.parent() {
+            Some(d) if d != Path::new("") => d,
+            _ => Path::new("."),
+        };
+        let mut tmp = tempfile::NamedTempFile::new_in(dir)?;
+        tmp.write_all(text.as_bytes())?;
+        tmp.persist(path)
+            .map_err(|e| HWTracerError::from(io::Error::from(e)))?;
+        Ok(())
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::{bucket_bounds, LatencyHistogram, LatencyHistograms, BUCKETS, SUB};
+    use crate::backends::perf_pt::perf_pt_hist_bucket;
+    use std::time::Duration;
+
+    fn hist(values: &[u64]) -> LatencyHistogram {
+        let mut buckets = vec![0; BUCKETS];
+        for &v in values {
+            buckets[unsafe { perf_pt_hist_bucket(v) } as usize] += 1;
+        }
+        LatencyHistogram {
+            count: values.len() as u64,
+            sum: values.iter().sum(),
+            max: values.iter().cloned().max().unwrap_or(0),
+            buckets,
+        }
+    }
+
+    // Check that the Rust bucket bounds agree with the C bucket indices.
+    #[test]
+    fn test_buckets() {
+        let mut prev_hi = None;
+        for i in 0..BUCKETS {
+            let (lo, hi) = bucket_bounds(i);
+            assert!(lo <= hi);
+            if let Some(p) = prev_hi {
+                assert_eq!(lo, p + 1);
+            }
+            prev_hi = Some(hi);
+            for &v in &[lo, hi, lo + (hi - lo) / 2] {
+                assert_eq!(unsafe { perf_pt_hist_bucket(v) } as usize, i, "value {}", v);
+            }
+            // Relative error.
+            assert!((hi - lo) as f64 <= lo as f64 / SUB as f64);
+        }
+        assert_eq!(prev_hi, Some(u64::max_value()));
+    }
+
+    #[test]
+    fn test_percentile() {
+        let h = hist(&[]);
+        assert_eq!(h.percentile(50.0), Duration::from_secs(0));
+
+        let values = (1..=1000).map(|v| v * 1000).collect::<Vec<u64>>();
+        let h = hist(&values);
+        for &(p, exact) in &[(50.0, 500_000), (99.0, 990_000), (100.0, 1_000_000)] {
+            let got = h.percentile(p).as_nanos() as u64;
+            assert!(got >= exact && got as f64 <= exact as f64 * 1.125, "p{}", p);
+        }
+        assert_eq!(h.max(), Duration::from_micros(1000));
+        assert_eq!(h.count_at_most((1 << 20) - 1), 1000);
+        assert_eq!(h.count_at_most((1 << 10) - 1), 1); // Just 1000.
+        assert_eq!(h.count_at_most((1 << 9) - 1), 0);
+
+        let later = hist(&values.iter().chain(&[5, 6]).cloned().collect::<Vec<_>>());
+        let diff = later.since(&h);
+        assert_eq!(diff.count(), 2);
+        assert_eq!(diff.sum(), Duration::from_nanos(11));
+        assert_eq!(diff.percentile(100.0), Duration::from_nanos(6));
+    }
+
+    #[test]
+    fn test_formats() {
+        let hists = LatencyHistograms {
+            start: hist(&[2000, 3000]),
+            stop: hist(&[]),
+            drain: hist(&[1 << 40]),
+            decode_ttfb: hist(&[5]),
+            open_wait: hist(&[4096]),
+        };
+        let prom = hists.to_prometheus();
+        assert!(prom.contains("# TYPE hwtracer_perf_pt_start_seconds histogram\n"));
+        assert!(prom.contains("hwtracer_perf_pt_start_seconds_bucket{le=\"0.000004095\"} 2\n"));
+        assert!(prom.contains("hwtracer_perf_pt_start_seconds_bucket{le=\"0.000002047\"} 1\n"));
+        // A value on a power of two falls into the bucket above it.
+        assert!(prom.contains("hwtracer_perf_pt_open_wait_seconds_bucket{le=\"0.000004095\"} 0\n"));
+        assert!(prom.contains("hwtracer_perf_pt_open_wait_seconds_bucket{le=\"0.000008191\"} 1\n"));
+        assert!(prom.contains("hwtracer_perf_pt_drain_seconds_bucket{le=\"+Inf\"} 1\n"));
+        assert!(prom.contains("hwtracer_perf_pt_start_seconds_sum 0.000005\n"));
+        assert!(prom.contains("hwtracer_perf_pt_stop_seconds_count 0\n"));
+
+        let json = hists.to_json();
+        assert!(json.starts_with("{\"start\":{\"count\":2,\"sum_ns\":5000,\"max_ns\":3000,"));
+        assert!(json.contains("\"decode_ttfb\":{\"count\":1,"));
+        assert!(json.contains("\"buckets\":[[5,5,1]]"));
+        assert!(json.ends_with("}}"));
+    }
+
+    #[test]
+    fn test_dump() {
+        let dir = tempfile::tempdir().unwrap();
+        let path = dir.path().join("hists.prom");
+        let hists = LatencyHistograms::snapshot();
+        hists
+            .dump(&path, super::HistogramFormat::Prometheus)
+            .unwrap();
+        let text = std::fs::read_to_string(&path).unwrap();
+        assert!(text.contains("hwtracer_perf_pt_decode_ttfb_seconds_count"));
+    }
+}
@@ -1,20 +1,77 @@
 use super::PerfPTConfig;
 use crate::errors::HWTracerError;
-use crate::{Block, ThreadTracer, Trace, Tracer, TracerState};
-use libc::{c_char, c_int, c_void, free, geteuid, malloc, size_t};
+use crate::{
+    Block, PendingTrace, SessionStatus, Stats, StoppingSession, ThreadTracer, Trace, Tracer,
+    TracerState,
+};
+use libc::{
+    c_char, c_int, c_void, free, geteuid, malloc, pid_t, sched_get_priority_max,
+    sched_get_priority_min, size_t, SCHED_FIFO,
+};
 use std::error::Error;
 use std::ffi::{self, CStr, CString};
 use std::fmt::{self, Display, Formatter};
 use std::fs::File;
 use std::io::{self, Read};
 use std::iter::Iterator;
+use std::mem;
 use std::num::ParseIntError;
 #[cfg(debug_assertions)]
 use std::ops::Drop;
-use std::os::unix::io::AsRawFd;
+use std::os::unix::ffi::OsStrExt;
+use std::os::unix::io::{AsRawFd, RawFd};
 use std::ptr;
+use std::slice;
+use std::sync::atomic::{AtomicU32, Ordering};
+use std::sync::{Arc, Mutex};
+use std::time::{Duration, Instant};
 use tempfile::NamedTempFile;
 
+mod adapt;
+use adapt::Outcome;
+pub use adapt::{forget_aux_bufsizes, learned_aux_bufsize};
+mod arbiter;
+pub use arbiter::ArbiterStats;
+mod budget;
+mod cache;
+use budget::BudgetKind;
+pub use budget::MemoryStats;
+pub use cache::{CacheKey, CachedBlocks, DecodeCache};
+mod copy;
+pub use copy::CopyMode;
+mod emu;
+use emu::PerfPTEmuStats;
+// The emulator is only public so that the benchmarks can use it: it isn't part of the API.
+#[doc(hidden)]
+pub use emu::{emu_pattern_byte, emulate_collection, EmuConfig, EmuRun};
+mod flight;
+pub use flight::{FlightRecord, FlightRecorder, FlightSession};
+mod hist;
+pub use hist::{HistogramFormat, LatencyHistogram, LatencyHistograms};
+use hist::{PerfPTCHist, PerfPTCHistKind};
+mod modules;
+pub use modules::{Module, ModuleAddr, ModuleBlock, ModuleId, ModuleMap};
+mod offline;
+use offline::PerfPTImageSection;
+mod pool;
+use pool::Pool;
+mod share;
+pub use share::{recv_trace, send_trace};
+mod stats;
+pub use offline::{build_id, next_psb, parse_num, psb_offsets, ImageSection, PerfPTRawTrace};
+use stats::PerfPTCDecoderStats;
+pub use stats::{CollectorStats, DecoderStats};
+mod symbols;
+pub use symbols::{Symbol, Symbolizer};
+mod synth;
+use synth::PerfPTSynthOut;
+pub use synth::{hash_blocks, SynthConfig, SynthTrace};
+
+// The values of the C code's `enum perf_pt_status`. Must stay in sync.
+const PERF_PT_STATUS_OK: u32 = 0;
+const PERF_PT_STATUS_OVERFLOW: u32 = 1;
+const PERF_PT_STATUS_TRUNCATED: u32 = 3;
+
 // The sysfs path used to set perf permissions.
 const PERF_PERMS_PATH: &str = "/proc/sys/kernel/perf_event_paranoid";
 
@@ -48,6 +105,7 @@ enum PerfPTCErrorKind {
     Unknown,
     Errno,
     IPT,
+    Timeout,
 }
 
 /// Represents an error occurring in the C code in this backend.
@@ -83,6 +141,9 @@ impl From<PerfPTCError> for HWTracerError {
                     false => HWTracerError::Custom(Box::new(LibIPTError(err.code))),
                 }
             }
+            PerfPTCErrorKind::Timeout => {
+                HWTracerError::SessionTimeout(Duration::from_millis(err.code as u64))
+            }
         }
     }
 }
@@ -90,14 +151,87 @@ impl From<PerfPTCError> for HWTracerError {
 // FFI prototypes.
 extern "C" {
     // collect.c
-    fn perf_pt_init_tracer(conf: *const PerfPTConfig, err: *mut PerfPTCError) -> *mut c_void;
+    fn perf_pt_init_tracer(
+        conf: *const PerfPTConfig,
+        tid: pid_t,
+        err: *mut PerfPTCError,
+    ) -> *mut c_void;
     fn perf_pt_start_tracer(
         tr_ctx: *mut c_void,
-        trace: *mut PerfPTTrace,
+        trace: *mut PerfPTCTrace,
         err: *mut PerfPTCError,
     ) -> bool;
     fn perf_pt_stop_tracer(tr_ctx: *mut c_void, err: *mut PerfPTCError) -> bool;
+    fn perf_pt_disable_tracer(tr_ctx: *mut c_void, err: *mut PerfPTCError) -> bool;
+    fn perf_pt_release_when_drained(tr_ctx: *mut c_void, err: *mut PerfPTCError) -> bool;
+    fn perf_pt_collector_done(tr_ctx: *mut c_void) -> bool;
+    fn perf_pt_join_tracer(tr_ctx: *mut c_void, err: *mut PerfPTCError) -> bool;
+    fn perf_pt_status_word(tr_ctx: *mut c_void) -> *const AtomicU32;
+    fn perf_pt_status_fd(tr_ctx: *mut c_void) -> c_int;
+    fn perf_pt_aux_bufsize(tr_ctx: *mut c_void) -> size_t;
     fn perf_pt_free_tracer(tr_ctx: *mut c_void, err: *mut PerfPTCError) -> bool;
+    fn perf_pt_get_phase_times(tr_ctx: *mut c_void, times: *mut PerfPTCPhaseTimes);
+    fn perf_pt_get_collector_stats(tr_ctx: *mut c_void, stats: *mut CollectorStats);
+    // arbiter.c
+    #[cfg(test)]
+    fn perf_pt_arbiter_new() -> *mut c_void;
+    #[cfg(test)]
+    fn perf_pt_arbiter_free(arbiter: *mut c_void);
+    #[cfg(test)]
+    fn perf_pt_arbiter_open_in(
+        arbiter: *mut c_void,
+        open_fn: extern "C" fn(*mut c_void) -> c_int,
+        arg: *mut c_void,
+        priority: c_int,
+        timeout_ns: u64,
+        waited_ns: *mut u64,
+        err: *mut PerfPTCError,
+    ) -> c_int;
+    #[cfg(test)]
+    fn perf_pt_arbiter_release_in(arbiter: *mut c_void);
+    fn perf_pt_get_arbiter_stats(stats: *mut ArbiterStats);
+    #[cfg(test)]
+    fn perf_pt_get_arbiter_stats_in(arbiter: *mut c_void, stats: *mut ArbiterStats);
+    // flight.c
+    fn perf_pt_flight_install(
+        fd: c_int,
+        manifest: *const c_char,
+        len: size_t,
+        err: *mut PerfPTCError,
+    ) -> bool;
+    fn perf_pt_flight_uninstall();
+    #[cfg(test)]
+    fn perf_pt_flight_table_new() -> *mut c_void;
+    #[cfg(test)]
+    fn perf_pt_flight_table_free(table: *mut c_void);
+    #[cfg(test)]
+    fn perf_pt_flight_dump_in(table: *mut c_void) -> bool;
+    #[cfg(test)]
+    fn perf_pt_flight_register_in(
+        table: *mut c_void,
+        perf_fd: c_int,
+        hdr: *mut c_void,
+        aux_buf: *mut c_void,
+        aux_size: size_t,
+    ) -> c_int;
+    #[cfg(test)]
+    fn perf_pt_flight_unregister_in(table: *mut c_void, slot: c_int);
+    // budget.c
+    fn perf_pt_budget_reserve(kind: BudgetKind, bytes: u64, limit: u64) -> bool;
+    fn perf_pt_budget_release(kind: BudgetKind, bytes: u64);
+    fn perf_pt_get_budget_stats(stats: *mut MemoryStats);
+    // copy.c
+    fn perf_pt_copy_supported(mode: CopyMode) -> bool;
+    fn perf_pt_set_copy_mode(mode: CopyMode) -> bool;
+    fn perf_pt_copy_with(mode: CopyMode, dst: *mut c_void, src: *const c_void, len: usize);
+    // emu.c
+    fn perf_pt_emu_run(
+        conf: *const EmuConfig,
+        trace: *mut PerfPTCTrace,
+        stats: *mut PerfPTEmuStats,
+        err: *mut PerfPTCError,
+    ) -> bool;
+    fn perf_pt_emu_pattern_byte(off: u64, seed: u64) -> u8;
     // decode.c
     fn perf_pt_init_block_decoder(
         buf: *const c_void,
@@ -107,16 +241,38 @@ extern "C" {
         decoder_status: *mut c_int,
         err: *mut PerfPTCError,
     ) -> *mut c_void;
+    fn perf_pt_init_raw_block_decoder(
+        buf: *const c_void,
+        len: u64,
+        sections: *const PerfPTImageSection,
+        nsections: size_t,
+        decoder_status: *mut c_int,
+        err: *mut PerfPTCError,
+    ) -> *mut c_void;
     fn perf_pt_next_block(
         decoder: *mut c_void,
         decoder_status: *mut c_int,
         addr: *mut u64,
         len: *mut u64,
+        stats: *mut PerfPTCDecoderStats,
         err: *mut PerfPTCError,
     ) -> bool;
+    fn perf_pt_event_name(typ: c_int) -> *const c_char;
     fn perf_pt_free_block_decoder(decoder: *mut c_void);
+    // synth.c
+    fn perf_pt_synth(
+        conf: *const SynthConfig,
+        out: *mut PerfPTSynthOut,
+        err: *mut PerfPTCError,
+    ) -> bool;
+    fn perf_pt_synth_free(out: *mut PerfPTSynthOut);
+    fn perf_pt_synth_hash_block(hash: u64, addr: u64) -> u64;
     // util.c
     fn perf_pt_is_overflow_err(err: c_int) -> bool;
+    #[cfg(test)]
+    fn perf_pt_hist_bucket(val: u64) -> c_int;
+    fn perf_pt_hist_record(kind: PerfPTCHistKind, val: u64);
+    fn perf_pt_hist_snapshot(kind: PerfPTCHistKind, hist: *mut PerfPTCHist);
     // libipt
     fn pt_errstr(error_code: c_int) -> *const c_char;
 }
@@ -128,7 +284,14 @@ struct PerfPTBlockIterator<'t> {
     #[allow(dead_code)] // Rust doesn't know that this exists only to keep the file long enough.
     vdso_tempfile: Option<NamedTempFile>, // VDSO code stored temporarily.
     trace: &'t PerfPTTrace, // The trace we are iterating.
-    errored: bool,         // Set to true when an error occurs, thus invalidating the iterator.
+    // The code to decode against, or `None` to use the code of the current process.
+    image: Option<&'t [ImageSection]>,
+    errored: bool, // Set to true when an error occurs, thus invalidating the iterator.
+    // Statistics, merged into the trace's when decoding ends.
+    stats: DecoderStats,
+    cstats: PerfPTCDecoderStats,
+    // When decoding started, or `None` if it hasn't started or has already finished.
+    started: Option<Instant>,
 }
 
 impl From<io::Error> for HWTracerError {
@@ -150,8 +313,33 @@ impl From<ParseIntError> for HWTracerError {
 }
 
 impl<'t> PerfPTBlockIterator<'t> {
+    fn new(trace: &'t PerfPTTrace, image: Option<&'t [ImageSection]>) -> Self {
+        Self {
+            decoder: ptr::null_mut(),
+            decoder_status: 0,
+            vdso_tempfile: None,
+            trace,
+            image,
+            errored: false,
+            stats: DecoderStats::default(),
+            cstats: PerfPTCDecoderStats::default(),
+            started: None,
+        }
+    }
+
+    // Stop the decoding clock.
+    fn finish(&mut self) {
+        if let Some(started) = self.started.take() {
+            self.stats.decode_time += started.elapsed();
+        }
+    }
+
     // Initialise the block decoder.
     fn init_decoder(&mut self) -> Result<(), HWTracerError> {
+        if let Some(image) = self.image {
+            return self.init_raw_decoder(image);
+        }
+
         // Make a temp file for the C code to write the VDSO code into.
         //
         // We have to do this because libipt lazily reads the code from the files you load into the
@@ -162,8 +350,8 @@ impl<'t> PerfPTBlockIterator<'t> {
         let mut cerr = PerfPTCError::new();
         let decoder = unsafe {
             perf_pt_init_block_decoder(
-                self.trace.buf.0 as *const c_void,
-                self.trace.len,
+                self.trace.ctrace.buf.0 as *const c_void,
+                self.trace.ctrace.len,
                 vdso_tempfile.as_raw_fd(),
                 vdso_filename.as_ptr(),
                 &mut self.decoder_status,
@@ -179,11 +367,49 @@ impl<'t> PerfPTBlockIterator<'t> {
         self.vdso_tempfile = Some(vdso_tempfile);
         Ok(())
     }
+
+    // Initialise the block decoder to decode against the code in `image`.
+    fn init_raw_decoder(&mut self, image: &[ImageSection]) -> Result<(), HWTracerError> {
+        // The filenames must outlive the C-level sections which point to them.
+        let filenames = image
+            .iter()
+            .map(|s| CString::new(s.filename.as_os_str().as_bytes()))
+            .collect::<Result<Vec<_>, _>>()?;
+        let sections = image
+            .iter()
+            .zip(filenames.iter())
+            .map(|(s, f)| PerfPTImageSection {
+                filename: f.as_ptr(),
+                offset: s.offset,
+                size: s.size,
+                vaddr: s.vaddr,
+            })
+            .collect::<Vec<_>>();
+        let mut cerr = PerfPTCError::new();
+        let decoder = unsafe {
+            perf_pt_init_raw_block_decoder(
+                self.trace.ctrace.buf.0 as *const c_void,
+                self.trace.ctrace.len,
+                sections.as_ptr(),
+                sections.len(),
+                &mut self.decoder_status,
+                &mut cerr,
+            )
+        };
+        if decoder.is_null() {
+            return Err(cerr.into());
+        }
+        self.decoder = decoder;
+        Ok(())
+    }
 }
 
 impl<'t> Drop for PerfPTBlockIterator<'t> {
     fn drop(&mut self) {
         unsafe { perf_pt_free_block_decoder(self.decoder) };
+        self.finish();
+        self.stats.add_events(&self.cstats);
+        self.trace.decoder_stats.lock().unwrap().merge(&self.stats);
     }
 }
 
@@ -198,10 +424,13 @@ impl<'t> Iterator for PerfPTBlockIterator<'t> {
 
         // Lazily initialise the block decoder.
         if self.decoder.is_null() {
+            self.started = Some(Instant::now());
             if let Err(e) = self.init_decoder() {
                 self.errored = true;
+                self.finish();
                 return Some(Err(e));
             }
+            self.stats.syncs += 1;
         }
 
         let mut first_instr = 0;
@@ -213,23 +442,33 @@ impl<'t> Iterator for PerfPTBlockIterator<'t> {
                 &mut self.decoder_status,
                 &mut first_instr,
                 &mut last_instr,
+                &mut self.cstats,
                 &mut cerr,
             )
         };
         if !rv {
             self.errored = true; // This iterator is unusable now.
+            self.finish();
             return Some(Err(HWTracerError::from(cerr)));
         }
         if first_instr == 0 {
+            self.finish();
             None // End of packet stream.
         } else {
+            self.stats.blocks += 1;
+            if self.stats.blocks == 1 {
+                if let Some(started) = self.started {
+                    let ttfb = started.elapsed().as_nanos() as u64;
+                    unsafe { perf_pt_hist_record(PerfPTCHistKind::DecodeTTFB, ttfb) };
+                }
+            }
             Some(Ok(Block::new(first_instr, last_instr)))
         }
     }
 }
 
-/// A wrapper around a manually malloc/free'd buffer for holding an Intel PT trace. We've split
-/// this out from PerfPTTrace so that we can mark just this raw pointer as `unsafe Send`.
+/// A wrapper around a manually malloc/free'd (or mapped) buffer for holding an Intel PT trace. We've split
+/// this out from PerfPTCTrace so that we can mark just this raw pointer as `unsafe Send`.
 #[repr(C)]
 #[derive(Debug)]
 struct PerfPTTraceBuf(*mut u8);
@@ -241,16 +480,37 @@ struct PerfPTTraceBuf(*mut u8);
 /// unsafely) mark the struct as being Send.
 unsafe impl Send for PerfPTTrace {}
 
-/// An Intel PT trace, obtained via Linux perf.
+/// The part of a trace which C reads and writes.
+///
+/// Shared with C code. Must stay in sync.
 #[repr(C)]
 #[derive(Debug)]
-pub struct PerfPTTrace {
+struct PerfPTCTrace {
     // The trace buffer.
     buf: PerfPTTraceBuf,
     // The length of the trace (in bytes).
     len: u64,
     // `buf`'s allocation size (in bytes), <= `len`.
     capacity: u64,
+    // The memory budget which growing `buf` must stay within (0 = unlimited).
+    budget: u64,
+    // Collection stops once `len` reaches this (0 = unlimited). Set by C.
+    max_len: u64,
+    // If not -1, `buf` is a shared mapping of this memfd, sized to `capacity` (see share.rs).
+    memfd: c_int,
+    // Whether collection stopped at `max_len`.
+    truncated: bool,
+}
+
+/// An Intel PT trace, obtained via Linux perf.
+#[derive(Debug)]
+pub struct PerfPTTrace {
+    // The trace data, filled in by C.
+    ctrace: PerfPTCTrace,
+    // What the collector saw while collecting the trace.
+    collector_stats: CollectorStats,
+    // Statistics from decoding the trace so far.
+    decoder_stats: Mutex<DecoderStats>,
 }
 
 impl PerfPTTrace {
@@ -259,16 +519,82 @@ impl PerfPTTrace {
     ///
     /// The allocation is automatically freed by Rust when the struct falls out of scope.
     fn new(capacity: size_t) -> Result<Self, HWTracerError> {
-        let buf = unsafe { malloc(capacity) as *mut u8 };
-        if buf.is_null() {
-            return Err(HWTracerError::Unknown);
+        Self::with_storage(capacity, 0, false)
+    }
+
+    /// Makes a new trace as `new()` does, but whose storage must stay within the memory budget
+    /// `budget` (see `PerfPTConfig::memory_budget`), and which is kept in a memfd if `memfd` is
+    /// true (see `PerfPTConfig::memfd_storage`). Fails with `ENOMEM` if the budget is exceeded.
+    fn with_storage(capacity: size_t, budget: u64, memfd: bool) -> Result<Self, HWTracerError> {
+        // A memfd can't be mapped with a size of 0.
+        let capacity = if memfd { capacity.max(1) } else { capacity };
+        if !unsafe { perf_pt_budget_reserve(BudgetKind::Trace, capacity as u64, budget) } {
+            return Err(HWTracerError::Errno(libc::ENOMEM));
         }
+        let storage = if memfd {
+            share::memfd_storage(capacity)
+        } else {
+            match unsafe { malloc(capacity) as *mut u8 } {
+                buf if buf.is_null() => Err(HWTracerError::Unknown),
+                buf => Ok((buf, -1)),
+            }
+        };
+        let (buf, memfd) = match storage {
+            Ok(s) => s,
+            Err(e) => {
+                unsafe { perf_pt_budget_release(BudgetKind::Trace, capacity as u64) };
+                return Err(e);
+            }
+        };
         Ok(Self {
-            buf: PerfPTTraceBuf(buf),
-            len: 0,
-            capacity: capacity as u64,
+            ctrace: PerfPTCTrace {
+                buf: PerfPTTraceBuf(buf),
+                len: 0,
+                capacity: capacity as u64,
+                budget,
+                max_len: 0,
+                memfd,
+                truncated: false,
+            },
+            collector_stats: CollectorStats::default(),
+            decoder_stats: Mutex::new(DecoderStats::default()),
         })
     }
+
+    /// Makes a new trace from a copy of the raw PT packets in `data`.
+    fn from_bytes(data: &[u8]) -> Result<Self, HWTracerError> {
+        // Always allocate at least one byte, as malloc(0) may return NULL.
+        let mut trace = Self::new(data.len().max(1))?;
+        unsafe { ptr::copy_nonoverlapping(data.as_ptr(), trace.ctrace.buf.0, data.len()) };
+        trace.ctrace.len = data.len() as u64;
+        Ok(trace)
+    }
+
+    /// Iterate over the blocks of the trace, decoding against `image`, or the code of the current
+    /// process if `image` is `None`.
+    fn iter_blocks_with<'t: 'i, 'i>(
+        &'t self,
+        image: Option<&'t [ImageSection]>,
+    ) -> Box<dyn Iterator<Item = Result<Block, HWTracerError>> + 'i> {
+        Box::new(PerfPTBlockIterator::new(self, image))
+    }
+
+    /// Returns true if collection stopped early because the trace reached
+    /// `PerfPTConfig::max_session_bytes`.
+    pub fn is_truncated(&self) -> bool {
+        self.ctrace.truncated
+    }
+
+    /// Returns what the collector saw while collecting this trace.
+    pub fn collector_stats(&self) -> &CollectorStats {
+        &self.collector_stats
+    }
+
+    /// Returns statistics about decoding this trace so far. These are updated when an iterator
+    /// over the trace's blocks is dropped.
+    pub fn decoder_stats(&self) -> DecoderStats {
+        self.decoder_stats.lock().unwrap().clone()
+    }
 }
 
 impl Trace for PerfPTTrace {
@@ -276,39 +602,96 @@ impl Trace for PerfPTTrace {
     #[cfg(test)]
     fn to_file(&self, file: &mut File) {
         use std::io::prelude::*;
-        use std::slice;
 
-        let slice = unsafe { slice::from_raw_parts(self.buf.0 as *const u8, self.len as usize) };
-        file.write_all(slice).unwrap();
+        file.write_all(self.raw_data()).unwrap();
+    }
+
+    /// Returns the raw Intel PT packets.
+    fn raw_data(&self) -> &[u8] {
+        unsafe { slice::from_raw_parts(self.ctrace.buf.0 as *const u8, self.ctrace.len as usize) }
+    }
+
+    /// Traces are only handed out once sealed (see `seal()`), so any memfd is ready to share.
+    fn shared_fd(&self) -> Option<RawFd> {
+        match self.ctrace.memfd {
+            -1 => None,
+            fd => Some(fd),
+        }
     }
 
     fn iter_blocks<'t: 'i, 'i>(
         &'t self,
     ) -> Box<dyn Iterator<Item = Result<Block, HWTracerError>> + 'i> {
-        let itr = PerfPTBlockIterator {
-            decoder: ptr::null_mut(),
-            decoder_status: 0,
-            vdso_tempfile: None,
-            trace: self,
-            errored: false,
-        };
-        Box::new(itr)
+        self.iter_blocks_with(None)
+    }
+
+    fn stats(&self) -> Stats {
+        let mut stats = Stats::new();
+        self.collector_stats.add_to(&mut stats);
+        self.decoder_stats.lock().unwrap().add_to(&mut stats);
+        stats
     }
 
     #[cfg(test)]
     fn capacity(&self) -> usize {
-        self.capacity as usize
+        self.ctrace.capacity as usize
     }
 }
 
 impl Drop for PerfPTTrace {
     fn drop(&mut self) {
-        if !self.buf.0.is_null() {
-            unsafe { free(self.buf.0 as *mut c_void) };
+        if !self.ctrace.buf.0.is_null() {
+            if self.ctrace.memfd == -1 {
+                unsafe { free(self.ctrace.buf.0 as *mut c_void) };
+            } else {
+                let capacity = self.ctrace.capacity as size_t;
+                unsafe { libc::munmap(self.ctrace.buf.0 as *mut c_void, capacity) };
+            }
+            unsafe { perf_pt_budget_release(BudgetKind::Trace, self.ctrace.capacity) };
+        }
+        // A trace whose sealing failed may have lost its mapping, but still has its memfd.
+        if self.ctrace.memfd != -1 {
+            unsafe { libc::close(self.ctrace.memfd) };
         }
     }
 }
 
+/// C-level phase timings, in nanoseconds.
+///
+/// Must stay in sync with the C code.
+#[repr(C)]
+#[derive(Default)]
+struct PerfPTCPhaseTimes {
+    spawn_ns: u64,
+    enable_ns: u64,
+    disable_ns: u64,
+    join_ns: u64,
+    collector_cpu_ns: u64,
+    open_wait_ns: u64,
+}
+
+/// How long each phase of starting and stopping a tracing session took.
+#[derive(Clone, Debug, Default)]
+pub struct PerfPTPhaseTimes {
+    /// Opening the perf file descriptor and mapping its buffers.
+    pub init: Duration,
+    /// Of `init`, the time spent queueing for the tracing hardware (see
+    /// `PerfPTConfig::open_timeout_ns`).
+    pub open_wait: Duration,
+    /// Starting the collector thread and waiting for it to become ready.
+    pub spawn: Duration,
+    /// Turning the tracing hardware on.
+    pub enable: Duration,
+    /// Turning the tracing hardware off.
+    pub disable: Duration,
+    /// Telling the collector thread to stop and waiting for it to drain the buffers and exit.
+    pub join: Duration,
+    /// Unmapping the buffers and closing the perf file descriptor.
+    pub free: Duration,
+    /// CPU time used by the collector thread while the session was running.
+    pub collector_cpu: Duration,
+}
+
 #[derive(Debug)]
 pub struct PerfPTTracer {
     config: PerfPTConfig,
@@ -319,7 +702,13 @@ impl PerfPTTracer {
     where
         Self: Sized,
     {
-        // Check for inavlid configuration.
+        Self::check_config(&config)?;
+        Self::check_perf_perms()?;
+        Ok(Self { config })
+    }
+
+    /// Checks `config` for invalid settings.
+    fn check_config(config: &PerfPTConfig) -> Result<(), HWTracerError> {
         fn power_of_2(v: size_t) -> bool {
             (v & (v - 1)) == 0
         }
@@ -333,9 +722,30 @@ impl PerfPTTracer {
                 "aux_bufsize must be a positive power of 2",
             )));
         }
+        if config.collector_fifo_priority != 0 {
+            let (min, max) = unsafe {
+                (
+                    sched_get_priority_min(SCHED_FIFO),
+                    sched_get_priority_max(SCHED_FIFO),
+                )
+            };
+            if config.collector_fifo_priority < min || config.collector_fifo_priority > max {
+                return Err(HWTracerError::BadConfig(format!(
+                    "collector_fifo_priority must be 0 or between {} and {}",
+                    min, max
+                )));
+            }
+        }
 
-        Self::check_perf_perms()?;
-        Ok(Self { config })
+        if config.aux_bufsize_max != 0
+            && (!power_of_2(config.aux_bufsize_max) || config.aux_bufsize_max < config.aux_bufsize)
+        {
+            return Err(HWTracerError::BadConfig(String::from(
+                "aux_bufsize_max must be 0 or a power of 2 no smaller than aux_bufsize",
+            )));
+        }
+
+        pool::check_config(config)
     }
 
     fn check_perf_perms() -> Result<(), HWTracerError> {
@@ -362,7 +772,7 @@ impl PerfPTTracer {
 
 impl Tracer for PerfPTTracer {
     fn thread_tracer(&self) -> Box<dyn ThreadTracer> {
-        Box::new(PerfPTThreadTracer::new(self.config.clone()))
+        Box::new(PerfPTThreadTracer::with_checked_config(self.config.clone()))
     }
 }
 
@@ -376,46 +786,90 @@ pub struct PerfPTThreadTracer {
     state: TracerState,
     // The trace currently being collected, or `None`.
     trace: Option<Box<PerfPTTrace>>,
+    // Timings of the most recent tracing session.
+    phase_times: PerfPTPhaseTimes,
+    // Collector statistics of the most recent (stopped) tracing session.
+    collector_stats: CollectorStats,
+    // Where the context for the next session is prepared, if `config.pool_refill` is enabled.
+    pool: Option<Arc<Pool>>,
+    // The status word of the current session (see `PerfPTCStatus`), or null if stopped.
+    status_word: *const AtomicU32,
+    // The AUX buffer size (in pages) of the current or most recent session.
+    aux_bufsize: size_t,
+    // The tag of the current session, if it was started with `start_tracing_tagged()`.
+    tag: Option<String>,
 }
 
 impl PerfPTThreadTracer {
-    fn new(config: PerfPTConfig) -> Self {
+    /// Makes a thread tracer with the configuration `config`, which is checked as
+    /// `TracerBuilder` checks it.
+    ///
+    /// Unlike building a tracer with `TracerBuilder`, this doesn't check whether the system
+    /// supports tracing: such errors are reported when tracing starts instead.
+    ///
+    /// The tracer traces the calling thread. If `config.pool_refill` is enabled, it starts
+    /// preparing the context for its first session now.
+    pub fn new(config: PerfPTConfig) -> Result<Self, HWTracerError> {
+        PerfPTTracer::check_config(&config)?;
+        Ok(Self::with_checked_config(config))
+    }
+
+    fn with_checked_config(config: PerfPTConfig) -> Self {
+        let pool = Pool::new(&config);
+        if let Some(ref p) = pool {
+            p.refill(config.aux_bufsize);
+        }
         Self {
+            aux_bufsize: config.aux_bufsize,
             config,
             tracer_ctx: ptr::null_mut(),
             state: TracerState::Stopped,
             trace: None,
+            phase_times: PerfPTPhaseTimes::default(),
+            collector_stats: CollectorStats::default(),
+            pool,
+            status_word: ptr::null(),
+            tag: None,
         }
     }
-}
-
-impl Default for PerfPTThreadTracer {
-    fn default() -> Self {
-        PerfPTThreadTracer::new(PerfPTConfig::default())
-    }
-}
 
-impl Drop for PerfPTThreadTracer {
-    fn drop(&mut self) {
-        if self.state == TracerState::Started {
-            // If we haven't stopped the tracer already, stop it now.
-            self.stop_tracing().unwrap();
-        }
-    }
-}
-
-impl ThreadTracer for PerfPTThreadTracer {
-    fn start_tracing(&mut self) -> Result<(), HWTracerError> {
+    /// Starts tracing, with an AUX buffer sized for sessions tagged `tag` (e.g. a call site, such
+    /// as `concat!(file!(), ":", line!())`). If `PerfPTConfig::aux_bufsize_max` is non-zero, the
+    /// outcome of the session is used to size the next session with the same tag: see
+    /// `learned_aux_bufsize()`. Otherwise this is the same as `start_tracing()`.
+    pub fn start_tracing_tagged(&mut self, tag: &str) -> Result<(), HWTracerError> {
         if self.state == TracerState::Started {
             return Err(TracerState::Started.as_error());
         }
+        self.start(adapt::aux_bufsize(tag, &self.config))?;
+        if self.config.aux_bufsize_max != 0 {
+            self.tag = Some(tag.to_owned());
+        }
+        Ok(())
+    }
 
+    /// Starts a session with an AUX buffer of `aux_bufsize` pages.
+    fn start(&mut self, aux_bufsize: size_t) -> Result<(), HWTracerError> {
         // At the time of writing, we have to use a fresh Perf file descriptor to ensure traces
         // start with a `PSB+` packet sequence. This is required for correct instruction-level and
         // block-level decoding. Therefore we have to re-initialise for each new tracing session.
         let mut cerr = PerfPTCError::new();
-        self.tracer_ctx =
-            unsafe { perf_pt_init_tracer(&self.config as *const PerfPTConfig, &mut cerr) };
+        let before = Instant::now();
+        self.aux_bufsize = aux_bufsize;
+        self.tracer_ctx = match self.pool.as_ref().and_then(|p| p.take(aux_bufsize)) {
+            Some(ctx) => ctx,
+            None if aux_bufsize == self.config.aux_bufsize => unsafe {
+                perf_pt_init_tracer(&self.config as *const PerfPTConfig, 0, &mut cerr)
+            },
+            None => {
+                let config = PerfPTConfig {
+                    aux_bufsize,
+                    ..self.config.clone()
+                };
+                unsafe { perf_pt_init_tracer(&config as *const PerfPTConfig, 0, &mut cerr) }
+            }
+        };
+        self.phase_times.init = before.elapsed();
         if self.tracer_ctx.is_null() {
             return Err(cerr.into());
         }
@@ -425,37 +879,262 @@ impl ThreadTracer for PerfPTThreadTracer {
         // `stop_tracing` needs to return a Box<Tracer> anyway, so it's no big deal.
         //
         // Note that the C code will mutate the trace's members directly.
-        let mut trace = Box::new(PerfPTTrace::new(self.config.initial_trace_bufsize)?);
+        // The AUX buffer may have been shrunk to fit the memory budget.
+        self.aux_bufsize = unsafe { perf_pt_aux_bufsize(self.tracer_ctx) };
+        let trace = PerfPTTrace::with_storage(
+            self.config.initial_trace_bufsize,
+            self.config.memory_budget,
+            self.config.memfd_storage,
+        );
+        let mut trace = match trace {
+            Ok(t) => Box::new(t),
+            Err(e) => {
+                unsafe { perf_pt_free_tracer(self.tracer_ctx, &mut PerfPTCError::new()) };
+                self.tracer_ctx = ptr::null_mut();
+                return Err(e);
+            }
+        };
         let mut cerr = PerfPTCError::new();
-        if !unsafe { perf_pt_start_tracer(self.tracer_ctx, &mut *trace, &mut cerr) } {
+        if !unsafe { perf_pt_start_tracer(self.tracer_ctx, &mut trace.ctrace, &mut cerr) } {
+            // Don't leak the context: the next call to `start_tracing()` makes a fresh one.
+            unsafe { perf_pt_free_tracer(self.tracer_ctx, &mut PerfPTCError::new()) };
+            self.tracer_ctx = ptr::null_mut();
             return Err(cerr.into());
         }
+        let mut ctimes = PerfPTCPhaseTimes::default();
+        unsafe { perf_pt_get_phase_times(self.tracer_ctx, &mut ctimes) };
+        self.phase_times.open_wait = Duration::from_nanos(ctimes.open_wait_ns);
+        self.phase_times.spawn = Duration::from_nanos(ctimes.spawn_ns);
+        self.phase_times.enable = Duration::from_nanos(ctimes.enable_ns);
         self.state = TracerState::Started;
+        self.status_word = unsafe { perf_pt_status_word(self.tracer_ctx) };
         self.trace = Some(trace);
         Ok(())
     }
 
-    fn stop_tracing(&mut self) -> Result<Box<dyn Trace>, HWTracerError> {
-        if self.state == TracerState::Stopped {
-            return Err(TracerState::Stopped.as_error());
-        }
+    /// Stops the current session. The caller must refill the pool.
+    fn stop(&mut self) -> Result<Box<dyn Trace>, HWTracerError> {
         let mut cerr = PerfPTCError::new();
         let rc = unsafe { perf_pt_stop_tracer(self.tracer_ctx, &mut cerr) };
         self.state = TracerState::Stopped;
+        self.status_word = ptr::null();
+        // The collector has stopped, so its statistics are final (even if it failed).
+        unsafe { perf_pt_get_collector_stats(self.tracer_ctx, &mut self.collector_stats) };
         if !rc {
+            // Free the context anyway: it holds the thread's perf event, without which no new
+            // session could be opened for this thread.
+            unsafe { perf_pt_free_tracer(self.tracer_ctx, &mut PerfPTCError::new()) };
+            self.tracer_ctx = ptr::null_mut();
             return Err(cerr.into());
         }
+        let mut ctimes = PerfPTCPhaseTimes::default();
+        unsafe { perf_pt_get_phase_times(self.tracer_ctx, &mut ctimes) };
+        self.phase_times.disable = Duration::from_nanos(ctimes.disable_ns);
+        self.phase_times.join = Duration::from_nanos(ctimes.join_ns);
+        self.phase_times.collector_cpu = Duration::from_nanos(ctimes.collector_cpu_ns);
 
         let mut cerr = PerfPTCError::new();
+        let before = Instant::now();
         if !unsafe { perf_pt_free_tracer(self.tracer_ctx, &mut cerr) } {
             return Err(cerr.into());
         }
+        self.phase_times.free = before.elapsed();
         self.tracer_ctx = ptr::null_mut();
 
-        let ret = self.trace.take().unwrap();
-        self.trace = None;
+        let mut ret = self.trace.take().unwrap();
+        ret.collector_stats = self.collector_stats.clone();
+        ret.seal()?;
         Ok(ret as Box<dyn Trace>)
     }
+
+    /// Returns how long each phase of the most recent start/stop took.
+    ///
+    /// The start phases are updated by `start_tracing()`, the stop phases by `stop_tracing()`.
+    pub fn phase_times(&self) -> &PerfPTPhaseTimes {
+        &self.phase_times
+    }
+
+    /// Returns the current session's status eventfd, if `PerfPTConfig::status_eventfd` is set and
+    /// the tracer is started. The eventfd becomes readable as soon as `status()` leaves
+    /// `SessionStatus::Ok`. It is closed when the session is stopped.
+    pub fn status_fd(&self) -> Option<RawFd> {
+        if self.state != TracerState::Started {
+            return None;
+        }
+        match unsafe { perf_pt_status_fd(self.tracer_ctx) } {
+            -1 => None,
+            fd => Some(fd),
+        }
+    }
+
+    /// Returns the collector statistics of the current tracing session or, if the tracer is
+    /// stopped, of the most recent one stopped with `stop_tracing()`. (The statistics of a session
+    /// stopped with `stop_tracing_async()` are only available from its trace.)
+    pub fn collector_stats(&self) -> CollectorStats {
+        if self.state == TracerState::Started {
+            let mut stats = CollectorStats::default();
+            unsafe { perf_pt_get_collector_stats(self.tracer_ctx, &mut stats) };
+            stats
+        } else {
+            self.collector_stats.clone()
+        }
+    }
+}
+
+impl Default for PerfPTThreadTracer {
+    fn default() -> Self {
+        PerfPTThreadTracer::with_checked_config(PerfPTConfig::default())
+    }
+}
+
+impl Drop for PerfPTThreadTracer {
+    fn drop(&mut self) {
+        if self.state == TracerState::Started {
+            // If we haven't stopped the tracer already, stop it now.
+            self.stop_tracing().unwrap();
+        }
+    }
+}
+
+/// A session stopped by `stop_tracing_async()`. Owns the tracer context until the trace is resolved,
+/// although the collector releases the perf event and buffers as soon as it has drained them.
+struct PerfPTStoppingSession {
+    tracer_ctx: *mut c_void,
+    trace: Option<Box<PerfPTTrace>>,
+    // The outcome of `perf_pt_disable_tracer()` and `perf_pt_release_when_drained()`.
+    disable_ok: bool,
+    cerr: PerfPTCError,
+}
+
+// The context and trace are only used by whichever thread holds the session.
+unsafe impl Send for PerfPTStoppingSession {}
+
+impl StoppingSession for PerfPTStoppingSession {
+    fn is_done(&self) -> bool {
+        unsafe { perf_pt_collector_done(self.tracer_ctx) }
+    }
+
+    fn finish(mut self: Box<Self>) -> Result<Box<dyn Trace>, HWTracerError> {
+        let mut cerr = mem::replace(&mut self.cerr, PerfPTCError::new());
+        let join_ok = unsafe { perf_pt_join_tracer(self.tracer_ctx, &mut cerr) };
+        let mut collector_stats = CollectorStats::default();
+        unsafe { perf_pt_get_collector_stats(self.tracer_ctx, &mut collector_stats) };
+        let free_ok = unsafe { perf_pt_free_tracer(self.tracer_ctx, &mut cerr) };
+        self.tracer_ctx = ptr::null_mut();
+        if !(self.disable_ok && join_ok && free_ok) {
+            return Err(cerr.into());
+        }
+        let mut trace = self.trace.take().unwrap();
+        trace.collector_stats = collector_stats;
+        trace.seal()?;
+        Ok(trace as Box<dyn Trace>)
+    }
+}
+
+impl Drop for PerfPTStoppingSession {
+    fn drop(&mut self) {
+        if !self.tracer_ctx.is_null() {
+            unsafe {
+                perf_pt_join_tracer(self.tracer_ctx, &mut PerfPTCError::new());
+                perf_pt_free_tracer(self.tracer_ctx, &mut PerfPTCError::new());
+            }
+        }
+    }
+}
+
+impl ThreadTracer for PerfPTThreadTracer {
+    fn start_tracing(&mut self) -> Result<(), HWTracerError> {
+        if self.state == TracerState::Started {
+            return Err(TracerState::Started.as_error());
+        }
+        self.start(self.config.aux_bufsize)
+    }
+
+    fn stop_tracing(&mut self) -> Result<Box<dyn Trace>, HWTracerError> {
+        if self.state == TracerState::Stopped {
+            return Err(TracerState::Stopped.as_error());
+        }
+        let res = self.stop();
+        // The next session probably has the same tag, so prepare a context of its size.
+        let mut next_aux_bufsize = self.config.aux_bufsize;
+        if let Some(tag) = self.tag.take() {
+            let outcome = match &res {
+                Ok(_) => Some(Outcome::Filled(self.collector_stats.max_aux_fill)),
+                Err(HWTracerError::HWBufferOverflow) => Some(Outcome::Overflowed),
+                Err(_) => None,
+            };
+            if let Some(o) = outcome {
+                adapt::record(&tag, &self.config, self.aux_bufsize, o);
+            }
+            next_aux_bufsize = adapt::aux_bufsize(&tag, &self.config);
+        }
+        if let Some(ref p) = self.pool {
+            if self.tracer_ctx.is_null() {
+                p.refill(next_aux_bufsize);
+            }
+        }
+        res
+    }
+
+    /// Turns the tracing hardware off and returns at once, leaving the collector thread to drain
+    /// the buffers. Only `phase_times().disable` is updated.
+    ///
+    /// The session holds this thread's perf event until the collector has drained the buffers (not
+    /// until the returned `PendingTrace` is resolved), so a new session started before then waits
+    /// for it (see `PerfPTConfig::open_timeout_ns`). The context pool isn't refilled. A tagged
+    /// session only contributes to its tag's AUX buffer size if it had already overflowed.
+    fn stop_tracing_async(&mut self) -> Result<PendingTrace, HWTracerError> {
+        if self.state == TracerState::Stopped {
+            return Err(TracerState::Stopped.as_error());
+        }
+        if let Some(tag) = self.tag.take() {
+            if self.status() == SessionStatus::Overflowed {
+                adapt::record(&tag, &self.config, self.aux_bufsize, Outcome::Overflowed);
+            }
+        }
+        let mut cerr = PerfPTCError::new();
+        let mut disable_ok = unsafe { perf_pt_disable_tracer(self.tracer_ctx, &mut cerr) };
+        if !unsafe { perf_pt_release_when_drained(self.tracer_ctx, &mut cerr) } {
+            disable_ok = false;
+        }
+        self.state = TracerState::Stopped;
+        self.status_word = ptr::null();
+        let mut ctimes = PerfPTCPhaseTimes::default();
+        unsafe { perf_pt_get_phase_times(self.tracer_ctx, &mut ctimes) };
+        self.phase_times.disable = Duration::from_nanos(ctimes.disable_ns);
+
+        let session = PerfPTStoppingSession {
+            tracer_ctx: mem::replace(&mut self.tracer_ctx, ptr::null_mut()),
+            trace: self.trace.take(),
+            disable_ok,
+            cerr,
+        };
+        Ok(PendingTrace::stopping(Box::new(session)))
+    }
+
+    fn status(&self) -> SessionStatus {
+        if self.status_word.is_null() {
+            return SessionStatus::Stopped;
+        }
+        match unsafe { &*self.status_word }.load(Ordering::Acquire) {
+            PERF_PT_STATUS_OK => SessionStatus::Ok,
+            PERF_PT_STATUS_OVERFLOW => SessionStatus::Overflowed,
+            PERF_PT_STATUS_TRUNCATED => SessionStatus::Truncated,
+            _ => SessionStatus::Failed,
+        }
+    }
+
+    fn stats(&self) -> Stats {
+        let mut stats = Stats::new();
+        self.collector_stats().add_to(&mut stats);
+        if let Some(ref p) = self.pool {
+            let (hits, misses) = p.hits_misses();
+            stats.set("pool.hits", hits);
+            stats.set("pool.misses", misses);
+        }
+        stats.set("aux_bufsize", self.aux_bufsize as u64);
+        stats
+    }
 }
 
 // Called by C to store a ptxed argument into a Rust Vec.
@@ -474,15 +1153,18 @@ pub unsafe extern "C" fn push_ptxed_arg(args: &mut Vec<String>, new_arg: *const
 mod tests {
     use super::PerfPTCError;
     use super::{
-        c_int, ptr, size_t, AsRawFd, HWTracerError, NamedTempFile, PerfPTBlockIterator,
-        PerfPTConfig, PerfPTThreadTracer, PerfPTTrace, ThreadTracer, Trace,
+        c_int, learned_aux_bufsize, recv_trace, send_trace, size_t, AsRawFd, Duration,
+        HWTracerError, ImageSection, LatencyHistograms, ModuleMap, NamedTempFile,
+        PerfPTBlockIterator, PerfPTConfig, PerfPTThreadTracer, PerfPTTrace, ThreadTracer, Trace,
     };
-    use crate::backends::{BackendConfig, TracerBuilder};
-    use crate::{test_helpers, Block};
+    use crate::backends::{BackendConfig, PoolRefill, TracerBuilder};
+    use crate::{test_helpers, Block, SessionStatus};
     use phdrs::{PF_X, PT_LOAD};
     use std::convert::TryFrom;
     use std::env;
+    use std::os::unix::net::UnixStream;
     use std::process::Command;
+    use std::sync::atomic::{AtomicU64, Ordering};
 
     extern "C" {
         fn dump_vdso(fd: c_int, vaddr: u64, len: size_t, err: &PerfPTCError) -> bool;
@@ -658,6 +1340,125 @@ mod tests {
         test_helpers::test_not_started(PerfPTThreadTracer::default());
     }
 
+    #[test]
+    fn test_async_stop() {
+        test_helpers::test_async_stop(PerfPTThreadTracer::default());
+    }
+
+    // A thread can trace again while its previous session is still pending, without waiting for
+    // the pending trace to be resolved.
+    #[test]
+    fn test_async_stop_restart() {
+        let mut tracer = PerfPTThreadTracer::new(PerfPTConfig {
+            open_timeout_ns: 5_000_000_000,
+            ..PerfPTConfig::default()
+        })
+        .unwrap();
+        tracer.start_tracing().unwrap();
+        println!("{}", test_helpers::work_loop(500));
+        let pending = tracer.stop_tracing_async().unwrap();
+        // This only has to wait for the collector to drain the previous session (otherwise it would
+        // time out, as `pending` isn't resolved until later).
+        tracer.start_tracing().unwrap();
+        println!("{}", test_helpers::work_loop(500));
+        let trace = tracer.stop_tracing().unwrap();
+        assert!(tracer.phase_times().open_wait < Duration::from_secs(1));
+        assert!(trace.iter_blocks().all(|b| b.is_ok()));
+        assert!(pending.wait().unwrap().iter_blocks().all(|b| b.is_ok()));
+    }
+
+    #[test]
+    fn test_status() {
+        test_helpers::test_status(PerfPTThreadTracer::default());
+    }
+
+    // An overflow is reported by the status word and eventfd before the tracer is stopped.
+    #[test]
+    fn test_status_overflow() {
+        let mut tracer = PerfPTThreadTracer::new(PerfPTConfig {
+            aux_bufsize: 1,
+            status_eventfd: true,
+            ..PerfPTConfig::default()
+        })
+        .unwrap();
+        assert_eq!(tracer.status_fd(), None);
+        tracer.start_tracing().unwrap();
+        let fd = tracer.status_fd().unwrap();
+        let mut iters = 0;
+        while tracer.status() == SessionStatus::Ok && iters < 1000 {
+            println!("{}", test_helpers::work_loop(1000));
+            iters += 1;
+        }
+        if tracer.status() == SessionStatus::Overflowed {
+            let mut pfd = libc::pollfd {
+                fd,
+                events: libc::POLLIN,
+                revents: 0,
+            };
+            assert_eq!(unsafe { libc::poll(&mut pfd, 1, 0) }, 1);
+            match tracer.stop_tracing() {
+                Err(HWTracerError::HWBufferOverflow) => (),
+                r => panic!("expected overflow, got {:?}", r.map(|_| ())),
+            }
+        } else {
+            // The collector kept up, which we can't prevent.
+            tracer.stop_tracing().unwrap();
+        }
+        assert_eq!(tracer.status(), SessionStatus::Stopped);
+        assert_eq!(tracer.status_fd(), None);
+    }
+
+    // Check that the start and stop phases are timed.
+    #[test]
+    fn test_phase_times() {
+        let mut tracer = PerfPTThreadTracer::default();
+        test_helpers::trace_closure(&mut tracer, || test_helpers::work_loop(10));
+        let times = tracer.phase_times();
+        assert!(times.init > Duration::from_secs(0));
+        assert!(times.spawn > Duration::from_secs(0));
+        assert!(times.join > Duration::from_secs(0));
+        assert!(times.free > Duration::from_secs(0));
+        assert!(times.collector_cpu > Duration::from_secs(0));
+    }
+
+    // Check that collecting and decoding a trace are counted.
+    #[test]
+    fn test_stats() {
+        let mut tracer = PerfPTThreadTracer::default();
+        let trace = test_helpers::trace_closure(&mut tracer, || test_helpers::work_loop(100));
+        let cstats = tracer.collector_stats();
+        assert!(cstats.wakeups > 0);
+        assert_eq!(cstats.aux_bytes, trace.raw_data().len() as u64);
+        assert_eq!(cstats.lost_records, 0);
+        assert_eq!(
+            tracer.stats().get("collector.aux_bytes"),
+            Some(cstats.aux_bytes)
+        );
+
+        let nblocks = trace.iter_blocks().count() as u64;
+        let stats = trace.stats();
+        assert_eq!(stats.get("decoder.blocks"), Some(nblocks));
+        assert_eq!(stats.get("decoder.syncs"), Some(1));
+        trace.iter_blocks().count();
+        assert_eq!(trace.stats().get("decoder.blocks"), Some(2 * nblocks));
+    }
+
+    // Check that tracing and decoding are recorded in the latency histograms.
+    #[test]
+    fn test_latency_histograms() {
+        let before = LatencyHistograms::snapshot();
+        let mut tracer = PerfPTThreadTracer::default();
+        let trace = test_helpers::trace_closure(&mut tracer, || test_helpers::work_loop(10));
+        trace.iter_blocks().next().unwrap().unwrap();
+        let after = LatencyHistograms::snapshot();
+        // Other tests may be tracing concurrently, so we can't check exact counts.
+        assert!(after.start.count() > before.start.count());
+        assert!(after.stop.count() > before.stop.count());
+        assert!(after.drain.count() > before.drain.count());
+        assert!(after.decode_ttfb.count() > before.decode_ttfb.count());
+        assert!(after.start.percentile(50.0) > Duration::from_secs(0));
+    }
+
     // Test writing a trace to file.
     #[cfg(debug_assertions)]
     #[test]
@@ -670,8 +1471,8 @@ mod tests {
         // Allocate and fill a buffer to make a "trace" from.
         let capacity = 1024;
         let mut trace = PerfPTTrace::new(capacity).unwrap();
-        trace.len = capacity as u64;
-        let sl = unsafe { slice::from_raw_parts_mut(trace.buf.0 as *mut u8, capacity) };
+        trace.ctrace.len = capacity as u64;
+        let sl = unsafe { slice::from_raw_parts_mut(trace.ctrace.buf.0 as *mut u8, capacity) };
         for (i, byte) in sl.iter_mut().enumerate() {
             *byte = i as u8;
         }
@@ -750,7 +1551,7 @@ mod tests {
         let start_bufsize = 512;
         let mut config = PerfPTConfig::default();
         config.initial_trace_bufsize = start_bufsize;
-        let mut tracer = PerfPTThreadTracer::new(config);
+        let mut tracer = PerfPTThreadTracer::new(config).unwrap();
 
         tracer.start_tracing().unwrap();
         let res = test_helpers::work_loop(10000);
@@ -765,13 +1566,7 @@ mod tests {
     fn test_error_stops_block_iter1() {
         // A zero-sized trace will lead to an error.
         let trace = PerfPTTrace::new(0).unwrap();
-        let mut itr = PerfPTBlockIterator {
-            decoder: ptr::null_mut(),
-            decoder_status: 0,
-            vdso_tempfile: None,
-            trace: &trace,
-            errored: false,
-        };
+        let mut itr = PerfPTBlockIterator::new(&trace, None);
 
         // First we expect a libipt error.
         match itr.next() {
@@ -801,6 +1596,21 @@ mod tests {
         }
     }
 
+    // A thread tracer made directly checks its configuration too.
+    #[test]
+    fn test_thread_tracer_bad_config() {
+        let config = PerfPTConfig {
+            aux_bufsize: 3,
+            ..PerfPTConfig::default()
+        };
+        match PerfPTThreadTracer::new(config) {
+            Err(HWTracerError::BadConfig(s)) => {
+                assert_eq!(s, "aux_bufsize must be a positive power of 2");
+            }
+            _ => panic!(),
+        }
+    }
+
     #[test]
     fn test_config_bad_aux_bufsize() {
         let mut bldr = TracerBuilder::new().perf_pt();
@@ -815,4 +1625,203 @@ mod tests {
             _ => panic!(),
         }
     }
+    #[test]
+    fn test_config_bad_fifo_priority() {
+        let mut bldr = TracerBuilder::new().perf_pt();
+        match bldr.config() {
+            BackendConfig::PerfPT(ref mut ppt_conf) => ppt_conf.collector_fifo_priority = 100,
+            _ => panic!(),
+        }
+        match bldr.build() {
+            Err(HWTracerError::BadConfig(s)) => {
+                assert!(s.starts_with("collector_fifo_priority must be"));
+            }
+            _ => panic!(),
+        }
+    }
+
+    // Check that tracing works with the collector pinned to a CPU and its storage on that CPU's
+    // NUMA node.
+    #[test]
+    fn test_collector_placement() {
+        let mut config = PerfPTConfig::default();
+        config.collector_cpus.add(0).unwrap();
+        config.collector_numa_local = true;
+        let mut tracer = PerfPTThreadTracer::new(config).unwrap();
+        let trace = test_helpers::trace_closure(&mut tracer, || test_helpers::work_loop(100));
+        assert!(trace.iter_blocks().count() > 0);
+    }
+
+    // Check that a busy-polling collector collects the whole trace.
+    #[test]
+    fn test_collector_spin() {
+        let mut tracer = PerfPTThreadTracer::new(PerfPTConfig {
+            collector_spin_ns: 1_000_000,
+            ..PerfPTConfig::default()
+        })
+        .unwrap();
+        let trace = test_helpers::trace_closure(&mut tracer, || test_helpers::work_loop(100));
+        assert!(trace.iter_blocks().all(|b| b.is_ok()));
+        let cstats = tracer.collector_stats();
+        assert!(cstats.spin_hits + cstats.spin_misses > 0);
+        assert_eq!(cstats.aux_bytes, trace.raw_data().len() as u64);
+    }
+
+    // Running the collector under `SCHED_FIFO` either works or, without the privileges to do so,
+    // fails cleanly.
+    #[test]
+    fn test_collector_fifo() {
+        let mut tracer = PerfPTThreadTracer::new(PerfPTConfig {
+            collector_fifo_priority: 1,
+            ..PerfPTConfig::default()
+        })
+        .unwrap();
+        match tracer.start_tracing() {
+            Ok(()) => {
+                test_helpers::work_loop(100);
+                tracer.stop_tracing().unwrap();
+            }
+            Err(HWTracerError::Errno(libc::EPERM)) => (),
+            Err(e) => panic!("unexpected error: {}", e),
+        }
+    }
+
+    // Overflowing tagged sessions grow their tag's AUX buffer.
+    #[test]
+    fn test_adaptive_aux_bufsize() {
+        let tag = "test_adaptive_aux_bufsize";
+        let mut tracer = PerfPTThreadTracer::new(PerfPTConfig {
+            aux_bufsize: 1,
+            aux_bufsize_max: 64,
+            pool_refill: PoolRefill::Inline,
+            ..PerfPTConfig::default()
+        })
+        .unwrap();
+        for _ in 0..8 {
+            tracer.start_tracing_tagged(tag).unwrap();
+            let pages = tracer.stats().get("aux_bufsize").unwrap();
+            println!("{}", test_helpers::work_loop(10000));
+            match tracer.stop_tracing() {
+                Ok(_) => break,
+                Err(HWTracerError::HWBufferOverflow) => {
+                    assert_eq!(learned_aux_bufsize(tag), Some((pages as usize * 2).min(64)));
+                }
+                Err(e) => panic!("{}", e),
+            }
+        }
+        // Untagged sessions are unaffected.
+        tracer.start_tracing().unwrap();
+        assert_eq!(tracer.stats().get("aux_bufsize"), Some(1));
+        let _ = tracer.stop_tracing();
+    }
+
+    // A tracer whose buffers can't fit in the memory budget fails to start.
+    #[test]
+    fn test_memory_budget() {
+        let mut tracer = PerfPTThreadTracer::new(PerfPTConfig {
+            memory_budget: 1,
+            ..PerfPTConfig::default()
+        })
+        .unwrap();
+        match tracer.start_tracing() {
+            Err(HWTracerError::Errno(libc::ENOMEM)) => (),
+            r => panic!("expected ENOMEM, got {:?}", r),
+        }
+        test_helpers::trace_closure(&mut PerfPTThreadTracer::default(), || {
+            test_helpers::work_loop(100)
+        });
+    }
+
+    // A trace which reaches `max_session_bytes` stops growing, and the callback is called.
+    #[test]
+    fn test_max_session_bytes() {
+        static TRUNCATED_AT: AtomicU64 = AtomicU64::new(0);
+        extern "C" fn truncated(data: usize, len: u64) {
+            assert_eq!(data, 42);
+            TRUNCATED_AT.store(len, Ordering::SeqCst);
+        }
+        let max = 64 * 1024;
+        let mut tracer = PerfPTThreadTracer::new(PerfPTConfig {
+            max_session_bytes: max,
+            truncate_callback: Some(truncated),
+            truncate_callback_data: 42,
+            ..PerfPTConfig::default()
+        })
+        .unwrap();
+        tracer.start_tracing().unwrap();
+        let mut iters = 0;
+        while tracer.status() == SessionStatus::Ok && iters < 1000 {
+            println!("{}", test_helpers::work_loop(1000));
+            iters += 1;
+        }
+        assert_eq!(tracer.status(), SessionStatus::Truncated);
+        let trace = tracer.stop_tracing().unwrap();
+        let len = trace.raw_data().len() as u64;
+        assert!(len >= max);
+        assert_eq!(TRUNCATED_AT.load(Ordering::SeqCst), len);
+    }
+
+    // A trace stored in a memfd grows like any other, and can be passed to another process
+    // (here, over a socket to ourselves) and decoded there.
+    #[test]
+    fn test_memfd_storage() {
+        let mut tracer = PerfPTThreadTracer::new(PerfPTConfig {
+            initial_trace_bufsize: 1,
+            memfd_storage: true,
+            ..PerfPTConfig::default()
+        })
+        .unwrap();
+        let trace = test_helpers::trace_closure(&mut tracer, || test_helpers::work_loop(1000));
+        assert!(trace.stats().get("collector.reallocs").unwrap() > 0);
+        let dir = tempfile::TempDir::new().unwrap();
+        let image = ImageSection::current_process(dir.path().join("vdso")).unwrap();
+        let (a, b) = UnixStream::pair().unwrap();
+        send_trace(&a, &*trace, &image).unwrap();
+        let got = recv_trace(&b).unwrap();
+        assert_eq!(got.raw_data(), trace.raw_data());
+        let blocks = |t: &dyn Trace| t.iter_blocks().map(|b| b.unwrap()).collect::<Vec<_>>();
+        assert_eq!(blocks(&got), blocks(&*trace));
+    }
+
+    // The blocks of a trace of this process normalize to module-relative addresses and back.
+    #[test]
+    fn test_module_blocks() {
+        let mut tracer = PerfPTThreadTracer::default();
+        let trace = test_helpers::trace_closure(&mut tracer, || test_helpers::work_loop(100));
+        let dir = tempfile::TempDir::new().unwrap();
+        let map = ModuleMap::current_process(dir.path().join("vdso")).unwrap();
+        let mut nblocks = 0;
+        for b in trace.iter_blocks() {
+            let b = b.unwrap();
+            let norm = map.normalize_block(&b).unwrap();
+            assert!(map.module_by_id(norm.module).is_some());
+            assert_eq!(map.resolve_block(&norm), Some(b));
+            nblocks += 1;
+        }
+        assert!(nblocks > 0);
+    }
+
+    // Sessions start with a context prepared on the traced thread or in the background.
+    #[test]
+    fn test_context_pool() {
+        for &refill in &[PoolRefill::Inline, PoolRefill::Background] {
+            let mut tracer = PerfPTThreadTracer::new(PerfPTConfig {
+                pool_refill: refill,
+                ..PerfPTConfig::default()
+            })
+            .unwrap();
+            for _ in 0..3 {
+                let trace =
+                    test_helpers::trace_closure(&mut tracer, || test_helpers::work_loop(100));
+                assert!(trace.iter_blocks().all(|b| b.is_ok()));
+            }
+            let stats = tracer.stats();
+            let (hits, misses) = (stats.get("pool.hits").unwrap(), stats.get("pool.misses"));
+            assert_eq!(hits + misses.unwrap(), 3);
+            // A background refill may not be ready in time, in which case we don't wait.
+            if refill == PoolRefill::Inline {
+                assert_eq!(hits, 3);
+            }
+        }
+    }
 }
@@ -0,0 +1,277 @@
+//! Block addresses which don't depend on where code was loaded.
+//!
+//! A block's addresses depend on where its module (the executable, a shared object or the VDSO)
+//! happened to be loaded, so blocks from different runs or processes can't be compared directly.
+//! A `ModuleMap` turns an address into a `ModuleAddr`: the `ModuleId` of its module, derived from
+//! the module's ELF build-id (or from its code, if it has none), and the address's offset in the
+//! module's file. Both are the same wherever, and in whichever process, the module is loaded, so
+//! normalized blocks can be compared, merged and deduplicated with plain hash lookups.
+
+use super::cache::KeyHasher;
+use super::offline::build_id;
+use super::ImageSection;
+use crate::errors::HWTracerError;
+use crate::Block;
+use std::fmt::{self, Display, Formatter};
+use std::path::{Path, PathBuf};
+
+/// Identifies a module independently of its path and load address.
+#[derive(Clone, Copy, Debug, Eq, Hash, Ord, PartialEq, PartialOrd)]
+pub struct ModuleId(pub u64);
+
+impl Display for ModuleId {
+    fn fmt(&self, f: &mut Formatter) -> fmt::Result {
+        write!(f, "{:016x}", self.0)
+    }
+}
+
+/// An address, as an offset in its module's file.
+#[derive(Clone, Copy, Debug, Eq, Hash, Ord, PartialEq, PartialOrd)]
+pub struct ModuleAddr {
+    pub module: ModuleId,
+    pub offset: u64,
+}
+
+/// A block whose addresses are offsets in its module's file. (Both instructions of a block are
+/// always in the same module.)
+#[derive(Clone, Copy, Debug, Eq, Hash, Ord, PartialEq, PartialOrd)]
+pub struct ModuleBlock {
+    pub module: ModuleId,
+    pub first_instr: u64,
+    pub last_instr: u64,
+}
+
+/// A module of a code image.
+#[derive(Clone, Debug)]
+pub struct Module {
+    pub id: ModuleId,
+    /// The module's file in this image.
+    pub filename: PathBuf,
+    /// The module's GNU build-id, if it has one.
+    pub build_id: Option<Vec<u8>>,
+}
+
+// Where some of a module's code was loaded.
+#[derive(Debug)]
+pub(super) struct Range {
+    pub(super) vaddr: u64,
+    pub(super) size: u64,
+    // The offset of `vaddr`'s byte in the module's file.
+    pub(super) file_offset: u64,
+    // The index of the module in `ModuleMap::modules`.
+    pub(super) module: usize,
+}
+
+impl Range {
+    pub(super) fn contains(&self, addr: u64) -> bool {
+        addr >= self.vaddr && addr - self.vaddr < self.size
+    }
+}
+
+/// Maps the addresses of a code image to and from `ModuleAddr`s.
+#[derive(Debug)]
+pub struct ModuleMap {
+    modules: Vec<Module>,
+    // Sorted by `vaddr`.
+    ranges: Vec<Range>,
+}
+
+impl ModuleMap {
+    /// Makes the map of the code image `image`. Each file in `image` is one module.
+    pub fn new(image: &[ImageSection]) -> Result<Self, HWTracerError> {
+        let mut modules: Vec<Module> = Vec::new();
+        let mut ranges = Vec::new();
+        for sec in image {
+            let module = match modules.iter().position(|m| m.filename == sec.filename) {
+                Some(i) => i,
+                None => {
+                    let secs = image.iter().filter(|s| s.filename == sec.filename);
+                    modules.push(Self::module(&sec.filename, secs)?);
+                    modules.len() - 1
+                }
+            };
+            ranges.push(Range {
+                vaddr: sec.vaddr,
+                size: sec.size,
+                file_offset: sec.offset,
+                module,
+            });
+        }
+        ranges.sort_by_key(|r| r.vaddr);
+        Ok(Self { modules, ranges })
+    }
+
+    // Identifies the module in `filename`, whose sections in the image are `secs`.
+    fn module<'a, I: Iterator<Item = &'a ImageSection>>(
+        filename: &Path,
+        secs: I,
+    ) -> Result<Module, HWTracerError> {
+        let mut h = KeyHasher::new();
+        let build_id = build_id(filename)?;
+        match build_id {
+            Some(ref id) => {
+                h.write_u64(1);
+                h.write(id);
+            }
+            None => {
+                // Without a build-id, the module is identified by its code and where that is in
+                // the file.
+                h.write_u64(0);
+                for sec in secs {
+                    h.write_u64(sec.offset);
+                    h.write(&sec.read_code()?);
+                }
+            }
+        }
+        Ok(Module {
+            id: ModuleId(h.finish().0),
+            filename: filename.to_owned(),
+            build_id,
+        })
+    }
+
+    /// Makes the map of the code of the current process, as loaded now (see
+    /// `ImageSection::current_process()`, which writes the VDSO to `vdso_path`).
+    pub fn current_process<P: AsRef<Path>>(vdso_path: P) -> Result<Self, HWTracerError> {
+        Self::new(&ImageSection::current_process(vdso_path)?)
+    }
+
+    /// Returns the modules of the image.
+    pub fn modules(&self) -> &[Module] {
+        &self.modules
+    }
+
+    /// Returns the module `id`, if it is in the image.
+    pub fn module_by_id(&self, id: ModuleId) -> Option<&Module> {
+        self.modules.iter().find(|m| m.id == id)
+    }
+
+    /// Returns the range containing `addr`, if any.
+    pub(super) fn range_of(&self, addr: u64) -> Option<&Range> {
+        let i = self.ranges.partition_point(|r| r.vaddr <= addr);
+        let r = &self.ranges[i.checked_sub(1)?];
+        if r.contains(addr) {
+            Some(r)
+        } else {
+            None
+        }
+    }
+
+    /// Returns the module-relative form of `addr`, or `None` if `addr` isn't in the image.
+    pub fn normalize(&self, addr: u64) -> Option<ModuleAddr> {
+        let r = self.range_of(addr)?;
+        Some(ModuleAddr {
+            module: self.modules[r.module].id,
+            offset: r.file_offset + (addr - r.vaddr),
+        })
+    }
+
+    /// Returns the module-relative form of `block`, or `None` if it isn't in the image.
+    pub fn normalize_block(&self, block: &Block) -> Option<ModuleBlock> {
+        let first = self.normalize(block.first_instr())?;
+        let last = self.normalize(block.last_instr())?;
+        if first.module != last.module {
+            return None;
+        }
+        Some(ModuleBlock {
+            module: first.module,
+            first_instr: first.offset,
+            last_instr: last.offset,
+        })
+    }
+
+    /// Returns the address in this image of `addr`, or `None` if its module isn't loaded or that
+    /// part of it isn't mapped.
+    pub fn resolve(&self, addr: ModuleAddr) -> Option<u64> {
+        self.ranges
+            .iter()
+            .find(|r| {
+                self.modules[r.module].id == addr.module
+                    && addr.offset >= r.file_offset
+                    && addr.offset - r.file_offset < r.size
+            })
+            .map(|r| r.vaddr + (addr.offset - r.file_offset))
+    }
+
+    /// Returns `block` as a block in this image, or `None` if it can't be resolved.
+    pub fn resolve_block(&self, block: &ModuleBlock) -> Option<Block> {
+        let first = self.resolve(ModuleAddr {
+            module: block.module,
+            offset: block.first_instr,
+        })?;
+        let last = self.resolve(ModuleAddr {
+            module: block.module,
+            offset: block.last_instr,
+        })?;
+        Some(Block::new(first, last))
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::{ModuleAddr, ModuleMap};
+    use crate::backends::perf_pt::ImageSection;
+    use crate::Block;
+    use std::fs;
+    use tempfile::TempDir;
+
+    #[test]
+    fn test_normalize() {
+        let dir = TempDir::new().unwrap();
+        let (a, b, c) = (
+            dir.path().join("a"),
+            dir.path().join("b"),
+            dir.path().join("c"),
+        );
+        fs::write(&a, &[0x90; 0x3000]).unwrap();
+        fs::write(&b, &[0xc3; 0x1000]).unwrap();
+        // The same code as `a`, in another file.
+        fs::copy(&a, &c).unwrap();
+
+        // `a` has two sections, and `b` is loaded between them.
+        let run1 = ModuleMap::new(&[
+            ImageSection::new(&a, 0x1000, 0x1000, 0x40_1000),
+            ImageSection::new(&a, 0x2000, 0x800, 0x40_3000),
+            ImageSection::new(&b, 0, 0x1000, 0x40_2000),
+        ])
+        .unwrap();
+        assert_eq!(run1.modules().len(), 2);
+        let (ida, idb) = (run1.modules()[0].id, run1.modules()[1].id);
+        assert_ne!(ida, idb);
+        assert!(run1.modules()[0].build_id.is_none());
+
+        let addr = |module, offset| Some(ModuleAddr { module, offset });
+        assert_eq!(run1.normalize(0x40_1010), addr(ida, 0x1010));
+        assert_eq!(run1.normalize(0x40_2fff), addr(idb, 0xfff));
+        assert_eq!(run1.normalize(0x40_3010), addr(ida, 0x2010));
+        assert_eq!(run1.normalize(0x40_0fff), None);
+        assert_eq!(run1.normalize(0x40_3800), None);
+
+        // Another run, with the code loaded elsewhere from another path, normalizes the same.
+        let run2 = ModuleMap::new(&[
+            ImageSection::new(&c, 0x1000, 0x1000, 0x7f00_1000),
+            ImageSection::new(&c, 0x2000, 0x800, 0x7f00_2000),
+        ])
+        .unwrap();
+        let blk = Block::new(0x40_3010, 0x40_3020);
+        let norm = run1.normalize_block(&blk).unwrap();
+        assert_eq!(norm.module, ida);
+        assert_eq!(
+            run2.normalize_block(&Block::new(0x7f00_2010, 0x7f00_2020)),
+            Some(norm)
+        );
+        assert_eq!(run2.module_by_id(ida).unwrap().filename, c);
+        assert_eq!(
+            run2.resolve_block(&norm),
+            Some(Block::new(0x7f00_2010, 0x7f00_2020))
+        );
+        assert_eq!(run1.resolve_block(&norm), Some(blk));
+        // `b` isn't loaded in the second run.
+        assert_eq!(run2.resolve(run1.normalize(0x40_2000).unwrap()), None);
+        // A block can't straddle modules.
+        assert_eq!(
+            run1.normalize_block(&Block::new(0x40_1ff0, 0x40_2010)),
+            None
+        );
+    }
+}
@@ -0,0 +1,496 @@
+//! Decoding of Intel PT traces which were recorded elsewhere (e.g. read back from disk).
+//!
+//! Unlike traces collected by a `PerfPTThreadTracer`, these traces can't be decoded against the
+//! code of the current process, so the caller must describe the code image explicitly.
+
+use super::PerfPTTrace;
+use crate::errors::HWTracerError;
+use crate::{Block, Stats, Trace};
+use libc::c_char;
+use phdrs::{PF_X, PT_LOAD};
+use std::env;
+use std::fs;
+#[cfg(test)]
+use std::fs::File;
+use std::io::{self, Read, Seek, SeekFrom};
+use std::iter::Iterator;
+use std::os::unix::io::RawFd;
+use std::path::{Path, PathBuf};
+use std::slice;
+
+/// The bytes of a PSB packet. A decoder can synchronise at any of these.
+const PSB: [u8; 16] = [
+    0x02, 0x82, 0x02, 0x82, 0x02, 0x82, 0x02, 0x82, 0x02, 0x82, 0x02, 0x82, 0x02, 0x82, 0x02, 0x82,
+];
+
+// ELF constants we need. See elf(5).
+const ELFMAG: &[u8] = b"\x7fELF";
+const ELFCLASS64: u8 = 2;
+const ELFDATA2LSB: u8 = 1;
+pub(super) const ELF64_EHDR_SIZE: usize = 64;
+const ELF64_PHDR_SIZE: usize = 56;
+pub(super) const ELF_PT_LOAD: u32 = 1;
+const ELF_PT_NOTE: u32 = 4;
+pub(super) const ELF_PF_X: u32 = 1;
+const ELF_NT_GNU_BUILD_ID: u32 = 3;
+
+// The name under which the VDSO appears in the list of loaded objects.
+const VDSO_NAME: &str = "linux-vdso.so.1";
+
+/// A region of a file containing code which was loaded at `vaddr` when a trace was recorded.
+#[derive(Clone, Debug, Eq, PartialEq)]
+pub struct ImageSection {
+    /// The file containing the code.
+    pub filename: PathBuf,
+    /// Offset of the region within `filename` (in bytes).
+    pub offset: u64,
+    /// Size of the region (in bytes).
+    pub size: u64,
+    /// The virtual address at which the region was loaded.
+    pub vaddr: u64,
+}
+
+impl ImageSection {
+    pub fn new<P: AsRef<Path>>(filename: P, offset: u64, size: u64, vaddr: u64) -> Self {
+        Self {
+            filename: filename.as_ref().to_owned(),
+            offset,
+            size,
+            vaddr,
+        }
+    }
+
+    /// Parses a section from a ptxed-style `--raw` argument of the form `file:begin-end:vaddr`.
+    ///
+    /// Numbers may be given in decimal or in hex with a `0x` prefix.
+    pub fn parse_raw(s: &str) -> Result<Self, HWTracerError> {
+        let bad = || HWTracerError::BadConfig(format!("bad image section: {}", s));
+        // Split from the right, as the filename may itself contain colons.
+        let mut parts = s.rsplitn(3, ':');
+        let vaddr = parts.next().ok_or_else(bad)?;
+        let range = parts.next().ok_or_else(bad)?;
+        let filename = parts.next().ok_or_else(bad)?;
+        let mut range = range.splitn(2, '-');
+        let begin = parse_num(range.next().ok_or_else(bad)?).ok_or_else(bad)?;
+        let end = parse_num(range.next().ok_or_else(bad)?).ok_or_else(bad)?;
+        let vaddr = parse_num(vaddr).ok_or_else(bad)?;
+        if filename.is_empty() || end < begin {
+            return Err(bad());
+        }
+        Ok(Self::new(filename, begin, end - begin, vaddr))
+    }
+
+    /// Splits an `--elf` argument of the form `file[:base]` into the file and the base address
+    /// to pass to `from_elf()`. The base defaults to 0, and a suffix which isn't a number is taken
+    /// to be part of the filename.
+    pub fn split_elf_arg(s: &str) -> (&str, u64) {
+        match s.rfind(':').map(|i| (i, parse_num(&s[i + 1..]))) {
+            Some((i, Some(base))) => (&s[..i], base),
+            _ => (s, 0),
+        }
+    }
+
+    /// Reads the section's bytes from its file.
+    pub(super) fn read_code(&self) -> Result<Vec<u8>, HWTracerError> {
+        let mut code = vec![0; self.size as usize];
+        let mut file = fs::File::open(&self.filename)?;
+        file.seek(SeekFrom::Start(self.offset))?;
+        file.read_exact(&mut code)?;
+        Ok(code)
+    }
+
+    /// Formats the section as a ptxed-style `--raw` argument, as read by `parse_raw()`.
+    pub fn to_raw(&self) -> String {
+        format!(
+            "{}:{:#x}-{:#x}:{:#x}",
+            self.filename.display(),
+            self.offset,
+            self.offset + self.size,
+            self.vaddr
+        )
+    }
+
+    /// Returns the sections for the loadable and executable segments of the ELF file `filename`,
+    /// assuming that it was loaded at `base` (which is 0 for non-position-independent code).
+    pub fn from_elf<P: AsRef<Path>>(filename: P, base: u64) -> Result<Vec<Self>, HWTracerError> {
+        let filename = filename.as_ref();
+        let mut file = fs::File::open(filename)?;
+        let (phdrs, phentsize) = match read_phdrs(&mut file, filename)? {
+            Some(p) => p,
+            None => return Err(invalid_elf(filename, "not a little-endian ELF64 file")),
+        };
+
+        let mut sections = Vec::new();
+        for phdr in phdrs.chunks(phentsize) {
+            // Only use loadable and executable segments.
+            if read_u32(phdr, 0) != ELF_PT_LOAD || read_u32(phdr, 4) & ELF_PF_X == 0 {
+                continue;
+            }
+            let offset = read_u64(phdr, 8);
+            let vaddr = read_u64(phdr, 16);
+            let filesz = read_u64(phdr, 32);
+            sections.push(Self::new(filename, offset, filesz, base + vaddr));
+        }
+        Ok(sections)
+    }
+
+    /// Returns the sections making up the code of the current process, such that a trace of the
+    /// current process can later be decoded elsewhere (given the same files).
+    ///
+    /// The VDSO doesn't exist on disk, so its code is written to `vdso_path`.
+    pub fn current_process<P: AsRef<Path>>(vdso_path: P) -> Result<Vec<Self>, HWTracerError> {
+        let exe = env::current_exe()?;
+        let mut sections = Vec::new();
+        for obj in phdrs::objects() {
+            let obj_name = obj.name().to_str().map_err(|e| {
+                HWTracerError::Custom(Box::new(io::Error::new(io::ErrorKind::InvalidData, e)))
+            })?;
+            for hdr in obj.iter_phdrs() {
+                if hdr.type_() != PT_LOAD || hdr.flags() & PF_X.0 == 0 {
+                    continue; // Only look at loadable and executable segments.
+                }
+                let vaddr = obj.addr() + hdr.vaddr();
+                if obj_name == VDSO_NAME {
+                    let code =
+                        unsafe { slice::from_raw_parts(vaddr as *const u8, hdr.memsz() as usize) };
+                    fs::write(vdso_path.as_ref(), code)?;
+                    sections.push(Self::new(vdso_path.as_ref(), 0, hdr.memsz(), vaddr));
+                } else if obj_name.is_empty() {
+                    // On Linux, an empty name means that it is the executable itself.
+                    sections.push(Self::new(&exe, hdr.offset(), hdr.filesz(), vaddr));
+                } else {
+                    sections.push(Self::new(obj_name, hdr.offset(), hdr.filesz(), vaddr));
+                }
+            }
+        }
+        Ok(sections)
+    }
+}
+
+/// Returns the GNU build-id of the ELF file `filename`, or `None` if it doesn't have one (or isn't
+/// a little-endian ELF64 file, e.g. a VDSO dumped by `current_process()`).
+pub fn build_id<P: AsRef<Path>>(filename: P) -> Result<Option<Vec<u8>>, HWTracerError> {
+    let filename = filename.as_ref();
+    let mut file = fs::File::open(filename)?;
+    let (phdrs, phentsize) = match read_phdrs(&mut file, filename)? {
+        Some(p) => p,
+        None => return Ok(None),
+    };
+    for phdr in phdrs.chunks(phentsize) {
+        if read_u32(phdr, 0) != ELF_PT_NOTE {
+            continue;
+        }
+        let offset = read_u64(phdr, 8);
+        let filesz = read_u64(phdr, 32) as usize;
+        // Notes are padded to the segment's alignment, which is 4 or 8.
+        let align = if read_u64(phdr, 48) == 8 { 8 } else { 4 };
+        let pad = |n: usize| (n + align - 1) & !(align - 1);
+        let mut notes = vec![0; filesz];
+        file.seek(SeekFrom::Start(offset))?;
+        file.read_exact(&mut notes)?;
+
+        let mut off = 0;
+        while off + 12 <= notes.len() {
+            let namesz = read_u32(&notes, off) as usize;
+            let descsz = read_u32(&notes, off + 4) as usize;
+            let name_off = off + 12;
+            let desc_off = name_off + pad(namesz);
+            if desc_off + descsz > notes.len() {
+                break;
+            }
+            if read_u32(&notes, off + 8) == ELF_NT_GNU_BUILD_ID
+                && &notes[name_off..name_off + namesz] == b"GNU\0"
+            {
+                return Ok(Some(notes[desc_off..desc_off + descsz].to_vec()));
+            }
+            off = desc_off + pad(descsz);
+        }
+    }
+    Ok(None)
+}
+
+/// Reads the program headers of the ELF file `file` (opened from `filename`), returning them and
+/// the size of each, or `None` if `file` isn't a little-endian ELF64 file.
+pub(super) fn read_phdrs(
+    file: &mut fs::File,
+    filename: &Path,
+) -> Result<Option<(Vec<u8>, usize)>, HWTracerError> {
+    let mut ehdr = [0; ELF64_EHDR_SIZE];
+    match file.read_exact(&mut ehdr) {
+        Ok(()) => (),
+        Err(e) if e.kind() == io::ErrorKind::UnexpectedEof => return Ok(None),
+        Err(e) => return Err(e.into()),
+    }
+    if &ehdr[..4] != ELFMAG || ehdr[4] != ELFCLASS64 || ehdr[5] != ELFDATA2LSB {
+        return Ok(None);
+    }
+    let phoff = read_u64(&ehdr, 32);
+    let phentsize = read_u16(&ehdr, 54) as usize;
+    let phnum = read_u16(&ehdr, 56) as usize;
+    if phentsize < ELF64_PHDR_SIZE {
+        return Err(invalid_elf(filename, "bad program header size"));
+    }
+
+    let mut phdrs = vec![0; phentsize * phnum];
+    file.seek(SeekFrom::Start(phoff))?;
+    file.read_exact(&mut phdrs)?;
+    Ok(Some((phdrs, phentsize)))
+}
+
+/// Parses a decimal or `0x`-prefixed hex number.
+pub fn parse_num(s: &str) -> Option<u64> {
+    if s.starts_with("0x") {
+        u64::from_str_radix(&s[2..], 16).ok()
+    } else {
+        s.parse().ok()
+    }
+}
+
+pub(super) fn read_u16(buf: &[u8], off: usize) -> u16 {
+    let mut b = [0; 2];
+    b.copy_from_slice(&buf[off..off + 2]);
+    u16::from_le_bytes(b)
+}
+
+pub(super) fn read_u32(buf: &[u8], off: usize) -> u32 {
+    let mut b = [0; 4];
+    b.copy_from_slice(&buf[off..off + 4]);
+    u32::from_le_bytes(b)
+}
+
+pub(super) fn read_u64(buf: &[u8], off: usize) -> u64 {
+    let mut b = [0; 8];
+    b.copy_from_slice(&buf[off..off + 8]);
+    u64::from_le_bytes(b)
+}
+
+fn invalid_elf(filename: &Path, msg: &str) -> HWTracerError {
+    HWTracerError::Custom(Box::new(io::Error::new(
+        io::ErrorKind::InvalidData,
+        format!("{}: {}", filename.display(), msg),
+    )))
+}
+
+/// A C-level image section.
+///
+/// Must stay in sync with the C code.
+#[repr(C)]
+pub(super) struct PerfPTImageSection {
+    pub(super) filename: *const c_char,
+    pub(super) offset: u64,
+    pub(super) size: u64,
+    pub(super) vaddr: u64,
+}
+
+/// Returns the offset of the first PSB packet at or after `from` in the raw trace `data`.
+pub fn next_psb(data: &[u8], from: usize) -> Option<usize> {
+    let mut i = from;
+    while i + PSB.len() <= data.len() {
+        // Cheaply skip bytes which can't start a PSB before doing a full comparison.
+        if data[i] == PSB[0] && data[i + 1] == PSB[1] && data[i..i + PSB.len()] == PSB {
+            return Some(i);
+        }
+        i += 1;
+    }
+    None
+}
+
+/// Returns the offsets of all PSB packets in the raw trace `data`.
+///
+/// Since the packets following a PSB carry the full decoder state, a trace can be split at these
+/// offsets and each piece decoded independently.
+pub fn psb_offsets(data: &[u8]) -> Vec<usize> {
+    let mut offs = Vec::new();
+    let mut from = 0;
+    while let Some(off) = next_psb(data, from) {
+        offs.push(off);
+        from = off + PSB.len();
+    }
+    offs
+}
+
+/// An Intel PT trace recorded elsewhere, decoded against an explicitly described code image.
+#[derive(Debug)]
+pub struct PerfPTRawTrace {
+    // The raw PT packets.
+    trace: PerfPTTrace,
+    // The code the trace ran through.
+    image: Vec<ImageSection>,
+}
+
+impl PerfPTRawTrace {
+    /// Makes a trace from a copy of the raw PT packets in `data`, which will be decoded against
+    /// the code described by `image`.
+    pub fn new(data: &[u8], image: Vec<ImageSection>) -> Result<Self, HWTracerError> {
+        Ok(Self {
+            trace: PerfPTTrace::from_bytes(data)?,
+            image,
+        })
+    }
+
+    /// Makes a trace from the raw PT packets in the file `path`.
+    pub fn from_file<P: AsRef<Path>>(
+        path: P,
+        image: Vec<ImageSection>,
+    ) -> Result<Self, HWTracerError> {
+        Self::new(&fs::read(path)?, image)
+    }
+
+    /// Makes a trace from an existing trace's packets.
+    pub(super) fn from_trace(trace: PerfPTTrace, image: Vec<ImageSection>) -> Self {
+        Self { trace, image }
+    }
+
+    /// Returns the code image this trace is decoded against.
+    pub fn image(&self) -> &[ImageSection] {
+        &self.image
+    }
+}
+
+impl Trace for PerfPTRawTrace {
+    #[cfg(test)]
+    fn to_file(&self, file: &mut File) {
+        self.trace.to_file(file)
+    }
+
+    fn raw_data(&self) -> &[u8] {
+        self.trace.raw_data()
+    }
+
+    fn shared_fd(&self) -> Option<RawFd> {
+        self.trace.shared_fd()
+    }
+
+    fn iter_blocks<'t: 'i, 'i>(
+        &'t self,
+    ) -> Box<dyn Iterator<Item = Result<Block, HWTracerError>> + 'i> {
+        self.trace.iter_blocks_with(Some(&self.image))
+    }
+
+    fn stats(&self) -> Stats {
+        self.trace.stats()
+    }
+
+    #[cfg(test)]
+    fn capacity(&self) -> usize {
+        self.trace.capacity()
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::{build_id, next_psb, psb_offsets, ImageSection, PSB};
+    use std::env;
+
+    #[test]
+    fn test_psb_offsets() {
+        let mut data = vec![0x02, 0x82, 0x00];
+        data.extend_from_slice(&PSB);
+        data.extend_from_slice(&[0x00; 5]);
+        data.extend_from_slice(&PSB);
+        data.push(0x00);
+        // A truncated PSB at the end of the buffer doesn't count.
+        data.extend_from_slice(&PSB[..8]);
+
+        assert_eq!(psb_offsets(&data), vec![3, 24]);
+        // A search starting inside a PSB skips it.
+        assert_eq!(next_psb(&data, 4), Some(24));
+        assert_eq!(next_psb(&data, 25), None);
+        assert_eq!(next_psb(&data, 41), None);
+        assert!(psb_offsets(&[]).is_empty());
+    }
+
+    #[test]
+    fn test_parse_raw() {
+        let sec = ImageSection::parse_raw("/a:b/c.so:0x1000-0x3000:0x7f0000001000").unwrap();
+        assert_eq!(
+            sec,
+            ImageSection::new("/a:b/c.so", 0x1000, 0x2000, 0x7f0000001000)
+        );
+        let sec = ImageSection::parse_raw("prog:0-16:4096").unwrap();
+        assert_eq!(sec, ImageSection::new("prog", 0, 16, 4096));
+
+        for bad in &["prog", "prog:0-16", ":0-16:0", "prog:16-0:0", "prog:0x-1:0"] {
+            assert!(ImageSection::parse_raw(bad).is_err());
+        }
+    }
+
+    #[test]
+    fn test_split_elf_arg() {
+        assert_eq!(ImageSection::split_elf_arg("prog"), ("prog", 0));
+        assert_eq!(ImageSection::split_elf_arg("prog:4096"), ("prog", 4096));
+        assert_eq!(
+            ImageSection::split_elf_arg("/a:b/c.so:0x1000"),
+            ("/a:b/c.so", 0x1000)
+        );
+        assert_eq!(ImageSection::split_elf_arg("/a:b/c.so"), ("/a:b/c.so", 0));
+    }
+
+    #[test]
+    fn test_current_process() {
+        let vdso = tempfile::NamedTempFile::new().unwrap();
+        let secs = ImageSection::current_process(vdso.path()).unwrap();
+        let exe = env::current_exe().unwrap();
+        assert!(secs.iter().any(|s| s.filename == exe));
+        for sec in secs {
+            assert!(sec.filename.exists());
+            assert!(sec.size > 0);
+        }
+    }
+
+    #[test]
+    fn test_from_elf() {
+        let exe = env::current_exe().unwrap();
+        let secs = ImageSection::from_elf(&exe, 0x1000).unwrap();
+        assert!(!secs.is_empty());
+        for sec in secs {
+            assert_eq!(sec.filename, exe);
+            assert!(sec.size > 0);
+            assert!(sec.vaddr >= 0x1000);
+        }
+
+        // Not an ELF file.
+        let tmp = tempfile::NamedTempFile::new().unwrap();
+        std::fs::write(tmp.path(), &[0; 128]).unwrap();
+        assert!(ImageSection::from_elf(tmp.path(), 0).is_err());
+    }
+
+    #[test]
+    fn test_build_id() {
+        // An ELF header, one PT_NOTE program header, and two notes, the second of which is the
+        // build-id.
+        fn put(buf: &mut Vec<u8>, off: usize, bytes: &[u8]) {
+            buf[off..off + bytes.len()].copy_from_slice(bytes);
+        }
+        let mut elf = vec![0; 120];
+        put(&mut elf, 0, b"\x7fELF\x02\x01");
+        put(&mut elf, 32, &64u64.to_le_bytes());
+        put(&mut elf, 54, &56u16.to_le_bytes());
+        put(&mut elf, 56, &1u16.to_le_bytes());
+        put(&mut elf, 64, &4u32.to_le_bytes());
+        put(&mut elf, 72, &120u64.to_le_bytes());
+        put(&mut elf, 96, &48u64.to_le_bytes());
+        put(&mut elf, 112, &4u64.to_le_bytes());
+        for &(ty, desc) in &[(1u32, &[9u8; 6][..]), (3, &[1, 2, 3, 4, 5][..])] {
+            elf.extend_from_slice(&4u32.to_le_bytes());
+            elf.extend_from_slice(&(desc.len() as u32).to_le_bytes());
+            elf.extend_from_slice(&ty.to_le_bytes());
+            elf.extend_from_slice(b"GNU\0");
+            elf.extend_from_slice(desc);
+            elf.resize((elf.len() + 3) & !3, 0);
+        }
+        assert_eq!(elf.len(), 120 + 48);
+        let tmp = tempfile::NamedTempFile::new().unwrap();
+        std::fs::write(tmp.path(), &elf).unwrap();
+        assert_eq!(build_id(tmp.path()).unwrap(), Some(vec![1, 2, 3, 4, 5]));
+
+        // No notes.
+        put(&mut elf, 64, &1u32.to_le_bytes());
+        std::fs::write(tmp.path(), &elf).unwrap();
+        assert_eq!(build_id(tmp.path()).unwrap(), None);
+
+        // Not an ELF file.
+        std::fs::write(tmp.path(), &[0; 16]).unwrap();
+        assert_eq!(build_id(tmp.path()).unwrap(), None);
+    }
+}
@@ -46,12 +46,14 @@
 #include <stddef.h>
 #include <inttypes.h>
 #include <stdbool.h>
+#include <stdatomic.h>
 
 enum perf_pt_cerror_kind {
     perf_pt_cerror_unused,
     perf_pt_cerror_unknown,
     perf_pt_cerror_errno,
     perf_pt_cerror_ipt,
+    perf_pt_cerror_timeout, // Code: milliseconds waited.
 };
 
 struct perf_pt_cerror {
@@ -59,8 +61,148 @@ struct perf_pt_cerror {
     int code;                      // The error code itself.
 };
 
+/*
+ * The manually malloc/free'd buffer managed by the Rust side.
+ * To understand why this is split out from `struct perf_pt_trace`, see the
+ * corresponding struct in the Rust side.
+ */
+struct perf_pt_trace_buf {
+    void *p;
+};
+
+/*
+ * Storage for a trace.
+ *
+ * Shared with Rust code. Must stay in sync.
+ */
+struct perf_pt_trace {
+    struct perf_pt_trace_buf buf;
+    uint64_t len;
+    uint64_t capacity;
+    uint64_t budget;    // The memory budget growing `buf` must stay within
+                        // (0 = unlimited). See budget.c.
+    uint64_t max_len;   // Stop collecting once `len` reaches this
+                        // (0 = unlimited).
+    int memfd;          // If not -1, `buf` is a shared mapping of this memfd,
+                        // sized to `capacity`, rather than malloc(3)d.
+    bool truncated;     // Set when collection stopped at `max_len`.
+};
+
+/*
+ * Statistics gathered by the collector during a tracing session.
+ *
+ * Only the collector thread writes these, but other threads may read them
+ * while it runs, so all accesses go through the PERF_PT_STAT_* macros below.
+ * All fields must be uint64_t.
+ *
+ * Shared with Rust code. Must stay in sync.
+ */
+struct perf_pt_collector_stats {
+    uint64_t wakeups;           // Times the poll loop woke up.
+    uint64_t aux_bytes;         // Bytes drained from the AUX buffer.
+    uint64_t aux_records;       // PERF_RECORD_AUX records seen.
+    uint64_t lost_records;      // PERF_RECORD_LOST records seen.
+    uint64_t itrace_start_records; // PERF_RECORD_ITRACE_START records seen.
+    uint64_t other_records;     // Records of any other type seen.
+    uint64_t reallocs;          // Times the trace storage was grown.
+    uint64_t bytes_copied;      // Bytes copied out of the data and AUX buffers.
+    uint64_t copy_ns;           // Time spent copying them.
+    uint64_t max_aux_fill;      // Most bytes waiting in the AUX buffer at once.
+    uint64_t aux_partial;       // AUX records flagged PERF_AUX_FLAG_PARTIAL.
+    uint64_t aux_collision;     // AUX records flagged PERF_AUX_FLAG_COLLISION.
+    uint64_t aux_truncated;     // AUX records flagged PERF_AUX_FLAG_TRUNCATED.
+    uint64_t spin_hits;         // Busy-polls which found new data.
+    uint64_t spin_misses;       // Busy-polls which gave up and fell back to poll(2).
+    uint64_t spin_ns;           // Time spent busy-polling.
+    uint64_t discarded_bytes;   // AUX bytes dropped after truncation.
+};
+
+// With a single writer, relaxed loads and stores are enough to make the
+// counters safe to read concurrently, and no atomic read-modify-write
+// instructions are needed.
+#define PERF_PT_STAT_LOAD(field) \
+    atomic_load_explicit((_Atomic uint64_t *) &(field), memory_order_relaxed)
+#define PERF_PT_STAT_SET(field, val) \
+    atomic_store_explicit((_Atomic uint64_t *) &(field), (val), memory_order_relaxed)
+#define PERF_PT_STAT_ADD(field, n) \
+    PERF_PT_STAT_SET(field, PERF_PT_STAT_LOAD(field) + (n))
+#define PERF_PT_STAT_MAX(field, val) do { \
+        if ((val) > PERF_PT_STAT_LOAD(field)) { \
+            PERF_PT_STAT_SET(field, val); \
+        } \
+    } while (0)
+
+/*
+ * Counts of the events seen by a decoder, indexed by `enum pt_event_type`.
+ *
+ * Shared with Rust code. Must stay in sync.
+ */
+#define PERF_PT_MAX_EVENT_TYPES 32
+struct perf_pt_decoder_stats {
+    uint64_t events[PERF_PT_MAX_EVENT_TYPES];
+};
+
+/*
+ * Process-wide latency histograms.
+ *
+ * Each histogram has log-linear buckets: values below PERF_PT_HIST_SUB get a
+ * bucket each, and every power of two range above that is split into
+ * PERF_PT_HIST_SUB equally sized buckets. This bounds the relative error of a
+ * bucket to 1/PERF_PT_HIST_SUB over the whole uint64_t range. Buckets are
+ * updated with relaxed atomic adds, so any thread may record a value.
+ *
+ * Shared with Rust code. Must stay in sync.
+ */
+#define PERF_PT_HIST_SUB_BITS 3
+#define PERF_PT_HIST_SUB (1 << PERF_PT_HIST_SUB_BITS)
+#define PERF_PT_HIST_BUCKETS ((64 - PERF_PT_HIST_SUB_BITS + 1) * PERF_PT_HIST_SUB)
+
+enum perf_pt_hist_kind {
+    perf_pt_hist_start,         // perf_pt_start_tracer().
+    perf_pt_hist_stop,          // perf_pt_stop_tracer().
+    perf_pt_hist_drain,         // Poll loop wakeup until the buffers are drained.
+    perf_pt_hist_decode_ttfb,   // Starting to decode until the first block.
+    perf_pt_hist_open_wait,     // Queueing in the arbiter for a session.
+    perf_pt_hist_kinds,         // The number of histograms. Must be last.
+};
+
+struct perf_pt_hist {
+    uint64_t count;             // Values recorded.
+    uint64_t sum;               // Their sum.
+    uint64_t max;               // The largest of them.
+    uint64_t buckets[PERF_PT_HIST_BUCKETS];
+};
+
+// The kinds of memory accounted by the memory budget (see budget.c).
+enum perf_pt_budget_kind {
+    perf_pt_budget_bufs,        // Perf buffers.
+    perf_pt_budget_trace,       // Trace storage.
+};
+
+struct perf_event_mmap_page;
+
 bool dump_vdso(int, uint64_t, size_t, struct perf_pt_cerror *);
 void perf_pt_set_err(struct perf_pt_cerror *, int, int);
+uint64_t perf_pt_now_ns(void);
+uint64_t perf_pt_thread_cpu_ns(void);
+bool perf_pt_poll_loop(int, int, struct perf_event_mmap_page *, void *,
+                       struct perf_pt_trace *, uint64_t,
+                       void (*)(void *, uint64_t), void *,
+                       struct perf_pt_collector_stats *, struct perf_pt_cerror *);
+void perf_pt_read_collector_stats(const struct perf_pt_collector_stats *,
+                                  struct perf_pt_collector_stats *);
+int perf_pt_hist_bucket(uint64_t);
+void perf_pt_hist_record(int, uint64_t);
+void perf_pt_hist_snapshot(int, struct perf_pt_hist *);
+void perf_pt_copy(void *, const void *, size_t);
+int perf_pt_arbiter_open(int (*)(void *), void *, int, uint64_t, uint64_t *,
+                         struct perf_pt_cerror *);
+void perf_pt_arbiter_release(void);
+bool perf_pt_budget_reserve(enum perf_pt_budget_kind, uint64_t, uint64_t);
+void perf_pt_budget_release(enum perf_pt_budget_kind, uint64_t);
+void perf_pt_budget_note_downsized(void);
+int perf_pt_flight_register(int, struct perf_event_mmap_page *, void *, size_t);
+void perf_pt_flight_unregister(int);
 
 #define VDSO_NAME "linux-vdso.so.1"
 
@@ -0,0 +1,187 @@
+//! Tracer contexts prepared ahead of time.
+//!
+//! Initialising a tracer context (opening the perf file descriptor and mapping its buffers) is the
+//! most expensive part of starting to trace. With `PerfPTConfig::pool_refill` set, a thread tracer
+//! prepares its next context when it is created and after each session ends, so that
+//! `start_tracing()` only has to enable a context which is ready.
+//!
+//! The kernel allows only one Intel PT event per thread, so each thread tracer holds at most one
+//! prepared context, and it can only be prepared while the thread isn't being traced.
+//! `PerfPTConfig::pool_depth` bounds how many prepared contexts the whole process holds, since
+//! each one pins its buffers' memory.
+//!
+//! A context is prepared with the AUX buffer size of the session which just ended (which may have
+//! been learned for its tag), on the assumption that the next session is similar. A session which
+//! needs a different size discards the prepared context.
+
+use super::{perf_pt_free_tracer, perf_pt_init_tracer, PerfPTCError};
+use crate::backends::{PerfPTConfig, PoolRefill};
+use crate::errors::HWTracerError;
+use lazy_static::lazy_static;
+use libc::{c_void, pid_t, size_t};
+use std::sync::atomic::{AtomicU64, AtomicUsize, Ordering};
+use std::sync::mpsc::{self, Sender};
+use std::sync::{Arc, Mutex, Weak};
+use std::thread;
+
+// How many prepared contexts the process holds.
+static PREPARED: AtomicUsize = AtomicUsize::new(0);
+
+lazy_static! {
+    // The background refill thread, which prepares contexts for the pools sent to it.
+    static ref REFILLER: Mutex<Sender<Weak<Pool>>> = {
+        let (tx, rx) = mpsc::channel::<Weak<Pool>>();
+        thread::Builder::new()
+            .name("hwtracer-refill".to_owned())
+            .spawn(move || {
+                for pool in rx {
+                    if let Some(pool) = pool.upgrade() {
+                        pool.fill();
+                    }
+                }
+            })
+            .expect("can't spawn the context refill thread");
+        Mutex::new(tx)
+    };
+}
+
+/// A tracer context initialised by `perf_pt_init_tracer()`, but never started, and the size of
+/// its AUX buffer.
+struct PreparedCtx(*mut c_void, size_t);
+
+// A prepared context isn't used until it is taken out of the pool, by the thread it traces.
+unsafe impl Send for PreparedCtx {}
+
+impl Drop for PreparedCtx {
+    fn drop(&mut self) {
+        unsafe { perf_pt_free_tracer(self.0, &mut PerfPTCError::new()) };
+        PREPARED.fetch_sub(1, Ordering::Relaxed);
+    }
+}
+
+struct Slot {
+    ctx: Option<PreparedCtx>,
+    // The AUX buffer size of the context to prepare, if one should be. Cleared when a session
+    // starts, so that a late background refill doesn't try to open a second perf event for a
+    // thread being traced.
+    wanted: Option<size_t>,
+}
+
+/// The prepared context (if any) of one thread tracer.
+pub(super) struct Pool {
+    config: PerfPTConfig,
+    // The thread to trace.
+    tid: pid_t,
+    // Held while a context is being prepared, so that `take()` waits for it rather than opening a
+    // second (conflicting) perf event for the thread.
+    slot: Mutex<Slot>,
+    // Sessions started with (hits) and without (misses) a prepared context.
+    hits: AtomicU64,
+    misses: AtomicU64,
+}
+
+impl Pool {
+    /// Returns a pool for the calling thread, or `None` if `config` doesn't ask for one.
+    pub(super) fn new(config: &PerfPTConfig) -> Option<Arc<Self>> {
+        if config.pool_refill == PoolRefill::Off || config.pool_depth == 0 {
+            return None;
+        }
+        Some(Arc::new(Self {
+            config: config.clone(),
+            tid: unsafe { libc::syscall(libc::SYS_gettid) } as pid_t,
+            slot: Mutex::new(Slot {
+                ctx: None,
+                wanted: None,
+            }),
+            hits: AtomicU64::new(0),
+            misses: AtomicU64::new(0),
+        }))
+    }
+
+    /// Prepares a context if one is wanted, unless there already is one or the process holds
+    /// `pool_depth` prepared contexts. Errors are ignored: `start_tracing()` then initialises a
+    /// context itself, and reports the error.
+    fn fill(&self) {
+        let mut slot = self.slot.lock().unwrap();
+        if slot.ctx.is_some() {
+            return;
+        }
+        let aux_bufsize = match slot.wanted.take() {
+            Some(a) => a,
+            None => return,
+        };
+        if PREPARED.fetch_add(1, Ordering::Relaxed) >= self.config.pool_depth {
+            PREPARED.fetch_sub(1, Ordering::Relaxed);
+            return;
+        }
+        let ctx = if aux_bufsize == self.config.aux_bufsize {
+            unsafe { perf_pt_init_tracer(&self.config, self.tid, &mut PerfPTCError::new()) }
+        } else {
+            let config = PerfPTConfig {
+                aux_bufsize,
+                ..self.config.clone()
+            };
+            unsafe { perf_pt_init_tracer(&config, self.tid, &mut PerfPTCError::new()) }
+        };
+        if ctx.is_null() {
+            PREPARED.fetch_sub(1, Ordering::Relaxed);
+        } else {
+            slot.ctx = Some(PreparedCtx(ctx, aux_bufsize));
+        }
+    }
+
+    /// Prepares a context with an AUX buffer of `aux_bufsize` pages, according to the refill
+    /// policy: now, or on the refill thread. Must not be called while the thread is being traced.
+    pub(super) fn refill(self: &Arc<Self>, aux_bufsize: size_t) {
+        self.slot.lock().unwrap().wanted = Some(aux_bufsize);
+        match self.config.pool_refill {
+            PoolRefill::Off => (),
+            PoolRefill::Inline => self.fill(),
+            PoolRefill::Background => {
+                // If the refill thread has gone, `start_tracing()` falls back to initialising.
+                let _ = REFILLER.lock().unwrap().send(Arc::downgrade(self));
+            }
+        }
+    }
+
+    /// Takes the prepared context, waiting if it is being prepared, or returns `None` if there
+    /// isn't one with an AUX buffer of `aux_bufsize` pages. The caller owns the context (and must
+    /// free it).
+    pub(super) fn take(&self, aux_bufsize: size_t) -> Option<*mut c_void> {
+        let mut slot = self.slot.lock().unwrap();
+        slot.wanted = None;
+        match slot.ctx.take() {
+            Some(ctx) if ctx.1 == aux_bufsize => {
+                self.hits.fetch_add(1, Ordering::Relaxed);
+                let ptr = ctx.0;
+                std::mem::forget(ctx);
+                PREPARED.fetch_sub(1, Ordering::Relaxed);
+                Some(ptr)
+            }
+            _ => {
+                // A context of the wrong size is freed (when dropped here), as it holds the
+                // thread's perf event.
+                self.misses.fetch_add(1, Ordering::Relaxed);
+                None
+            }
+        }
+    }
+
+    /// Returns how many sessions started with and without a prepared context.
+    pub(super) fn hits_misses(&self) -> (u64, u64) {
+        (
+            self.hits.load(Ordering::Relaxed),
+            self.misses.load(Ordering::Relaxed),
+        )
+    }
+}
+
+/// Checks the pool settings in `config`.
+pub(super) fn check_config(config: &PerfPTConfig) -> Result<(), HWTracerError> {
+    if config.pool_refill != PoolRefill::Off && config.pool_depth == 0 {
+        return Err(HWTracerError::BadConfig(String::from(
+            "pool_depth must be positive when pool_refill is enabled",
+        )));
+    }
+    Ok(())
+}
@@ -0,0 +1,99 @@
+// Copyright (c) 2018 King's College London
+// created by the Software Development Team <http://soft-dev.org/>
+//
+// The Universal Permissive License (UPL), Version 1.0
+//
+// Subject to the condition set forth below, permission is hereby granted to any
+// person obtaining a copy of this software, associated documentation and/or
+// data (collectively the "Software"), free of charge and under any and all
+// copyright rights in the Software, and any and all patent rights owned or
+// freely licensable by each licensor hereunder covering either (i) the
+// unmodified Software as contributed to or provided by such licensor, or (ii)
+// the Larger Works (as defined below), to deal in both
+//
+// (a) the Software, and
+// (b) any piece of software and/or hardware listed in the lrgrwrks.txt file
+// if one is included with the Software (each a "Larger Work" to which the Software
+// is contributed by such licensors),
+//
+// without restriction, including without limitation the rights to copy, create
+// derivative works of, display, perform, and distribute the Software and make,
+// use, sell, offer for sale, import, export, have made, and have sold the
+// Software and the Larger Work(s), and to sublicense the foregoing rights on
+// either these or other terms.
+//
+// This license is subject to the following condition: The above copyright
+// notice and either this complete permission notice or at a minimum a reference
+// to the UPL must be included in all copies or substantial portions of the
+// Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+/*
+ * USDT (statically defined tracing) probes.
+ *
+ * When <sys/sdt.h> is available at build time (see build.rs), each probe is a
+ * nop instruction plus an ELF note describing where its arguments live, which
+ * tools such as bpftrace, perf and SystemTap can attach to at runtime. When no
+ * tool is attached, a probe costs one nop. Without <sys/sdt.h> the probes
+ * compile to nothing.
+ *
+ * All probes are in the `hwtracer` provider. For example:
+ *
+ *   bpftrace -e 'usdt:./prog:hwtracer:aux_drain { @bytes = hist(arg0); }'
+ *
+ * Probes and their arguments:
+ *
+ *   session_init(perf_fd, data_bufsize, aux_bufsize)
+ *       A tracer context was made. Buffer sizes are in pages.
+ *   session_start(perf_fd)
+ *   session_stop(perf_fd, ok)
+ *       Tracing started or stopped. `ok` is 0 if stopping failed.
+ *   session_free(perf_fd)
+ *       A tracer context was freed.
+ *   collector_wakeup(perf_fd_revents, stop_fd_revents)
+ *       The collector's poll loop woke up.
+ *   aux_drain(bytes, aux_head, trace_len)
+ *       `bytes` bytes were copied out of the AUX buffer, leaving the trace
+ *       `trace_len` bytes long.
+ *   overflow(reason, trace_len)
+ *       The collector detected lost trace data. `reason` is 1 for a truncated
+ *       AUX record and 2 for a PERF_RECORD_LOST record.
+ *   trace_truncated(trace_len)
+ *       The trace reached its size limit, and tracing was disabled.
+ *   decoder_sync(status, offset)
+ *       A decoder synchronised with the packet stream at byte `offset`.
+ *   decode_error(code, offset)
+ *       Decoding failed with the libipt error `code` (e.g. pte_overflow) at
+ *       byte `offset` of the trace.
+ */
+
+#ifndef __PERF_PT_PROBES_H
+#define __PERF_PT_PROBES_H
+
+#ifdef PERF_PT_HAVE_SDT
+#include <sys/sdt.h>
+
+#define PERF_PT_PROBE1(name, a) \
+    DTRACE_PROBE1(hwtracer, name, a)
+#define PERF_PT_PROBE2(name, a, b) \
+    DTRACE_PROBE2(hwtracer, name, a, b)
+#define PERF_PT_PROBE3(name, a, b, c) \
+    DTRACE_PROBE3(hwtracer, name, a, b, c)
+#else
+#define PERF_PT_PROBE1(name, a) do { } while (0)
+#define PERF_PT_PROBE2(name, a, b) do { } while (0)
+#define PERF_PT_PROBE3(name, a, b, c) do { } while (0)
+#endif
+
+// Values of the `reason` argument of the `overflow` probe.
+#define PERF_PT_OVERFLOW_TRUNCATED 1
+#define PERF_PT_OVERFLOW_LOST 2
+
+#endif
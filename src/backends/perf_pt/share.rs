@@ -0,0 +1,346 @@
+//! Handing traces to another process without copying them.
+//!
+//! With `PerfPTConfig::memfd_storage`, a trace is kept in a memfd rather than in `malloc`ed
+//! memory (growing it is done by C, see `grow_storage()` in `collect.c`). Once collection stops,
+//! the memfd is shrunk to the trace, mapped read-only and sealed, so `send_trace()` can pass the
+//! descriptor over a Unix socket and `recv_trace()` can map it in the receiving process, knowing
+//! that the trace can no longer change or shrink underneath it.
+
+use super::{perf_pt_budget_release, perf_pt_budget_reserve, BudgetKind};
+use super::{CollectorStats, DecoderStats, ImageSection, PerfPTCTrace, PerfPTRawTrace};
+use super::{PerfPTTrace, PerfPTTraceBuf};
+use crate::errors::HWTracerError;
+use crate::Trace;
+use libc::{c_int, c_void, size_t};
+use std::ffi::CString;
+use std::fs::File;
+use std::io::{self, Read, Write};
+use std::mem;
+use std::os::unix::io::{AsRawFd, FromRawFd, IntoRawFd, RawFd};
+use std::os::unix::net::UnixStream;
+use std::ptr;
+use std::sync::Mutex;
+
+// The seals of a finished trace's memfd. A receiver requires at least `REQUIRED_SEALS`.
+const SEALS: c_int =
+    libc::F_SEAL_SHRINK | libc::F_SEAL_GROW | libc::F_SEAL_WRITE | libc::F_SEAL_SEAL;
+const REQUIRED_SEALS: c_int = libc::F_SEAL_SHRINK | libc::F_SEAL_WRITE;
+
+// A message starts with a header of three native-endian `u64`s: `MSG_MAGIC`, the length of the
+// trace and the length of the image manifest which follows. The memfd is attached to the header.
+// The manifest holds one section per line, in the form read by `ImageSection::parse_raw()`.
+const MSG_MAGIC: u64 = 0x6877_7472_6163_6531; // "hwtrace1"
+const MSG_HEADER_SIZE: usize = 24;
+// The manifest length comes from the peer, so a receiver refuses anything longer than this rather
+// than allocating it. Real manifests are a few KiB.
+const MAX_MANIFEST_LEN: u64 = 4 * 1024 * 1024;
+
+/// Makes a memfd of `capacity` bytes and maps it, returning the mapping and the memfd.
+pub(super) fn memfd_storage(capacity: size_t) -> Result<(*mut u8, c_int), HWTracerError> {
+    let name = CString::new("hwtracer-trace").unwrap();
+    let fd =
+        unsafe { libc::memfd_create(name.as_ptr(), libc::MFD_CLOEXEC | libc::MFD_ALLOW_SEALING) };
+    if fd == -1 {
+        return Err(io::Error::last_os_error().into());
+    }
+    let file = unsafe { File::from_raw_fd(fd) };
+    file.set_len(capacity as u64)?;
+    let buf = map(&file, capacity, libc::PROT_READ | libc::PROT_WRITE)?;
+    Ok((buf, file.into_raw_fd()))
+}
+
+fn map(file: &File, size: size_t, prot: c_int) -> Result<*mut u8, HWTracerError> {
+    let buf = unsafe {
+        libc::mmap(
+            ptr::null_mut(),
+            size,
+            prot,
+            libc::MAP_SHARED,
+            file.as_raw_fd(),
+            0,
+        )
+    };
+    if buf == libc::MAP_FAILED {
+        return Err(io::Error::last_os_error().into());
+    }
+    Ok(buf as *mut u8)
+}
+
+impl PerfPTTrace {
+    /// Shrinks a memfd-backed trace's memfd to the trace, replaces the writable mapping with a
+    /// read-only one, and seals the memfd. Does nothing to other traces.
+    pub(super) fn seal(&mut self) -> Result<(), HWTracerError> {
+        let ct = &mut self.ctrace;
+        if ct.memfd == -1 {
+            return Ok(());
+        }
+        // Borrow the memfd without taking ownership of it.
+        let file = mem::ManuallyDrop::new(unsafe { File::from_raw_fd(ct.memfd) });
+        // A memfd can't be mapped with a size of 0.
+        let size = (ct.len as size_t).max(1);
+        file.set_len(size as u64)?;
+        // Sealing writes fails while any shared mapping could be made writable, even a read-only
+        // one, so the trace has to be unmapped first.
+        unsafe { libc::munmap(ct.buf.0 as *mut c_void, ct.capacity as size_t) };
+        ct.buf = PerfPTTraceBuf(ptr::null_mut());
+        unsafe { perf_pt_budget_release(BudgetKind::Trace, ct.capacity) };
+        ct.capacity = 0;
+        if unsafe { libc::fcntl(ct.memfd, libc::F_ADD_SEALS, SEALS) } == -1 {
+            return Err(io::Error::last_os_error().into());
+        }
+        let buf = map(&file, size, libc::PROT_READ)?;
+        unsafe { perf_pt_budget_reserve(BudgetKind::Trace, size as u64, 0) };
+        ct.buf = PerfPTTraceBuf(buf);
+        ct.capacity = size as u64;
+        Ok(())
+    }
+}
+
+/// Sends `trace` over `sock` to another process, which receives it with `recv_trace()` and
+/// decodes it against `image` (e.g. `ImageSection::current_process()`). Only the trace's
+/// descriptor is sent, so the trace isn't copied, and it stays usable here.
+///
+/// Fails if `trace` doesn't have a shared descriptor (see `PerfPTConfig::memfd_storage`).
+pub fn send_trace(
+    sock: &UnixStream,
+    trace: &dyn Trace,
+    image: &[ImageSection],
+) -> Result<(), HWTracerError> {
+    let fd = trace.shared_fd().ok_or_else(|| {
+        HWTracerError::BadConfig(String::from(
+            "the trace isn't stored in a memfd (see PerfPTConfig::memfd_storage)",
+        ))
+    })?;
+    let mut manifest = String::new();
+    for sec in image {
+        manifest.push_str(&sec.to_raw());
+        manifest.push('\n');
+    }
+    if manifest.len() as u64 > MAX_MANIFEST_LEN {
+        return Err(HWTracerError::BadConfig(String::from(
+            "the image manifest is too large to send",
+        )));
+    }
+    let mut msg = Vec::with_capacity(MSG_HEADER_SIZE + manifest.len());
+    for &word in &[
+        MSG_MAGIC,
+        trace.raw_data().len() as u64,
+        manifest.len() as u64,
+    ] {
+        msg.extend_from_slice(&word.to_ne_bytes());
+    }
+    msg.extend_from_slice(manifest.as_bytes());
+
+    let sent = send_with_fd(sock, &msg, fd)?;
+    (&*sock).write_all(&msg[sent..])?;
+    Ok(())
+}
+
+/// Receives a trace sent by `send_trace()` from `sock`, mapping the sender's trace storage
+/// rather than copying it.
+pub fn recv_trace(sock: &UnixStream) -> Result<PerfPTRawTrace, HWTracerError> {
+    let mut hdr = [0; MSG_HEADER_SIZE];
+    let (got, fd) = recv_with_fd(sock, &mut hdr)?;
+    // Take ownership of the memfd at once, so that it is closed on error.
+    let file = fd.map(|fd| unsafe { File::from_raw_fd(fd) });
+    if got == 0 {
+        return Err(io::Error::from(io::ErrorKind::UnexpectedEof).into());
+    }
+    (&*sock).read_exact(&mut hdr[got..])?;
+    let word = |i: usize| {
+        let mut b = [0; 8];
+        b.copy_from_slice(&hdr[i * 8..i * 8 + 8]);
+        u64::from_ne_bytes(b)
+    };
+    if word(0) != MSG_MAGIC {
+        return Err(invalid("not a trace message"));
+    }
+    let (len, manifest_len) = (word(1), word(2));
+    if manifest_len > MAX_MANIFEST_LEN {
+        return Err(invalid("the trace manifest is too large"));
+    }
+    let mut manifest = vec![0; manifest_len as usize];
+    (&*sock).read_exact(&mut manifest)?;
+    let file = file.ok_or_else(|| invalid("no memfd attached to the trace message"))?;
+
+    let seals = unsafe { libc::fcntl(file.as_raw_fd(), libc::F_GET_SEALS) };
+    if seals == -1 || seals & REQUIRED_SEALS != REQUIRED_SEALS {
+        return Err(invalid("the trace memfd isn't sealed"));
+    }
+    let size = file.metadata()?.len();
+    if size == 0 || size < len {
+        return Err(invalid("the trace memfd is too small"));
+    }
+    let mut image = Vec::new();
+    for line in String::from_utf8_lossy(&manifest).lines() {
+        image.push(ImageSection::parse_raw(line)?);
+    }
+
+    let buf = map(&file, size as size_t, libc::PROT_READ)?;
+    // Budgets don't apply to received traces, but they are still accounted for.
+    unsafe { perf_pt_budget_reserve(BudgetKind::Trace, size, 0) };
+    let trace = PerfPTTrace {
+        ctrace: PerfPTCTrace {
+            buf: PerfPTTraceBuf(buf),
+            len,
+            capacity: size,
+            budget: 0,
+            max_len: 0,
+            memfd: file.into_raw_fd(),
+            truncated: false,
+        },
+        collector_stats: CollectorStats::default(),
+        decoder_stats: Mutex::new(DecoderStats::default()),
+    };
+    Ok(PerfPTRawTrace::from_trace(trace, image))
+}
+
+fn invalid(msg: &str) -> HWTracerError {
+    HWTracerError::Custom(Box::new(io::Error::new(io::ErrorKind::InvalidData, msg)))
+}
+
+// Room for the control message carrying one descriptor.
+const CMSG_BUF_WORDS: usize = 8;
+
+// Sends (some of) `data` over `sock` with `fd` attached, returning how many bytes were sent.
+fn send_with_fd(sock: &UnixStream, data: &[u8], fd: RawFd) -> io::Result<usize> {
+    let mut iov = libc::iovec {
+        iov_base: data.as_ptr() as *mut c_void,
+        iov_len: data.len(),
+    };
+    let mut cbuf = [0u64; CMSG_BUF_WORDS];
+    let mut msg: libc::msghdr = unsafe { mem::zeroed() };
+    msg.msg_iov = &mut iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf.as_mut_ptr() as *mut c_void;
+    unsafe {
+        msg.msg_controllen = libc::CMSG_SPACE(mem::size_of::<c_int>() as u32) as _;
+        let cmsg = libc::CMSG_FIRSTHDR(&msg);
+        (*cmsg).cmsg_level = libc::SOL_SOCKET;
+        (*cmsg).cmsg_type = libc::SCM_RIGHTS;
+        (*cmsg).cmsg_len = libc::CMSG_LEN(mem::size_of::<c_int>() as u32) as _;
+        ptr::write_unaligned(libc::CMSG_DATA(cmsg) as *mut c_int, fd);
+    }
+    match unsafe { libc::sendmsg(sock.as_raw_fd(), &msg, libc::MSG_NOSIGNAL) } {
+        -1 => Err(io::Error::last_os_error()),
+        n => Ok(n as usize),
+    }
+}
+
+// Receives up to `buf.len()` bytes from `sock`, returning how many were received and the
+// descriptor attached to them, if any.
+fn recv_with_fd(sock: &UnixStream, buf: &mut [u8]) -> io::Result<(usize, Option<RawFd>)> {
+    let mut iov = libc::iovec {
+        iov_base: buf.as_mut_ptr() as *mut c_void,
+        iov_len: buf.len(),
+    };
+    let mut cbuf = [0u64; CMSG_BUF_WORDS];
+    let mut msg: libc::msghdr = unsafe { mem::zeroed() };
+    msg.msg_iov = &mut iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf.as_mut_ptr() as *mut c_void;
+    msg.msg_controllen = mem::size_of_val(&cbuf) as _;
+    let got = match unsafe { libc::recvmsg(sock.as_raw_fd(), &mut msg, libc::MSG_CMSG_CLOEXEC) } {
+        -1 => return Err(io::Error::last_os_error()),
+        n => n as usize,
+    };
+    let mut fd = None;
+    let mut cmsg = unsafe { libc::CMSG_FIRSTHDR(&msg) };
+    while !cmsg.is_null() {
+        unsafe {
+            if (*cmsg).cmsg_level == libc::SOL_SOCKET && (*cmsg).cmsg_type == libc::SCM_RIGHTS {
+                let data = libc::CMSG_DATA(cmsg) as *const c_int;
+                let n = ((*cmsg).cmsg_len as usize - libc::CMSG_LEN(0) as usize)
+                    / mem::size_of::<c_int>();
+                // Only one descriptor is expected: close any others.
+                for i in 0..n {
+                    let f = ptr::read_unaligned(data.add(i));
+                    if fd.is_none() {
+                        fd = Some(f);
+                    } else {
+                        libc::close(f);
+                    }
+                }
+            }
+            cmsg = libc::CMSG_NXTHDR(&msg, cmsg);
+        }
+    }
+    Ok((got, fd))
+}
+
+#[cfg(test)]
+mod tests {
+    use super::{recv_trace, send_trace, MAX_MANIFEST_LEN, MSG_MAGIC};
+    use crate::backends::perf_pt::{ImageSection, PerfPTTrace};
+    use crate::Trace;
+    use std::io::Write;
+    use std::os::unix::net::UnixStream;
+    use std::ptr;
+
+    fn memfd_trace(data: &[u8]) -> PerfPTTrace {
+        let mut trace = PerfPTTrace::with_storage(16, 0, true).unwrap();
+        assert!(data.len() <= 16);
+        unsafe { ptr::copy_nonoverlapping(data.as_ptr(), trace.ctrace.buf.0, data.len()) };
+        trace.ctrace.len = data.len() as u64;
+        trace.seal().unwrap();
+        trace
+    }
+
+    #[test]
+    fn test_send_recv() {
+        let (a, b) = UnixStream::pair().unwrap();
+        let trace = memfd_trace(b"hwtracer");
+        assert_eq!(trace.capacity(), 8);
+        let image = vec![
+            ImageSection::new("/bin/true", 0x1000, 0x2000, 0x40_1000),
+            ImageSection::new("/tmp/a:b", 0, 0x100, 0x7fff_0000),
+        ];
+        send_trace(&a, &trace, &image).unwrap();
+        drop(trace);
+
+        let got = recv_trace(&b).unwrap();
+        assert_eq!(got.raw_data(), b"hwtracer");
+        assert_eq!(got.image(), &image[..]);
+        assert!(got.shared_fd().is_some());
+        // The storage can't be changed any more.
+        let fd = got.shared_fd().unwrap();
+        assert_eq!(unsafe { libc::write(fd, b"x".as_ptr() as *const _, 1) }, -1);
+        assert_eq!(unsafe { libc::ftruncate(fd, 0) }, -1);
+
+        // A received trace can be passed on.
+        send_trace(&b, &got, got.image()).unwrap();
+        assert_eq!(recv_trace(&a).unwrap().raw_data(), b"hwtracer");
+    }
+
+    #[test]
+    fn test_empty_trace() {
+        let (a, b) = UnixStream::pair().unwrap();
+        send_trace(&a, &memfd_trace(&[]), &[]).unwrap();
+        let got = recv_trace(&b).unwrap();
+        assert!(got.raw_data().is_empty());
+        assert!(got.image().is_empty());
+    }
+
+    #[test]
+    fn test_not_shareable() {
+        let (a, b) = UnixStream::pair().unwrap();
+        let trace = PerfPTTrace::new(16).unwrap();
+        assert!(send_trace(&a, &trace, &[]).is_err());
+        // So is receiving from a closed socket.
+        drop(a);
+        assert!(recv_trace(&b).is_err());
+    }
+
+    #[test]
+    fn test_bad_manifest_len() {
+        let (a, b) = UnixStream::pair().unwrap();
+        let mut hdr = Vec::new();
+        for &word in &[MSG_MAGIC, 0, MAX_MANIFEST_LEN + 1] {
+            hdr.extend_from_slice(&word.to_ne_bytes());
+        }
+        (&a).write_all(&hdr).unwrap();
+        // Refused before anything is allocated or read.
+        let err = recv_trace(&b).unwrap_err();
+        assert!(err.to_string().contains("manifest is too large"));
+    }
+}
@@ -0,0 +1,184 @@
+//! Statistics gathered by the PerfPT collector and decoder.
+//!
+//! The counters are cheap enough to always be enabled: the collector thread updates its counters
+//! with plain (relaxed atomic) stores, and the decoder only counts blocks and events.
+
+use super::perf_pt_event_name;
+use crate::Stats;
+use libc::c_int;
+use std::collections::BTreeMap;
+use std::ffi::CStr;
+use std::time::Duration;
+
+/// The size of the event count array in `PerfPTCDecoderStats`.
+///
+/// Must stay in sync with the C code.
+const MAX_EVENT_TYPES: usize = 32;
+
+/// Statistics gathered by the collector thread during a tracing session.
+///
+/// Shared with C code. Must stay in sync.
+#[repr(C)]
+#[derive(Clone, Debug, Default)]
+pub struct CollectorStats {
+    /// Times the collector woke up.
+    pub wakeups: u64,
+    /// Bytes drained from the AUX buffer.
+    pub aux_bytes: u64,
+    /// `PERF_RECORD_AUX` records seen.
+    pub aux_records: u64,
+    /// `PERF_RECORD_LOST` records seen.
+    pub lost_records: u64,
+    /// `PERF_RECORD_ITRACE_START` records seen.
+    pub itrace_start_records: u64,
+    /// Records of any other type seen.
+    pub other_records: u64,
+    /// Times the trace storage buffer was grown.
+    pub reallocs: u64,
+    /// Bytes copied out of the data and AUX buffers.
+    pub bytes_copied: u64,
+    /// Nanoseconds spent copying them.
+    pub copy_ns: u64,
+    /// The most bytes seen waiting in the AUX buffer at once.
+    pub max_aux_fill: u64,
+    /// AUX records flagged `PERF_AUX_FLAG_PARTIAL`.
+    pub aux_partial: u64,
+    /// AUX records flagged `PERF_AUX_FLAG_COLLISION`.
+    pub aux_collision: u64,
+    /// AUX records flagged `PERF_AUX_FLAG_TRUNCATED`.
+    pub aux_truncated: u64,
+    /// Times busy-polling found new data (see `PerfPTConfig::collector_spin_ns`).
+    pub spin_hits: u64,
+    /// Times busy-polling gave up and the collector blocked instead.
+    pub spin_misses: u64,
+    /// Nanoseconds spent busy-polling.
+    pub spin_ns: u64,
+    /// Bytes dropped from the AUX buffer after the trace was truncated (see
+    /// `PerfPTConfig::max_session_bytes`).
+    pub discarded_bytes: u64,
+}
+
+impl CollectorStats {
+    /// Adds the counters to `stats`, with names prefixed by `collector.`.
+    pub(super) fn add_to(&self, stats: &mut Stats) {
+        for &(name, v) in &[
+            ("wakeups", self.wakeups),
+            ("aux_bytes", self.aux_bytes),
+            ("aux_records", self.aux_records),
+            ("lost_records", self.lost_records),
+            ("itrace_start_records", self.itrace_start_records),
+            ("other_records", self.other_records),
+            ("reallocs", self.reallocs),
+            ("bytes_copied", self.bytes_copied),
+            ("copy_ns", self.copy_ns),
+            ("max_aux_fill", self.max_aux_fill),
+            ("aux_partial", self.aux_partial),
+            ("aux_collision", self.aux_collision),
+            ("aux_truncated", self.aux_truncated),
+            ("spin_hits", self.spin_hits),
+            ("spin_misses", self.spin_misses),
+            ("spin_ns", self.spin_ns),
+            ("discarded_bytes", self.discarded_bytes),
+        ] {
+            stats.set(format!("collector.{}", name), v);
+        }
+    }
+}
+
+/// Event counts gathered by the C decoder, indexed by libipt's `enum pt_event_type`.
+///
+/// Shared with C code. Must stay in sync.
+#[repr(C)]
+#[derive(Default)]
+pub(super) struct PerfPTCDecoderStats {
+    events: [u64; MAX_EVENT_TYPES],
+}
+
+/// Statistics gathered while decoding a trace. These accumulate over every iteration over the
+/// trace's blocks.
+#[derive(Clone, Debug, Default)]
+pub struct DecoderStats {
+    /// Blocks decoded.
+    pub blocks: u64,
+    /// Times the decoder synchronised with the packet stream.
+    pub syncs: u64,
+    /// Time from starting to decode until decoding ended (including time the consumer spent
+    /// between blocks).
+    pub decode_time: Duration,
+    /// Counts of the libipt events seen, by event type (e.g. `overflow`, `exec_mode`).
+    pub events: BTreeMap<String, u64>,
+}
+
+impl DecoderStats {
+    /// Adds the event counts in `cstats` to our own.
+    pub(super) fn add_events(&mut self, cstats: &PerfPTCDecoderStats) {
+        for (i, &n) in cstats.events.iter().enumerate().filter(|(_, &n)| n != 0) {
+            let name = unsafe { perf_pt_event_name(i as c_int) };
+            let name = if name.is_null() {
+                format!("type{}", i)
+            } else {
+                unsafe { CStr::from_ptr(name) }
+                    .to_string_lossy()
+                    .into_owned()
+            };
+            *self.events.entry(name).or_insert(0) += n;
+        }
+    }
+
+    /// Adds the statistics in `other` to our own.
+    pub(super) fn merge(&mut self, other: &DecoderStats) {
+        self.blocks += other.blocks;
+        self.syncs += other.syncs;
+        self.decode_time += other.decode_time;
+        for (name, n) in &other.events {
+            *self.events.entry(name.clone()).or_insert(0) += n;
+        }
+    }
+
+    /// Adds the counters to `stats`, with names prefixed by `decoder.`.
+    pub(super) fn add_to(&self, stats: &mut Stats) {
+        stats.set("decoder.blocks", self.blocks);
+        stats.set("decoder.syncs", self.syncs);
+        stats.set("decoder.decode_ns", self.decode_time.as_nanos() as u64);
+        for (name, n) in &self.events {
+            stats.set(format!("decoder.events.{}", name), *n);
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::{CollectorStats, DecoderStats, PerfPTCDecoderStats};
+    use crate::Stats;
+    use std::time::Duration;
+
+    #[test]
+    fn test_add_to() {
+        let mut stats = Stats::new();
+        CollectorStats {
+            wakeups: 3,
+            aux_bytes: 100,
+            ..CollectorStats::default()
+        }
+        .add_to(&mut stats);
+        assert_eq!(stats.get("collector.wakeups"), Some(3));
+        assert_eq!(stats.get("collector.aux_bytes"), Some(100));
+        assert_eq!(stats.get("collector.aux_truncated"), Some(0));
+
+        let mut cstats = PerfPTCDecoderStats::default();
+        cstats.events[0] = 2; // ptev_enabled
+        let mut dstats = DecoderStats::default();
+        dstats.add_events(&cstats);
+        dstats.blocks = 10;
+        let mut total = DecoderStats {
+            decode_time: Duration::from_nanos(5),
+            ..DecoderStats::default()
+        };
+        total.merge(&dstats);
+        total.merge(&dstats);
+        total.add_to(&mut stats);
+        assert_eq!(stats.get("decoder.blocks"), Some(20));
+        assert_eq!(stats.get("decoder.events.enabled"), Some(4));
+        assert_eq!(stats.get("decoder.decode_ns"), Some(5));
+    }
+}
@@ -0,0 +1,524 @@
+//! Symbolizing block addresses.
+//!
+//! A `Symbolizer` maps addresses to the functions containing them, using the `.symtab` and
+//! `.dynsym` symbols of the modules of a `ModuleMap`. A module's symbols are read the first time
+//! an address in it is looked up, and the resulting table is shared with every other symbolizer
+//! in the process which has the same module (modules are matched by `ModuleId`, so this works
+//! across images and processes' worth of `ModuleMap`s).
+//!
+//! A table keeps its functions' start offsets in a sorted array, indexed by a radix table: the
+//! offsets are split into equal-sized buckets (about one per function), and the index records
+//! where each bucket's functions start in the array. A lookup reads the index entry for the
+//! offset's bucket, and then only has to search the handful of functions in that bucket, so it
+//! takes about two cache misses however big the table is.
+
+use super::modules::{ModuleMap, Range};
+use super::offline::{
+    read_phdrs, read_u16, read_u32, read_u64, ELF64_EHDR_SIZE, ELF_PF_X, ELF_PT_LOAD,
+};
+use super::{Module, ModuleId};
+use crate::errors::HWTracerError;
+use lazy_static::lazy_static;
+use once_cell::sync::OnceCell;
+use std::collections::HashMap;
+use std::fs::File;
+use std::io::{Read, Seek, SeekFrom};
+use std::path::Path;
+use std::sync::{Arc, Mutex, Weak};
+
+const ELF64_SHDR_SIZE: usize = 64;
+const ELF64_SYM_SIZE: usize = 24;
+const ELF_SHT_SYMTAB: u32 = 2;
+const ELF_SHT_DYNSYM: u32 = 11;
+const ELF_STT_FUNC: u8 = 2;
+const ELF_STT_GNU_IFUNC: u8 = 10;
+const ELF_SHN_UNDEF: u16 = 0;
+
+lazy_static! {
+    // The symbol tables in use by any symbolizer, so that each module's is only read once.
+    static ref TABLES: Mutex<HashMap<ModuleId, Weak<SymbolTable>>> = Mutex::new(HashMap::new());
+}
+
+/// The function containing a symbolized address.
+#[derive(Clone, Copy, Debug)]
+pub struct Symbol<'a> {
+    /// The function's (possibly mangled) name.
+    pub name: &'a str,
+    /// The module containing the function.
+    pub module: &'a Module,
+    /// The offset of the address from the start of the function.
+    pub offset: u64,
+}
+
+#[derive(Debug)]
+struct Func {
+    start: u64,
+    end: u64,
+    // The function's name, as a range of `SymbolTable::names`.
+    name_off: u32,
+    name_len: u32,
+}
+
+/// The functions of a module, by file offset.
+#[derive(Debug)]
+pub(super) struct SymbolTable {
+    // The functions, sorted by start offset.
+    funcs: Vec<Func>,
+    // The functions' start offsets (as in `funcs`, but packed more densely for searching).
+    starts: Vec<u64>,
+    // `radix[b]` is the number of functions starting before `base + (b << shift)`, for each
+    // bucket `b` up to and including the one holding the last function, plus one.
+    radix: Vec<u32>,
+    // The start of the first function.
+    base: u64,
+    shift: u32,
+    names: String,
+}
+
+impl SymbolTable {
+    /// Makes a table of the functions `(start, size, name)`. If two functions start at the same
+    /// offset, the first is kept. A function of size 0 is assumed to end where the next starts.
+    pub(super) fn new(mut syms: Vec<(u64, u64, String)>) -> Self {
+        // A stable sort, so the first of two functions with the same start comes first.
+        syms.sort_by_key(|s| s.0);
+        syms.dedup_by_key(|s| s.0);
+
+        let mut names = String::new();
+        let mut funcs = Vec::with_capacity(syms.len());
+        for (i, (start, size, name)) in syms.iter().enumerate() {
+            let end = if *size > 0 {
+                start.saturating_add(*size)
+            } else {
+                syms.get(i + 1).map(|s| s.0).unwrap_or(u64::max_value())
+            };
+            funcs.push(Func {
+                start: *start,
+                end,
+                name_off: names.len() as u32,
+                name_len: name.len() as u32,
+            });
+            names.push_str(name);
+        }
+
+        let starts = funcs.iter().map(|f| f.start).collect::<Vec<_>>();
+        let (base, shift, radix) = match (starts.first(), starts.last()) {
+            (Some(&first), Some(&last)) => {
+                // Make roughly one bucket per function.
+                let span_bits = 64 - (last - first).leading_zeros();
+                let bucket_bits = starts.len().next_power_of_two().trailing_zeros();
+                let shift = span_bits.saturating_sub(bucket_bits);
+                let nbuckets = ((last - first) >> shift) as usize + 1;
+                let mut radix = Vec::with_capacity(nbuckets + 1);
+                let mut i = 0;
+                for b in 0..=nbuckets as u64 {
+                    let bucket_start = first.saturating_add(b << shift);
+                    while i < starts.len() && starts[i] < bucket_start {
+                        i += 1;
+                    }
+                    radix.push(i as u32);
+                }
+                (first, shift, radix)
+            }
+            _ => (0, 0, Vec::new()),
+        };
+        SymbolTable {
+            funcs,
+            starts,
+            radix,
+            base,
+            shift,
+            names,
+        }
+    }
+
+    /// Reads the functions of the ELF file `filename`. A file which isn't a little-endian ELF64
+    /// file, or has no symbols, gives an empty table.
+    pub(super) fn read(filename: &Path) -> Result<Self, HWTracerError> {
+        let mut file = File::open(filename)?;
+        let (phdrs, phentsize) = match read_phdrs(&mut file, filename)? {
+            Some(p) => p,
+            None => return Ok(Self::new(Vec::new())),
+        };
+        // The executable segments, as `(vaddr, file offset, file size)`, to turn symbols' virtual
+        // addresses into file offsets (which is what `ModuleMap` deals in).
+        let segs = phdrs
+            .chunks(phentsize)
+            .filter(|p| read_u32(p, 0) == ELF_PT_LOAD && read_u32(p, 4) & ELF_PF_X != 0)
+            .map(|p| (read_u64(p, 16), read_u64(p, 8), read_u64(p, 32)))
+            .collect::<Vec<_>>();
+
+        let mut ehdr = [0; ELF64_EHDR_SIZE];
+        file.seek(SeekFrom::Start(0))?;
+        file.read_exact(&mut ehdr)?;
+        let shoff = read_u64(&ehdr, 40);
+        let shentsize = read_u16(&ehdr, 58) as usize;
+        let shnum = read_u16(&ehdr, 60) as usize;
+        if shoff == 0 || shentsize < ELF64_SHDR_SIZE {
+            return Ok(Self::new(Vec::new()));
+        }
+        let shdrs = read_at(&mut file, shoff, shentsize * shnum)?;
+        let shdr = |i: usize| &shdrs[i * shentsize..(i + 1) * shentsize];
+
+        let mut syms = Vec::new();
+        // `.symtab` first, since its names are kept over `.dynsym`'s for the same function.
+        for &ty in &[ELF_SHT_SYMTAB, ELF_SHT_DYNSYM] {
+            for i in 0..shnum {
+                let sh = shdr(i);
+                let link = read_u32(sh, 40) as usize;
+                if read_u32(sh, 4) != ty || link >= shnum {
+                    continue;
+                }
+                let symtab = read_at(&mut file, read_u64(sh, 24), read_u64(sh, 32) as usize)?;
+                let strs = shdr(link);
+                let strtab = read_at(&mut file, read_u64(strs, 24), read_u64(strs, 32) as usize)?;
+                for sym in symtab.chunks_exact(ELF64_SYM_SIZE) {
+                    let kind = sym[4] & 0xf;
+                    if (kind != ELF_STT_FUNC && kind != ELF_STT_GNU_IFUNC)
+                        || read_u16(sym, 6) == ELF_SHN_UNDEF
+                    {
+                        continue;
+                    }
+                    let vaddr = read_u64(sym, 8);
+                    let start = match segs
+                        .iter()
+                        .find(|&&(va, _, sz)| vaddr >= va && vaddr - va < sz)
+                    {
+                        Some(&(va, off, _)) => off + (vaddr - va),
+                        None => continue,
+                    };
+                    let name = match strtab.get(read_u32(sym, 0) as usize..) {
+                        Some(s) => s.split(|&b| b == 0).next().unwrap_or(&[]),
+                        None => continue,
+                    };
+                    if !name.is_empty() {
+                        let name = String::from_utf8_lossy(name).into_owned();
+                        syms.push((start, read_u64(sym, 16), name));
+                    }
+                }
+            }
+        }
+        Ok(Self::new(syms))
+    }
+
+    /// Returns the name of the function containing the file offset `off`, and `off`'s offset from
+    /// the start of the function.
+    pub(super) fn lookup(&self, off: u64) -> Option<(&str, u64)> {
+        let f = &self.funcs[self.find(off)?];
+        if off >= f.end {
+            return None;
+        }
+        let name = &self.names[f.name_off as usize..(f.name_off + f.name_len) as usize];
+        Some((name, off - f.start))
+    }
+
+    /// Returns the index of the last function starting at or before `off`.
+    fn find(&self, off: u64) -> Option<usize> {
+        if self.starts.is_empty() || off < self.base {
+            return None;
+        }
+        let b = ((off - self.base) >> self.shift) as usize;
+        match self.radix.get(b + 1) {
+            Some(&end) => {
+                // Every function before bucket `b` starts before `off` (and, as bucket 0 starts
+                // with the first function, there's at least one such function or `b` is 0), so
+                // only the functions in the bucket need searching.
+                let start = self.radix[b] as usize;
+                let n = self.starts[start..end as usize].partition_point(|&s| s <= off);
+                Some(start + n - 1)
+            }
+            // `off` is past the last bucket, so after every function's start.
+            None => Some(self.starts.len() - 1),
+        }
+    }
+}
+
+fn read_at(file: &mut File, off: u64, len: usize) -> Result<Vec<u8>, HWTracerError> {
+    let mut buf = vec![0; len];
+    file.seek(SeekFrom::Start(off))?;
+    file.read_exact(&mut buf)?;
+    Ok(buf)
+}
+
+/// Returns the symbol table of `module`, reading it unless another symbolizer already has. Returns
+/// `None` if the module's file can't be read.
+fn shared_table(module: &Module) -> Option<Arc<SymbolTable>> {
+    if let Some(t) = TABLES
+        .lock()
+        .unwrap()
+        .get(&module.id)
+        .and_then(Weak::upgrade)
+    {
+        return Some(t);
+    }
+    // Read without holding the lock. If another thread reads the same table meanwhile, both
+    // copies work and the last one registered is the one shared from then on.
+    let table = Arc::new(SymbolTable::read(&module.filename).ok()?);
+    let mut tables = TABLES.lock().unwrap();
+    tables.retain(|_, t| t.strong_count() > 0);
+    tables.insert(module.id, Arc::downgrade(&table));
+    Some(table)
+}
+
+/// Maps the addresses of a code image to the functions containing them.
+pub struct Symbolizer {
+    map: ModuleMap,
+    // The symbol table of each module of `map`, once loaded (`None` if it couldn't be read).
+    tables: Vec<OnceCell<Option<Arc<SymbolTable>>>>,
+}
+
+impl Symbolizer {
+    /// Makes a symbolizer for the code image described by `map`. No symbols are read until needed.
+    pub fn new(map: ModuleMap) -> Self {
+        let tables = map.modules().iter().map(|_| OnceCell::new()).collect();
+        Symbolizer { map, tables }
+    }
+
+    /// Makes a symbolizer for the code of the current process. See `ModuleMap::current_process()`.
+    pub fn current_process<P: AsRef<Path>>(vdso_path: P) -> Result<Self, HWTracerError> {
+        Ok(Self::new(ModuleMap::current_process(vdso_path)?))
+    }
+
+    /// Returns the modules of the image.
+    pub fn module_map(&self) -> &ModuleMap {
+        &self.map
+    }
+
+    fn table(&self, module: usize) -> Option<&SymbolTable> {
+        self.tables[module]
+            .get_or_init(|| shared_table(&self.map.modules()[module]))
+            .as_deref()
+    }
+
+    /// Returns the function containing `addr`, or `None` if `addr` isn't in the image or in a
+    /// known function.
+    pub fn symbolize_one(&self, addr: u64) -> Option<Symbol<'_>> {
+        let r = self.map.range_of(addr)?;
+        let (name, offset) = self
+            .table(r.module)?
+            .lookup(r.file_offset + (addr - r.vaddr))?;
+        Some(Symbol {
+            name,
+            module: &self.map.modules()[r.module],
+            offset,
+        })
+    }
+
+    /// Symbolizes each of `addrs` as `symbolize_one()` does. This is faster than symbolizing the
+    /// addresses one by one, especially if nearby addresses are close together (as a trace's
+    /// blocks tend to be).
+    pub fn symbolize(&self, addrs: &[u64]) -> Vec<Option<Symbol<'_>>> {
+        let mut syms = Vec::new();
+        self.symbolize_into(addrs, &mut syms);
+        syms
+    }
+
+    /// As `symbolize()`, but replaces the contents of `syms` with the symbols, so that the vector
+    /// can be reused. Symbolizing a long trace in pieces this way saves allocating (and faulting
+    /// in) memory for each piece, which otherwise costs more than the lookups themselves.
+    pub fn symbolize_into<'a>(&'a self, addrs: &[u64], syms: &mut Vec<Option<Symbol<'a>>>) {
+        syms.clear();
+        syms.reserve(addrs.len());
+        // The last range looked up, and its module's table.
+        let mut last: Option<(&Range, Option<&SymbolTable>)> = None;
+        for &addr in addrs {
+            let (r, table) = match last {
+                Some((r, table)) if r.contains(addr) => (r, table),
+                _ => match self.map.range_of(addr) {
+                    Some(r) => (r, self.table(r.module)),
+                    None => {
+                        syms.push(None);
+                        continue;
+                    }
+                },
+            };
+            last = Some((r, table));
+            syms.push(
+                table
+                    .and_then(|t| t.lookup(r.file_offset + (addr - r.vaddr)))
+                    .map(|(name, offset)| Symbol {
+                        name,
+                        module: &self.map.modules()[r.module],
+                        offset,
+                    }),
+            );
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::{SymbolTable, Symbolizer};
+    use crate::backends::perf_pt::{ImageSection, ModuleMap};
+    use std::fs;
+    use std::sync::Arc;
+    use tempfile::TempDir;
+
+    // Makes an ELF64 file with one executable segment (file offsets 0x1000..0x2000, linked at
+    // 0x40_1000) and a `.symtab` of `syms`: `(name, type, section, vaddr, size)`.
+    fn elf(syms: &[(&str, u8, u16, u64, u64)]) -> Vec<u8> {
+        let (strtab_off, symtab_off, shdrs_off) = (0x2000, 0x2400, 0x2800);
+        let mut f = vec![0; shdrs_off + 3 * 64];
+        let put = |f: &mut Vec<u8>, off: usize, bytes: &[u8]| {
+            f[off..off + bytes.len()].copy_from_slice(bytes)
+        };
+
+        put(&mut f, 0, b"\x7fELF\x02\x01\x01");
+        put(&mut f, 32, &64u64.to_le_bytes()); // e_phoff
+        put(&mut f, 40, &(shdrs_off as u64).to_le_bytes()); // e_shoff
+        put(&mut f, 54, &56u16.to_le_bytes()); // e_phentsize
+        put(&mut f, 56, &1u16.to_le_bytes()); // e_phnum
+        put(&mut f, 58, &64u16.to_le_bytes()); // e_shentsize
+        put(&mut f, 60, &3u16.to_le_bytes()); // e_shnum
+
+        put(&mut f, 64, &1u32.to_le_bytes()); // PT_LOAD
+        put(&mut f, 68, &5u32.to_le_bytes()); // PF_R | PF_X
+        put(&mut f, 72, &0x1000u64.to_le_bytes()); // p_offset
+        put(&mut f, 80, &0x40_1000u64.to_le_bytes()); // p_vaddr
+        put(&mut f, 96, &0x1000u64.to_le_bytes()); // p_filesz
+
+        let (mut strtab, mut symtab) = (vec![0], vec![0; 24]);
+        for &(name, ty, shndx, vaddr, size) in syms {
+            let mut sym = [0; 24];
+            sym[..4].copy_from_slice(&(strtab.len() as u32).to_le_bytes());
+            sym[4] = 0x10 | ty; // STB_GLOBAL
+            sym[6..8].copy_from_slice(&shndx.to_le_bytes());
+            sym[8..16].copy_from_slice(&vaddr.to_le_bytes());
+            sym[16..24].copy_from_slice(&size.to_le_bytes());
+            symtab.extend_from_slice(&sym);
+            strtab.extend_from_slice(name.as_bytes());
+            strtab.push(0);
+        }
+        put(&mut f, strtab_off, &strtab);
+        put(&mut f, symtab_off, &symtab);
+
+        // Section 1 is `.symtab`, linked to `.strtab` (section 2).
+        let sh1 = shdrs_off + 64;
+        put(&mut f, sh1 + 4, &2u32.to_le_bytes());
+        put(&mut f, sh1 + 24, &(symtab_off as u64).to_le_bytes());
+        put(&mut f, sh1 + 32, &(symtab.len() as u64).to_le_bytes());
+        put(&mut f, sh1 + 40, &2u32.to_le_bytes());
+        let sh2 = shdrs_off + 128;
+        put(&mut f, sh2 + 4, &3u32.to_le_bytes());
+        put(&mut f, sh2 + 24, &(strtab_off as u64).to_le_bytes());
+        put(&mut f, sh2 + 32, &(strtab.len() as u64).to_le_bytes());
+        f
+    }
+
+    #[test]
+    fn test_symbolize() {
+        let dir = TempDir::new().unwrap();
+        let path = dir.path().join("lib.so");
+        fs::write(
+            &path,
+            elf(&[
+                ("foo", 2, 1, 0x40_1000, 0x100),
+                ("foo_alias", 2, 1, 0x40_1000, 0x100),
+                ("bar", 2, 1, 0x40_1200, 0),
+                ("baz", 10, 1, 0x40_1400, 0x10),
+                ("undef", 2, 0, 0x40_1500, 0x10),
+                ("data", 1, 1, 0x40_1600, 0x10),
+            ]),
+        )
+        .unwrap();
+
+        // The code is loaded somewhere other than where it was linked.
+        let map = ModuleMap::new(&[ImageSection::new(&path, 0x1000, 0x1000, 0x7f00_0000)]).unwrap();
+        let sym = Symbolizer::new(map);
+        let addrs = [
+            0x7f00_0000,
+            0x7f00_00ff,
+            0x7f00_0100,
+            0x7f00_0200,
+            0x7f00_03ff,
+            0x7f00_0405,
+            0x7f00_0410,
+            0x7f00_0600,
+            0x7f00_2000,
+        ];
+        let names = sym
+            .symbolize(&addrs)
+            .iter()
+            .map(|s| s.map(|s| (s.name, s.offset)))
+            .collect::<Vec<_>>();
+        assert_eq!(
+            names,
+            vec![
+                Some(("foo", 0)),
+                Some(("foo", 0xff)),
+                None,
+                Some(("bar", 0)),
+                Some(("bar", 0x1ff)),
+                Some(("baz", 5)),
+                None,
+                None,
+                None,
+            ]
+        );
+        for (&addr, s) in addrs.iter().zip(sym.symbolize(&addrs)) {
+            assert_eq!(
+                sym.symbolize_one(addr).map(|s| (s.name, s.offset)),
+                s.map(|s| (s.name, s.offset))
+            );
+        }
+        assert_eq!(
+            sym.symbolize_one(0x7f00_0010).unwrap().module.filename,
+            path
+        );
+
+        // Another symbolizer with the same module shares its table.
+        let map2 = ModuleMap::new(&[ImageSection::new(&path, 0x1000, 0x1000, 0x40_1000)]).unwrap();
+        let sym2 = Symbolizer::new(map2);
+        assert_eq!(sym2.symbolize_one(0x40_1405).unwrap().name, "baz");
+        let (t1, t2) = (
+            sym.tables[0].get().unwrap().clone().unwrap(),
+            sym2.tables[0].get().unwrap().clone().unwrap(),
+        );
+        assert!(Arc::ptr_eq(&t1, &t2));
+        assert_eq!(t1.funcs.len(), 3);
+    }
+
+    #[test]
+    fn test_find() {
+        for n in 0..70u64 {
+            // Functions at 100, 110, 120, ... of size 5.
+            let table = SymbolTable::new(
+                (0..n)
+                    .rev()
+                    .map(|i| (i * 10 + 100, 5, format!("f{}", i)))
+                    .collect(),
+            );
+            for off in 0..n * 10 + 120 {
+                let expect = if off >= 100 && (off - 100) % 10 < 5 && (off - 100) / 10 < n {
+                    Some((format!("f{}", (off - 100) / 10), (off - 100) % 10))
+                } else {
+                    None
+                };
+                assert_eq!(
+                    table.lookup(off).map(|(s, o)| (s.to_owned(), o)),
+                    expect,
+                    "n = {}, off = {}",
+                    n,
+                    off
+                );
+            }
+        }
+
+        // Unevenly spread functions, so that most buckets are empty and one holds several.
+        let starts = [3, 5, 7, 9, 11, 1000, 1_000_000, u64::from(u32::max_value())];
+        let table = SymbolTable::new(
+            starts
+                .iter()
+                .enumerate()
+                .map(|(i, &s)| (s, 1, format!("f{}", i)))
+                .collect(),
+        );
+        for (i, &s) in starts.iter().enumerate() {
+            assert_eq!(table.lookup(s), Some((format!("f{}", i).as_str(), 0)));
+            assert_eq!(table.lookup(s + 1), None);
+            assert_eq!(table.find(s + 1), Some(i));
+        }
+        assert_eq!(table.find(2), None);
+        assert_eq!(table.find(999), Some(4));
+        assert_eq!(table.find(u64::max_value()), Some(starts.len() - 1));
+    }
+}
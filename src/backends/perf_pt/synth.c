@@ -0,0 +1,620 @@
+// Copyright (c) 2018 King's College London
+// created by the Software Development Team <http://soft-dev.org/>
+//
+// The Universal Permissive License (UPL), Version 1.0
+//
+// Subject to the condition set forth below, permission is hereby granted to any
+// person obtaining a copy of this software, associated documentation and/or
+// data (collectively the "Software"), free of charge and under any and all
+// copyright rights in the Software, and any and all patent rights owned or
+// freely licensable by each licensor hereunder covering either (i) the
+// unmodified Software as contributed to or provided by such licensor, or (ii)
+// the Larger Works (as defined below), to deal in both
+//
+// (a) the Software, and
+// (b) any piece of software and/or hardware listed in the lrgrwrks.txt file
+// if one is included with the Software (each a "Larger Work" to which the Software
+// is contributed by such licensors),
+//
+// without restriction, including without limitation the rights to copy, create
+// derivative works of, display, perform, and distribute the Software and make,
+// use, sell, offer for sale, import, export, have made, and have sold the
+// Software and the Larger Work(s), and to sublicense the foregoing rights on
+// either these or other terms.
+//
+// This license is subject to the following condition: The above copyright
+// notice and either this complete permission notice or at a minimum a reference
+// to the UPL must be included in all copies or substantial portions of the
+// Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+/*
+ * Synthetic Intel PT trace generation.
+ *
+ * We generate a small x86_64 code image and a PT packet stream describing an
+ * execution of it, using libipt's packet encoder. This allows the decoder to
+ * be exercised without Intel PT hardware.
+ *
+ * The code image consists of some tiny callee functions followed by a loop.
+ * The loop body is a sequence of "sites", each of which is one of:
+ *
+ *   - A conditional branch, which jumps over two nops if taken.
+ *   - A direct call to one of the callees.
+ *   - An indirect call to one of the callees.
+ *
+ * The loop ends with a direct jump back to its start. Each callee is a nop
+ * followed by a return.
+ *
+ * Since we know exactly which path the "execution" takes, we also compute the
+ * blocks that a decoder should report.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <intel-pt.h>
+
+#include "perf_pt_private.h"
+
+#define NUM_CALLEES         4
+#define CALLEE_SIZE         2   // nop; ret
+#define LOOP_ALIGN          16
+#define INITIAL_TRACE_SIZE  (1024 * 1024)
+#define MAX_TNT_BITS        6   // The capacity of a short TNT packet.
+
+// Instruction encodings.
+#define OP_NOP          0x90
+#define OP_RET          0xc3
+#define OP_JE_REL8      0x74
+#define OP_CALL_REL32   0xe8
+#define OP_JMP_REL32    0xe9
+#define OP_GRP5         0xff
+#define MODRM_CALL_RAX  0xd0
+
+enum site_kind {
+    site_cond,
+    site_call,
+    site_icall,
+};
+
+/*
+ * A site in the loop body.
+ */
+struct site {
+    enum site_kind  kind;
+    uint64_t        branch;     // Address of the branch instruction.
+    uint64_t        end;        // Address of the first instruction after the site.
+    uint64_t        callee;     // Target of a direct call.
+};
+
+/*
+ * Parameters for the generator.
+ *
+ * Shared with Rust code. Must stay in sync.
+ */
+struct perf_pt_synth_config {
+    uint64_t    base_vaddr;         // The address the code is loaded at.
+    uint64_t    loop_iters;         // How many times the loop runs.
+    uint32_t    sites;              // Number of sites in the loop body.
+    uint32_t    cond_pct;           // % of sites that are conditional branches.
+    uint32_t    taken_pct;          // % of conditional branches taken.
+    uint32_t    indirect_pct;       // % of sites that are indirect calls.
+    uint64_t    psb_period;         // Emit a PSB+ every this many bytes.
+    uint64_t    overflow_period;    // Inject an overflow every this many
+                                    // iterations (0 = never).
+    uint64_t    seed;               // Seed for the pseudo-random choices.
+};
+
+/*
+ * The generated trace and code, and what a decoder should make of them.
+ *
+ * Shared with Rust code. Must stay in sync.
+ */
+struct perf_pt_synth_out {
+    void        *trace;             // The PT packets (malloc'd).
+    uint64_t    trace_len;
+    void        *code;              // The code image (malloc'd).
+    uint64_t    code_len;
+    uint64_t    blocks;             // Number of blocks a decoder should report.
+    uint64_t    blocks_hash;        // Hash of their start addresses.
+    uint64_t    blocks_before_overflow; // Number of blocks before the first
+                                        // injected overflow.
+};
+
+/*
+ * The state of the generator.
+ */
+struct synth {
+    const struct perf_pt_synth_config *conf;
+    struct pt_encoder   *encoder;
+    uint8_t             *buf;           // Trace storage.
+    size_t              bufsize;
+    uint64_t            len;            // Bytes of trace written.
+    uint64_t            last_psb;       // Offset of the most recent PSB.
+    uint64_t            last_ip;        // For IP compression.
+    uint64_t            tnt;            // Pending TNT bits.
+    uint8_t             tnt_bits;       // Number of pending TNT bits.
+    uint64_t            rng;            // PRNG state.
+    uint64_t            block_start;    // Start of the current block.
+    uint64_t            blocks;
+    uint64_t            blocks_hash;
+    bool                overflowed;
+    uint64_t            blocks_before_overflow;
+    struct perf_pt_cerror *err;
+};
+
+// Private prototypes.
+static uint64_t next_rand(struct synth *);
+static bool chance(struct synth *, uint32_t);
+static bool new_encoder(struct synth *);
+static bool emit(struct synth *, struct pt_packet *);
+static bool emit_ip(struct synth *, enum pt_packet_type, uint64_t);
+static bool flush_tnt(struct synth *);
+static bool push_tnt(struct synth *, bool);
+static bool emit_psb(struct synth *, uint64_t);
+static void end_block(struct synth *, uint64_t);
+static uint8_t *build_code(struct synth *, struct site *, uint64_t *, uint64_t *);
+
+// Public prototypes.
+bool perf_pt_synth(const struct perf_pt_synth_config *,
+                   struct perf_pt_synth_out *, struct perf_pt_cerror *);
+void perf_pt_synth_free(struct perf_pt_synth_out *);
+uint64_t perf_pt_synth_hash_block(uint64_t, uint64_t);
+
+/*
+ * xorshift64*.
+ */
+static uint64_t
+next_rand(struct synth *s)
+{
+    s->rng ^= s->rng >> 12;
+    s->rng ^= s->rng << 25;
+    s->rng ^= s->rng >> 27;
+    return s->rng * 0x2545F4914F6CDD1DULL;
+}
+
+/*
+ * Returns true with probability `pct` percent.
+ */
+static bool
+chance(struct synth *s, uint32_t pct)
+{
+    return (next_rand(s) % 100) < pct;
+}
+
+/*
+ * (Re-)create the encoder to write into `s->buf` from offset `s->len`.
+ */
+static bool
+new_encoder(struct synth *s)
+{
+    if (s->encoder != NULL) {
+        pt_free_encoder(s->encoder);
+    }
+
+    struct pt_config config;
+    memset(&config, 0, sizeof(config));
+    config.size = sizeof(config);
+    config.begin = s->buf;
+    config.end = s->buf + s->bufsize;
+
+    s->encoder = pt_alloc_encoder(&config);
+    if (s->encoder == NULL) {
+        perf_pt_set_err(s->err, perf_pt_cerror_unknown, 0);
+        return false;
+    }
+    int rv = pt_enc_sync_set(s->encoder, s->len);
+    if (rv < 0) {
+        perf_pt_set_err(s->err, perf_pt_cerror_ipt, -rv);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Append a packet to the trace, growing the trace storage as required.
+ */
+static bool
+emit(struct synth *s, struct pt_packet *pkt)
+{
+    while (1) {
+        int rv = pt_enc_next(s->encoder, pkt);
+        if (rv >= 0) {
+            s->len += rv;
+            return true;
+        } else if (rv != -pte_eos) {
+            perf_pt_set_err(s->err, perf_pt_cerror_ipt, -rv);
+            return false;
+        }
+
+        // Out of space. Grow the buffer and try again.
+        size_t new_size = s->bufsize * 2;
+        uint8_t *new_buf = realloc(s->buf, new_size);
+        if (new_buf == NULL) {
+            perf_pt_set_err(s->err, perf_pt_cerror_errno, errno);
+            return false;
+        }
+        s->buf = new_buf;
+        s->bufsize = new_size;
+        if (!new_encoder(s)) {
+            return false;
+        }
+    }
+}
+
+/*
+ * Emit a packet of type `type` carrying the IP `ip`, compressed against the
+ * last IP where possible.
+ */
+static bool
+emit_ip(struct synth *s, enum pt_packet_type type, uint64_t ip)
+{
+    struct pt_packet pkt;
+    memset(&pkt, 0, sizeof(pkt));
+    pkt.type = type;
+    pkt.payload.ip.ip = ip;
+    if ((ip >> 16) == (s->last_ip >> 16)) {
+        pkt.payload.ip.ipc = pt_ipc_update_16;
+    } else if ((ip >> 32) == (s->last_ip >> 32)) {
+        pkt.payload.ip.ipc = pt_ipc_update_32;
+    } else {
+        pkt.payload.ip.ipc = pt_ipc_sext_48;
+    }
+    s->last_ip = ip;
+    return emit(s, &pkt);
+}
+
+/*
+ * Emit any pending TNT bits.
+ */
+static bool
+flush_tnt(struct synth *s)
+{
+    if (s->tnt_bits == 0) {
+        return true;
+    }
+    struct pt_packet pkt;
+    memset(&pkt, 0, sizeof(pkt));
+    pkt.type = ppt_tnt_8;
+    pkt.payload.tnt.bit_size = s->tnt_bits;
+    pkt.payload.tnt.payload = s->tnt;
+    s->tnt = 0;
+    s->tnt_bits = 0;
+    return emit(s, &pkt);
+}
+
+/*
+ * Record the outcome of a conditional branch or compressed return. The first
+ * outcome ends up in the most significant bit of the TNT payload.
+ */
+static bool
+push_tnt(struct synth *s, bool taken)
+{
+    s->tnt = (s->tnt << 1) | taken;
+    s->tnt_bits++;
+    if (s->tnt_bits == MAX_TNT_BITS) {
+        return flush_tnt(s);
+    }
+    return true;
+}
+
+/*
+ * Emit a PSB+ sequence for a thread currently executing at `ip`.
+ */
+static bool
+emit_psb(struct synth *s, uint64_t ip)
+{
+    struct pt_packet pkt;
+
+    if (!flush_tnt(s)) {
+        return false;
+    }
+    s->last_psb = s->len;
+
+    memset(&pkt, 0, sizeof(pkt));
+    pkt.type = ppt_psb;
+    if (!emit(s, &pkt)) {
+        return false;
+    }
+    // A PSB resets IP compression.
+    s->last_ip = 0;
+
+    memset(&pkt, 0, sizeof(pkt));
+    pkt.type = ppt_mode;
+    pkt.payload.mode.leaf = pt_mol_exec;
+    pkt.payload.mode.bits.exec.csl = 1;
+    if (!emit(s, &pkt)) {
+        return false;
+    }
+
+    if (!emit_ip(s, ppt_fup, ip)) {
+        return false;
+    }
+
+    memset(&pkt, 0, sizeof(pkt));
+    pkt.type = ppt_psbend;
+    return emit(s, &pkt);
+}
+
+/*
+ * Combine a block start address into a running hash of blocks.
+ */
+uint64_t
+perf_pt_synth_hash_block(uint64_t hash, uint64_t addr)
+{
+    // FNV-1a style mixing, one address at a time.
+    return (hash ^ addr) * 0x100000001b3ULL;
+}
+
+/*
+ * Note that the instruction just executed ended a block, and that the next
+ * block starts at `next`.
+ */
+static void
+end_block(struct synth *s, uint64_t next)
+{
+    s->blocks++;
+    s->blocks_hash = perf_pt_synth_hash_block(s->blocks_hash, s->block_start);
+    s->block_start = next;
+}
+
+/*
+ * Lay out the code, filling in `sites`.
+ *
+ * Returns the (malloc'd) code, or NULL on error. The size of the code is
+ * written to `*len` and the address of the loop to `*loop_start`.
+ */
+static uint8_t *
+build_code(struct synth *s, struct site *sites, uint64_t *len,
+           uint64_t *loop_start)
+{
+    const struct perf_pt_synth_config *conf = s->conf;
+    // Each site is at most 6 bytes, plus the closing jump.
+    size_t max_len = LOOP_ALIGN + (size_t) conf->sites * 6 + 5;
+    uint8_t *code = malloc(max_len);
+    if (code == NULL) {
+        perf_pt_set_err(s->err, perf_pt_cerror_errno, errno);
+        return NULL;
+    }
+    memset(code, OP_NOP, max_len);
+
+    for (int i = 0; i < NUM_CALLEES; i++) {
+        code[i * CALLEE_SIZE + 1] = OP_RET;
+    }
+
+    size_t off = LOOP_ALIGN;
+    *loop_start = conf->base_vaddr + off;
+    for (uint32_t i = 0; i < conf->sites; i++) {
+        struct site *site = &sites[i];
+        uint64_t r = next_rand(s) % 100;
+        if (r < conf->cond_pct) {
+            site->kind = site_cond;
+        } else if (r < conf->cond_pct + conf->indirect_pct) {
+            site->kind = site_icall;
+        } else {
+            site->kind = site_call;
+        }
+
+        off++; // Leading nop.
+        site->branch = conf->base_vaddr + off;
+        switch (site->kind) {
+            case site_cond:
+                // je over two nops.
+                code[off++] = OP_JE_REL8;
+                code[off++] = 2;
+                off += 2;
+                break;
+            case site_call: {
+                site->callee = conf->base_vaddr +
+                    (next_rand(s) % NUM_CALLEES) * CALLEE_SIZE;
+                code[off++] = OP_CALL_REL32;
+                int32_t rel = (int32_t) (site->callee - (conf->base_vaddr + off + 4));
+                memcpy(&code[off], &rel, sizeof(rel));
+                off += sizeof(rel);
+                break;
+            }
+            case site_icall:
+                code[off++] = OP_GRP5;
+                code[off++] = MODRM_CALL_RAX;
+                break;
+        }
+        site->end = conf->base_vaddr + off;
+    }
+
+    // Jump back to the start of the loop.
+    code[off++] = OP_JMP_REL32;
+    int32_t rel = (int32_t) (*loop_start - (conf->base_vaddr + off + 4));
+    memcpy(&code[off], &rel, sizeof(rel));
+    off += sizeof(rel);
+
+    *len = off;
+    return code;
+}
+
+/*
+ * Generate a synthetic trace as described by `conf`, storing the result in
+ * `out`. The caller must free the result with `perf_pt_synth_free()`.
+ *
+ * Returns true on success or false otherwise.
+ */
+bool
+perf_pt_synth(const struct perf_pt_synth_config *conf,
+              struct perf_pt_synth_out *out, struct perf_pt_cerror *err)
+{
+    bool ret = true;
+    struct site *sites = NULL;
+    uint8_t *code = NULL;
+    struct pt_packet pkt;
+
+    memset(out, 0, sizeof(*out));
+    struct synth s;
+    memset(&s, 0, sizeof(s));
+    s.conf = conf;
+    s.err = err;
+    // xorshift state must be non-zero.
+    s.rng = conf->seed ? conf->seed : 1;
+
+    sites = calloc(conf->sites, sizeof(*sites));
+    if (sites == NULL) {
+        perf_pt_set_err(err, perf_pt_cerror_errno, errno);
+        ret = false;
+        goto clean;
+    }
+    uint64_t code_len, loop_start;
+    code = build_code(&s, sites, &code_len, &loop_start);
+    if (code == NULL) {
+        ret = false;
+        goto clean;
+    }
+
+    s.bufsize = INITIAL_TRACE_SIZE;
+    s.buf = malloc(s.bufsize);
+    if (s.buf == NULL) {
+        perf_pt_set_err(err, perf_pt_cerror_errno, errno);
+        ret = false;
+        goto clean;
+    }
+    if (!new_encoder(&s)) {
+        ret = false;
+        goto clean;
+    }
+
+    // Start of trace: tracing is enabled at the start of the loop.
+    memset(&pkt, 0, sizeof(pkt));
+    pkt.type = ppt_psb;
+    if (!emit(&s, &pkt)) {
+        ret = false;
+        goto clean;
+    }
+    pkt.type = ppt_psbend;
+    if (!emit(&s, &pkt)) {
+        ret = false;
+        goto clean;
+    }
+    memset(&pkt, 0, sizeof(pkt));
+    pkt.type = ppt_mode;
+    pkt.payload.mode.leaf = pt_mol_exec;
+    pkt.payload.mode.bits.exec.csl = 1;
+    if ((!emit(&s, &pkt)) || (!emit_ip(&s, ppt_tip_pge, loop_start))) {
+        ret = false;
+        goto clean;
+    }
+    s.block_start = loop_start;
+
+    for (uint64_t iter = 0; iter < conf->loop_iters; iter++) {
+        if ((conf->overflow_period != 0) && (iter != 0) &&
+            (iter % conf->overflow_period == 0)) {
+            // Packets were "lost" and tracing resumes at the loop start.
+            if (!flush_tnt(&s)) {
+                ret = false;
+                goto clean;
+            }
+            memset(&pkt, 0, sizeof(pkt));
+            pkt.type = ppt_ovf;
+            if (!emit(&s, &pkt)) {
+                ret = false;
+                goto clean;
+            }
+            s.last_ip = 0;
+            if (!emit_ip(&s, ppt_fup, loop_start)) {
+                ret = false;
+                goto clean;
+            }
+            if (!s.overflowed) {
+                s.overflowed = true;
+                s.blocks_before_overflow = s.blocks;
+            }
+        }
+
+        for (uint32_t i = 0; i < conf->sites; i++) {
+            struct site *site = &sites[i];
+            uint64_t callee;
+            bool ok = true;
+            switch (site->kind) {
+                case site_cond: {
+                    bool taken = chance(&s, conf->taken_pct);
+                    ok = push_tnt(&s, taken);
+                    // Not taken falls through to the two nops after the branch.
+                    end_block(&s, taken ? site->end : site->branch + 2);
+                    break;
+                }
+                case site_call:
+                    end_block(&s, site->callee);
+                    // The callee's return is compressed to a taken TNT bit.
+                    ok = push_tnt(&s, true);
+                    end_block(&s, site->end);
+                    break;
+                case site_icall:
+                    callee = conf->base_vaddr +
+                        (next_rand(&s) % NUM_CALLEES) * CALLEE_SIZE;
+                    ok = flush_tnt(&s) && emit_ip(&s, ppt_tip, callee);
+                    end_block(&s, callee);
+                    ok = ok && push_tnt(&s, true);
+                    end_block(&s, site->end);
+                    break;
+            }
+            if (ok && (conf->psb_period != 0) &&
+                (s.len - s.last_psb >= conf->psb_period)) {
+                ok = emit_psb(&s, site->end);
+            }
+            if (!ok) {
+                ret = false;
+                goto clean;
+            }
+        }
+        // The jump back to the loop start.
+        end_block(&s, loop_start);
+    }
+
+    // End of trace: tracing is asynchronously disabled at the loop start.
+    if ((!flush_tnt(&s)) || (!emit_ip(&s, ppt_fup, loop_start))) {
+        ret = false;
+        goto clean;
+    }
+    memset(&pkt, 0, sizeof(pkt));
+    pkt.type = ppt_tip_pgd;
+    pkt.payload.ip.ipc = pt_ipc_suppressed;
+    if (!emit(&s, &pkt)) {
+        ret = false;
+        goto clean;
+    }
+
+    out->trace = s.buf;
+    out->trace_len = s.len;
+    out->code = code;
+    out->code_len = code_len;
+    out->blocks = s.blocks;
+    out->blocks_hash = s.blocks_hash;
+    out->blocks_before_overflow = s.overflowed ? s.blocks_before_overflow : s.blocks;
+    s.buf = NULL;
+    code = NULL;
+
+clean:
+    if (s.encoder != NULL) {
+        pt_free_encoder(s.encoder);
+    }
+    free(s.buf);
+    free(code);
+    free(sites);
+    return ret;
+}
+
+/*
+ * Free the buffers of a generated trace.
+ */
+void
+perf_pt_synth_free(struct perf_pt_synth_out *out)
+{
+    free(out->trace);
+    free(out->code);
+    out->trace = out->code = NULL;
+}
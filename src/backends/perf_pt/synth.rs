@@ -0,0 +1,310 @@
+//! Generation of synthetic Intel PT traces.
+//!
+//! A synthetic trace describes an execution of a small generated code image with a known shape
+//! (loop length, branch mix, indirect call density, PSB and overflow frequency), so the decoder
+//! can be tested and benchmarked on machines without Intel PT hardware. The generator also
+//! computes what a decoder should report for the trace. See `synth.c` for the shape of the code.
+
+use super::offline::ImageSection;
+use super::{
+    perf_pt_synth, perf_pt_synth_free, perf_pt_synth_hash_block, PerfPTCError, PerfPTRawTrace,
+};
+use crate::errors::HWTracerError;
+use libc::c_void;
+use std::fs;
+use std::path::Path;
+use std::ptr;
+use std::slice;
+
+/// Describes the shape of a synthetic trace.
+///
+/// Shared with C code. Must stay in sync.
+#[repr(C)]
+#[derive(Clone, Debug)]
+pub struct SynthConfig {
+    /// The address the generated code is loaded at.
+    pub base_vaddr: u64,
+    /// How many times the generated loop runs.
+    pub loop_iters: u64,
+    /// Number of branch sites in the loop body.
+    pub sites: u32,
+    /// Percentage of sites which are conditional branches.
+    pub cond_pct: u32,
+    /// Percentage of conditional branches which are taken.
+    pub taken_pct: u32,
+    /// Percentage of sites which are indirect calls. Sites which are neither conditional branches
+    /// nor indirect calls are direct calls.
+    pub indirect_pct: u32,
+    /// Emit a PSB+ sequence roughly every this many bytes of trace (0 = only at the start).
+    pub psb_period: u64,
+    /// Inject an overflow packet every this many loop iterations (0 = never).
+    pub overflow_period: u64,
+    /// Seed for the pseudo-random choices made by the generator.
+    pub seed: u64,
+}
+
+impl Default for SynthConfig {
+    fn default() -> Self {
+        Self {
+            base_vaddr: 0x400000,
+            loop_iters: 1000,
+            sites: 16,
+            cond_pct: 60,
+            taken_pct: 50,
+            indirect_pct: 20,
+            psb_period: 4096, // The default PSB period of Linux perf.
+            overflow_period: 0,
+            seed: 1,
+        }
+    }
+}
+
+impl SynthConfig {
+    fn validate(&self) -> Result<(), HWTracerError> {
+        if self.sites == 0 {
+            return Err(HWTracerError::BadConfig(String::from(
+                "sites must be at least 1",
+            )));
+        }
+        let branch_pct = self.cond_pct.checked_add(self.indirect_pct);
+        if branch_pct.map_or(true, |p| p > 100) || self.taken_pct > 100 {
+            return Err(HWTracerError::BadConfig(String::from(
+                "branch percentages must not exceed 100",
+            )));
+        }
+        // The generated code uses 32-bit relative branches and 48-bit IP packets.
+        if self.base_vaddr >= (1 << 47)
+            || self.base_vaddr.checked_add(u64::from(u32::MAX)).is_none()
+        {
+            return Err(HWTracerError::BadConfig(String::from(
+                "base_vaddr must be a user-space address",
+            )));
+        }
+        Ok(())
+    }
+}
+
+/// The output of the C generator.
+///
+/// Shared with C code. Must stay in sync.
+#[repr(C)]
+pub(super) struct PerfPTSynthOut {
+    trace: *mut c_void,
+    trace_len: u64,
+    code: *mut c_void,
+    code_len: u64,
+    blocks: u64,
+    blocks_hash: u64,
+    blocks_before_overflow: u64,
+}
+
+/// A generated trace, the code it ran through, and what decoding it should yield.
+pub struct SynthTrace {
+    trace: Vec<u8>,
+    code: Vec<u8>,
+    base_vaddr: u64,
+    blocks: u64,
+    blocks_hash: u64,
+    blocks_before_overflow: u64,
+}
+
+impl SynthTrace {
+    /// Generates a trace with the shape described by `conf`.
+    pub fn generate(conf: &SynthConfig) -> Result<Self, HWTracerError> {
+        conf.validate()?;
+        let mut out = PerfPTSynthOut {
+            trace: ptr::null_mut(),
+            trace_len: 0,
+            code: ptr::null_mut(),
+            code_len: 0,
+            blocks: 0,
+            blocks_hash: 0,
+            blocks_before_overflow: 0,
+        };
+        let mut cerr = PerfPTCError::new();
+        if !unsafe { perf_pt_synth(conf, &mut out, &mut cerr) } {
+            return Err(cerr.into());
+        }
+        let copy = |p: *mut c_void, len: u64| unsafe {
+            slice::from_raw_parts(p as *const u8, len as usize).to_vec()
+        };
+        let res = Self {
+            trace: copy(out.trace, out.trace_len),
+            code: copy(out.code, out.code_len),
+            base_vaddr: conf.base_vaddr,
+            blocks: out.blocks,
+            blocks_hash: out.blocks_hash,
+            blocks_before_overflow: out.blocks_before_overflow,
+        };
+        unsafe { perf_pt_synth_free(&mut out) };
+        Ok(res)
+    }
+
+    /// Returns the raw PT packets.
+    pub fn trace_data(&self) -> &[u8] {
+        &self.trace
+    }
+
+    /// Returns the generated code, which is loaded at the configured `base_vaddr`.
+    pub fn code(&self) -> &[u8] {
+        &self.code
+    }
+
+    /// The number of blocks a decoder should report (if no overflows were injected).
+    pub fn expected_blocks(&self) -> u64 {
+        self.blocks
+    }
+
+    /// A hash of the start addresses of the expected blocks. See `hash_blocks()`.
+    pub fn expected_blocks_hash(&self) -> u64 {
+        self.blocks_hash
+    }
+
+    /// The number of blocks executed before the first injected overflow (or `expected_blocks()`
+    /// if there were none). A decoder reports at most this many blocks before the overflow.
+    pub fn blocks_before_overflow(&self) -> u64 {
+        self.blocks_before_overflow
+    }
+
+    /// Writes the code to `path` and returns a trace which can be decoded against it. The file
+    /// must outlive the returned trace.
+    pub fn to_raw_trace<P: AsRef<Path>>(&self, path: P) -> Result<PerfPTRawTrace, HWTracerError> {
+        fs::write(&path, &self.code)?;
+        let sec = ImageSection::new(path, 0, self.code.len() as u64, self.base_vaddr);
+        PerfPTRawTrace::new(&self.trace, vec![sec])
+    }
+}
+
+/// Hashes a sequence of block start addresses in the same way as `expected_blocks_hash()`.
+pub fn hash_blocks<I: IntoIterator<Item = u64>>(addrs: I) -> u64 {
+    addrs
+        .into_iter()
+        .fold(0, |h, a| unsafe { perf_pt_synth_hash_block(h, a) })
+}
+
+#[cfg(test)]
+mod tests {
+    use super::{hash_blocks, SynthConfig, SynthTrace};
+    use crate::errors::HWTracerError;
+    use crate::Trace;
+    use tempfile::NamedTempFile;
+
+    // Decodes `st`, returning the start addresses of the blocks and the error which ended
+    // decoding, if any.
+    fn decode(st: &SynthTrace) -> (Vec<u64>, Option<HWTracerError>) {
+        let code = NamedTempFile::new().unwrap();
+        let trace = st.to_raw_trace(code.path()).unwrap();
+        let mut addrs = Vec::new();
+        for b in trace.iter_blocks() {
+            match b {
+                Ok(b) => addrs.push(b.first_instr()),
+                Err(e) => return (addrs, Some(e)),
+            }
+        }
+        (addrs, None)
+    }
+
+    // The expected counts and hashes come from the generator's own model of the code it emits,
+    // so these tests check the generator and the decoder against each other. They have yet to
+    // be run against a real libipt: until they have, a shared misunderstanding of the block
+    // boundaries (e.g. around far transfers) would go unnoticed.
+    fn check_expected(conf: &SynthConfig) {
+        let st = SynthTrace::generate(conf).unwrap();
+        let (addrs, err) = decode(&st);
+        assert!(err.is_none(), "{:?}", err);
+        assert_eq!(addrs.len() as u64, st.expected_blocks());
+        assert_eq!(hash_blocks(addrs), st.expected_blocks_hash());
+    }
+
+    #[test]
+    fn test_default() {
+        check_expected(&SynthConfig::default());
+    }
+
+    #[test]
+    fn test_branch_mixes() {
+        for &(cond_pct, indirect_pct) in &[(100, 0), (0, 100), (0, 0), (30, 30)] {
+            for &taken_pct in &[0, 50, 100] {
+                check_expected(&SynthConfig {
+                    cond_pct,
+                    indirect_pct,
+                    taken_pct,
+                    seed: u64::from(cond_pct + indirect_pct + taken_pct),
+                    ..SynthConfig::default()
+                });
+            }
+        }
+    }
+
+    #[test]
+    fn test_psb_periods() {
+        for &psb_period in &[0, 64, 4096] {
+            check_expected(&SynthConfig {
+                psb_period,
+                ..SynthConfig::default()
+            });
+        }
+    }
+
+    // Grow the trace beyond the initial buffer size of the generator.
+    #[test]
+    fn test_large() {
+        let conf = SynthConfig {
+            loop_iters: 100_000,
+            ..SynthConfig::default()
+        };
+        let st = SynthTrace::generate(&conf).unwrap();
+        assert!(st.trace_data().len() > 1024 * 1024);
+        check_expected(&conf);
+    }
+
+    #[test]
+    fn test_deterministic() {
+        let conf = SynthConfig::default();
+        let st1 = SynthTrace::generate(&conf).unwrap();
+        let st2 = SynthTrace::generate(&conf).unwrap();
+        assert_eq!(st1.trace_data(), st2.trace_data());
+        assert_eq!(st1.code(), st2.code());
+    }
+
+    #[test]
+    fn test_overflow() {
+        let st = SynthTrace::generate(&SynthConfig {
+            overflow_period: 10,
+            ..SynthConfig::default()
+        })
+        .unwrap();
+        assert!(st.blocks_before_overflow() < st.expected_blocks());
+        let (addrs, err) = decode(&st);
+        match err {
+            Some(HWTracerError::HWBufferOverflow) => (),
+            _ => panic!("expected an overflow, got {:?}", err),
+        }
+        assert!(addrs.len() as u64 <= st.blocks_before_overflow());
+    }
+
+    #[test]
+    fn test_bad_config() {
+        for conf in &[
+            SynthConfig {
+                sites: 0,
+                ..SynthConfig::default()
+            },
+            SynthConfig {
+                cond_pct: 60,
+                indirect_pct: 50,
+                ..SynthConfig::default()
+            },
+            SynthConfig {
+                cond_pct: u32::max_value(),
+                indirect_pct: 1,
+                ..SynthConfig::default()
+            },
+        ] {
+            match SynthTrace::generate(conf) {
+                Err(HWTracerError::BadConfig(_)) => (),
+                _ => panic!(),
+            }
+        }
+    }
+}
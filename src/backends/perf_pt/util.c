@@ -36,6 +36,8 @@
 // SOFTWARE.
 
 #include <stdbool.h>
+#include <stdatomic.h>
+#include <time.h>
 #include <intel-pt.h>
 #include "perf_pt_private.h"
 
@@ -60,3 +62,88 @@ bool
 perf_pt_is_overflow_err(int err) {
     return err == pte_overflow;
 }
+
+/*
+ * Returns the current time of the monotonic clock in nanoseconds.
+ */
+uint64_t
+perf_pt_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Returns the CPU time consumed by the calling thread in nanoseconds.
+ */
+uint64_t
+perf_pt_thread_cpu_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Take a snapshot of the collector statistics `src` (which may be being
+ * updated concurrently) into `dest`.
+ */
+void
+perf_pt_read_collector_stats(const struct perf_pt_collector_stats *src,
+                             struct perf_pt_collector_stats *dest) {
+    const uint64_t *from = (const uint64_t *) src;
+    uint64_t *to = (uint64_t *) dest;
+    for (size_t i = 0; i < sizeof(*src) / sizeof(uint64_t); i++) {
+        to[i] = PERF_PT_STAT_LOAD(from[i]);
+    }
+}
+
+static struct perf_pt_hist hists[perf_pt_hist_kinds];
+
+/*
+ * Returns the index of the histogram bucket which `val` falls in.
+ */
+int
+perf_pt_hist_bucket(uint64_t val) {
+    if (val < PERF_PT_HIST_SUB) {
+        return val;
+    }
+    // The position of the most significant set bit, >= PERF_PT_HIST_SUB_BITS.
+    int msb = 63 - __builtin_clzll(val);
+    int shift = msb - PERF_PT_HIST_SUB_BITS;
+    return (shift + 1) * PERF_PT_HIST_SUB + (int) (val >> shift) - PERF_PT_HIST_SUB;
+}
+
+/*
+ * Record `val` into the histogram `kind`. Safe to call from any thread.
+ */
+void
+perf_pt_hist_record(int kind, uint64_t val) {
+    struct perf_pt_hist *hist = &hists[kind];
+    atomic_fetch_add_explicit((_Atomic uint64_t *) &hist->buckets[perf_pt_hist_bucket(val)],
+                              1, memory_order_relaxed);
+    atomic_fetch_add_explicit((_Atomic uint64_t *) &hist->sum, val, memory_order_relaxed);
+    atomic_fetch_add_explicit((_Atomic uint64_t *) &hist->count, 1, memory_order_relaxed);
+    uint64_t max = PERF_PT_STAT_LOAD(hist->max);
+    while (val > max) {
+        if (atomic_compare_exchange_weak_explicit((_Atomic uint64_t *) &hist->max,
+                                                  &max, val, memory_order_relaxed,
+                                                  memory_order_relaxed)) {
+            break;
+        }
+    }
+}
+
+/*
+ * Copy the histogram `kind` into `dest`.
+ *
+ * Values may be recorded while the copy is made, so the snapshot's count and
+ * sum may include a few values which its buckets don't (or vice versa).
+ */
+void
+perf_pt_hist_snapshot(int kind, struct perf_pt_hist *dest) {
+    const uint64_t *from = (const uint64_t *) &hists[kind];
+    uint64_t *to = (uint64_t *) dest;
+    for (size_t i = 0; i < sizeof(*dest) / sizeof(uint64_t); i++) {
+        to[i] = PERF_PT_STAT_LOAD(from[i]);
+    }
+}
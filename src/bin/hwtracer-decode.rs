@@ -0,0 +1,465 @@
+//! Offline, multi-threaded decoder for raw Intel PT traces.
+//!
+//! The trace is split at PSB packets and the pieces are decoded in parallel. Blocks are written to
+//! the output in trace order, either as text or in a compact binary form (two little-endian `u64`s
+//! per block: the addresses of the first and last instructions).
+//!
+//! Decoding from a PSB starts at the address where the PSB was emitted, so the piece after a split
+//! point only sees the tail of the block which straddles it. To report that block whole, each
+//! piece is decoded a little past its end, and the blocks are stitched together so that the output
+//! is the same whatever the number of threads. (If a piece can't be stitched to the next, e.g.
+//! because of a decoding error near the split point, the straddling block is reported as its
+//! tail only.)
+//!
+//! With `--cache`, the blocks of a trace which decodes without errors are kept in an on-disk
+//! `DecodeCache`, so that decoding the same trace against the same code again just reads them
+//! back. Since the blocks may depend on where the trace was split, the entry's key includes the
+//! split points (see `CacheKey::split_at()`): only a trace decoded in one piece shares its entry
+//! with `DecodeCache::decode()`, and a trace split differently (e.g. with another `--jobs`) is
+//! decoded again.
+
+#[cfg(perf_pt)]
+mod decode {
+    use hwtracer::backends::perf_pt::{
+        next_psb, parse_num, CacheKey, DecodeCache, ImageSection, PerfPTRawTrace,
+    };
+    use hwtracer::{Block, Trace};
+    use std::borrow::Borrow;
+    use std::collections::BTreeMap;
+    use std::env;
+    use std::fs::{self, File};
+    use std::io::{self, BufWriter, Write};
+    use std::process;
+    use std::sync::atomic::{AtomicUsize, Ordering};
+    use std::sync::{mpsc, Arc};
+    use std::thread;
+    use std::time::Instant;
+
+    const USAGE: &str = "usage: hwtracer-decode [options] --pt <file> <image>...
+
+Image (at least one required):
+  --raw <file:begin-end:vaddr>  load bytes [begin, end) of <file> at <vaddr>
+  --elf <file>[:<base>]         load the executable segments of ELF <file>,
+                                relocated by <base> (default 0)
+
+Options:
+  -j, --jobs <n>                decode using <n> threads (default: all CPUs)
+  -f, --format <text|binary>    output format (default: text)
+  -o, --output <file>           write blocks to <file> (default: stdout)
+  --cache <dir>                 reuse and keep decoded blocks in the cache <dir>
+  --cache-size <bytes>          keep the cache within <bytes> (default: 1GiB)";
+
+    // Don't bother splitting traces into pieces smaller than this (in bytes).
+    const MIN_CHUNK_SIZE: usize = 1024 * 1024;
+    // The size of a PSB packet.
+    const PSB_LEN: usize = 16;
+    // How many pieces to split the trace into per thread. More pieces balance the load better.
+    const CHUNKS_PER_JOB: usize = 4;
+    const DFLT_CACHE_SIZE: u64 = 1024 * 1024 * 1024;
+
+    #[derive(PartialEq)]
+    enum Format {
+        Text,
+        Binary,
+    }
+
+    struct Opts {
+        pt: String,
+        image: Vec<ImageSection>,
+        jobs: usize,
+        format: Format,
+        output: Option<String>,
+        cache: Option<String>,
+        cache_size: u64,
+    }
+
+    impl Opts {
+        fn parse<I: Iterator<Item = String>>(mut args: I) -> Result<Self, String> {
+            let mut pt = None;
+            let mut image = Vec::new();
+            let mut jobs = thread::available_parallelism().map_or(1, |n| n.get());
+            let mut format = Format::Text;
+            let mut output = None;
+            let mut cache = None;
+            let mut cache_size = DFLT_CACHE_SIZE;
+
+            while let Some(arg) = args.next() {
+                let mut val = || args.next().ok_or(format!("{} requires an argument", arg));
+                match arg.as_str() {
+                    "--pt" => pt = Some(val()?),
+                    "--raw" => {
+                        image.push(ImageSection::parse_raw(&val()?).map_err(|e| e.to_string())?)
+                    }
+                    "--elf" => {
+                        let v = val()?;
+                        let (file, base) = ImageSection::split_elf_arg(&v);
+                        let secs = ImageSection::from_elf(file, base).map_err(|e| e.to_string())?;
+                        image.extend(secs);
+                    }
+                    "-j" | "--jobs" => {
+                        jobs = val()?
+                            .parse()
+                            .ok()
+                            .filter(|&n| n > 0)
+                            .ok_or("bad number of jobs")?
+                    }
+                    "-f" | "--format" => {
+                        format = match val()?.as_str() {
+                            "text" => Format::Text,
+                            "binary" => Format::Binary,
+                            f => return Err(format!("unknown format: {}", f)),
+                        }
+                    }
+                    "-o" | "--output" => output = Some(val()?),
+                    "--cache" => cache = Some(val()?),
+                    "--cache-size" => {
+                        cache_size = parse_num(&val()?).ok_or("bad cache size")?;
+                    }
+                    "-h" | "--help" => {
+                        println!("{}", USAGE);
+                        process::exit(0);
+                    }
+                    _ => return Err(format!("unknown argument: {}", arg)),
+                }
+            }
+
+            let pt = pt.ok_or("no trace file given")?;
+            if image.is_empty() {
+                return Err("no code image given".to_owned());
+            }
+            Ok(Self {
+                pt,
+                image,
+                jobs,
+                format,
+                output,
+                cache,
+                cache_size,
+            })
+        }
+    }
+
+    /// Split `data` into pieces of at least `min_size` bytes which each start with a PSB packet
+    /// (except perhaps the first).
+    fn chunk_bounds(data: &[u8], jobs: usize, min_size: usize) -> Vec<(usize, usize)> {
+        let chunk_size = (data.len() / (jobs * CHUNKS_PER_JOB)).max(min_size);
+        let mut starts = vec![0];
+        let mut from = chunk_size;
+        while from < data.len() {
+            match next_psb(data, from) {
+                Some(off) => {
+                    starts.push(off);
+                    from = off + chunk_size;
+                }
+                None => break,
+            }
+        }
+        let mut bounds = Vec::with_capacity(starts.len());
+        for (i, &start) in starts.iter().enumerate() {
+            let end = starts.get(i + 1).cloned().unwrap_or_else(|| data.len());
+            bounds.push((start, end));
+        }
+        bounds
+    }
+
+    /// The decoded blocks of one piece of the trace.
+    struct ChunkResult {
+        blocks: Vec<Block>,
+        // The error which stopped decoding, if any.
+        err: Option<String>,
+        // Whether `blocks` ends with the whole block straddling the end of the piece, in which case
+        // the next piece's first block (the tail of that block) is dropped.
+        stitched: bool,
+    }
+
+    /// Decodes the piece `data[start..end]`.
+    ///
+    /// To report the block straddling `end` whole, the piece is decoded on up to the PSB after
+    /// `end`. The blocks which the next piece also reports are then removed: they are those from
+    /// decoding `data[end..]` up to the same PSB, except the first (which is the tail of the
+    /// straddling block).
+    fn decode_chunk(data: &[u8], start: usize, end: usize, image: &[ImageSection]) -> ChunkResult {
+        if end < data.len() {
+            let over = next_psb(data, end + PSB_LEN).unwrap_or_else(|| data.len());
+            if let (mut blocks, None) = decode_range(&data[start..over], image) {
+                if let (next, None) = decode_range(&data[end..over], image) {
+                    if !next.is_empty() && blocks.ends_with(&next[1..]) {
+                        blocks.truncate(blocks.len() - (next.len() - 1));
+                        return ChunkResult {
+                            blocks,
+                            err: None,
+                            stitched: true,
+                        };
+                    }
+                }
+            }
+        }
+        let (blocks, err) = decode_range(&data[start..end], image);
+        ChunkResult {
+            blocks,
+            err,
+            stitched: false,
+        }
+    }
+
+    /// Decodes all of `data`, returning the blocks and the error which stopped decoding, if any.
+    fn decode_range(data: &[u8], image: &[ImageSection]) -> (Vec<Block>, Option<String>) {
+        let trace = match PerfPTRawTrace::new(data, image.to_vec()) {
+            Ok(t) => t,
+            Err(e) => return (Vec::new(), Some(e.to_string())),
+        };
+        let mut blocks = Vec::new();
+        for blk in trace.iter_blocks() {
+            match blk {
+                Ok(b) => blocks.push(b),
+                Err(e) => return (blocks, Some(e.to_string())),
+            }
+        }
+        (blocks, None)
+    }
+
+    fn write_blocks<B: Borrow<Block>, I: IntoIterator<Item = B>>(
+        out: &mut dyn Write,
+        blocks: I,
+        format: &Format,
+    ) -> io::Result<()> {
+        for b in blocks {
+            let b = b.borrow();
+            match format {
+                Format::Text => writeln!(out, "0x{:x} 0x{:x}", b.first_instr(), b.last_instr())?,
+                Format::Binary => {
+                    out.write_all(&b.first_instr().to_le_bytes())?;
+                    out.write_all(&b.last_instr().to_le_bytes())?;
+                }
+            }
+        }
+        Ok(())
+    }
+
+    /// Decodes the pieces `bounds` of `data` using `jobs` threads, passing each piece's blocks, the
+    /// error which stopped decoding it (if any) and its bounds to `emit`, in trace order.
+    fn decode_chunks<F>(
+        data: &Arc<Vec<u8>>,
+        image: &Arc<Vec<ImageSection>>,
+        bounds: &Arc<Vec<(usize, usize)>>,
+        jobs: usize,
+        mut emit: F,
+    ) where
+        F: FnMut(Vec<Block>, Option<String>, (usize, usize)),
+    {
+        let next_chunk = Arc::new(AtomicUsize::new(0));
+        let (tx, rx) = mpsc::channel::<(usize, ChunkResult)>();
+        let mut workers = Vec::new();
+        for _ in 0..jobs.min(bounds.len()) {
+            let (data, bounds, image, next_chunk, tx) = (
+                Arc::clone(data),
+                Arc::clone(bounds),
+                Arc::clone(image),
+                Arc::clone(&next_chunk),
+                tx.clone(),
+            );
+            workers.push(thread::spawn(move || loop {
+                let idx = next_chunk.fetch_add(1, Ordering::Relaxed);
+                if idx >= bounds.len() {
+                    break;
+                }
+                let (start, end) = bounds[idx];
+                if tx
+                    .send((idx, decode_chunk(&data, start, end, &image)))
+                    .is_err()
+                {
+                    break;
+                }
+            }));
+        }
+        drop(tx);
+
+        // Pass on pieces in trace order as they become available.
+        let mut pending = BTreeMap::new();
+        let mut next_out = 0;
+        let mut prev_stitched = false;
+        for (idx, res) in rx {
+            pending.insert(idx, res);
+            while let Some(mut res) = pending.remove(&next_out) {
+                if prev_stitched && !res.blocks.is_empty() {
+                    res.blocks.remove(0);
+                }
+                prev_stitched = res.stitched;
+                emit(res.blocks, res.err, bounds[next_out]);
+                next_out += 1;
+            }
+        }
+        for w in workers {
+            w.join().unwrap();
+        }
+    }
+
+    pub fn main() {
+        let opts = Opts::parse(env::args().skip(1)).unwrap_or_else(|msg| {
+            eprintln!("{}\n\n{}", msg, USAGE);
+            process::exit(2);
+        });
+
+        let data = Arc::new(fs::read(&opts.pt).unwrap_or_else(|e| {
+            eprintln!("{}: {}", opts.pt, e);
+            process::exit(1);
+        }));
+        let mut out: Box<dyn Write> = match opts.output {
+            Some(ref path) => Box::new(BufWriter::new(File::create(path).unwrap_or_else(|e| {
+                eprintln!("{}: {}", path, e);
+                process::exit(1);
+            }))),
+            None => Box::new(BufWriter::new(io::stdout())),
+        };
+
+        let before = Instant::now();
+        let bounds = Arc::new(chunk_bounds(&data, opts.jobs, MIN_CHUNK_SIZE));
+        let cache = opts.cache.as_ref().map(|dir| {
+            let splits = bounds[1..]
+                .iter()
+                .map(|&(start, _)| start)
+                .collect::<Vec<_>>();
+            let key = CacheKey::new(&data, &opts.image).map(|k| k.split_at(&splits));
+            match DecodeCache::open(dir, opts.cache_size).and_then(|c| key.map(|k| (c, k))) {
+                Ok(ck) => ck,
+                Err(e) => {
+                    eprintln!("{}: {}", dir, e);
+                    process::exit(1);
+                }
+            }
+        });
+        if let Some((ref cache, ref key)) = cache {
+            match cache.get(key) {
+                Ok(Some(blocks)) => {
+                    if let Err(e) = write_blocks(&mut *out, blocks.iter(), &opts.format)
+                        .and_then(|_| out.flush())
+                    {
+                        eprintln!("write error: {}", e);
+                        process::exit(1);
+                    }
+                    eprintln!(
+                        "read {} cached blocks in {:.3}s",
+                        blocks.len(),
+                        before.elapsed().as_secs_f64()
+                    );
+                    return;
+                }
+                Ok(None) => (),
+                Err(e) => eprintln!("cache error: {}", e),
+            }
+        }
+
+        let image = Arc::new(opts.image);
+        let format = &opts.format;
+        let mut num_blocks = 0;
+        let mut failed = false;
+        // All the blocks, if they are to be cached.
+        let mut all_blocks = Vec::new();
+        decode_chunks(
+            &data,
+            &image,
+            &bounds,
+            opts.jobs,
+            |blocks, err, (start, end)| {
+                if let Err(e) = write_blocks(&mut *out, blocks.iter(), format) {
+                    eprintln!("write error: {}", e);
+                    process::exit(1);
+                }
+                num_blocks += blocks.len();
+                if cache.is_some() {
+                    all_blocks.extend(blocks);
+                }
+                if let Some(e) = err {
+                    eprintln!("error decoding bytes {}-{}: {}", start, end, e);
+                    failed = true;
+                }
+            },
+        );
+        if let Err(e) = out.flush() {
+            eprintln!("write error: {}", e);
+            process::exit(1);
+        }
+
+        let secs = before.elapsed().as_secs_f64();
+        let mib = data.len() as f64 / (1024.0 * 1024.0);
+        eprintln!(
+            "decoded {:.2} MiB ({} blocks) in {:.3}s using {} threads: {:.2} MiB/s, {:.0} blocks/s",
+            mib,
+            num_blocks,
+            secs,
+            opts.jobs.min(bounds.len()),
+            mib / secs,
+            num_blocks as f64 / secs
+        );
+        if failed {
+            process::exit(1);
+        }
+        if let Some((ref cache, ref key)) = cache {
+            if let Err(e) = cache.insert(key, &all_blocks) {
+                eprintln!("cache error: {}", e);
+            }
+        }
+    }
+
+    #[cfg(test)]
+    mod tests {
+        use super::{chunk_bounds, decode_chunks};
+        use hwtracer::backends::perf_pt::{ImageSection, SynthConfig, SynthTrace};
+        use hwtracer::{Block, Trace};
+        use std::sync::Arc;
+        use tempfile::NamedTempFile;
+
+        // Decodes `data` in pieces of at least `min_size` bytes using `jobs` threads.
+        fn decode(
+            data: &Arc<Vec<u8>>,
+            image: &Arc<Vec<ImageSection>>,
+            jobs: usize,
+            min_size: usize,
+        ) -> (Vec<Block>, usize) {
+            let bounds = Arc::new(chunk_bounds(data, jobs, min_size));
+            let mut blocks = Vec::new();
+            decode_chunks(data, image, &bounds, jobs, |b, err, _| {
+                assert!(err.is_none(), "{:?}", err);
+                blocks.extend(b);
+            });
+            (blocks, bounds.len())
+        }
+
+        // Splitting a trace, at whatever PSBs, gives the same blocks as decoding it whole.
+        #[test]
+        fn test_jobs() {
+            let st = SynthTrace::generate(&SynthConfig {
+                loop_iters: 20_000,
+                psb_period: 512,
+                ..SynthConfig::default()
+            })
+            .unwrap();
+            let code = NamedTempFile::new().unwrap();
+            let trace = st.to_raw_trace(code.path()).unwrap();
+            let expect = trace.iter_blocks().map(|b| b.unwrap()).collect::<Vec<_>>();
+            assert_eq!(expect.len() as u64, st.expected_blocks());
+
+            let data = Arc::new(st.trace_data().to_vec());
+            let image = Arc::new(trace.image().to_vec());
+            let (blocks, nchunks) = decode(&data, &image, 1, data.len());
+            assert_eq!(nchunks, 1);
+            assert_eq!(blocks, expect);
+            for &(jobs, min_size) in &[(1, 4096), (2, 4096), (4, 1000), (8, 1)] {
+                let (blocks, nchunks) = decode(&data, &image, jobs, min_size);
+                assert!(nchunks > jobs);
+                assert_eq!(blocks, expect, "jobs = {}, min_size = {}", jobs, min_size);
+            }
+        }
+    }
+}
+
+#[cfg(perf_pt)]
+fn main() {
+    decode::main();
+}
+
+#[cfg(not(perf_pt))]
+fn main() {
+    eprintln!("hwtracer-decode requires the perf_pt backend, which was not built");
+    std::process::exit(1);
+}
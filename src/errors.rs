@@ -3,6 +3,7 @@ use libc::{c_int, strerror};
 use std::error::Error;
 use std::ffi::CStr;
 use std::fmt::{self, Display, Formatter};
+use std::time::Duration;
 
 #[derive(Debug)]
 pub enum HWTracerError {
@@ -17,6 +18,8 @@ pub enum HWTracerError {
     Errno(c_int),                    // Something went wrong in C code.
     TracerState(TracerState),        // The tracer is in the wrong state to do the requested task.
     BadConfig(String),               // The tracer configuration was invalid.
+    SessionTimeout(Duration), // Timed out (after the given time) waiting for the tracing hardware
+    // to become free. Not fatal: it may be free later.
     Custom(Box<dyn Error>), // All other errors can be nested here, however, don't rely on this
     // for performance since the `Box` incurs a runtime cost.
     Unknown, // An unknown error. Used sparingly in C code which doesn't set errno.
@@ -36,6 +39,9 @@ impl Display for HWTracerError {
             }
             HWTracerError::TracerState(ref s) => write!(f, "Tracer in wrong state: {}", s),
             HWTracerError::BadConfig(ref s) => write!(f, "{}", s),
+            HWTracerError::SessionTimeout(d) => {
+                write!(f, "Timed out after {:?} waiting for a tracing session", d)
+            }
             HWTracerError::Custom(ref bx) => write!(f, "{}", bx),
             HWTracerError::Unknown => write!(f, "Unknown error"),
         }
@@ -55,6 +61,7 @@ impl Error for HWTracerError {
             HWTracerError::Permissions(_) => None,
             HWTracerError::TracerState(_) => None,
             HWTracerError::BadConfig(_) => None,
+            HWTracerError::SessionTimeout(_) => None,
             HWTracerError::Errno(_) => None,
             HWTracerError::Custom(ref bx) => Some(bx.as_ref()),
             HWTracerError::Unknown => None,
@@ -3,13 +3,16 @@
 
 pub mod backends;
 pub mod errors;
+pub mod stats;
 
 pub use errors::HWTracerError;
+pub use stats::Stats;
 use std::fmt::Debug;
 use std::fmt::{self, Display, Formatter};
 #[cfg(test)]
 use std::fs::File;
 use std::iter::Iterator;
+use std::os::unix::io::RawFd;
 
 /// Information about a basic block.
 #[derive(Debug, Eq, PartialEq)]
@@ -50,6 +53,21 @@ pub trait Trace: Debug + Send {
     #[cfg(test)]
     fn to_file(&self, file: &mut File);
 
+    /// Get the raw trace data.
+    ///
+    /// The exact format varies per-backend.
+    fn raw_data(&self) -> &[u8];
+
+    /// Returns a file descriptor holding exactly the raw trace data, sealed against changes, if
+    /// the backend keeps the trace in one (see `PerfPTConfig::memfd_storage`). Another process
+    /// can map it instead of copying the trace. It is closed when the trace is dropped.
+    fn shared_fd(&self) -> Option<RawFd> {
+        None
+    }
+
+    /// Get statistics about how the trace was collected, and about decoding it so far.
+    fn stats(&self) -> Stats;
+
     /// Iterate over the blocks of the trace.
     fn iter_blocks<'t: 'i, 'i>(
         &'t self,
@@ -75,6 +93,106 @@ pub trait ThreadTracer {
     ///
     /// [start_tracing](trait.ThreadTracer.html#method.start_tracing) must have been called prior.
     fn stop_tracing(&mut self) -> Result<Box<dyn Trace>, HWTracerError>;
+    /// Turns off the tracer without waiting for the trace to be collected.
+    ///
+    /// The tracing hardware is turned off before this returns, but collecting what it recorded
+    /// (e.g. draining a hardware buffer) carries on in the background. The returned
+    /// `PendingTrace` resolves to the trace once that is done. Backends which can't stop
+    /// asynchronously stop synchronously and return a resolved `PendingTrace`.
+    fn stop_tracing_async(&mut self) -> Result<PendingTrace, HWTracerError> {
+        self.stop_tracing().map(PendingTrace::ready)
+    }
+    /// Returns the status of the current tracing session. This is cheap enough to poll from the
+    /// traced thread, so that a session which has already failed (e.g. overflowed) can be
+    /// abandoned and restarted early, rather than when the traced work is done.
+    fn status(&self) -> SessionStatus;
+    /// Get statistics about the current tracing session, or the most recent one if the tracer is
+    /// stopped.
+    ///
+    /// This may be called while tracing.
+    fn stats(&self) -> Stats;
+}
+
+/// A session stopped by `ThreadTracer::stop_tracing_async()` whose trace is still being
+/// collected.
+pub(crate) trait StoppingSession: Send {
+    /// Returns true if `finish()` won't block.
+    fn is_done(&self) -> bool;
+    /// Waits for collection to finish and returns the trace.
+    fn finish(self: Box<Self>) -> Result<Box<dyn Trace>, HWTracerError>;
+}
+
+enum Pending {
+    Ready(Box<dyn Trace>),
+    // Only the perf_pt backend stops asynchronously.
+    #[cfg_attr(not(perf_pt), allow(dead_code))]
+    Stopping(Box<dyn StoppingSession>),
+}
+
+/// A trace which is still being collected, returned by `ThreadTracer::stop_tracing_async()`.
+///
+/// A `PendingTrace` may be sent to, and resolved on, another thread. Dropping it without calling
+/// `wait()` waits for collection to finish and discards the trace.
+pub struct PendingTrace {
+    pending: Pending,
+}
+
+impl PendingTrace {
+    /// Returns an already resolved `PendingTrace`.
+    pub(crate) fn ready(trace: Box<dyn Trace>) -> Self {
+        Self {
+            pending: Pending::Ready(trace),
+        }
+    }
+
+    #[cfg_attr(not(perf_pt), allow(dead_code))]
+    pub(crate) fn stopping(session: Box<dyn StoppingSession>) -> Self {
+        Self {
+            pending: Pending::Stopping(session),
+        }
+    }
+
+    /// Returns true if the trace has been collected, so that `wait()` won't block.
+    pub fn is_ready(&self) -> bool {
+        match self.pending {
+            Pending::Ready(_) => true,
+            Pending::Stopping(ref s) => s.is_done(),
+        }
+    }
+
+    /// Waits for the trace to be collected and returns it, or the error which stopping the
+    /// tracer ended with.
+    pub fn wait(self) -> Result<Box<dyn Trace>, HWTracerError> {
+        match self.pending {
+            Pending::Ready(t) => Ok(t),
+            Pending::Stopping(s) => s.finish(),
+        }
+    }
+}
+
+impl Debug for PendingTrace {
+    fn fmt(&self, f: &mut Formatter) -> fmt::Result {
+        f.debug_struct("PendingTrace")
+            .field("ready", &self.is_ready())
+            .finish()
+    }
+}
+
+/// The status of a tracing session, as reported by `ThreadTracer::status()`.
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub enum SessionStatus {
+    /// The tracer isn't tracing.
+    Stopped,
+    /// The trace is being collected.
+    Ok,
+    /// The trace overflowed and collection has stopped: stopping will return
+    /// `HWTracerError::HWBufferOverflow`.
+    Overflowed,
+    /// Collection failed for another reason, which stopping will return.
+    Failed,
+    /// The trace reached its size limit and collection has stopped: stopping will return the
+    /// (truncated) trace so far.
+    Truncated,
 }
 
 // Keeps track of the internal state of a tracer.
@@ -106,7 +224,7 @@ impl Display for TracerState {
 // calling the following helpers.
 #[cfg(test)]
 mod test_helpers {
-    use super::{Block, HWTracerError, ThreadTracer, TracerState};
+    use super::{Block, HWTracerError, SessionStatus, ThreadTracer, TracerState};
     use crate::Trace;
     use std::slice::Iter;
     use std::time::SystemTime;
@@ -176,6 +294,43 @@ mod test_helpers {
         };
     }
 
+    // Check that a trace stopped asynchronously can be resolved on another thread, and that the
+    // tracer can then be used again.
+    pub fn test_async_stop<T>(mut tracer: T)
+    where
+        T: ThreadTracer,
+    {
+        tracer.start_tracing().unwrap();
+        println!("{}", work_loop(500));
+        let pending = tracer.stop_tracing_async().unwrap();
+        match tracer.stop_tracing_async() {
+            Err(HWTracerError::TracerState(TracerState::Stopped)) => (),
+            _ => panic!(),
+        };
+        let trace = std::thread::spawn(move || pending.wait().unwrap())
+            .join()
+            .unwrap();
+        assert!(trace.iter_blocks().all(|b| b.is_ok()));
+
+        // Dropping a pending trace cleans up too.
+        tracer.start_tracing().unwrap();
+        drop(tracer.stop_tracing_async().unwrap());
+        trace_closure(&mut tracer, || work_loop(500));
+    }
+
+    // Check that a session's status is only `Ok` while it's started.
+    pub fn test_status<T>(mut tracer: T)
+    where
+        T: ThreadTracer,
+    {
+        assert_eq!(tracer.status(), SessionStatus::Stopped);
+        tracer.start_tracing().unwrap();
+        assert_eq!(tracer.status(), SessionStatus::Ok);
+        println!("{}", work_loop(500));
+        tracer.stop_tracing().unwrap();
+        assert_eq!(tracer.status(), SessionStatus::Stopped);
+    }
+
     // Helper to check an expected list of blocks matches what we actually got.
     pub fn test_expected_blocks(trace: Box<dyn Trace>, mut expect_iter: Iter<Block>) {
         let mut got_iter = trace.iter_blocks();
@@ -0,0 +1,75 @@
+//! Statistics reported by thread tracers and traces.
+
+use std::collections::BTreeMap;
+use std::fmt::{self, Display, Formatter};
+
+/// A set of named counters.
+///
+/// Counter names are backend-specific and use dots to group related counters (e.g.
+/// `collector.wakeups` or `decoder.events.overflow`). Counters measuring time are in nanoseconds
+/// and have names ending in `_ns`.
+#[derive(Clone, Debug, Default, Eq, PartialEq)]
+pub struct Stats {
+    counters: BTreeMap<String, u64>,
+}
+
+impl Stats {
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    /// Returns the value of the counter `name`, or `None` if there is no such counter.
+    pub fn get(&self, name: &str) -> Option<u64> {
+        self.counters.get(name).cloned()
+    }
+
+    /// Sets the counter `name` to `value`.
+    pub fn set<S: Into<String>>(&mut self, name: S, value: u64) {
+        self.counters.insert(name.into(), value);
+    }
+
+    /// Adds `value` to the counter `name`, which is created if it doesn't already exist.
+    pub fn add<S: Into<String>>(&mut self, name: S, value: u64) {
+        *self.counters.entry(name.into()).or_insert(0) += value;
+    }
+
+    /// Iterates over the counters in order of name.
+    pub fn iter(&self) -> impl Iterator<Item = (&str, u64)> {
+        self.counters.iter().map(|(k, v)| (k.as_str(), *v))
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.counters.is_empty()
+    }
+}
+
+/// Formats the counters one per line, as `name value`.
+impl Display for Stats {
+    fn fmt(&self, f: &mut Formatter) -> fmt::Result {
+        for (k, v) in self.iter() {
+            writeln!(f, "{} {}", k, v)?;
+        }
+        Ok(())
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::Stats;
+
+    #[test]
+    fn test_counters() {
+        let mut stats = Stats::new();
+        assert!(stats.is_empty());
+        assert_eq!(stats.get("a.b"), None);
+        stats.set("a.b", 2);
+        stats.add("a.b", 3);
+        stats.add("a.a", 1);
+        assert_eq!(stats.get("a.b"), Some(5));
+        assert_eq!(
+            stats.iter().collect::<Vec<_>>(),
+            vec![("a.a", 1), ("a.b", 5)]
+        );
+        assert_eq!(stats.to_string(), "a.a 1\na.b 5\n");
+    }
+}